@@ -0,0 +1,157 @@
+#include "btree_dir.h"
+#include "crypto.h"
+#include "lock_guard.h"
+#include "mystring.h"
+#include "myutils.h"
+#include "platform.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    // The number of names inserted or removed before the directory is restored to its original
+    // size, outside of the timed region.
+    constexpr size_t kBatchSize = 1024;
+
+    std::string random_name()
+    {
+        byte buffer[12];
+        generate_random(buffer, sizeof(buffer));
+        return hexify(buffer, sizeof(buffer));
+    }
+
+    // A `BtreeDirectory` backed by temporary files and filled with `size` random names.
+    class PopulatedDirectory
+    {
+    public:
+        explicit PopulatedDirectory(size_t size)
+            : data_path_(OSService::temp_name("securefs-bench-btree-", ".data"))
+            , meta_path_(OSService::temp_name("securefs-bench-btree-", ".meta"))
+        {
+            int flags = O_RDWR | O_CREAT | O_EXCL;
+            dir_.emplace(Directory::DirNameComparison{&binary_compare},
+                         OSService::get_default().open_file_stream(data_path_, flags, 0644),
+                         OSService::get_default().open_file_stream(meta_path_, flags, 0644),
+                         key_type(0x3e),
+                         id_type{},
+                         true,
+                         8000,
+                         12,
+                         0,
+                         false);
+            names_.reserve(size);
+            LockGuard<FileBase> lg(*dir_);
+            for (size_t i = 0; i < size; ++i)
+            {
+                names_.push_back(random_name());
+                add(names_.back());
+            }
+            std::shuffle(names_.begin(), names_.end(), std::mt19937(size));
+        }
+
+        ~PopulatedDirectory()
+        {
+            dir_.reset();
+            OSService::get_default().remove_file_nothrow(data_path_);
+            OSService::get_default().remove_file_nothrow(meta_path_);
+        }
+
+        DISABLE_COPY_MOVE(PopulatedDirectory)
+
+        BtreeDirectory& dir() { return *dir_; }
+        // The names in the directory, in random order.
+        const std::vector<std::string>& names() const { return names_; }
+
+        void add(const std::string& name) ABSL_NO_THREAD_SAFETY_ANALYSIS
+        {
+            id_type id;
+            generate_random(id.data(), id.size());
+            dir_->add_entry(name, id, FileBase::REGULAR_FILE);
+        }
+
+        void remove(const std::string& name) ABSL_NO_THREAD_SAFETY_ANALYSIS
+        {
+            id_type id;
+            int type;
+            dir_->remove_entry(name, id, type);
+        }
+
+    private:
+        std::string data_path_, meta_path_;
+        std::optional<BtreeDirectory> dir_;
+        std::vector<std::string> names_;
+    };
+
+    void BM_BtreeLookup(benchmark::State& state)
+    {
+        PopulatedDirectory populated(state.range(0));
+        LockGuard<FileBase> lg(populated.dir());
+        const auto& names = populated.names();
+        id_type id;
+        int type;
+        size_t i = 0;
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(populated.dir().get_entry(names[i], id, type));
+            i = (i + 1) % names.size();
+        }
+    }
+    BENCHMARK(BM_BtreeLookup)->RangeMultiplier(10)->Range(1000, 1000000);
+
+    void BM_BtreeInsert(benchmark::State& state)
+    {
+        PopulatedDirectory populated(state.range(0));
+        LockGuard<FileBase> lg(populated.dir());
+        std::vector<std::string> fresh(kBatchSize);
+        std::generate(fresh.begin(), fresh.end(), random_name);
+        size_t i = 0;
+        for (auto _ : state)
+        {
+            populated.add(fresh[i]);
+            if (++i == fresh.size())
+            {
+                state.PauseTiming();
+                for (const auto& name : fresh)
+                {
+                    populated.remove(name);
+                }
+                i = 0;
+                state.ResumeTiming();
+            }
+        }
+    }
+    BENCHMARK(BM_BtreeInsert)->RangeMultiplier(10)->Range(1000, 1000000);
+
+    void BM_BtreeRemove(benchmark::State& state)
+    {
+        PopulatedDirectory populated(state.range(0));
+        LockGuard<FileBase> lg(populated.dir());
+        const auto& names = populated.names();
+        size_t batch = std::min(kBatchSize, names.size());
+        size_t i = 0;
+        for (auto _ : state)
+        {
+            populated.remove(names[i]);
+            if (++i == batch)
+            {
+                state.PauseTiming();
+                for (size_t j = 0; j < batch; ++j)
+                {
+                    populated.add(names[j]);
+                }
+                i = 0;
+                state.ResumeTiming();
+            }
+        }
+    }
+    BENCHMARK(BM_BtreeRemove)->RangeMultiplier(10)->Range(1000, 1000000);
+}    // namespace
+}    // namespace securefs
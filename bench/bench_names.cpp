@@ -0,0 +1,120 @@
+#include "crypto.h"
+#include "lite_format.h"
+#include "mystring.h"
+#include "myutils.h"
+#include "tags.h"
+
+#include <absl/strings/str_cat.h>
+#include <benchmark/benchmark.h>
+#include <fruit/fruit.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    fruit::Component<lite_format::NameTranslator> get_translator_component()
+    {
+        return fruit::createComponent()
+            .registerProvider(
+                []()
+                {
+                    lite_format::NameNormalizationFlags flags{};
+                    flags.long_name_threshold = 128;
+                    return flags;
+                })
+            .registerProvider<fruit::Annotated<tNameMasterKey, key_type>()>(
+                []() { return key_type(122); })
+            .install(lite_format::get_name_translator_component);
+    }
+
+    // A path of four components, each `state.range(0)` bytes long. Components longer than the
+    // threshold of 128 take the long name path.
+    void BM_NewStyleEncryptFullPath(benchmark::State& state)
+    {
+        fruit::Injector<lite_format::NameTranslator> injector(get_translator_component);
+        auto& translator = injector.get<lite_format::NameTranslator&>();
+        std::string component(state.range(0), 'a');
+        auto path = absl::StrCat("/", component, "/", component, "/", component, "/", component);
+        std::string last_component;
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(translator.encrypt_full_path(path, &last_component));
+        }
+        state.SetBytesProcessed(state.iterations() * path.size());
+    }
+    BENCHMARK(BM_NewStyleEncryptFullPath)->Arg(8)->Arg(32)->Arg(200);
+
+    void BM_Base32Encode(benchmark::State& state)
+    {
+        std::vector<byte> input(state.range(0));
+        generate_random(input.data(), input.size());
+        std::string output;
+        for (auto _ : state)
+        {
+            base32_encode(input.data(), input.size(), output);
+            benchmark::DoNotOptimize(output.data());
+        }
+        state.SetBytesProcessed(state.iterations() * input.size());
+    }
+    BENCHMARK(BM_Base32Encode)->RangeMultiplier(4)->Range(16, 4096);
+
+    void BM_Base32Decode(benchmark::State& state)
+    {
+        std::vector<byte> input(state.range(0));
+        generate_random(input.data(), input.size());
+        std::string encoded, output;
+        base32_encode(input.data(), input.size(), encoded);
+        for (auto _ : state)
+        {
+            base32_decode(encoded.data(), encoded.size(), output);
+            benchmark::DoNotOptimize(output.data());
+        }
+        state.SetBytesProcessed(state.iterations() * encoded.size());
+    }
+    BENCHMARK(BM_Base32Decode)->RangeMultiplier(4)->Range(16, 4096);
+
+    // Compares two names that differ only in the last character, so that the whole of them is
+    // scanned.
+    void BM_Compare(benchmark::State& state,
+                    int (*compare)(std::string_view, std::string_view),
+                    std::string_view stem)
+    {
+        std::string a = absl::StrCat(stem, stem, stem, "a");
+        std::string b = absl::StrCat(stem, stem, stem, "b");
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(compare(a, b));
+        }
+    }
+    BENCHMARK_CAPTURE(BM_Compare, binary_ascii, &binary_compare, "Quarterly Report");
+    BENCHMARK_CAPTURE(BM_Compare, binary_unicode, &binary_compare, u8"Überprüfung 報告書");
+    BENCHMARK_CAPTURE(BM_Compare,
+                      case_insensitive_ascii,
+                      &case_insensitive_compare,
+                      "Quarterly Report");
+    BENCHMARK_CAPTURE(BM_Compare,
+                      case_insensitive_unicode,
+                      &case_insensitive_compare,
+                      u8"Überprüfung 報告書");
+    BENCHMARK_CAPTURE(BM_Compare,
+                      uni_norm_insensitive_ascii,
+                      &uni_norm_insensitive_compare,
+                      "Quarterly Report");
+    BENCHMARK_CAPTURE(BM_Compare,
+                      uni_norm_insensitive_unicode,
+                      &uni_norm_insensitive_compare,
+                      u8"Überprüfung 報告書");
+    BENCHMARK_CAPTURE(BM_Compare,
+                      case_uni_norm_insensitive_ascii,
+                      &case_uni_norm_insensitve_compare,
+                      "Quarterly Report");
+    BENCHMARK_CAPTURE(BM_Compare,
+                      case_uni_norm_insensitive_unicode,
+                      &case_uni_norm_insensitve_compare,
+                      u8"Überprüfung 報告書");
+}    // namespace
+}    // namespace securefs
@@ -0,0 +1,64 @@
+#include "crypto.h"
+#include "lite_stream.h"
+#include "myutils.h"
+
+#include <benchmark/benchmark.h>
+#include <cryptopp/aes.h>
+#include <cryptopp/integer.h>
+#include <cryptopp/modes.h>
+
+#include <array>
+#include <cstdint>
+
+namespace securefs
+{
+namespace
+{
+    constexpr unsigned kMaxPadding = 65535;
+
+    void BM_PaddingModuloCryptoPPInteger(benchmark::State& state)
+    {
+        std::array<byte, 16> data;
+        generate_random(data.data(), data.size());
+        for (auto _ : state)
+        {
+            CryptoPP::Integer integer(data.data(),
+                                      data.size(),
+                                      CryptoPP::Integer::UNSIGNED,
+                                      CryptoPP::BIG_ENDIAN_ORDER);
+            benchmark::DoNotOptimize(integer.Modulo(kMaxPadding + 1));
+            ++data[0];
+        }
+    }
+    BENCHMARK(BM_PaddingModuloCryptoPPInteger);
+
+    void BM_PaddingModuloBigEndian(benchmark::State& state)
+    {
+        std::array<byte, 16> data;
+        generate_random(data.data(), data.size());
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(
+                big_endian_modulo(data.data(), data.size(), uint64_t(kMaxPadding) + 1));
+            ++data[0];
+        }
+    }
+    BENCHMARK(BM_PaddingModuloBigEndian);
+
+    void BM_LiteDefaultComputePadding(benchmark::State& state)
+    {
+        key_type key;
+        generate_random(key.data(), key.size());
+        CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption aes(key.data(), key.size());
+        std::array<byte, 16> id;
+        generate_random(id.data(), id.size());
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(
+                lite::default_compute_padding(kMaxPadding, aes, id.data(), id.size()));
+            ++id[0];
+        }
+    }
+    BENCHMARK(BM_LiteDefaultComputePadding);
+}    // namespace
+}    // namespace securefs
@@ -0,0 +1,168 @@
+#include "crypto.h"
+#include "lite_stream.h"
+#include "myutils.h"
+#include "streams.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    // Keeps the ciphertext in memory, so that only the cost of the stream layers is measured.
+    class MemoryStream final : public StreamBase
+    {
+    private:
+        std::vector<byte> m_buffer;
+
+    public:
+        length_type read(void* output, offset_type offset, length_type length) override
+        {
+            if (offset >= m_buffer.size())
+            {
+                return 0;
+            }
+            auto read_sz = std::min<length_type>(length, m_buffer.size() - offset);
+            memcpy(output, m_buffer.data() + offset, read_sz);
+            return read_sz;
+        }
+
+        void write(const void* input, offset_type offset, length_type length) override
+        {
+            if (offset + length > m_buffer.size())
+            {
+                m_buffer.resize(offset + length);
+            }
+            memcpy(m_buffer.data() + offset, input, length);
+        }
+
+        length_type size() const override { return m_buffer.size(); }
+        void flush() override {}
+        void resize(length_type size) override { m_buffer.resize(size); }
+        bool is_sparse() const noexcept override { return true; }
+    };
+
+    // Reads and writes cycle through this many bytes at the start of the stream.
+    constexpr length_type kRegionSize = 8 << 20;
+
+    key_type random_key()
+    {
+        key_type key;
+        generate_random(key.data(), key.size());
+        return key;
+    }
+
+    id_type random_id()
+    {
+        id_type id;
+        generate_random(id.data(), id.size());
+        return id;
+    }
+
+    // Fills the stream with random data, because all-zero blocks may be stored as holes.
+    void fill(StreamBase& stream, length_type size)
+    {
+        std::vector<byte> buffer(std::min<length_type>(size, 1 << 20));
+        generate_random(buffer.data(), buffer.size());
+        for (length_type offset = 0; offset < size; offset += buffer.size())
+        {
+            auto length = std::min<length_type>(buffer.size(), size - offset);
+            stream.write(buffer.data(), offset, length);
+        }
+    }
+
+    void run_writes(benchmark::State& state, StreamBase& stream)
+    {
+        std::vector<byte> buffer(state.range(0));
+        generate_random(buffer.data(), buffer.size());
+        offset_type offset = 0;
+        for (auto _ : state)
+        {
+            stream.write(buffer.data(), offset, buffer.size());
+            offset = (offset + buffer.size()) % kRegionSize;
+        }
+        state.SetBytesProcessed(state.iterations() * buffer.size());
+    }
+
+    void run_reads(benchmark::State& state, StreamBase& stream)
+    {
+        fill(stream, kRegionSize);
+        std::vector<byte> buffer(state.range(0));
+        offset_type offset = 0;
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(stream.read(buffer.data(), offset, buffer.size()));
+            offset = (offset + buffer.size()) % kRegionSize;
+        }
+        state.SetBytesProcessed(state.iterations() * buffer.size());
+    }
+
+    void BM_LiteAESGCMCryptStreamWrite(benchmark::State& state)
+    {
+        lite::AESGCMCryptStream stream(std::make_shared<MemoryStream>(), random_key());
+        run_writes(state, stream);
+    }
+    BENCHMARK(BM_LiteAESGCMCryptStreamWrite)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+    void BM_LiteAESGCMCryptStreamRead(benchmark::State& state)
+    {
+        lite::AESGCMCryptStream stream(std::make_shared<MemoryStream>(), random_key());
+        run_reads(state, stream);
+    }
+    BENCHMARK(BM_LiteAESGCMCryptStreamRead)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+    void BM_FullAESGCMCryptStreamWrite(benchmark::State& state)
+    {
+        auto key = random_key();
+        auto streams = make_cryptstream_aes_gcm(std::make_shared<MemoryStream>(),
+                                                std::make_shared<MemoryStream>(),
+                                                key,
+                                                key,
+                                                random_id(),
+                                                true,
+                                                4096,
+                                                12);
+        run_writes(state, *streams.first);
+    }
+    BENCHMARK(BM_FullAESGCMCryptStreamWrite)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+    void BM_FullAESGCMCryptStreamRead(benchmark::State& state)
+    {
+        auto key = random_key();
+        auto streams = make_cryptstream_aes_gcm(std::make_shared<MemoryStream>(),
+                                                std::make_shared<MemoryStream>(),
+                                                key,
+                                                key,
+                                                random_id(),
+                                                true,
+                                                4096,
+                                                12);
+        run_reads(state, *streams.first);
+    }
+    BENCHMARK(BM_FullAESGCMCryptStreamRead)->RangeMultiplier(4)->Range(4 << 10, 1 << 20);
+
+    // The MAC covers the whole stream, so the cost of a flush after a one byte change grows with
+    // the size of the file.
+    void BM_HMACStreamFlush(benchmark::State& state)
+    {
+        auto stream
+            = make_stream_hmac(random_key(), random_id(), std::make_shared<MemoryStream>(), true);
+        fill(*stream, state.range(0));
+        stream->flush();
+        byte value = 0;
+        for (auto _ : state)
+        {
+            stream->write(&value, 0, 1);
+            stream->flush();
+            ++value;
+        }
+        state.SetBytesProcessed(state.iterations() * state.range(0));
+    }
+    BENCHMARK(BM_HMACStreamFlush)->RangeMultiplier(8)->Range(4 << 10, 32 << 20);
+}    // namespace
+}    // namespace securefs
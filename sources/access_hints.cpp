@@ -0,0 +1,71 @@
+#include "access_hints.h"
+#include "lock_guard.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace securefs
+{
+namespace
+{
+    std::atomic_bool access_hints_flag{false};
+}
+
+void set_access_hints_enabled(bool value) { access_hints_flag.store(value); }
+bool is_access_hints_enabled() { return access_hints_flag.load(); }
+
+AccessPatternTracker::Hints
+AccessPatternTracker::on_read(offset_type offset, length_type length, length_type window)
+{
+    Hints hints;
+    if (length == 0)
+    {
+        return hints;
+    }
+    LockGuard<Mutex> lg(mu_);
+    if (run_reads_ > 0 && offset >= last_offset_ && offset <= next_offset_)
+    {
+        ++run_reads_;
+        next_offset_ = std::max(next_offset_, offset + length);
+    }
+    else
+    {
+        if (sequential_)
+        {
+            sequential_ = false;
+            hints.advice = Hints::Advice::kNormal;
+        }
+        run_start_ = offset;
+        run_reads_ = 1;
+        next_offset_ = offset + length;
+    }
+    last_offset_ = offset;
+
+    if (!sequential_)
+    {
+        if (run_reads_ < kSequentialReads && next_offset_ - run_start_ < window)
+        {
+            return hints;
+        }
+        sequential_ = true;
+        hints.advice = Hints::Advice::kSequential;
+        dropped_end_ = run_start_;
+        prefetched_end_ = next_offset_;
+    }
+    // Prefetches a window at a time, once less than half of one is left ahead.
+    if (prefetched_end_ < next_offset_ + window / 2)
+    {
+        hints.prefetch_offset = std::max(prefetched_end_, next_offset_);
+        hints.prefetch_length = next_offset_ + window - hints.prefetch_offset;
+        prefetched_end_ = next_offset_ + window;
+    }
+    // Likewise drops at least a window at a time.
+    if (offset - dropped_end_ >= 2 * window)
+    {
+        hints.drop_offset = dropped_end_;
+        hints.drop_length = offset - window - dropped_end_;
+        dropped_end_ = offset - window;
+    }
+    return hints;
+}
+}    // namespace securefs
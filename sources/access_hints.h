@@ -0,0 +1,65 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/base/thread_annotations.h>
+
+#include <cstdint>
+
+namespace securefs
+{
+/// Makes the underlying files opened afterwards tell the kernel how they are being read, with
+/// `posix_fadvise` and `readahead`, as decided by an `AccessPatternTracker` for each of them.
+void set_access_hints_enabled(bool value);
+bool is_access_hints_enabled();
+
+/// Follows the reads on one underlying file and decides which hints the kernel should get.
+///
+/// Reads that start within the previous one or right where it ended continue a run, so that the
+/// blocks reread by unaligned plaintext reads do not break it. A long enough run makes the file
+/// sequential: the window ahead of the run is prefetched before the reads get there, and the
+/// range more than a window behind is dropped from the page cache, so that a scan through a huge
+/// file does not evict everything else. A read elsewhere ends the run and reverts the advice.
+class AccessPatternTracker
+{
+public:
+    struct Hints
+    {
+        enum class Advice : uint8_t
+        {
+            kUnchanged,
+            kSequential,
+            kNormal,
+        };
+
+        Advice advice = Advice::kUnchanged;
+        offset_type prefetch_offset = 0;
+        length_type prefetch_length = 0;
+        offset_type drop_offset = 0;
+        length_type drop_length = 0;
+    };
+
+    /// The number of reads in a row after which a run counts as sequential, whatever their size.
+    static constexpr unsigned kSequentialReads = 4;
+
+    AccessPatternTracker() = default;
+    DISABLE_COPY_MOVE(AccessPatternTracker)
+
+    /// A run also counts as sequential once it spans `window` bytes, which is then the amount
+    /// prefetched ahead of it and kept cached behind it.
+    Hints on_read(offset_type offset, length_type length, length_type window);
+
+private:
+    Mutex mu_;
+    offset_type run_start_ ABSL_GUARDED_BY(mu_) = 0;
+    offset_type last_offset_ ABSL_GUARDED_BY(mu_) = 0;
+    offset_type next_offset_ ABSL_GUARDED_BY(mu_) = 0;
+    unsigned run_reads_ ABSL_GUARDED_BY(mu_) = 0;
+    bool sequential_ ABSL_GUARDED_BY(mu_) = false;
+    // Everything in the run below `dropped_end_` has been dropped, and everything up to
+    // `prefetched_end_` prefetched.
+    offset_type dropped_end_ ABSL_GUARDED_BY(mu_) = 0;
+    offset_type prefetched_end_ ABSL_GUARDED_BY(mu_) = 0;
+};
+}    // namespace securefs
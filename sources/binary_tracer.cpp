@@ -0,0 +1,305 @@
+#include "binary_tracer.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "op_stats.h"
+
+#include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <csignal>
+#endif
+
+namespace securefs::trace
+{
+namespace
+{
+    constexpr char kMagic[8] = {'S', 'F', 'S', 'T', 'R', 'A', 'C', 'E'};
+    // Version 1 had 16 bit thread numbers.
+    constexpr uint32_t kFormatVersion = 2;
+    constexpr size_t kEncodedSizeV1 = 48;
+    constexpr auto kMinDumpInterval = std::chrono::seconds(10);
+    constexpr unsigned kMaxDumps = 8;
+
+    std::atomic<bool> dump_requested{false};
+
+    template <class T>
+    void append(std::string& out, T value)
+    {
+        char buffer[sizeof(T)];
+        to_little_endian(value, buffer);
+        out.append(buffer, sizeof(buffer));
+    }
+
+    class Reader
+    {
+    public:
+        explicit Reader(std::string_view data) : data_(data) {}
+
+        template <class T>
+        T read()
+        {
+            return from_little_endian<T>(take(sizeof(T)).data());
+        }
+
+        std::string_view take(size_t size)
+        {
+            if (data_.size() < size)
+            {
+                throw_runtime_error("Truncated trace file");
+            }
+            auto result = data_.substr(0, size);
+            data_.remove_prefix(size);
+            return result;
+        }
+
+    private:
+        std::string_view data_;
+    };
+}    // namespace
+
+std::string BinaryTrace::encode() const
+{
+    std::string out(kMagic, sizeof(kMagic));
+    append(out, kFormatVersion);
+    append(out, static_cast<uint64_t>(wall_clock_offset_ns));
+    append(out, static_cast<uint32_t>(op_names.size()));
+    for (const auto& name : op_names)
+    {
+        auto size = std::min<size_t>(name.size(), UINT16_MAX);
+        append(out, static_cast<uint16_t>(size));
+        out.append(name.data(), size);
+    }
+    append(out, static_cast<uint64_t>(records.size()));
+    out.reserve(out.size() + records.size() * BinaryTraceRecord::kEncodedSize);
+    for (const auto& r : records)
+    {
+        append(out, r.start_ns);
+        append(out, r.duration_ns);
+        append(out, r.handle);
+        append(out, r.offset);
+        append(out, r.size);
+        append(out, static_cast<uint32_t>(r.rc));
+        append(out, r.op);
+        append(out, r.thread);
+    }
+    return out;
+}
+
+BinaryTrace BinaryTrace::decode(std::string_view data)
+{
+    Reader reader(data);
+    if (reader.take(sizeof(kMagic)) != std::string_view(kMagic, sizeof(kMagic)))
+    {
+        throw_runtime_error("Not a securefs trace file");
+    }
+    auto version = reader.read<uint32_t>();
+    if (version != kFormatVersion && version != 1)
+    {
+        throw_runtime_error(absl::StrFormat("Unsupported trace file version %d", version));
+    }
+    BinaryTrace trace;
+    trace.wall_clock_offset_ns = static_cast<int64_t>(reader.read<uint64_t>());
+    auto name_count = reader.read<uint32_t>();
+    for (uint32_t i = 0; i < name_count; ++i)
+    {
+        auto size = reader.read<uint16_t>();
+        trace.op_names.emplace_back(reader.take(size));
+    }
+    auto record_count = reader.read<uint64_t>();
+    auto record_size = version == 1 ? kEncodedSizeV1 : BinaryTraceRecord::kEncodedSize;
+    if (record_count > data.size() / record_size)
+    {
+        throw_runtime_error("Truncated trace file");
+    }
+    trace.records.resize(record_count);
+    for (auto& r : trace.records)
+    {
+        r.start_ns = reader.read<uint64_t>();
+        r.duration_ns = reader.read<uint64_t>();
+        r.handle = reader.read<uint64_t>();
+        r.offset = reader.read<uint64_t>();
+        r.size = reader.read<uint64_t>();
+        r.rc = static_cast<int32_t>(reader.read<uint32_t>());
+        r.op = reader.read<uint16_t>();
+        r.thread = version == 1 ? reader.read<uint16_t>() : reader.read<uint32_t>();
+    }
+    return trace;
+}
+
+std::string BinaryTrace::format() const
+{
+    std::string result;
+    for (const auto& r : records)
+    {
+        auto time = absl::FromUnixNanos(static_cast<int64_t>(r.start_ns) + wall_clock_offset_ns);
+        std::string_view op
+            = r.op < op_names.size() ? std::string_view(op_names[r.op]) : "unknown";
+        absl::StrAppendFormat(&result,
+                              "%s thread=%d op=%s handle=%#x offset=%d size=%d rc=%d "
+                              "duration_us=%.1f\n",
+                              absl::FormatTime(absl::RFC3339_full, time, absl::UTCTimeZone()),
+                              r.thread,
+                              op,
+                              r.handle,
+                              r.offset,
+                              r.size,
+                              r.rc,
+                              r.duration_ns / 1e3);
+    }
+    return result;
+}
+
+BinaryTracer& BinaryTracer::global()
+{
+    static BinaryTracer tracer;
+    return tracer;
+}
+
+BinaryTracer::BinaryTracer()
+    : rings_(
+        [this]()
+        {
+            auto ring = std::make_unique<Ring>();
+            ring->thread = next_thread_.fetch_add(1, std::memory_order_relaxed);
+            return ring;
+        },
+        [](Ring& from, Ring& into)
+        {
+            // The exiting thread is the only writer of `from`, so every slot is intact.
+            auto head = from.head.load(std::memory_order_relaxed);
+            for (uint64_t i = head > kRingCapacity ? head - kRingCapacity : 0; i < head; ++i)
+            {
+                into.append(from.load(i));
+            }
+        })
+{
+}
+
+void BinaryTracer::request_dump() noexcept { dump_requested.store(true); }
+
+void BinaryTracer::Ring::append(const BinaryTraceRecord& record) noexcept
+{
+    uint64_t words[kWordsPerRecord];
+    memcpy(words, &record, sizeof(words));
+    auto head = this->head.load(std::memory_order_relaxed);
+    auto& slot = slots[head & (kRingCapacity - 1)];
+    for (size_t i = 0; i < kWordsPerRecord; ++i)
+    {
+        slot[i].store(words[i], std::memory_order_relaxed);
+    }
+    this->head.store(head + 1, std::memory_order_release);
+    // Keeps the stores of the next record from being reordered before the new head, as in the
+    // writer of a seqlock. A reader that sees any of them then also sees the head moving past them.
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+BinaryTraceRecord BinaryTracer::Ring::load(uint64_t index) const noexcept
+{
+    uint64_t words[kWordsPerRecord];
+    const auto& slot = slots[index & (kRingCapacity - 1)];
+    for (size_t i = 0; i < kWordsPerRecord; ++i)
+    {
+        words[i] = slot[i].load(std::memory_order_relaxed);
+    }
+    BinaryTraceRecord record;
+    memcpy(&record, words, sizeof(words));
+    return record;
+}
+
+void BinaryTracer::record(BinaryTraceRecord record) noexcept
+{
+    Ring* ring;
+    try
+    {
+        ring = &rings_.local();
+    }
+    catch (...)
+    {
+        return;
+    }
+    record.thread = ring->thread;
+    ring->append(record);
+}
+
+std::vector<BinaryTraceRecord> BinaryTracer::snapshot()
+{
+    std::vector<BinaryTraceRecord> result;
+    std::vector<BinaryTraceRecord> copy(kRingCapacity);
+    rings_.for_each(
+        [&](const Ring& ring)
+        {
+            auto head_before = ring.head.load(std::memory_order_acquire);
+            for (size_t i = 0; i < kRingCapacity; ++i)
+            {
+                copy[i] = ring.load(i);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto head_after = ring.head.load(std::memory_order_relaxed);
+            // The owner may have overwritten the slots up to and including `head_after` while we
+            // copied them, so only the ones published before the copy and still intact are kept.
+            uint64_t begin = head_after >= kRingCapacity ? head_after - kRingCapacity + 1 : 0;
+            for (uint64_t i = begin; i < head_before; ++i)
+            {
+                result.push_back(copy[i & (kRingCapacity - 1)]);
+            }
+        });
+    std::sort(result.begin(),
+              result.end(),
+              [](const BinaryTraceRecord& a, const BinaryTraceRecord& b)
+              { return a.start_ns < b.start_ns; });
+    return result;
+}
+
+BinaryTraceDumper::BinaryTraceDumper(std::string path) : path_(std::move(path))
+{
+    BinaryTracer::global().enable();
+#ifndef _WIN32
+    install_signal_handler(SIGUSR2, [](int) { BinaryTracer::request_dump(); });
+#endif
+    poller_ = std::make_unique<PollingThread>([this]() { poll(); });
+}
+
+BinaryTraceDumper::~BinaryTraceDumper() { poller_.reset(); }
+
+void BinaryTraceDumper::dump()
+{
+    auto path = absl::StrFormat("%s.%d", path_, sequence_++ % kMaxDumps + 1);
+    try
+    {
+        BinaryTrace trace;
+        trace.op_names = OpStats::global().op_names();
+        trace.records = BinaryTracer::global().snapshot();
+        auto steady_now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now().time_since_epoch())
+                              .count();
+        trace.wall_clock_offset_ns = absl::GetCurrentTimeNanos() - steady_now;
+        auto data = trace.encode();
+        auto tmp_path = path + ".tmp";
+        OSService::get_default()
+            .open_file_stream(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+            ->write(data.data(), 0, data.size());
+        OSService::get_default().rename(tmp_path, path);
+        INFO_LOG("Wrote %d trace records to %s", trace.records.size(), path);
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to write trace records to %s: %s", path, e.what());
+    }
+}
+
+void BinaryTraceDumper::poll()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_dump_ >= kMinDumpInterval && dump_requested.exchange(false))
+    {
+        dump();
+        last_dump_ = now;
+    }
+}
+}    // namespace securefs::trace
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+#include "polling_thread.h"
+#include "thread_local.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace securefs::trace
+{
+/// One completed FUSE operation, as kept in the binary trace rings.
+struct BinaryTraceRecord
+{
+    // Nanoseconds on the steady clock.
+    uint64_t start_ns = 0;
+    uint64_t duration_ns = 0;
+    // The file handle when the operation has one, otherwise the inode number, or zero.
+    uint64_t handle = 0;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    int32_t rc = 0;
+    // The slot of the operation in `OpStats::global()`.
+    uint16_t op = 0;
+    uint32_t thread = 0;
+
+    static constexpr size_t kEncodedSize = 50;
+};
+
+/// A decoded trace snapshot.
+struct BinaryTrace
+{
+    // Indexed by `BinaryTraceRecord::op`.
+    std::vector<std::string> op_names;
+    // Adding this to `start_ns` yields nanoseconds since the Unix epoch.
+    int64_t wall_clock_offset_ns = 0;
+    std::vector<BinaryTraceRecord> records;
+
+    /// Serializes into the little endian format read by `decode()`.
+    std::string encode() const;
+    static BinaryTrace decode(std::string_view data);
+
+    /// One line of human readable text per record.
+    std::string format() const;
+};
+
+/// A lock free alternative to the text tracing of `FuseTracer`.
+///
+/// Every thread appends fixed size records to its own ring, which keeps the most recent
+/// `kRingCapacity` operations. Writers never wait: they publish each record by a release store of
+/// the ring head, and readers discard the slots that may have been overwritten while they copied
+/// the ring. When a thread exits, its records move to a shared ring of the same capacity.
+class BinaryTracer
+{
+public:
+    static constexpr size_t kRingCapacity = 4096;
+    static_assert((kRingCapacity & (kRingCapacity - 1)) == 0, "Must be a power of two");
+
+    BinaryTracer();
+    DISABLE_COPY_MOVE(BinaryTracer)
+
+    static BinaryTracer& global();
+
+    void enable() noexcept { enabled_.store(true, std::memory_order_relaxed); }
+    bool enabled() const noexcept { return enabled_.load(std::memory_order_relaxed); }
+
+    /// Appends to the ring of the calling thread. `record.thread` is filled in automatically.
+    void record(BinaryTraceRecord record) noexcept;
+
+    /// Copies the records of all threads, sorted by their start time.
+    std::vector<BinaryTraceRecord> snapshot();
+
+    /// Asks the `BinaryTraceDumper` to write a snapshot. Safe to call from signal handlers.
+    static void request_dump() noexcept;
+
+private:
+    static constexpr size_t kWordsPerRecord = sizeof(BinaryTraceRecord) / sizeof(uint64_t);
+    static_assert(sizeof(BinaryTraceRecord) % sizeof(uint64_t) == 0);
+
+    struct Ring
+    {
+        std::atomic<uint64_t> head{0};
+        uint32_t thread = 0;
+        // The records are copied in and out word by word with relaxed atomics, so that a reader
+        // racing with the owner gets a torn slot, which it discards, rather than a data race.
+        std::array<std::array<std::atomic<uint64_t>, kWordsPerRecord>, kRingCapacity> slots{};
+
+        // Only one thread may append at a time.
+        void append(const BinaryTraceRecord& record) noexcept;
+        BinaryTraceRecord load(uint64_t index) const noexcept;
+    };
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<uint32_t> next_thread_{0};
+    PerThread<Ring> rings_;
+};
+
+/// Writes snapshots of `BinaryTracer::global()` to numbered files `path.1` to `path.8` whenever
+/// the process receives SIGUSR2, and when an operation fails with an unexpected exception. Dumps
+/// are at least ten seconds apart, so that a burst of errors does not flood the disk, and reuse
+/// the oldest file once all eight exist, so that a recurring error does not fill it either.
+class BinaryTraceDumper
+{
+public:
+    explicit BinaryTraceDumper(std::string path);
+    ~BinaryTraceDumper();
+    DISABLE_COPY_MOVE(BinaryTraceDumper)
+
+    void dump();
+
+private:
+    std::string path_;
+    unsigned sequence_ = 0;
+    std::chrono::steady_clock::time_point last_dump_{};
+    std::unique_ptr<PollingThread> poller_;
+
+private:
+    void poll();
+};
+}    // namespace securefs::trace
@@ -1,26 +1,37 @@
 #include "commands.h"
+#include "access_hints.h"
+#include "binary_tracer.h"
 #include "btree_dir.h"
+#include "control_dir.h"
 #include "crypto.h"
 #include "exceptions.h"
 #include "files.h"
 #include "full_format.h"
 #include "fuse2_workaround.h"
 #include "fuse_high_level_ops_base.h"
+#include "fuse_low_level_frontend.h"
 #include "git-version.h"
+#include "io_uring.h"
 #include "lite_format.h"
 #include "lock_enabled.h"
 #include "logger.h"
 #include "myutils.h"
 #include "object.h"
+#include "op_recorder.h"
+#include "op_stats.h"
+#include "ops_bench.h"
 #include "params.pb.h"
 #include "params_io.h"
 #include "platform.h"
 #include "tags.h"
+#include "tree_walk.h"
 
+#include <absl/strings/ascii.h>
 #include <absl/strings/escaping.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
+#include <absl/strings/str_join.h>
 #include <argon2.h>
 #include <cryptopp/cpu.h>
 #include <cryptopp/hmac.h>
@@ -40,6 +51,7 @@
 #include <cstdio>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,6 +64,8 @@
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <fcntl.h>
+#include <io.h>
 #include <winfsp/winfsp.h>
 #endif
 
@@ -130,6 +144,70 @@ static void secure_wipe(char* buffer, size_t size)
 
 void CommandBase::parse_cmdline(int argc, const char* const* argv) { cmdline().parse(argc, argv); }
 
+static void randomize(std::string* str, size_t size)
+{
+    str->resize(size);
+    generate_random(str->data(), str->size());
+}
+
+// Parameters with fresh keys for a temporary repository, such as those of `bench` and `replay`.
+static DecryptedSecurefsParams make_scratch_params(const std::string& format,
+                                                   unsigned iv_size,
+                                                   unsigned block_size,
+                                                   unsigned max_padding)
+{
+    DecryptedSecurefsParams params;
+    params.mutable_size_params()->set_iv_size(iv_size);
+    params.mutable_size_params()->set_block_size(block_size);
+    params.mutable_size_params()->set_max_padding_size(max_padding);
+    if (absl::EqualsIgnoreCase(format, "lite"))
+    {
+        randomize(params.mutable_lite_format_params()->mutable_name_key(), 32);
+        randomize(params.mutable_lite_format_params()->mutable_content_key(), 32);
+        randomize(params.mutable_lite_format_params()->mutable_xattr_key(), 32);
+        randomize(params.mutable_lite_format_params()->mutable_padding_key(), 32);
+        params.mutable_lite_format_params()->set_long_name_threshold(128);
+    }
+    else if (absl::EqualsIgnoreCase(format, "full"))
+    {
+        randomize(params.mutable_full_format_params()->mutable_master_key(), 32);
+    }
+    else
+    {
+        throw_runtime_error("Invalid value for --format: " + format);
+    }
+    return params;
+}
+
+static void remove_tree_nothrow(const std::string& path) noexcept
+{
+    try
+    {
+        std::vector<std::pair<std::string, int>> entries;
+        OSService::get_default().recursive_traverse(
+            path,
+            [&](const std::string& parent, const std::string& name, int type)
+            { entries.emplace_back(absl::StrCat(parent, "/", name), type); });
+        // Children are visited after their parents.
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+        {
+            if (it->second == S_IFDIR)
+            {
+                OSService::get_default().remove_directory(it->first);
+            }
+            else
+            {
+                OSService::get_default().remove_file(it->first);
+            }
+        }
+        OSService::get_default().remove_directory(path);
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to remove %s: %s", path, e.what());
+    }
+}
+
 struct SinglePasswordHolder : public DataDirHolder
 {
     using DataDirHolder::DataDirHolder;
@@ -198,9 +276,30 @@ struct Argon2idArgsHolder : public ArgsHolder
                                 cmdline};
     TCLAP::ValueArg<unsigned> p{
         "", "argon2-p", "The parallelism for argon2 algorithm", false, 4, "integer", cmdline};
+    TCLAP::ValueArg<unsigned> calibrate{
+        "",
+        "calibrate",
+        "Benchmark this machine and choose the argon2 parameters so that unlocking takes about "
+        "this many milliseconds, using all CPU cores. Overrides --argon2-t, as well as "
+        "--argon2-p unless it is given. --argon2-m is lowered if a single pass is too slow.",
+        false,
+        0,
+        "ms",
+        cmdline};
 
     EncryptedSecurefsParams::Argon2idParams to_params()
     {
+        if (calibrate.isSet())
+        {
+            auto result = calibrate_argon2id(absl::Milliseconds(calibrate.getValue()),
+                                             m.getValue(),
+                                             p.isSet() ? p.getValue() : 0);
+            INFO_LOG("Calibrated argon2 parameters: --argon2-t %u --argon2-m %u --argon2-p %u",
+                     result.time_cost(),
+                     result.memory_cost(),
+                     result.parallelism());
+            return result;
+        }
         EncryptedSecurefsParams::Argon2idParams result;
         result.set_time_cost(t.getValue());
         result.set_memory_cost(m.getValue());
@@ -274,13 +373,6 @@ private:
         absl::StrCat(kSensitive, "/", kInsensitive),
         cmdline()};
 
-private:
-    static void randomize(std::string* str, size_t size)
-    {
-        str->resize(size);
-        generate_random(str->data(), str->size());
-    }
-
 public:
     void parse_cmdline(int argc, const char* const* argv) override
     {
@@ -494,6 +586,143 @@ public:
     }
 };
 
+// What the filesystem operations need to know about a repository, whether it is mounted or accessed
+// directly by another command.
+struct RepoOpsConfig
+{
+    DecryptedSecurefsParams fsparams;
+    std::string data_dir;
+    bool verify = true;
+    // One of none, casefold, nfc and casefold+nfc.
+    std::string normalization = "none";
+    bool plain_text_names = false;
+};
+
+static key_type from_byte_string(std::string_view view)
+{
+    return key_type{reinterpret_cast<const byte*>(view.data()), view.size()};
+}
+
+static fruit::Component<FuseHighLevelOpsBase>
+get_fuse_high_ops_component(const RepoOpsConfig* config)
+{
+    auto internal_binder = [](DecryptedSecurefsParams::FormatSpecificParamsCase format_case)
+        -> fruit::Component<
+            fruit::Required<lite_format::FuseHighLevelOps, full_format::FuseHighLevelOps>,
+            FuseHighLevelOpsBase>
+    {
+        switch (format_case)
+        {
+        case DecryptedSecurefsParams::kLiteFormatParams:
+            return fruit::createComponent()
+                .bind<FuseHighLevelOpsBase, lite_format::FuseHighLevelOps>();
+        case DecryptedSecurefsParams::kFullFormatParams:
+            return fruit::createComponent()
+                .bind<FuseHighLevelOpsBase, full_format::FuseHighLevelOps>();
+        default:
+            throwInvalidArgumentException("Unknown format case");
+        }
+    };
+
+    return fruit::createComponent()
+        .bindInstance(*config)
+        .install(+internal_binder, config->fsparams.format_specific_params_case())
+        .install(::securefs::lite_format::get_name_translator_component)
+        .install(full_format::get_table_io_component,
+                 config->fsparams.full_format_params().legacy_file_table_io())
+        .registerProvider<lite_format::NameNormalizationFlags(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            {
+                lite_format::NameNormalizationFlags flags{};
+                if (config.plain_text_names)
+                {
+                    flags.no_op = true;
+                }
+                else if (config.normalization == "nfc")
+                {
+                    flags.should_normalize_nfc = true;
+                }
+                else if (config.normalization == "casefold")
+                {
+                    flags.should_case_fold = true;
+                }
+                else if (config.normalization == "casefold+nfc")
+                {
+                    flags.should_normalize_nfc = true;
+                    flags.should_case_fold = true;
+                }
+                else if (config.normalization != "none")
+                {
+                    throw_runtime_error("Invalid flag of --normalization: " + config.normalization);
+                }
+                flags.long_name_threshold
+                    = config.fsparams.lite_format_params().long_name_threshold();
+                return flags;
+            })
+        .registerProvider<fruit::Annotated<tVerify, bool>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config) { return config.verify; })
+        .registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            { return config.fsparams.full_format_params().store_time(); })
+        .registerProvider<fruit::Annotated<tReadOnly, bool>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            {
+                // TODO: Support readonly mounts.
+                return false;
+            })
+        .bind<Directory, BtreeDirectory>()
+        .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            { return config.fsparams.size_params().max_padding_size(); })
+        .registerProvider<fruit::Annotated<tIvSize, unsigned>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config) { return config.fsparams.size_params().iv_size(); })
+        .registerProvider<fruit::Annotated<tBlockSize, unsigned>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config) { return config.fsparams.size_params().block_size(); })
+        .registerProvider<fruit::Annotated<tMasterKey, key_type>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            { return from_byte_string(config.fsparams.full_format_params().master_key()); })
+        .registerProvider<fruit::Annotated<tNameMasterKey, key_type>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            { return from_byte_string(config.fsparams.lite_format_params().name_key()); })
+        .registerProvider<fruit::Annotated<tContentMasterKey, key_type>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            { return from_byte_string(config.fsparams.lite_format_params().content_key()); })
+        .registerProvider<fruit::Annotated<tXattrMasterKey, key_type>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            { return from_byte_string(config.fsparams.lite_format_params().xattr_key()); })
+        .registerProvider<fruit::Annotated<tPaddingMasterKey, key_type>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            {
+                if (config.fsparams.size_params().max_padding_size() > 0
+                    || !config.fsparams.lite_format_params().padding_key().empty())
+                    return from_byte_string(config.fsparams.lite_format_params().padding_key());
+                return key_type();
+            })
+        .registerProvider([](const RepoOpsConfig& config)
+                          { return new OSService(config.data_dir); })
+        .registerProvider(
+            [](const RepoOpsConfig& config)
+            {
+                const auto& p = config.fsparams.full_format_params();
+                if (p.case_insensitive() && p.unicode_normalization_agnostic())
+                {
+                    return Directory::DirNameComparison{&case_uni_norm_insensitve_compare};
+                }
+                if (p.case_insensitive())
+                {
+                    return Directory::DirNameComparison{&case_insensitive_compare};
+                }
+                if (p.unicode_normalization_agnostic())
+                {
+                    return Directory::DirNameComparison{&uni_norm_insensitive_compare};
+                }
+                return Directory::DirNameComparison{&binary_compare};
+            })
+        .registerProvider<fruit::Annotated<tCaseInsensitive, bool>(const RepoOpsConfig&)>(
+            [](const RepoOpsConfig& config)
+            { return config.fsparams.full_format_params().case_insensitive(); });
+}
+
 class MountCommand : public CommandBase
 {
 private:
@@ -534,6 +763,13 @@ private:
                                      "",
                                      "path",
                                      cmdline()};
+    TCLAP::SwitchArg async_log{"",
+                               "async-log",
+                               "Write log messages from a background thread, so that slow log "
+                               "I/O does not block the filesystem. Messages are dropped (and "
+                               "counted) when they are produced faster than they can be written. "
+                               "Errors are still written synchronously.",
+                               cmdline()};
     TCLAP::MultiArg<std::string> fuse_options{
         "o",
         "opt",
@@ -583,7 +819,9 @@ private:
                                                cmdline()};
     TCLAP::ValueArg<int> attr_timeout{"",
                                       "attr-timeout",
-                                      "Number of seconds to cache file attributes. Default is 30.",
+                                      "Number of seconds to cache file attributes. Default is 30, "
+                                      "or 3600 for positive entries in low level mode, where "
+                                      "securefs invalidates the kernel caches by itself.",
                                       false,
                                       30,
                                       "int",
@@ -595,6 +833,119 @@ private:
                                       "When enabled, securefs does not encrypt or decrypt file "
                                       "names. Use it at your own risk. No effect on full format.",
                                       cmdline()};
+    TCLAP::ValueArg<std::string> stats_file{
+        "",
+        "stats",
+        "Path of the file to write the statistics of FUSE operations into (counts, errors, bytes "
+        "and latency percentiles). It is written on SIGUSR1, every --stats-interval seconds, and "
+        "on unmount.",
+        false,
+        "",
+        "path",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> stats_interval{"",
+                                             "stats-interval",
+                                             "Number of seconds between writes to the --stats "
+                                             "file. Zero means only on SIGUSR1 and on unmount.",
+                                             false,
+                                             0,
+                                             "int",
+                                             cmdline()};
+    TCLAP::SwitchArg control_dir{
+        "",
+        "control-dir",
+        "Serve a hidden directory /.securefs inside the mount. Reading /.securefs/stats shows the "
+        "live statistics of FUSE operations, caches and encryption. Writing \"<name> <value>\" "
+        "lines to /.securefs/control changes the tunables listed there without remounting.",
+        cmdline()};
+    TCLAP::ValueArg<std::string> trace_ring{
+        "",
+        "trace-ring",
+        "Keep the most recent FUSE operations of each thread in an in-memory binary ring, at a "
+        "much lower cost than --trace. The rings are written to numbered files with this path "
+        "prefix on SIGUSR2 and when an operation fails unexpectedly, reusing the oldest of eight "
+        "files after that. Use the trace-dump command to read them.",
+        false,
+        "",
+        "path",
+        cmdline()};
+    TCLAP::ValueArg<std::string> record{
+        "",
+        "record",
+        "Record every FUSE operation with its arguments, result and timing into this file, for "
+        "the replay command. The data read and written are never recorded, only their sizes.",
+        false,
+        "",
+        "path",
+        cmdline()};
+    TCLAP::SwitchArg record_anonymize{"",
+                                      "record-anonymize",
+                                      "Replace every file name in the --record file by a keyed "
+                                      "hash, with a random key that is never stored",
+                                      cmdline()};
+#if !defined(_WIN32) && FUSE_USE_VERSION >= 30
+    TCLAP::SwitchArg clone_fd{"",
+                              "clone-fd",
+                              "Give each FUSE worker thread its own file descriptor to the "
+                              "kernel, so that they do not contend on a single queue",
+                              cmdline()};
+    TCLAP::ValueArg<unsigned> max_threads{"",
+                                          "max-threads",
+                                          "Maximum number of FUSE worker threads. Defaults to "
+                                          "the number of CPU cores.",
+                                          false,
+                                          0,
+                                          "int",
+                                          cmdline()};
+#endif
+#if !defined(_WIN32) && !defined(__APPLE__)
+    TCLAP::SwitchArg low_level{"",
+                               "low-level",
+                               "Serve the filesystem through the low level FUSE API, with securefs "
+                               "tracking the inodes itself instead of libfuse's path cache",
+                               cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"",
+                                      "threads",
+                                      "Number of threads that serve the reads and writes queued "
+                                      "behind another request on the same file, in --low-level "
+                                      "mode. The FUSE worker threads queue such requests and move "
+                                      "on to other files instead of waiting. Defaults to the "
+                                      "number of CPU cores.",
+                                      false,
+                                      0,
+                                      "int",
+                                      cmdline()};
+#endif
+#ifdef __linux__
+    TCLAP::SwitchArg use_io_uring{
+        "",
+        "io-uring",
+        "Read and write the underlying files through io_uring, which submits the several reads "
+        "that one operation needs at once. Falls back to the usual system calls when the kernel "
+        "does not support io_uring.",
+        cmdline()};
+#endif
+#ifndef _WIN32
+    TCLAP::SwitchArg direct_io{
+        "",
+        "direct-io",
+        "Read and write the encrypted data files with O_DIRECT (F_NOCACHE on macOS), so that the "
+        "kernel does not cache the ciphertext in addition to the plaintext. Metadata files stay "
+        "cached. Meant for the full format, whose blocks are aligned to sectors; the blocks of the "
+        "lite format are not, so each write there also reads the sectors at both of its ends.",
+        cmdline()};
+    TCLAP::SwitchArg access_hints{
+        "",
+        "access-hints",
+        "Tell the kernel how the underlying files are read, so that sequential reads get "
+        "prefetched further ahead and do not fill the page cache with what they have passed. The "
+        "window is the access_hints_window_kib tunable.",
+        cmdline()};
+#endif
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+    static constexpr int kLowLevelDefaultAttrTimeout = 3600;
+#endif
 
     DecryptedSecurefsParams fsparams{};
 
@@ -637,131 +988,13 @@ private:
         return result;
     }
 
-    static key_type from_byte_string(std::string_view view)
-    {
-        return key_type{reinterpret_cast<const byte*>(view.data()), view.size()};
-    }
-
-    static fruit::Component<FuseHighLevelOpsBase>
-    get_fuse_high_ops_component(const MountCommand* cmd)
+    bool use_low_level() const
     {
-        auto internal_binder = [](DecryptedSecurefsParams::FormatSpecificParamsCase format_case)
-            -> fruit::Component<
-                fruit::Required<lite_format::FuseHighLevelOps, full_format::FuseHighLevelOps>,
-                FuseHighLevelOpsBase>
-        {
-            switch (format_case)
-            {
-            case DecryptedSecurefsParams::kLiteFormatParams:
-                return fruit::createComponent()
-                    .bind<FuseHighLevelOpsBase, lite_format::FuseHighLevelOps>();
-            case DecryptedSecurefsParams::kFullFormatParams:
-                return fruit::createComponent()
-                    .bind<FuseHighLevelOpsBase, full_format::FuseHighLevelOps>();
-            default:
-                throwInvalidArgumentException("Unknown format case");
-            }
-        };
-
-        return fruit::createComponent()
-            .bindInstance(*cmd)
-            .install(+internal_binder, cmd->fsparams.format_specific_params_case())
-            .install(::securefs::lite_format::get_name_translator_component)
-            .install(full_format::get_table_io_component,
-                     cmd->fsparams.full_format_params().legacy_file_table_io())
-            .registerProvider<lite_format::NameNormalizationFlags(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                {
-                    lite_format::NameNormalizationFlags flags{};
-                    if (cmd.plain_text_names.getValue())
-                    {
-                        flags.no_op = true;
-                    }
-                    else if (cmd.normalization.getValue() == "nfc")
-                    {
-                        flags.should_normalize_nfc = true;
-                    }
-                    else if (cmd.normalization.getValue() == "casefold")
-                    {
-                        flags.should_case_fold = true;
-                    }
-                    else if (cmd.normalization.getValue() == "casefold+nfc")
-                    {
-                        flags.should_normalize_nfc = true;
-                        flags.should_case_fold = true;
-                    }
-                    else if (cmd.normalization.getValue() != "none")
-                    {
-                        throw_runtime_error("Invalid flag of --normalization: "
-                                            + cmd.normalization.getValue());
-                    }
-                    flags.long_name_threshold
-                        = cmd.fsparams.lite_format_params().long_name_threshold();
-                    return flags;
-                })
-            .registerProvider<fruit::Annotated<tVerify, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd) { return !cmd.insecure.getValue(); })
-            .registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return cmd.fsparams.full_format_params().store_time(); })
-            .registerProvider<fruit::Annotated<tReadOnly, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                {
-                    // TODO: Support readonly mounts.
-                    return false;
-                })
-            .bind<Directory, BtreeDirectory>()
-            .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return cmd.fsparams.size_params().max_padding_size(); })
-            .registerProvider<fruit::Annotated<tIvSize, unsigned>(const MountCommand&)>(
-                [](const MountCommand& cmd) { return cmd.fsparams.size_params().iv_size(); })
-            .registerProvider<fruit::Annotated<tBlockSize, unsigned>(const MountCommand&)>(
-                [](const MountCommand& cmd) { return cmd.fsparams.size_params().block_size(); })
-            .registerProvider<fruit::Annotated<tMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return from_byte_string(cmd.fsparams.full_format_params().master_key()); })
-            .registerProvider<fruit::Annotated<tNameMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return from_byte_string(cmd.fsparams.lite_format_params().name_key()); })
-            .registerProvider<fruit::Annotated<tContentMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return from_byte_string(cmd.fsparams.lite_format_params().content_key()); })
-            .registerProvider<fruit::Annotated<tXattrMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return from_byte_string(cmd.fsparams.lite_format_params().xattr_key()); })
-            .registerProvider<fruit::Annotated<tPaddingMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                {
-                    if (cmd.fsparams.size_params().max_padding_size() > 0
-                        || !cmd.fsparams.lite_format_params().padding_key().empty())
-                        return from_byte_string(cmd.fsparams.lite_format_params().padding_key());
-                    return key_type();
-                })
-            .registerProvider(
-                [](const MountCommand& cmd)
-                { return new OSService(cmd.single_pass_holder_.data_dir.getValue()); })
-            .registerProvider(
-                [](const MountCommand& cmd)
-                {
-                    const auto& p = cmd.fsparams.full_format_params();
-                    if (p.case_insensitive() && p.unicode_normalization_agnostic())
-                    {
-                        return Directory::DirNameComparison{&case_uni_norm_insensitve_compare};
-                    }
-                    if (p.case_insensitive())
-                    {
-                        return Directory::DirNameComparison{&case_insensitive_compare};
-                    }
-                    if (p.unicode_normalization_agnostic())
-                    {
-                        return Directory::DirNameComparison{&uni_norm_insensitive_compare};
-                    }
-                    return Directory::DirNameComparison{&binary_compare};
-                })
-            .registerProvider<fruit::Annotated<tCaseInsensitive, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return cmd.fsparams.full_format_params().case_insensitive(); });
+#if !defined(_WIN32) && !defined(__APPLE__)
+        return low_level.getValue();
+#else
+        return false;
+#endif
     }
 
     bool should_use_ino()
@@ -843,6 +1076,11 @@ public:
         {
             OSService::enter_background();
         }
+        if (global_logger && async_log.getValue())
+        {
+            global_logger->start_async();
+        }
+        DEFER(if (global_logger) { global_logger->stop_async(); });
 
         if (single_pass_holder_.data_dir.getValue() == mount_point.getValue())
         {
@@ -905,22 +1143,28 @@ public:
         std::vector<std::string> fuse_args{
             "securefs",
             "-o",
-            "hard_remove",
-            "-o",
             "fsname=" + fsname.getValue(),
             "-o",
             "subtype=" + fssubtype.getValue(),
-            "-o",
-            absl::StrFormat("entry_timeout=%d", attr_timeout.getValue()),
-            "-o",
-            absl::StrFormat("attr_timeout=%d", attr_timeout.getValue()),
-            "-o",
-            absl::StrFormat("negative_timeout=%d", attr_timeout.getValue()),
-#ifndef _WIN32
+#if !defined(_WIN32) && FUSE_USE_VERSION < 30
+            // libfuse3 turns this into a capability, which is requested during initialization.
             "-o",
             "atomic_o_trunc",
 #endif
         };
+        if (!use_low_level())
+        {
+            // These are options of the high level libfuse API. The low level frontend handles them
+            // by itself.
+            for (auto&& opt : {std::string("hard_remove"),
+                               absl::StrFormat("entry_timeout=%d", attr_timeout.getValue()),
+                               absl::StrFormat("attr_timeout=%d", attr_timeout.getValue()),
+                               absl::StrFormat("negative_timeout=%d", attr_timeout.getValue())})
+            {
+                fuse_args.emplace_back("-o");
+                fuse_args.emplace_back(opt);
+            }
+        }
         if (single_threaded.getValue())
         {
             fuse_args.emplace_back("-s");
@@ -931,12 +1175,23 @@ public:
             fuse_args.emplace_back("-o");
             fuse_args.emplace_back(
                 absl::StrFormat("ThreadCount=%d", std::thread::hardware_concurrency()));
+#elif FUSE_USE_VERSION >= 30
+            fuse_args.emplace_back("-o");
+            fuse_args.emplace_back(absl::StrFormat("max_threads=%d",
+                                                   max_threads.getValue() > 0
+                                                       ? max_threads.getValue()
+                                                       : std::thread::hardware_concurrency()));
+            if (clone_fd.getValue())
+            {
+                fuse_args.emplace_back("-o");
+                fuse_args.emplace_back("clone_fd");
+            }
 #endif
         }
         // Handling `daemon` ourselves, as FUSE's version interferes with our initialization.
         fuse_args.emplace_back("-f");
 
-        if (should_use_ino())
+        if (!use_low_level() && should_use_ino())
         {
             fuse_args.emplace_back("-o");
             fuse_args.emplace_back("use_ino");
@@ -970,7 +1225,7 @@ public:
         fuse_args.emplace_back("-o");
         fuse_args.emplace_back(
             absl::StrFormat("VolumeInfoTimeout=%d", attr_timeout.getValue() * 1000));
-#else
+#elif FUSE_USE_VERSION < 30
         fuse_args.emplace_back("-o");
         fuse_args.emplace_back("big_writes");
 #endif
@@ -988,7 +1243,24 @@ public:
 #endif
             fuse_args.emplace_back(mount_point.getValue());
 
-        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, this);
+#ifdef __linux__
+        if (use_io_uring.getValue() && !set_io_uring_enabled(true))
+        {
+            WARN_LOG("io_uring is unavailable, so --io-uring falls back to the usual system calls");
+        }
+#endif
+#ifndef _WIN32
+        OSService::set_direct_io_enabled(direct_io.getValue());
+        set_access_hints_enabled(access_hints.getValue());
+#endif
+
+        RepoOpsConfig ops_config;
+        ops_config.fsparams = fsparams;
+        ops_config.data_dir = single_pass_holder_.data_dir.getValue();
+        ops_config.verify = !insecure.getValue();
+        ops_config.normalization = normalization.getValue();
+        ops_config.plain_text_names = plain_text_names.getValue();
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, &ops_config);
 
         bool native_xattr = !noxattr.getValue();
 #ifdef __APPLE__
@@ -1006,7 +1278,53 @@ public:
             }
         }
 #endif
-        auto high_level_ops = injector.get<FuseHighLevelOpsBase*>();
+        FuseHighLevelOpsBase* high_level_ops = injector.get<FuseHighLevelOpsBase*>();
+        // Wrapped before the control directory, whose operations are not worth replaying.
+        std::optional<OpRecorder> recorder;
+        std::optional<RecordingOps> recording_ops;
+        if (record.isSet())
+        {
+            recorder.emplace(OSService::get_default().open_file_stream(
+                                 record.getValue(), O_WRONLY | O_CREAT | O_TRUNC, 0600),
+                             record_anonymize.getValue());
+            recording_ops.emplace(*high_level_ops, *recorder);
+            high_level_ops = &*recording_ops;
+        }
+        std::optional<ControlDirOps> control_dir_ops;
+        if (control_dir.getValue())
+        {
+            control_dir_ops.emplace(*high_level_ops);
+            high_level_ops = &*control_dir_ops;
+        }
+        std::optional<OpStatsDumper> stats_dumper;
+        if (stats_file.isSet())
+        {
+            stats_dumper.emplace(stats_file.getValue(), stats_interval.getValue());
+        }
+        std::optional<trace::BinaryTraceDumper> trace_dumper;
+        if (trace_ring.isSet())
+        {
+            trace_dumper.emplace(trace_ring.getValue());
+        }
+#if !defined(_WIN32) && !defined(__APPLE__)
+        if (use_low_level())
+        {
+            FuseLowLevelFrontend::Options options;
+            // Negative entries stay at the short default, because a name that is created under a
+            // different spelling (with case folding or normalization) cannot be invalidated.
+            options.entry_timeout = attr_timeout.isSet() ? attr_timeout.getValue()
+                                                         : kLowLevelDefaultAttrTimeout;
+            options.attr_timeout = options.entry_timeout;
+            options.negative_timeout = attr_timeout.getValue();
+            options.use_ino = should_use_ino();
+            options.enable_xattr = native_xattr;
+            options.scheduler_threads = threads.getValue();
+            FuseLowLevelFrontend frontend(*high_level_ops, options);
+            VERBOSE_LOG("Serving low level FUSE with arguments: %s", escape_args(fuse_args));
+            return frontend.run(static_cast<int>(fuse_args.size()),
+                                const_cast<char**>(to_c_style_args(fuse_args).data()));
+        }
+#endif
         auto fuse_callbacks = FuseHighLevelOpsBase::build_ops(high_level_ops, native_xattr);
         VERBOSE_LOG("Calling fuse_main with arguments: %s", escape_args(fuse_args));
         return my_fuse_main(static_cast<int>(fuse_args.size()),
@@ -1238,53 +1556,847 @@ public:
     }
 };
 
-class DocCommand : public CommandBase
+class TraceDumpCommand : public CommandBase
 {
 private:
-    std::vector<CommandBase*> commands{};
+    TCLAP::UnlabeledValueArg<std::string> path{
+        "path", "Trace file written by mount --trace-ring", true, "", "path", cmdline()};
 
 public:
-    DocCommand() = default;
-    ~DocCommand() = default;
-    const char* long_name() const noexcept override { return "doc"; }
+    const char* long_name() const noexcept override { return "trace-dump"; }
     char short_name() const noexcept override { return 0; }
     const char* help_message() const noexcept override
     {
-        return "Display the full help message of all commands in markdown format";
+        return "Decode a binary trace file into human readable text";
     }
-    void add_command(CommandBase* c) { commands.push_back(c); }
+
     int execute() override
     {
-        fputs("# securefs\n", stdout);
-        fputs("The command strucuture is `securefs ${SUBCOMMAND} ${SUBOPTIONS}`.\nSee below for "
-              "available subcommands and relevant options\n\n",
-              stdout);
-        for (auto c : commands)
-        {
-            if (c->short_name())
-                absl::PrintF("## %s (short name: %c)\n", c->long_name(), c->short_name());
-            else
-                absl::PrintF("## %s\n", c->long_name());
-            absl::PrintF("%s\n\n", c->help_message());
-            auto&& cmdline = c->cmdline();
+        auto data
+            = OSService::get_default().open_file_stream(path.getValue(), O_RDONLY, 0)->as_string();
+        auto text = trace::BinaryTrace::decode(data).format();
+        fwrite(text.data(), 1, text.size(), stdout);
+        return 0;
+    }
+};
 
-            std::vector<std::pair<size_t, TCLAP::Arg*>> prioritizedArgs;
-            size_t index = 0;
-            for (TCLAP::Arg* arg : cmdline.getArgList())
+static void log_walk_progress(const char* state, ParallelTreeWalker& walker)
+{
+    auto& progress = walker.progress();
+    INFO_LOG("%s: %d directories, %d files, %d symlinks, %.1f MiB, %d errors",
+             state,
+             progress.directories.load(),
+             progress.files.load(),
+             progress.symlinks.load(),
+             progress.bytes.load() / 1048576.0,
+             progress.errors.load());
+}
+
+// Logs the failures recorded by `walker`, and returns the exit status of the command.
+static int report_walk_errors(ParallelTreeWalker& walker)
+{
+    auto errors = walker.errors();
+    for (const auto& error : errors)
+    {
+        ERROR_LOG("%s", error);
+    }
+    auto count = walker.progress().errors.load();
+    if (count > errors.size())
+    {
+        ERROR_LOG("%d more errors are not shown", count - errors.size());
+    }
+    return count == 0 ? 0 : 1;
+}
+
+class VerifyCommand : public CommandBase
+{
+private:
+    SinglePasswordHolder single_pass_holder_{cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads to verify with. 0 means the number of "
+                                      "CPU cores.",
+                                      false,
+                                      0,
+                                      "int",
+                                      cmdline()};
+    TCLAP::SwitchArg fail_fast{
+        "", "fail-fast", "Stop at the first corrupted entry instead of reporting all", cmdline()};
+    TCLAP::SwitchArg plain_text_names{"",
+                                      "plain-text-names",
+                                      "Must be given if the repository is mounted with "
+                                      "--plain-text-names. No effect on full format.",
+                                      cmdline()};
+
+    static constexpr absl::Duration kProgressInterval = absl::Seconds(10);
+
+public:
+    const char* long_name() const noexcept override { return "verify"; }
+    char short_name() const noexcept override { return 0; }
+    const char* help_message() const noexcept override
+    {
+        return "Check the integrity of every file, directory and name in the repository without "
+               "mounting it. Returns a nonzero status if any corruption is found.";
+    }
+
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+        single_pass_holder_.get_password(false);
+    }
+
+    int execute() override
+    {
+        auto real_config_path = single_pass_holder_.get_real_config_path_for_reading();
+        RepoOpsConfig ops_config;
+        ops_config.fsparams = decrypt(
+            OSService::get_default().open_file_stream(real_config_path, O_RDONLY, 0)->as_string(),
+            {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
+            maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get());
+        CryptoPP::SecureWipeBuffer(single_pass_holder_.password.data(),
+                                   single_pass_holder_.password.size());
+        ops_config.data_dir = single_pass_holder_.data_dir.getValue();
+        ops_config.plain_text_names = plain_text_names.getValue();
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, &ops_config);
+
+        OpsTreeSource source(injector.get<FuseHighLevelOpsBase&>());
+        ParallelTreeWalker walker(source, threads.getValue(), !fail_fast.getValue());
+        auto& progress = walker.progress();
+        INFO_LOG("Verifying %s with %d threads", ops_config.data_dir, walker.thread_count());
+        walker.walk(
+            [&](const std::string& path, const fuse_stat& st)
             {
-                ++index;
-                if (dynamic_cast<TCLAP::UnlabeledValueArg<std::string>*>(arg))
+                // Reading a file decrypts and authenticates every block of it, and extended
+                // attributes are authenticated when they are decrypted.
+                switch (st.st_mode & S_IFMT)
                 {
-                    prioritizedArgs.emplace_back(index, arg);
-                }
-                else
+                case S_IFDIR:
+                    source.check_directory(path);
+                    break;
+                case S_IFLNK:
+                    source.read_link(path);
+                    break;
+                case S_IFREG:
                 {
-                    prioritizedArgs.emplace_back(2 * cmdline.getArgList().size() - index, arg);
+                    auto size = source.read_file(
+                        path, [&](const char*, size_t size) { progress.bytes += size; });
+                    if (size != static_cast<uint64_t>(st.st_size))
+                    {
+                        throw_runtime_error(absl::StrFormat(
+                            "The file has %d bytes but its size is %d", size, st.st_size));
+                    }
+                    break;
                 }
-            }
-            std::sort(prioritizedArgs.begin(), prioritizedArgs.end());
-
-            for (auto&& pair : prioritizedArgs)
+                default:
+                    break;
+                }
+                source.read_xattrs(path);
+            },
+            [&]() { log_walk_progress("Progress", walker); },
+            kProgressInterval);
+        log_walk_progress("Done", walker);
+        return report_walk_errors(walker);
+    }
+};
+
+class ImportCommand : public CommandBase
+{
+private:
+    // Declared first so that it comes before the repository among the positional arguments.
+    TCLAP::UnlabeledValueArg<std::string> source{
+        "source", "Directory of plain files to import", true, "", "source", cmdline()};
+    SinglePasswordHolder single_pass_holder_{cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads to import with. 0 means the number of "
+                                      "CPU cores.",
+                                      false,
+                                      0,
+                                      "int",
+                                      cmdline()};
+    TCLAP::SwitchArg fail_fast{
+        "", "fail-fast", "Stop at the first entry that fails to import", cmdline()};
+    TCLAP::ValueArg<std::string> normalization{"",
+                                               "normalization",
+                                               "Must match the --normalization that the "
+                                               "repository is mounted with",
+                                               false,
+#ifdef __APPLE__
+                                               "nfc",
+#else
+                                               "none",
+#endif
+                                               "",
+                                               cmdline()};
+    TCLAP::SwitchArg plain_text_names{"",
+                                      "plain-text-names",
+                                      "Must be given if the repository is mounted with "
+                                      "--plain-text-names. No effect on full format.",
+                                      cmdline()};
+
+    static constexpr absl::Duration kProgressInterval = absl::Seconds(10);
+
+public:
+    const char* long_name() const noexcept override { return "import"; }
+    char short_name() const noexcept override { return 0; }
+    const char* help_message() const noexcept override
+    {
+        return "Encrypt a directory tree into a repository created by `create`, without mounting "
+               "it. The repository must not be mounted at the same time.";
+    }
+
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+        single_pass_holder_.get_password(false);
+    }
+
+    int execute() override
+    {
+        auto real_config_path = single_pass_holder_.get_real_config_path_for_reading();
+        RepoOpsConfig ops_config;
+        ops_config.fsparams = decrypt(
+            OSService::get_default().open_file_stream(real_config_path, O_RDONLY, 0)->as_string(),
+            {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
+            maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get());
+        CryptoPP::SecureWipeBuffer(single_pass_holder_.password.data(),
+                                   single_pass_holder_.password.size());
+        ops_config.data_dir = single_pass_holder_.data_dir.getValue();
+        ops_config.normalization = normalization.getValue();
+        ops_config.plain_text_names = plain_text_names.getValue();
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, &ops_config);
+
+        OSTreeSource tree_source(source.getValue());
+        OpsTreeSink sink(injector.get<FuseHighLevelOpsBase&>(), ops_config.data_dir);
+        ParallelTreeCopier copier(tree_source, sink, threads.getValue(), !fail_fast.getValue());
+        INFO_LOG("Importing %s into %s with %d threads",
+                 source.getValue(),
+                 ops_config.data_dir,
+                 copier.walker().thread_count());
+        copier.copy([&]() { log_walk_progress("Progress", copier.walker()); }, kProgressInterval);
+        log_walk_progress("Done", copier.walker());
+        return report_walk_errors(copier.walker());
+    }
+};
+
+class ExportCommand : public CommandBase
+{
+private:
+    SinglePasswordHolder single_pass_holder_{cmdline()};
+    // Declared after the password holder so that it comes after the repository among the
+    // positional arguments.
+    TCLAP::UnlabeledValueArg<std::string> output{
+        "output",
+        "Directory to decrypt into, or - to write a tar archive to the standard output",
+        true,
+        "",
+        "output",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads to export with. 0 means the number of "
+                                      "CPU cores.",
+                                      false,
+                                      0,
+                                      "int",
+                                      cmdline()};
+    TCLAP::SwitchArg fail_fast{
+        "", "fail-fast", "Stop at the first entry that fails to export", cmdline()};
+    TCLAP::ValueArg<std::string> normalization{"",
+                                               "normalization",
+                                               "Must match the --normalization that the "
+                                               "repository is mounted with",
+                                               false,
+#ifdef __APPLE__
+                                               "nfc",
+#else
+                                               "none",
+#endif
+                                               "",
+                                               cmdline()};
+    TCLAP::SwitchArg plain_text_names{"",
+                                      "plain-text-names",
+                                      "Must be given if the repository is mounted with "
+                                      "--plain-text-names. No effect on full format.",
+                                      cmdline()};
+
+    static constexpr absl::Duration kProgressInterval = absl::Seconds(10);
+
+public:
+    const char* long_name() const noexcept override { return "export"; }
+    char short_name() const noexcept override { return 0; }
+    const char* help_message() const noexcept override
+    {
+        return "Decrypt a repository into a directory tree or a tar archive, without mounting it. "
+               "The repository must not be mounted at the same time.";
+    }
+
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+        single_pass_holder_.get_password(false);
+    }
+
+    int execute() override
+    {
+        auto real_config_path = single_pass_holder_.get_real_config_path_for_reading();
+        RepoOpsConfig ops_config;
+        ops_config.fsparams = decrypt(
+            OSService::get_default().open_file_stream(real_config_path, O_RDONLY, 0)->as_string(),
+            {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
+            maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get());
+        CryptoPP::SecureWipeBuffer(single_pass_holder_.password.data(),
+                                   single_pass_holder_.password.size());
+        ops_config.data_dir = single_pass_holder_.data_dir.getValue();
+        ops_config.normalization = normalization.getValue();
+        ops_config.plain_text_names = plain_text_names.getValue();
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, &ops_config);
+
+        OpsTreeSource tree_source(injector.get<FuseHighLevelOpsBase&>());
+        std::unique_ptr<TreeSink> sink;
+        if (output.getValue() == "-")
+        {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            sink = std::make_unique<TarTreeSink>(stdout);
+        }
+        else
+        {
+            OSService::get_default().ensure_directory(output.getValue(), 0755);
+            sink = std::make_unique<OSTreeSink>(output.getValue());
+        }
+        ParallelTreeCopier copier(tree_source, *sink, threads.getValue(), !fail_fast.getValue());
+        INFO_LOG("Exporting %s into %s with %d threads",
+                 ops_config.data_dir,
+                 output.getValue(),
+                 copier.walker().thread_count());
+        copier.copy([&]() { log_walk_progress("Progress", copier.walker()); }, kProgressInterval);
+        log_walk_progress("Done", copier.walker());
+        return report_walk_errors(copier.walker());
+    }
+};
+
+class ConvertCommand : public CommandBase
+{
+private:
+    SinglePasswordHolder single_pass_holder_{cmdline()};
+    // Declared after the password holder so that it comes after the repository among the
+    // positional arguments.
+    TCLAP::UnlabeledValueArg<std::string> new_dir{
+        "new_dir",
+        "Directory to store the converted repository in, with the same password and key file",
+        true,
+        "",
+        "new_dir",
+        cmdline()};
+    Argon2idArgsHolder argon2{cmdline()};
+    TCLAP::ValueArg<std::string> format{"f",
+                                        "format",
+                                        "The format type of the converted repository. Unchanged "
+                                        "by default.",
+                                        false,
+                                        "",
+                                        "lite/full",
+                                        cmdline()};
+    TCLAP::ValueArg<unsigned int> iv_size{
+        "", "iv-size", "The IV size. Unchanged by default.", false, 0, "integer", cmdline()};
+    TCLAP::ValueArg<unsigned int> block_size{"",
+                                             "block-size",
+                                             "Block size for files. Unchanged by default.",
+                                             false,
+                                             0,
+                                             "integer",
+                                             cmdline()};
+    TCLAP::ValueArg<unsigned> max_padding{"",
+                                          "max-padding",
+                                          "Maximum number of padding bytes of files. Unchanged by "
+                                          "default.",
+                                          false,
+                                          0,
+                                          "int",
+                                          cmdline()};
+    TCLAP::ValueArg<unsigned int> long_name_threshold{
+        "",
+        "long-name-threshold",
+        "(For lite format only) when the filename component exceeds this length, it will be stored "
+        "encrypted in a SQLite database. Unchanged by default.",
+        false,
+        0,
+        "integer",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads to convert with. 0 means the number of "
+                                      "CPU cores.",
+                                      false,
+                                      0,
+                                      "int",
+                                      cmdline()};
+    TCLAP::SwitchArg fail_fast{
+        "", "fail-fast", "Stop at the first entry that fails to convert", cmdline()};
+    TCLAP::ValueArg<std::string> normalization{"",
+                                               "normalization",
+                                               "Must match the --normalization that the "
+                                               "repository is mounted with",
+                                               false,
+#ifdef __APPLE__
+                                               "nfc",
+#else
+                                               "none",
+#endif
+                                               "",
+                                               cmdline()};
+    TCLAP::SwitchArg plain_text_names{"",
+                                      "plain-text-names",
+                                      "Must be given if the repository is mounted with "
+                                      "--plain-text-names. No effect on full format.",
+                                      cmdline()};
+
+    static constexpr absl::Duration kProgressInterval = absl::Seconds(10);
+    // Both are in the new repository until the conversion is done. Their names start with "." so
+    // that lite format does not take them as encrypted names.
+    static constexpr std::string_view kPendingConfigFileName = ".config.pb.converting";
+    static constexpr std::string_view kCheckpointFileName = ".securefs.convert";
+
+private:
+    DecryptedSecurefsParams make_new_params(const DecryptedSecurefsParams& old_params)
+    {
+        DecryptedSecurefsParams params;
+        *params.mutable_size_params() = old_params.size_params();
+        if (iv_size.isSet())
+        {
+            params.mutable_size_params()->set_iv_size(iv_size.getValue());
+        }
+        if (block_size.isSet())
+        {
+            params.mutable_size_params()->set_block_size(block_size.getValue());
+        }
+        if (max_padding.isSet())
+        {
+            params.mutable_size_params()->set_max_padding_size(max_padding.getValue());
+        }
+
+        bool lite = old_params.has_lite_format_params();
+        if (format.isSet())
+        {
+            if (absl::EqualsIgnoreCase(format.getValue(), "lite"))
+            {
+                lite = true;
+            }
+            else if (absl::EqualsIgnoreCase(format.getValue(), "full"))
+            {
+                lite = false;
+            }
+            else
+            {
+                throw_runtime_error("Invalid value for --format: " + format.getValue());
+            }
+        }
+        if (lite)
+        {
+            auto* lite_params = params.mutable_lite_format_params();
+            randomize(lite_params->mutable_name_key(), 32);
+            randomize(lite_params->mutable_content_key(), 32);
+            randomize(lite_params->mutable_xattr_key(), 32);
+            randomize(lite_params->mutable_padding_key(), 32);
+            if (long_name_threshold.getValue() > 0)
+            {
+                lite_params->set_long_name_threshold(long_name_threshold.getValue());
+            }
+            else if (old_params.has_lite_format_params())
+            {
+                lite_params->set_long_name_threshold(
+                    old_params.lite_format_params().long_name_threshold());
+            }
+            else
+            {
+                lite_params->set_long_name_threshold(128);
+            }
+        }
+        else
+        {
+            // Keeps the case and normalization handling of a full format repository, which the
+            // names in it may depend on.
+            if (old_params.has_full_format_params())
+            {
+                *params.mutable_full_format_params() = old_params.full_format_params();
+            }
+            randomize(params.mutable_full_format_params()->mutable_master_key(), 32);
+        }
+        return params;
+    }
+
+public:
+    const char* long_name() const noexcept override { return "convert"; }
+    char short_name() const noexcept override { return 0; }
+    const char* help_message() const noexcept override
+    {
+        return "Re-encrypt a repository into a new one with a different format, block size, IV "
+               "size or padding, without mounting it. The repository must not be mounted at the "
+               "same time. An interrupted conversion resumes when run again with the same "
+               "arguments, and the new repository cannot be mounted until it is complete.";
+    }
+
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+        single_pass_holder_.get_password(false);
+    }
+
+    int execute() override
+    {
+        auto real_config_path = single_pass_holder_.get_real_config_path_for_reading();
+        RepoOpsConfig old_config;
+        old_config.fsparams = decrypt(
+            OSService::get_default().open_file_stream(real_config_path, O_RDONLY, 0)->as_string(),
+            {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
+            maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get());
+        old_config.data_dir = single_pass_holder_.data_dir.getValue();
+        old_config.normalization = normalization.getValue();
+        old_config.plain_text_names = plain_text_names.getValue();
+
+        OSService::get_default().ensure_directory(new_dir.getValue(), 0755);
+        OSService new_root(new_dir.getValue());
+        const std::string pending_config_name(kPendingConfigFileName);
+        fuse_stat st{};
+        if (new_root.stat(std::string(kConfigFileName), &st))
+        {
+            throw_runtime_error(new_dir.getValue() + " already contains a repository");
+        }
+        RepoOpsConfig new_config = old_config;
+        new_config.data_dir = new_dir.getValue();
+        if (new_root.stat(pending_config_name, &st))
+        {
+            if (format.isSet() || iv_size.isSet() || block_size.isSet() || max_padding.isSet()
+                || long_name_threshold.isSet())
+            {
+                WARN_LOG("The parameters of an interrupted conversion cannot be changed, so they "
+                         "are ignored");
+            }
+            new_config.fsparams = decrypt(
+                new_root.open_file_stream(pending_config_name, O_RDONLY, 0)->as_string(),
+                {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
+                maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get());
+            INFO_LOG("Resuming the conversion into %s", new_config.data_dir);
+        }
+        else
+        {
+            new_config.fsparams = make_new_params(old_config.fsparams);
+            auto encrypted_data
+                = encrypt(
+                      new_config.fsparams,
+                      argon2.to_params(),
+                      {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
+                      maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get())
+                      .SerializeAsString();
+            auto config_stream
+                = new_root.open_file_stream(pending_config_name, O_WRONLY | O_EXCL | O_CREAT, 0644);
+            config_stream->write(encrypted_data.data(), 0, encrypted_data.size());
+            config_stream->fsync();
+        }
+        CryptoPP::SecureWipeBuffer(single_pass_holder_.password.data(),
+                                   single_pass_holder_.password.size());
+
+        {
+            fruit::Injector<FuseHighLevelOpsBase> old_injector(get_fuse_high_ops_component,
+                                                               &old_config);
+            fruit::Injector<FuseHighLevelOpsBase> new_injector(get_fuse_high_ops_component,
+                                                               &new_config);
+            TreeCheckpoint checkpoint(new_root.open_file_stream(
+                std::string(kCheckpointFileName), O_RDWR | O_CREAT, 0644));
+            OpsTreeSource tree_source(old_injector.get<FuseHighLevelOpsBase&>());
+            OpsTreeSink sink(new_injector.get<FuseHighLevelOpsBase&>(), new_config.data_dir);
+            ParallelTreeCopier copier(tree_source, sink, threads.getValue(), !fail_fast.getValue());
+            copier.set_checkpoint(&checkpoint);
+            INFO_LOG("Converting %s into %s with %d threads",
+                     old_config.data_dir,
+                     new_config.data_dir,
+                     copier.walker().thread_count());
+            copier.copy([&]() { log_walk_progress("Progress", copier.walker()); },
+                        kProgressInterval);
+            log_walk_progress("Done", copier.walker());
+            if (report_walk_errors(copier.walker()) != 0)
+            {
+                ERROR_LOG("Run the command again to retry the entries that failed");
+                return 1;
+            }
+        }
+
+        // The new repository only becomes usable here, in one atomic rename.
+        new_root.rename(pending_config_name, std::string(kConfigFileName));
+        new_root.remove_file(std::string(kCheckpointFileName));
+        new_root.syncfs();
+        INFO_LOG("%s is converted into %s", old_config.data_dir, new_config.data_dir);
+        return 0;
+    }
+};
+
+class ReplayCommand : public CommandBase
+{
+private:
+    TCLAP::UnlabeledValueArg<std::string> recording{
+        "recording", "Recording written by mount --record", true, "", "path", cmdline()};
+    TCLAP::ValueArg<std::string> format{"f",
+                                        "format",
+                                        "The format type of the repository to replay into",
+                                        false,
+                                        "lite",
+                                        "lite/full",
+                                        cmdline()};
+    TCLAP::ValueArg<unsigned int> iv_size{
+        "", "iv-size", "The IV size", false, 12, "integer", cmdline()};
+    TCLAP::ValueArg<unsigned int> block_size{
+        "", "block-size", "Block size for files", false, 4096, "integer", cmdline()};
+    TCLAP::ValueArg<unsigned> max_padding{
+        "", "max-padding", "Maximum number of padding bytes of files", false, 0, "int", cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads to replay with. The operations of each "
+                                      "recorded thread stay in order on one of them. Zero means "
+                                      "one per recorded thread.",
+                                      false,
+                                      0,
+                                      "int",
+                                      cmdline()};
+    TCLAP::SwitchArg original_speed{"",
+                                    "original-speed",
+                                    "Issue each operation at its recorded time, instead of as "
+                                    "fast as possible",
+                                    cmdline()};
+    TCLAP::ValueArg<std::string> dir{"",
+                                     "dir",
+                                     "Directory under which the temporary repository is created. "
+                                     "It is removed afterwards.",
+                                     false,
+                                     ".",
+                                     "path",
+                                     cmdline()};
+
+public:
+    const char* long_name() const noexcept override { return "replay"; }
+    char short_name() const noexcept override { return 0; }
+    const char* help_message() const noexcept override
+    {
+        return "Replay a recording of FUSE operations on a temporary repository, without FUSE, and "
+               "compare the latencies with the recorded ones";
+    }
+
+    int execute() override
+    {
+        auto ops = decode_op_recording(OSService::get_default()
+                                           .open_file_stream(recording.getValue(), O_RDONLY, 0)
+                                           ->as_string());
+        INFO_LOG("Loaded %d operations from %s", ops.size(), recording.getValue());
+
+        RepoOpsConfig ops_config;
+        ops_config.fsparams = make_scratch_params(
+            format.getValue(), iv_size.getValue(), block_size.getValue(), max_padding.getValue());
+        ops_config.data_dir
+            = absl::StrCat(dir.getValue(), "/", OSService::temp_name("securefs-replay-", ""));
+        OSService::get_default().mkdir(ops_config.data_dir, 0755);
+        // Declared before the injector, so that the repository is removed after it is closed.
+        DEFER(remove_tree_nothrow(ops_config.data_dir));
+
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, &ops_config);
+        OpReplayer::Options options;
+        options.threads = threads.getValue();
+        options.original_speed = original_speed.getValue();
+        OpReplayer replayer(injector.get<FuseHighLevelOpsBase&>(), options);
+        replayer.prepare(ops);
+        auto result = replayer.replay(ops);
+        if (result.diverged > 0)
+        {
+            WARN_LOG("%d operations succeeded or failed differently from the recording, so the "
+                     "latencies may not be comparable",
+                     result.diverged);
+        }
+        auto report = result.format_report();
+        fwrite(report.data(), 1, report.size(), stdout);
+        return 0;
+    }
+};
+
+class BenchCommand : public CommandBase
+{
+private:
+    TCLAP::ValueArg<std::string> format{"f",
+                                        "format",
+                                        "The format type of the repository to benchmark",
+                                        false,
+                                        "lite",
+                                        "lite/full",
+                                        cmdline()};
+    TCLAP::ValueArg<unsigned int> iv_size{
+        "", "iv-size", "The IV size", false, 12, "integer", cmdline()};
+    TCLAP::ValueArg<unsigned int> block_size{
+        "", "block-size", "Block size for files", false, 4096, "integer", cmdline()};
+    TCLAP::ValueArg<unsigned> max_padding{
+        "", "max-padding", "Maximum number of padding bytes of files", false, 0, "int", cmdline()};
+    TCLAP::MultiArg<std::string> workloads{
+        "w",
+        "workload",
+        "Workload to run, one of seq_write, seq_read, rand_write, rand_read, small_files, readdir "
+        "and rename. May be repeated. All of them are run by default.",
+        false,
+        "workload",
+        cmdline()};
+    TCLAP::MultiArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads to run each workload with. May be "
+                                      "repeated to compare thread counts. Defaults to 1.",
+                                      false,
+                                      "int",
+                                      cmdline()};
+    TCLAP::ValueArg<unsigned> file_size{"",
+                                        "file-size",
+                                        "Size in MiB of the file of each thread in the read and "
+                                        "write workloads",
+                                        false,
+                                        64,
+                                        "int",
+                                        cmdline()};
+    TCLAP::ValueArg<unsigned> io_size{
+        "", "io-size", "Size in KiB of each read and write", false, 128, "int", cmdline()};
+    TCLAP::ValueArg<unsigned> file_count{"",
+                                         "file-count",
+                                         "Number of files of each thread in the small_files and "
+                                         "rename workloads",
+                                         false,
+                                         1000,
+                                         "int",
+                                         cmdline()};
+    TCLAP::ValueArg<unsigned> dir_entries{"",
+                                          "dir-entries",
+                                          "Number of entries in the directory of the readdir "
+                                          "workload",
+                                          false,
+                                          100000,
+                                          "int",
+                                          cmdline()};
+    TCLAP::ValueArg<std::string> dir{"",
+                                     "dir",
+                                     "Directory under which the temporary repository is created. "
+                                     "It is removed afterwards.",
+                                     false,
+                                     ".",
+                                     "path",
+                                     cmdline()};
+
+public:
+    const char* long_name() const noexcept override { return "bench"; }
+    char short_name() const noexcept override { return 0; }
+    const char* help_message() const noexcept override
+    {
+        return "Benchmark the filesystem operations on a temporary repository, without FUSE";
+    }
+
+    int execute() override
+    {
+        std::vector<OpsBenchmark::Workload> selected;
+        for (const auto& name : workloads.getValue())
+        {
+            selected.push_back(OpsBenchmark::parse_workload(name));
+        }
+        if (selected.empty())
+        {
+            selected = OpsBenchmark::all_workloads();
+        }
+        std::vector<unsigned> thread_counts = threads.getValue();
+        if (thread_counts.empty())
+        {
+            thread_counts.push_back(1);
+        }
+
+        RepoOpsConfig ops_config;
+        ops_config.fsparams = make_scratch_params(
+            format.getValue(), iv_size.getValue(), block_size.getValue(), max_padding.getValue());
+        ops_config.data_dir
+            = absl::StrCat(dir.getValue(), "/", OSService::temp_name("securefs-bench-", ""));
+        OSService::get_default().mkdir(ops_config.data_dir, 0755);
+        // Declared before the injector, so that the repository is removed after it is closed.
+        DEFER(remove_tree_nothrow(ops_config.data_dir));
+
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, &ops_config);
+        auto& ops = injector.get<FuseHighLevelOpsBase&>();
+
+        std::vector<std::string> results;
+        for (unsigned thread_count : thread_counts)
+        {
+            OpsBenchmark::Options options;
+            options.threads = thread_count;
+            options.file_size = uint64_t(file_size.getValue()) << 20;
+            options.io_size = io_size.getValue() << 10;
+            options.file_count = file_count.getValue();
+            options.dir_entries = dir_entries.getValue();
+            OpsBenchmark bench(ops, options);
+            for (auto workload : selected)
+            {
+                INFO_LOG("Running %s with %d threads",
+                         OpsBenchmark::workload_name(workload),
+                         thread_count);
+                results.push_back(bench.run(workload).to_json());
+            }
+        }
+        absl::PrintF(R"({"format": "%s", "iv_size": %d, "block_size": %d, "max_padding": %d, )"
+                     R"("results": [%s]})"
+                     "\n",
+                     absl::AsciiStrToLower(format.getValue()),
+                     iv_size.getValue(),
+                     block_size.getValue(),
+                     max_padding.getValue(),
+                     absl::StrJoin(results, ", "));
+        return 0;
+    }
+};
+
+class DocCommand : public CommandBase
+{
+private:
+    std::vector<CommandBase*> commands{};
+
+public:
+    DocCommand() = default;
+    ~DocCommand() = default;
+    const char* long_name() const noexcept override { return "doc"; }
+    char short_name() const noexcept override { return 0; }
+    const char* help_message() const noexcept override
+    {
+        return "Display the full help message of all commands in markdown format";
+    }
+    void add_command(CommandBase* c) { commands.push_back(c); }
+    int execute() override
+    {
+        fputs("# securefs\n", stdout);
+        fputs("The command strucuture is `securefs ${SUBCOMMAND} ${SUBOPTIONS}`.\nSee below for "
+              "available subcommands and relevant options\n\n",
+              stdout);
+        for (auto c : commands)
+        {
+            if (c->short_name())
+                absl::PrintF("## %s (short name: %c)\n", c->long_name(), c->short_name());
+            else
+                absl::PrintF("## %s\n", c->long_name());
+            absl::PrintF("%s\n\n", c->help_message());
+            auto&& cmdline = c->cmdline();
+
+            std::vector<std::pair<size_t, TCLAP::Arg*>> prioritizedArgs;
+            size_t index = 0;
+            for (TCLAP::Arg* arg : cmdline.getArgList())
+            {
+                ++index;
+                if (dynamic_cast<TCLAP::UnlabeledValueArg<std::string>*>(arg))
+                {
+                    prioritizedArgs.emplace_back(index, arg);
+                }
+                else
+                {
+                    prioritizedArgs.emplace_back(2 * cmdline.getArgList().size() - index, arg);
+                }
+            }
+            std::sort(prioritizedArgs.begin(), prioritizedArgs.end());
+
+            for (auto&& pair : prioritizedArgs)
             {
                 TCLAP::Arg* arg = pair.second;
                 {
@@ -1355,13 +2467,11 @@ public:
                         continue;
                     }
                 }
+                if (dynamic_cast<TCLAP::MultiArg<std::string>*>(arg)
+                    || dynamic_cast<TCLAP::MultiArg<unsigned>*>(arg))
                 {
-                    auto a = dynamic_cast<TCLAP::MultiArg<std::string>*>(arg);
-                    if (a)
-                    {
-                        fputs("*This option can be specified multiple times.*\n", stdout);
-                        continue;
-                    }
+                    fputs("*This option can be specified multiple times.*\n", stdout);
+                    continue;
                 }
                 throw_runtime_error(std::string("Unknown type of arg ") + typeid(*arg).name());
             }
@@ -1381,6 +2491,13 @@ int commands_main(int argc, const char* const* argv)
                                                make_unique<VersionCommand>(),
                                                make_unique<InfoCommand>(),
                                                make_unique<MigrateLongNameCommand>(),
+                                               make_unique<TraceDumpCommand>(),
+                                               make_unique<VerifyCommand>(),
+                                               make_unique<ImportCommand>(),
+                                               make_unique<ExportCommand>(),
+                                               make_unique<ConvertCommand>(),
+                                               make_unique<ReplayCommand>(),
+                                               make_unique<BenchCommand>(),
                                                make_unique<DocCommand>()};
 
         const char* const program_name = argv[0];
@@ -4,6 +4,8 @@
 #include "platform.h"
 #include <absl/strings/str_cat.h>
 
+#include <atomic>
+
 namespace securefs
 {
 using absl::StrCat;
@@ -14,6 +16,15 @@ const OSService& OSService::get_default()
     return service;
 }
 
+namespace
+{
+    std::atomic_bool direct_io_flag{false};
+}    // namespace
+
+void OSService::set_direct_io_enabled(bool value) { direct_io_flag.store(value); }
+
+bool OSService::is_direct_io_enabled() { return direct_io_flag.load(); }
+
 std::string OSService::temp_name(std::string_view prefix, std::string_view suffix)
 {
     byte random[16];
@@ -0,0 +1,609 @@
+#include "control_dir.h"
+#include "exceptions.h"
+#include "logger.h"
+#include "op_stats.h"
+#include "stat_workaround.h"
+#include "tunables.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace securefs
+{
+struct ControlDirOps::Handle
+{
+    Kind kind;
+    // The rendered stats, or the input of the control file that is not terminated by a newline.
+    std::string content;
+};
+
+namespace
+{
+    constexpr std::string_view kStatsName = "stats";
+    constexpr std::string_view kControlName = "control";
+}    // namespace
+
+ControlDirOps::ControlDirOps(FuseHighLevelOpsBase& inner)
+    : inner_(inner), owner_uid_(OSService::getuid())
+{
+    OSService::get_current_time(mount_time_);
+}
+
+std::string ControlDirOps::render_stats()
+{
+    auto report = OpStats::global().format_report();
+    report.append("\n# Tunables, changed by writing \"<name> <value>\" to ");
+    report.append(kControlPath);
+    report.push_back('\n');
+    for (const auto& [name, value] : Tunables::global().list())
+    {
+        absl::StrAppendFormat(&report, "%-32s %14d\n", name, value);
+    }
+    if (global_logger)
+    {
+        absl::StrAppendFormat(
+            &report, "\n%-32s %14d\n", "log_messages_dropped", global_logger->dropped_messages());
+    }
+    return report;
+}
+
+void ControlDirOps::execute_commands(std::string_view input)
+{
+    for (std::string_view line : absl::StrSplit(input, '\n'))
+    {
+        line = absl::StripAsciiWhitespace(line);
+        if (line.empty() || line.front() == '#')
+        {
+            continue;
+        }
+        std::vector<std::string_view> parts
+            = absl::StrSplit(line, absl::ByAnyChar(" \t"), absl::SkipEmpty());
+        uint64_t value;
+        if (parts.size() != 2 || !absl::SimpleAtoi(parts[1], &value))
+        {
+            throwVFSException(EINVAL);
+        }
+        Tunables::global().set(parts[0], value);
+        INFO_LOG("Tunable %s is set to %d", parts[0], value);
+    }
+}
+
+ControlDirOps::Kind ControlDirOps::classify(const char* path) noexcept
+{
+    if (!path)
+    {
+        return Kind::kNone;
+    }
+    std::string_view p = path;
+    if (p == kDirPath)
+    {
+        return Kind::kDir;
+    }
+    if (p == kStatsPath)
+    {
+        return Kind::kStats;
+    }
+    if (p == kControlPath)
+    {
+        return Kind::kControl;
+    }
+    if (p.size() > kDirPath.size() && p.substr(0, kDirPath.size()) == kDirPath
+        && p[kDirPath.size()] == '/')
+    {
+        return Kind::kMissing;
+    }
+    return Kind::kNone;
+}
+
+ControlDirOps::Handle* ControlDirOps::get_handle(const fuse_file_info* info) noexcept
+{
+    if (!info || !(info->fh & 1))
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<Handle*>(static_cast<uintptr_t>(info->fh & ~uint64_t(1)));
+}
+
+void ControlDirOps::fill_attr(Kind kind, fuse_stat* st) const
+{
+    memset(st, 0, sizeof(*st));
+    switch (kind)
+    {
+    case Kind::kDir:
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        break;
+    case Kind::kStats:
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        break;
+    case Kind::kControl:
+        st->st_mode = S_IFREG | 0200;
+        st->st_nlink = 1;
+        break;
+    default:
+        throwVFSException(ENOENT);
+    }
+    // The contents are generated on open and read with direct I/O, so the size is left at zero.
+    st->st_uid = owner_uid_;
+    st->st_gid = OSService::getgid();
+    set_atim(*st, mount_time_);
+    set_mtim(*st, mount_time_);
+    set_ctim(*st, mount_time_);
+}
+
+void ControlDirOps::initialize(fuse_conn_info* info) { inner_.initialize(info); }
+
+int ControlDirOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx)
+{
+    return inner_.vstatfs(path, buf, ctx);
+}
+
+int ControlDirOps::vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx)
+{
+    auto kind = classify(path);
+    if (kind == Kind::kNone)
+    {
+        return inner_.vgetattr(path, st, ctx);
+    }
+    fill_attr(kind, st);
+    return 0;
+}
+
+int ControlDirOps::vfgetattr(const char* path,
+                             fuse_stat* st,
+                             fuse_file_info* info,
+                             const fuse_context* ctx)
+{
+    if (auto handle = get_handle(info))
+    {
+        fill_attr(handle->kind, st);
+        return 0;
+    }
+    return inner_.vfgetattr(path, st, info, ctx);
+}
+
+int ControlDirOps::vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    auto kind = classify(path);
+    switch (kind)
+    {
+    case Kind::kNone:
+        return inner_.vopendir(path, info, ctx);
+    case Kind::kDir:
+        info->fh = reinterpret_cast<uintptr_t>(new Handle{kind, {}}) | 1;
+        return 0;
+    case Kind::kMissing:
+        return -ENOENT;
+    default:
+        return -ENOTDIR;
+    }
+}
+
+int ControlDirOps::vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (auto handle = get_handle(info))
+    {
+        delete handle;
+        return 0;
+    }
+    return inner_.vreleasedir(path, info, ctx);
+}
+
+int ControlDirOps::vreaddir(const char* path,
+                            void* buf,
+                            fuse_fill_dir_t filler,
+                            fuse_off_t off,
+                            fuse_file_info* info,
+                            const fuse_context* ctx)
+{
+    if (!get_handle(info))
+    {
+        return inner_.vreaddir(path, buf, filler, off, info, ctx);
+    }
+    fuse_stat st;
+    fill_attr(Kind::kDir, &st);
+    filler(buf, ".", &st, 0);
+    filler(buf, "..", nullptr, 0);
+    fill_attr(Kind::kStats, &st);
+    filler(buf, kStatsName.data(), &st, 0);
+    fill_attr(Kind::kControl, &st);
+    filler(buf, kControlName.data(), &st, 0);
+    return 0;
+}
+
+int ControlDirOps::vcreate(const char* path,
+                           fuse_mode_t mode,
+                           fuse_file_info* info,
+                           const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Kind::kNone:
+        return inner_.vcreate(path, mode, info, ctx);
+    case Kind::kMissing:
+        return -EACCES;
+    default:
+        return -EEXIST;
+    }
+}
+
+int ControlDirOps::vopen(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    auto kind = classify(path);
+    int access = info->flags & O_ACCMODE;
+    switch (kind)
+    {
+    case Kind::kNone:
+        return inner_.vopen(path, info, ctx);
+    case Kind::kMissing:
+        return -ENOENT;
+    case Kind::kDir:
+        return -EISDIR;
+    case Kind::kStats:
+        if (access != O_RDONLY)
+        {
+            return -EACCES;
+        }
+        break;
+    case Kind::kControl:
+        if (access == O_RDONLY || (ctx->uid != owner_uid_ && ctx->uid != 0))
+        {
+            return -EACCES;
+        }
+        break;
+    }
+    auto handle = std::make_unique<Handle>(Handle{kind, {}});
+    if (kind == Kind::kStats)
+    {
+        handle->content = render_stats();
+    }
+    info->direct_io = 1;
+    info->fh = reinterpret_cast<uintptr_t>(handle.release()) | 1;
+    return 0;
+}
+
+int ControlDirOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vrelease(path, info, ctx);
+    }
+    std::unique_ptr<Handle> holder(handle);
+    if (handle->kind == Kind::kControl && !handle->content.empty())
+    {
+        try
+        {
+            execute_commands(handle->content);
+        }
+        catch (const std::exception& e)
+        {
+            WARN_LOG("Invalid command \"%s\" written to %s: %s",
+                     handle->content,
+                     kControlPath,
+                     e.what());
+        }
+    }
+    return 0;
+}
+
+int ControlDirOps::vread(const char* path,
+                         char* buf,
+                         size_t size,
+                         fuse_off_t offset,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vread(path, buf, size, offset, info, ctx);
+    }
+    const auto& content = handle->content;
+    if (offset < 0)
+    {
+        return -EINVAL;
+    }
+    if (static_cast<size_t>(offset) >= content.size())
+    {
+        return 0;
+    }
+    size = std::min(size, content.size() - static_cast<size_t>(offset));
+    memcpy(buf, content.data() + offset, size);
+    return static_cast<int>(size);
+}
+
+int ControlDirOps::vwrite(const char* path,
+                          const char* buf,
+                          size_t size,
+                          fuse_off_t offset,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vwrite(path, buf, size, offset, info, ctx);
+    }
+    // The offset is ignored, as commands are executed as soon as their lines are complete.
+    handle->content.append(buf, size);
+    auto end_of_lines = handle->content.rfind('\n');
+    if (end_of_lines != std::string::npos)
+    {
+        std::string lines = handle->content.substr(0, end_of_lines + 1);
+        handle->content.erase(0, end_of_lines + 1);
+        execute_commands(lines);
+    }
+    return static_cast<int>(size);
+}
+
+int ControlDirOps::vflush(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (get_handle(info))
+    {
+        return 0;
+    }
+    return inner_.vflush(path, info, ctx);
+}
+
+int ControlDirOps::vftruncate(const char* path,
+                              fuse_off_t len,
+                              fuse_file_info* info,
+                              const fuse_context* ctx)
+{
+    if (auto handle = get_handle(info))
+    {
+        return handle->kind == Kind::kControl ? 0 : -EACCES;
+    }
+    return inner_.vftruncate(path, len, info, ctx);
+}
+
+int ControlDirOps::vunlink(const char* path, const fuse_context* ctx)
+{
+    return classify(path) == Kind::kNone ? inner_.vunlink(path, ctx) : -EPERM;
+}
+
+int ControlDirOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Kind::kNone:
+        return inner_.vmkdir(path, mode, ctx);
+    case Kind::kMissing:
+        return -EACCES;
+    default:
+        return -EEXIST;
+    }
+}
+
+int ControlDirOps::vrmdir(const char* path, const fuse_context* ctx)
+{
+    return classify(path) == Kind::kNone ? inner_.vrmdir(path, ctx) : -EPERM;
+}
+
+int ControlDirOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    return classify(path) == Kind::kNone ? inner_.vchmod(path, mode, ctx) : -EPERM;
+}
+
+int ControlDirOps::vchown(const char* path,
+                          fuse_uid_t uid,
+                          fuse_gid_t gid,
+                          const fuse_context* ctx)
+{
+    return classify(path) == Kind::kNone ? inner_.vchown(path, uid, gid, ctx) : -EPERM;
+}
+
+int ControlDirOps::vsymlink(const char* to, const char* from, const fuse_context* ctx)
+{
+    return classify(from) == Kind::kNone ? inner_.vsymlink(to, from, ctx) : -EPERM;
+}
+
+int ControlDirOps::vlink(const char* src, const char* dest, const fuse_context* ctx)
+{
+    if (classify(src) != Kind::kNone || classify(dest) != Kind::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vlink(src, dest, ctx);
+}
+
+int ControlDirOps::vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx)
+{
+    return classify(path) == Kind::kNone ? inner_.vreadlink(path, buf, size, ctx) : -EINVAL;
+}
+
+int ControlDirOps::vrename(const char* from, const char* to, const fuse_context* ctx)
+{
+    if (classify(from) != Kind::kNone || classify(to) != Kind::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vrename(from, to, ctx);
+}
+
+int ControlDirOps::vfsync(const char* path,
+                          int datasync,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    if (get_handle(info))
+    {
+        return 0;
+    }
+    return inner_.vfsync(path, datasync, info, ctx);
+}
+
+int ControlDirOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Kind::kNone:
+        return inner_.vtruncate(path, len, ctx);
+    case Kind::kControl:
+        // For shell redirections without atomic O_TRUNC support.
+        return 0;
+    case Kind::kMissing:
+        return -ENOENT;
+    default:
+        return -EACCES;
+    }
+}
+
+int ControlDirOps::vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Kind::kNone:
+        return inner_.vutimens(path, ts, ctx);
+    case Kind::kMissing:
+        return -ENOENT;
+    default:
+        return 0;
+    }
+}
+
+int ControlDirOps::vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx)
+{
+    return classify(path) == Kind::kNone ? inner_.vlistxattr(path, list, size, ctx) : 0;
+}
+
+int ControlDirOps::vgetxattr(const char* path,
+                             const char* name,
+                             char* value,
+                             size_t size,
+                             uint32_t position,
+                             const fuse_context* ctx)
+{
+    if (classify(path) != Kind::kNone)
+    {
+        return -ENOTSUP;
+    }
+    return inner_.vgetxattr(path, name, value, size, position, ctx);
+}
+
+int ControlDirOps::vsetxattr(const char* path,
+                             const char* name,
+                             const char* value,
+                             size_t size,
+                             int flags,
+                             uint32_t position,
+                             const fuse_context* ctx)
+{
+    if (classify(path) != Kind::kNone)
+    {
+        return -ENOTSUP;
+    }
+    return inner_.vsetxattr(path, name, value, size, flags, position, ctx);
+}
+
+int ControlDirOps::vremovexattr(const char* path, const char* name, const fuse_context* ctx)
+{
+    return classify(path) == Kind::kNone ? inner_.vremovexattr(path, name, ctx) : -ENOTSUP;
+}
+
+int ControlDirOps::vfallocate(const char* path,
+                              int mode,
+                              fuse_off_t offset,
+                              fuse_off_t length,
+                              fuse_file_info* info,
+                              const fuse_context* ctx)
+{
+    if (get_handle(info))
+    {
+        return -EOPNOTSUPP;
+    }
+    return inner_.vfallocate(path, mode, offset, length, info, ctx);
+}
+
+int ControlDirOps::vlseek(const char* path,
+                          fuse_off_t offset,
+                          int whence,
+                          fuse_off_t* result,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vlseek(path, offset, whence, result, info, ctx);
+    }
+    // The content has no holes. Failing with ENOSYS would make the kernel stop asking for the
+    // rest of the mount.
+    if (whence != kSeekData && whence != kSeekHole)
+    {
+        return -EINVAL;
+    }
+    if (offset < 0 || static_cast<size_t>(offset) >= handle->content.size())
+    {
+        return -ENXIO;
+    }
+    *result = whence == kSeekData ? offset : static_cast<fuse_off_t>(handle->content.size());
+    return 0;
+}
+
+int ControlDirOps::vcopy_file_range(const char* path_in,
+                                    fuse_file_info* info_in,
+                                    fuse_off_t offset_in,
+                                    const char* path_out,
+                                    fuse_file_info* info_out,
+                                    fuse_off_t offset_out,
+                                    size_t size,
+                                    int flags,
+                                    const fuse_context* ctx)
+{
+    // Not ENOSYS either, which would turn copies off for the rest of the mount.
+    if (get_handle(info_in) || get_handle(info_out))
+    {
+        return -EOPNOTSUPP;
+    }
+    return inner_.vcopy_file_range(
+        path_in, info_in, offset_in, path_out, info_out, offset_out, size, flags, ctx);
+}
+
+bool ControlDirOps::has_getpath() const { return inner_.has_getpath(); }
+
+int ControlDirOps::vgetpath(
+    const char* path, char* buf, size_t size, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (get_handle(info))
+    {
+        return -ENOSYS;
+    }
+    return inner_.vgetpath(path, buf, size, info, ctx);
+}
+
+bool ControlDirOps::has_resolve() const { return inner_.has_resolve(); }
+
+std::optional<std::string> ControlDirOps::vresolve(const char* path)
+{
+    // Our own files are served by path.
+    if (classify(path) != Kind::kNone)
+    {
+        return std::nullopt;
+    }
+    return inner_.vresolve(path);
+}
+
+int ControlDirOps::vgetattr_resolved(const std::string& resolved,
+                                     fuse_stat* st,
+                                     const fuse_context* ctx)
+{
+    return inner_.vgetattr_resolved(resolved, st, ctx);
+}
+
+int ControlDirOps::vopen_resolved(const std::string& resolved,
+                                  fuse_file_info* info,
+                                  const fuse_context* ctx)
+{
+    return inner_.vopen_resolved(resolved, info, ctx);
+}
+}    // namespace securefs
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+
+#include <string>
+#include <string_view>
+
+namespace securefs
+{
+/// Serves a hidden virtual directory `/.securefs` on top of another `FuseHighLevelOpsBase`, and
+/// forwards everything else to it.
+///
+/// - `/.securefs/stats` is read only. Each open renders the live counters of `OpStats` and the
+///   current values of `Tunables`, so reading it takes no lock that the filesystem operations
+///   contend on.
+/// - `/.securefs/control` is write only. Each line written is a command `<tunable> <value>`. Only
+///   the user who mounted the filesystem and root may open it, even with `allow_other`.
+///
+/// The directory is not listed in the root, so it does not show up in recursive traversals.
+class ControlDirOps : public FuseHighLevelOpsBase
+{
+public:
+    static constexpr std::string_view kDirPath = "/.securefs";
+    static constexpr std::string_view kStatsPath = "/.securefs/stats";
+    static constexpr std::string_view kControlPath = "/.securefs/control";
+
+    explicit ControlDirOps(FuseHighLevelOpsBase& inner);
+
+    /// The content of the stats file.
+    static std::string render_stats();
+    /// Executes the commands in `input`, one per line. Blank lines and lines starting with `#`
+    /// are ignored. Throws on the first invalid command.
+    static void execute_commands(std::string_view input);
+
+    void initialize(fuse_conn_info* info) override;
+    int vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx) override;
+    int vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx) override;
+    int vfgetattr(const char* path,
+                  fuse_stat* st,
+                  fuse_file_info* info,
+                  const fuse_context* ctx) override;
+    int vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreaddir(const char* path,
+                 void* buf,
+                 fuse_fill_dir_t filler,
+                 fuse_off_t off,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    int vcreate(const char* path,
+                fuse_mode_t mode,
+                fuse_file_info* info,
+                const fuse_context* ctx) override;
+    int vopen(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vread(const char* path,
+              char* buf,
+              size_t size,
+              fuse_off_t offset,
+              fuse_file_info* info,
+              const fuse_context* ctx) override;
+    int vwrite(const char* path,
+               const char* buf,
+               size_t size,
+               fuse_off_t offset,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vflush(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vftruncate(const char* path,
+                   fuse_off_t len,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vunlink(const char* path, const fuse_context* ctx) override;
+    int vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vrmdir(const char* path, const fuse_context* ctx) override;
+    int vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vchown(const char* path, fuse_uid_t uid, fuse_gid_t gid, const fuse_context* ctx) override;
+    int vsymlink(const char* to, const char* from, const fuse_context* ctx) override;
+    int vlink(const char* src, const char* dest, const fuse_context* ctx) override;
+    int vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx) override;
+    int vrename(const char* from, const char* to, const fuse_context* ctx) override;
+    int
+    vfsync(const char* path, int datasync, fuse_file_info* info, const fuse_context* ctx) override;
+    int vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx) override;
+    int vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx) override;
+    int vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx) override;
+    int vgetxattr(const char* path,
+                  const char* name,
+                  char* value,
+                  size_t size,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vsetxattr(const char* path,
+                  const char* name,
+                  const char* value,
+                  size_t size,
+                  int flags,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    int vfallocate(const char* path,
+                   int mode,
+                   fuse_off_t offset,
+                   fuse_off_t length,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vlseek(const char* path,
+               fuse_off_t offset,
+               int whence,
+               fuse_off_t* result,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vcopy_file_range(const char* path_in,
+                         fuse_file_info* info_in,
+                         fuse_off_t offset_in,
+                         const char* path_out,
+                         fuse_file_info* info_out,
+                         fuse_off_t offset_out,
+                         size_t size,
+                         int flags,
+                         const fuse_context* ctx) override;
+    bool has_getpath() const override;
+    int vgetpath(const char* path,
+                 char* buf,
+                 size_t size,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    bool has_resolve() const override;
+    std::optional<std::string> vresolve(const char* path) override;
+    int vgetattr_resolved(const std::string& resolved,
+                          fuse_stat* st,
+                          const fuse_context* ctx) override;
+    int vopen_resolved(const std::string& resolved,
+                       fuse_file_info* info,
+                       const fuse_context* ctx) override;
+
+private:
+    enum class Kind
+    {
+        kNone,
+        kDir,
+        kStats,
+        kControl,
+        // A nonexistent path under the virtual directory.
+        kMissing
+    };
+
+    struct Handle;
+
+    FuseHighLevelOpsBase& inner_;
+    fuse_timespec mount_time_;
+    uint32_t owner_uid_;
+
+private:
+    static Kind classify(const char* path) noexcept;
+    // Handles of the virtual files are tagged in the lowest bit, which is always clear in the
+    // pointers that the inner implementation stores in `fh`.
+    static Handle* get_handle(const fuse_file_info* info) noexcept;
+    void fill_attr(Kind kind, fuse_stat* st) const;
+};
+}    // namespace securefs
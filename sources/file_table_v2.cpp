@@ -6,8 +6,10 @@
 #include "logger.h"
 #include "mystring.h"
 #include "myutils.h"
+#include "op_stats.h"
 #include "platform.h"
 #include "tags.h"
+#include "tunables.h"
 
 #include <absl/base/thread_annotations.h>
 #include <absl/strings/str_cat.h>
@@ -19,6 +21,27 @@
 
 namespace securefs::full_format
 {
+namespace
+{
+    struct FileTableCounters
+    {
+        OpStats::Counter live{"file_table_live"};
+        OpStats::Counter cached{"file_table_cached"};
+        // Opens served from the live map or the cache, versus those that hit the disk.
+        OpStats::Counter hits{"file_table_hits"};
+        OpStats::Counter misses{"file_table_misses"};
+    };
+
+    const FileTableCounters& counters()
+    {
+        static const FileTableCounters c;
+        return c;
+    }
+}    // namespace
+
+const std::atomic<uint64_t>& FileTable::max_cached_knob_
+    = Tunables::global().define("file_table_max_cached_per_shard", kMaxCached, 0, 1 << 20);
+
 void FileTable::init()
 {
     FileStreamPtrPair pair;
@@ -64,6 +87,7 @@ FilePtrHolder FileTable::open_as(const id_type& id, int type)
     LockGuard<Mutex> lg(s.mu);
     if (auto it = s.live_map.find(id); it != s.live_map.end())
     {
+        counters().hits.add(1);
         return create_holder(it->second);
     }
     if (auto it
@@ -76,12 +100,17 @@ FilePtrHolder FileTable::open_as(const id_type& id, int type)
         auto unique_base = std::move(*it);
         s.cache.erase(it);
         s.live_map.emplace(id, std::move(unique_base));
+        counters().hits.add(1);
+        counters().cached.add(-1);
+        counters().live.add(1);
         return holder;
     }
     auto [data, meta] = io_.open(id);
     auto unique_base = construct(type, std::move(data), std::move(meta), id);
     auto holder = create_holder(unique_base);
     s.live_map.emplace(id, std::move(unique_base));
+    counters().misses.add(1);
+    counters().live.add(1);
     return holder;
 }
 FileTable::Shard& FileTable::find_shard(const id_type& id)
@@ -102,6 +131,7 @@ FilePtrHolder FileTable::create_as(int type)
     auto fp = construct(type, std::move(data), std::move(meta), id);
     auto holder = create_holder(fp);
     s.live_map.emplace(id, std::move(fp));
+    counters().live.add(1);
     return holder;
 }
 std::unique_ptr<FileBase> FileTable::construct(int type,
@@ -171,20 +201,25 @@ void FileTable::close_internal(const id_type id)
     bool should_unlink = query_link_status(it->second.get());
     auto holder = std::move(it->second);
     s.live_map.erase(it);
+    counters().live.add(-1);
     if (!should_unlink)
     {
         s.cache.emplace_back(std::move(holder));
+        counters().cached.add(1);
     }
     else
     {
         holder.reset();
         io_.unlink(id);
     }
-    if (s.cache.size() > kMaxCached)
+    static_assert(kEjectNumber < kMaxCached);
+    auto max_cached = static_cast<size_t>(max_cached_knob_.load(std::memory_order_relaxed));
+    if (s.cache.size() > max_cached)
     {
-        static_assert(kEjectNumber < kMaxCached);
+        // Ejects in batches, or all the excess at once after the limit is lowered at runtime.
+        auto eject = std::min(s.cache.size(), s.cache.size() - max_cached + kEjectNumber);
         auto begin = s.cache.begin();
-        auto end = s.cache.begin() + kEjectNumber;
+        auto end = s.cache.begin() + eject;
         for (auto it = begin; it != end; ++it)
         {
             if (it->get()->getref() > 0)
@@ -194,6 +229,7 @@ void FileTable::close_internal(const id_type id)
             }
         }
         s.cache.erase(begin, end);
+        counters().cached.add(-static_cast<int64_t>(eject));
     }
 };
 
@@ -255,7 +291,7 @@ namespace
             calculate_paths(id, first_level_dir, second_level_dir, filename, metaname);
 
             int open_flags = m_readonly ? O_RDONLY : O_RDWR;
-            return std::make_pair(m_root.open_file_stream(filename, open_flags, 0),
+            return std::make_pair(m_root.open_data_file_stream(filename, open_flags, 0),
                                   m_root.open_file_stream(metaname, open_flags, 0));
         }
 
@@ -266,7 +302,7 @@ namespace
             m_root.ensure_directory(first_level_dir, 0755);
             m_root.ensure_directory(second_level_dir, 0755);
             int open_flags = O_RDWR | O_CREAT | O_EXCL;
-            return std::make_pair(m_root.open_file_stream(filename, open_flags, 0644),
+            return std::make_pair(m_root.open_data_file_stream(filename, open_flags, 0644),
                                   m_root.open_file_stream(metaname, open_flags, 0644));
         }
 
@@ -309,7 +345,7 @@ namespace
             calculate_paths(id, dir, filename, metaname);
 
             int open_flags = m_readonly ? O_RDONLY : O_RDWR;
-            return std::make_pair(m_root.open_file_stream(filename, open_flags, 0),
+            return std::make_pair(m_root.open_data_file_stream(filename, open_flags, 0),
                                   m_root.open_file_stream(metaname, open_flags, 0));
         }
 
@@ -319,7 +355,7 @@ namespace
             calculate_paths(id, dir, filename, metaname);
             m_root.ensure_directory(dir, 0755);
             int open_flags = O_RDWR | O_CREAT | O_EXCL;
-            return std::make_pair(m_root.open_file_stream(filename, open_flags, 0644),
+            return std::make_pair(m_root.open_data_file_stream(filename, open_flags, 0644),
                                   m_root.open_file_stream(metaname, open_flags, 0644));
         }
 
@@ -9,6 +9,7 @@
 #include <absl/container/flat_hash_map.h>
 
 #include <array>
+#include <atomic>
 #include <cstddef>
 #include <fruit/component.h>
 #include <fruit/fruit_forward_decls.h>
@@ -72,7 +73,9 @@ private:
             live_map ABSL_GUARDED_BY(mu);
         std::vector<std::unique_ptr<FileBase>> cache ABSL_GUARDED_BY(mu);
     };
+    // `kMaxCached` is the default of the `file_table_max_cached_per_shard` tunable.
     static constexpr inline size_t kNumShards = 32, kMaxCached = 50, kEjectNumber = 10;
+    static const std::atomic<uint64_t>& max_cached_knob_;
 
     void init();
     Shard& find_shard(const id_type& id);
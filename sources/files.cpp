@@ -4,7 +4,6 @@
 #include "myutils.h"
 #include "stat_workaround.h"
 
-#include <cryptopp/integer.h>
 #include <cryptopp/secblock.h>
 
 #include <utility>
@@ -161,11 +160,9 @@ FileBase::FileBase(std::shared_ptr<FileStream> data_stream,
     if (max_padding_size > 0)
     {
         warn_if_key_not_random(generated_keys, sizeof(generated_keys), __FILE__, __LINE__);
-        CryptoPP::Integer integer(generated_keys + 3 * KEY_LENGTH,
-                                  KEY_LENGTH,
-                                  CryptoPP::Integer::UNSIGNED,
-                                  CryptoPP::BIG_ENDIAN_ORDER);
-        auto padding_size = static_cast<unsigned>(integer.Modulo(max_padding_size + 1));
+        auto padding_size = big_endian_modulo(generated_keys + 3 * KEY_LENGTH,
+                                              KEY_LENGTH,
+                                              static_cast<uint64_t>(max_padding_size) + 1);
         m_stream = std::make_shared<PaddedStream>(std::move(m_stream), padding_size);
     }
 }
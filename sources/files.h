@@ -382,6 +382,20 @@ public:
         update_mtime_helper();
         return m_stream->resize(new_size);
     }
+
+    void punch_hole(offset_type off, length_type len) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        update_mtime_helper();
+        return m_stream->punch_hole(off, len);
+    }
+
+    void preallocate(offset_type off, length_type len, bool keep_size)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        if (!keep_size)
+            update_mtime_helper();
+        return m_stream->preallocate(off, len, keep_size);
+    }
 };
 
 class Symlink : public FileBase
@@ -1,7 +1,9 @@
 #include "full_format.h"
 #include "apple_xattr_workaround.h"
+#include "btree_dir.h"
 #include "exceptions.h"
 #include "files.h"
+#include "lock_guard.h"
 #include "logger.h"
 #include "myutils.h"
 #include "platform.h"
@@ -444,6 +446,33 @@ int FuseHighLevelOps::vremovexattr(const char* path, const char* name, const fus
     (**opened).removexattr(name);
     return 0;
 }
+int FuseHighLevelOps::vfallocate(const char* path,
+                                 int mode,
+                                 fuse_off_t offset,
+                                 fuse_off_t length,
+                                 fuse_file_info* info,
+                                 const fuse_context* ctx)
+{
+    if (offset < 0 || length <= 0)
+    {
+        return -EINVAL;
+    }
+    auto fp = get_file(info);
+    FileLockGuard lg(*fp);
+    auto* file = fp->cast_as<RegularFile>();
+    switch (mode)
+    {
+    case 0:
+    case kFallocKeepSize:
+        file->preallocate(offset, length, mode == kFallocKeepSize);
+        return 0;
+    case kFallocPunchHole | kFallocKeepSize:
+        file->punch_hole(offset, length);
+        return 0;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
 bool FuseHighLevelOps::has_getpath() const { return case_insensitive_; }
 
 int FuseHighLevelOps::vgetpath(
@@ -565,4 +594,21 @@ std::optional<FilePtrHolder> FuseHighLevelOps::open_all(absl::string_view path)
     return holder;
 }
 
+void FuseHighLevelOps::validate_directory(fuse_file_info* info)
+{
+    auto btree = dynamic_cast<BtreeDirectory*>(get_file(info));
+    if (!btree)
+    {
+        return;
+    }
+    LockGuard<FileBase> lg(*btree);
+    if (!btree->validate_btree_structure())
+    {
+        throw_runtime_error("The B-tree of the directory is malformed");
+    }
+    if (!btree->validate_free_list())
+    {
+        throw_runtime_error("The free page list of the directory is malformed");
+    }
+}
 }    // namespace securefs::full_format
@@ -133,6 +133,12 @@ public:
                   uint32_t position,
                   const fuse_context* ctx) override;
     int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    int vfallocate(const char* path,
+                   int mode,
+                   fuse_off_t offset,
+                   fuse_off_t length,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
     bool has_getpath() const override;
     int vgetpath(const char* path,
                  char* buf,
@@ -140,6 +146,10 @@ public:
                  fuse_file_info* info,
                  const fuse_context* ctx) override;
 
+    // Checks the pages of a directory opened by `vopendir`, if it is stored as a B-tree. Throws
+    // when they are corrupted.
+    void validate_directory(fuse_file_info* info);
+
 private:
     OSService& root_;
     FileTable& ft_;
@@ -22,7 +22,7 @@
 namespace securefs
 {
 
-#if defined(_WIN32) || defined(__APPLE__)
+#if defined(_WIN32) || defined(__APPLE__) || FUSE_USE_VERSION >= 30
 #else
 namespace
 {
@@ -133,7 +133,8 @@ namespace
 
 int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data)
 {
-#if defined(_WIN32) || defined(__APPLE__)
+#if defined(_WIN32) || defined(__APPLE__) || FUSE_USE_VERSION >= 30
+    // libfuse3 has its own worker pool, configured by the `clone_fd` and `max_threads` options.
     return fuse_main(argc, argv, op, user_data);
 #else
     char* mountpoint;
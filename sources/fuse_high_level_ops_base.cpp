@@ -4,6 +4,9 @@
 
 #include <absl/functional/function_ref.h>
 
+#include <algorithm>
+#include <vector>
+
 namespace securefs
 {
 int FuseHighLevelOpsBase::static_statfs(const char* path, fuse_statvfs* buf)
@@ -119,6 +122,50 @@ int FuseHighLevelOpsBase::static_write(
          {"offset", {offset}},
          {"info", {info}}});
 }
+#if !defined(_WIN32) && !defined(__APPLE__)
+int FuseHighLevelOpsBase::vwrite_buf(const char* path,
+                                     fuse_bufvec* buf,
+                                     fuse_off_t offset,
+                                     fuse_file_info* info,
+                                     const fuse_context* ctx)
+{
+    size_t size = fuse_buf_size(buf);
+    if (buf->count == 1 && buf->idx == 0 && buf->off == 0
+        && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+        return vwrite(path, static_cast<const char*>(buf->buf[0].mem), size, offset, info, ctx);
+    }
+    thread_local std::vector<char> staging;
+    if (staging.size() < size)
+    {
+        staging.resize(size);
+    }
+    fuse_bufvec dest = FUSE_BUFVEC_INIT(size);
+    dest.buf[0].mem = staging.data();
+    ssize_t copied = fuse_buf_copy(&dest, buf, FUSE_BUF_NO_SPLICE);
+    if (copied < 0)
+    {
+        return static_cast<int>(copied);
+    }
+    return vwrite(path, staging.data(), static_cast<size_t>(copied), offset, info, ctx);
+}
+int FuseHighLevelOpsBase::static_write_buf(const char* path,
+                                           fuse_bufvec* buf,
+                                           fuse_off_t offset,
+                                           fuse_file_info* info)
+{
+    auto ctx = fuse_get_context();
+    auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
+    return trace::FuseTracer::traced_call(
+        [=]() { return op->vwrite_buf(path, buf, offset, info, ctx); },
+        "write_buf",
+        __LINE__,
+        {{"path", {path}},
+         {"buf", {static_cast<const void*>(buf)}},
+         {"offset", {offset}},
+         {"info", {info}}});
+}
+#endif
 int FuseHighLevelOpsBase::static_flush(const char* path, fuse_file_info* info)
 {
     auto ctx = fuse_get_context();
@@ -297,6 +344,68 @@ int FuseHighLevelOpsBase::static_removexattr(const char* path, const char* name)
                                           {{"path", {path}}, {"name", {name}}});
 }
 
+int FuseHighLevelOpsBase::static_fallocate(
+    const char* path, int mode, fuse_off_t offset, fuse_off_t length, fuse_file_info* info)
+{
+    auto ctx = fuse_get_context();
+    auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
+    return trace::FuseTracer::traced_call(
+        [=]() { return op->vfallocate(path, mode, offset, length, info, ctx); },
+        "fallocate",
+        __LINE__,
+        {{"path", {path}},
+         {"mode", {mode}},
+         {"offset", {offset}},
+         {"length", {length}},
+         {"info", {info}}});
+}
+
+fuse_off_t FuseHighLevelOpsBase::static_lseek(const char* path,
+                                              fuse_off_t offset,
+                                              int whence,
+                                              fuse_file_info* info)
+{
+    auto ctx = fuse_get_context();
+    auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
+    fuse_off_t result = 0;
+    int rc = trace::FuseTracer::traced_call(
+        [&]() { return op->vlseek(path, offset, whence, &result, info, ctx); },
+        "lseek",
+        __LINE__,
+        {{"path", {path}}, {"offset", {offset}}, {"whence", {whence}}, {"info", {info}}});
+    return rc < 0 ? rc : result;
+}
+
+ssize_t FuseHighLevelOpsBase::static_copy_file_range(const char* path_in,
+                                                     fuse_file_info* info_in,
+                                                     fuse_off_t offset_in,
+                                                     const char* path_out,
+                                                     fuse_file_info* info_out,
+                                                     fuse_off_t offset_out,
+                                                     size_t size,
+                                                     int flags)
+{
+    auto ctx = fuse_get_context();
+    auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
+    size = std::min(size, kMaxCopyLength);
+    return trace::FuseTracer::traced_call(
+        [=]()
+        {
+            return op->vcopy_file_range(
+                path_in, info_in, offset_in, path_out, info_out, offset_out, size, flags, ctx);
+        },
+        "copy_file_range",
+        __LINE__,
+        {{"path_in", {path_in}},
+         {"info_in", {info_in}},
+         {"offset_in", {offset_in}},
+         {"path_out", {path_out}},
+         {"info_out", {info_out}},
+         {"offset_out", {offset_out}},
+         {"size", {size}},
+         {"flags", {flags}}});
+}
+
 int FuseHighLevelOpsBase::static_getpath(const char* path,
                                          char* buf,
                                          size_t size,
@@ -325,30 +434,47 @@ namespace
     }
 }    // namespace
 
-fuse_operations FuseHighLevelOpsBase::build_ops(const FuseHighLevelOpsBase* op, bool enable_xattr)
+void FuseHighLevelOpsBase::enable_common_capabilities(fuse_conn_info* info)
 {
-    fuse_operations opt{};
-
-    opt.flag_nopath = true;
-    opt.flag_nullpath_ok = true;
-
-    opt.init = [](fuse_conn_info* info) -> void*
-    {
 #ifdef FUSE_CAP_ASYNC_READ
-        enable_if_capable(info, FUSE_CAP_ASYNC_READ);
+    enable_if_capable(info, FUSE_CAP_ASYNC_READ);
 #endif
 #ifdef FUSE_CAP_ATOMIC_O_TRUNC
-        enable_if_capable(info, FUSE_CAP_ATOMIC_O_TRUNC);
+    enable_if_capable(info, FUSE_CAP_ATOMIC_O_TRUNC);
 #endif
 #ifdef FUSE_CAP_BIG_WRITES
-        enable_if_capable(info, FUSE_CAP_BIG_WRITES);
+    enable_if_capable(info, FUSE_CAP_BIG_WRITES);
 #endif
 #ifdef FUSE_CAP_CACHE_SYMLINKS
-        enable_if_capable(info, FUSE_CAP_CACHE_SYMLINKS);
+    enable_if_capable(info, FUSE_CAP_CACHE_SYMLINKS);
 #endif
 #ifdef FUSE_CAP_WRITEBACK_CACHE
-        enable_if_capable(info, FUSE_CAP_WRITEBACK_CACHE);
+    enable_if_capable(info, FUSE_CAP_WRITEBACK_CACHE);
+#endif
+#if !defined(_WIN32) && FUSE_USE_VERSION >= 30
+    enable_if_capable(info, FUSE_CAP_PARALLEL_DIROPS);
+    // libfuse clamps this to its receive buffer, and derives `max_pages` from it, which in turn
+    // lifts the limit on the size of read requests.
+    info->max_write = kMaxRequestSize;
+#endif
+}
+
+fuse_operations FuseHighLevelOpsBase::build_ops(const FuseHighLevelOpsBase* op, bool enable_xattr)
+{
+    fuse_operations opt{};
+
+#if !defined(_WIN32) && FUSE_USE_VERSION >= 30
+    opt.init = [](fuse_conn_info* info, fuse_config* config) -> void*
+    {
+        config->nullpath_ok = 1;
+#else
+    opt.flag_nopath = true;
+    opt.flag_nullpath_ok = true;
+
+    opt.init = [](fuse_conn_info* info) -> void*
+    {
 #endif
+        enable_common_capabilities(info);
         auto op = static_cast<FuseHighLevelOpsBase*>(fuse_get_context()->private_data);
         op->initialize(info);
         INFO_LOG("Fuse operations initialized");
@@ -357,25 +483,79 @@ fuse_operations FuseHighLevelOpsBase::build_ops(const FuseHighLevelOpsBase* op,
     };
     opt.destroy = [](void* data) { INFO_LOG("Fuse operations destroyed"); };
     opt.statfs = &FuseHighLevelOpsBase::static_statfs;
+#if !defined(_WIN32) && FUSE_USE_VERSION >= 30
+    // libfuse3 folds the operations on open files into the path based ones, with an optional
+    // `fuse_file_info`, so we dispatch to the matching libfuse2 style callback.
+    opt.getattr = [](const char* path, fuse_stat* st, fuse_file_info* info)
+    { return info ? static_fgetattr(path, st, info) : static_getattr(path, st); };
+    opt.readdir = [](const char* path,
+                     void* buf,
+                     ::fuse_fill_dir_t filler,
+                     fuse_off_t off,
+                     fuse_file_info* info,
+                     fuse_readdir_flags) -> int
+    {
+        struct FillerAdapter
+        {
+            void* buf;
+            ::fuse_fill_dir_t filler;
+        };
+        FillerAdapter adapter{buf, filler};
+        // Our directory entries do not carry complete attributes, so they are never filled as
+        // `FUSE_FILL_DIR_PLUS`.
+        return static_readdir(
+            path,
+            &adapter,
+            [](void* buf, const char* name, const fuse_stat* st, fuse_off_t off) -> int
+            {
+                auto adapter = static_cast<FillerAdapter*>(buf);
+                return adapter->filler(
+                    adapter->buf, name, st, off, static_cast<fuse_fill_dir_flags>(0));
+            },
+            off,
+            info);
+    };
+    opt.truncate = [](const char* path, fuse_off_t len, fuse_file_info* info)
+    { return info ? static_ftruncate(path, len, info) : static_truncate(path, len); };
+    opt.chmod = [](const char* path, fuse_mode_t mode, fuse_file_info*)
+    { return static_chmod(path, mode); };
+    opt.chown = [](const char* path, fuse_uid_t uid, fuse_gid_t gid, fuse_file_info*)
+    { return static_chown(path, uid, gid); };
+    opt.rename = [](const char* from, const char* to, unsigned int flags)
+    { return flags ? -EINVAL : static_rename(from, to); };
+    opt.utimens = [](const char* path, const fuse_timespec* ts, fuse_file_info*)
+    { return static_utimens(path, ts); };
+    opt.lseek = &FuseHighLevelOpsBase::static_lseek;
+    opt.copy_file_range = &FuseHighLevelOpsBase::static_copy_file_range;
+#else
     opt.getattr = &FuseHighLevelOpsBase::static_getattr;
     opt.fgetattr = &FuseHighLevelOpsBase::static_fgetattr;
+    opt.readdir = &FuseHighLevelOpsBase::static_readdir;
+    opt.truncate = &FuseHighLevelOpsBase::static_truncate;
+    opt.ftruncate = &FuseHighLevelOpsBase::static_ftruncate;
+    opt.rename = &FuseHighLevelOpsBase::static_rename;
+    opt.utimens = &FuseHighLevelOpsBase::static_utimens;
+#ifndef _WIN32
+    opt.chmod = &FuseHighLevelOpsBase::static_chmod;
+    opt.chown = &FuseHighLevelOpsBase::static_chown;
+#endif
+#endif
     opt.opendir = &FuseHighLevelOpsBase::static_opendir;
     opt.releasedir = &FuseHighLevelOpsBase::static_releasedir;
-    opt.readdir = &FuseHighLevelOpsBase::static_readdir;
     opt.create = &FuseHighLevelOpsBase::static_create;
     opt.open = &FuseHighLevelOpsBase::static_open;
     opt.release = &FuseHighLevelOpsBase::static_release;
     opt.read = &FuseHighLevelOpsBase::static_read;
     opt.write = &FuseHighLevelOpsBase::static_write;
+#if !defined(_WIN32) && !defined(__APPLE__)
+    opt.write_buf = &FuseHighLevelOpsBase::static_write_buf;
+    opt.fallocate = &FuseHighLevelOpsBase::static_fallocate;
+#endif
     opt.flush = &FuseHighLevelOpsBase::static_flush;
-    opt.truncate = &FuseHighLevelOpsBase::static_truncate;
-    opt.ftruncate = &FuseHighLevelOpsBase::static_ftruncate;
     opt.unlink = &FuseHighLevelOpsBase::static_unlink;
     opt.mkdir = &FuseHighLevelOpsBase::static_mkdir;
     opt.rmdir = &FuseHighLevelOpsBase::static_rmdir;
 #ifndef _WIN32
-    opt.chmod = &FuseHighLevelOpsBase::static_chmod;
-    opt.chown = &FuseHighLevelOpsBase::static_chown;
     opt.symlink = &FuseHighLevelOpsBase::static_symlink;
     opt.link = &FuseHighLevelOpsBase::static_link;
     opt.readlink = &FuseHighLevelOpsBase::static_readlink;
@@ -385,9 +565,7 @@ fuse_operations FuseHighLevelOpsBase::build_ops(const FuseHighLevelOpsBase* op,
         opt.getpath = &FuseHighLevelOpsBase::static_getpath;
     }
 #endif
-    opt.rename = &FuseHighLevelOpsBase::static_rename;
     opt.fsync = &FuseHighLevelOpsBase::static_fsync;
-    opt.utimens = &FuseHighLevelOpsBase::static_utimens;
 
     if (!enable_xattr)
         return opt;
@@ -3,12 +3,21 @@
 #include "object.h"
 #include "platform.h"    // IWYU pragma: keep
 
+#include <optional>
+#include <string>
+
 namespace securefs
 {
 class FuseHighLevelOpsBase : public Object
 {
 public:
+    // The largest read and write requests that we negotiate with libfuse3. libfuse2 is fixed at
+    // 128KiB.
+    static constexpr unsigned kMaxRequestSize = 1u << 20;
+
     static fuse_operations build_ops(const FuseHighLevelOpsBase* op, bool enable_xattr);
+    // Requests the capabilities that securefs wants from the kernel, if supported.
+    static void enable_common_capabilities(fuse_conn_info* info);
 
     virtual void initialize(fuse_conn_info* info) = 0;
     virtual int vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx) = 0;
@@ -80,12 +89,84 @@ public:
                           const fuse_context* ctx)
         = 0;
     virtual int vremovexattr(const char* path, const char* name, const fuse_context* ctx) = 0;
+    // The mode bits of fallocate in the FUSE protocol, which has those of Linux on all platforms.
+    static constexpr int kFallocKeepSize = 0x01;
+    static constexpr int kFallocPunchHole = 0x02;
+    // Modes other than 0, `kFallocKeepSize` and `kFallocPunchHole | kFallocKeepSize` are not
+    // supported. Neither is anything by default.
+    virtual int vfallocate(const char* path,
+                           int mode,
+                           fuse_off_t offset,
+                           fuse_off_t length,
+                           fuse_file_info* info,
+                           const fuse_context* ctx)
+    {
+        return -EOPNOTSUPP;
+    }
+    // The whence values of lseek that reach the filesystem in the FUSE protocol, which has those
+    // of Linux on all platforms.
+    static constexpr int kSeekData = 3;
+    static constexpr int kSeekHole = 4;
+    // Stores the offset found in `*result`. Not supported by default, so the kernel takes the
+    // whole file for data.
+    virtual int vlseek(const char* path,
+                       fuse_off_t offset,
+                       int whence,
+                       fuse_off_t* result,
+                       fuse_file_info* info,
+                       const fuse_context* ctx)
+    {
+        return -ENOSYS;
+    }
+    // The most that one call copies, so that the count fits in the return value.
+    static constexpr size_t kMaxCopyLength = 1 << 30;
+    // Returns the number of bytes copied, which is short only at the end of the input. Callers
+    // pass at most `kMaxCopyLength` in `size`. Not supported by default, so the kernel falls back
+    // to reads and writes.
+    virtual int vcopy_file_range(const char* path_in,
+                                 fuse_file_info* info_in,
+                                 fuse_off_t offset_in,
+                                 const char* path_out,
+                                 fuse_file_info* info_out,
+                                 fuse_off_t offset_out,
+                                 size_t size,
+                                 int flags,
+                                 const fuse_context* ctx)
+    {
+        return -ENOSYS;
+    }
+#if !defined(_WIN32) && !defined(__APPLE__)
+    // Writes `buf` through `vwrite` without copying it when it already resides in memory. Data
+    // that the kernel hands over in a pipe is drained into a reusable per-thread buffer instead
+    // of a fresh allocation per request.
+    int vwrite_buf(const char* path,
+                   fuse_bufvec* buf,
+                   fuse_off_t offset,
+                   fuse_file_info* info,
+                   const fuse_context* ctx);
+#endif
     virtual bool has_getpath() const { return false; }
     virtual int vgetpath(
         const char* path, char* buf, size_t size, fuse_file_info* info, const fuse_context* ctx)
     {
         return -ENOSYS;
     }
+    // Whether `vresolve` translates paths into the form taken by the `*_resolved` operations. A
+    // frontend that tracks nodes may keep that form per node until the path changes, so that the
+    // hottest operations skip the translation.
+    virtual bool has_resolve() const { return false; }
+    // Returns nullopt for the paths that must still go through the path based operations.
+    virtual std::optional<std::string> vresolve(const char* path) { return std::nullopt; }
+    virtual int
+    vgetattr_resolved(const std::string& resolved, fuse_stat* st, const fuse_context* ctx)
+    {
+        return -ENOSYS;
+    }
+    virtual int
+    vopen_resolved(const std::string& resolved, fuse_file_info* info, const fuse_context* ctx)
+    {
+        return -ENOSYS;
+    }
 
 private:
     static int static_statfs(const char* path, fuse_statvfs* buf);
@@ -102,6 +183,10 @@ private:
     static_read(const char* path, char* buf, size_t size, fuse_off_t offset, fuse_file_info* info);
     static int static_write(
         const char* path, const char* buf, size_t size, fuse_off_t offset, fuse_file_info* info);
+#if !defined(_WIN32) && !defined(__APPLE__)
+    static int
+    static_write_buf(const char* path, fuse_bufvec* buf, fuse_off_t offset, fuse_file_info* info);
+#endif
     static int static_flush(const char* path, fuse_file_info* info);
     static int static_ftruncate(const char* path, fuse_off_t len, fuse_file_info* info);
     static int static_unlink(const char* path);
@@ -126,6 +211,18 @@ private:
                                int flags,
                                uint32_t position);
     static int static_removexattr(const char* path, const char* name);
+    static int static_fallocate(
+        const char* path, int mode, fuse_off_t offset, fuse_off_t length, fuse_file_info* info);
+    static fuse_off_t
+    static_lseek(const char* path, fuse_off_t offset, int whence, fuse_file_info* info);
+    static ssize_t static_copy_file_range(const char* path_in,
+                                          fuse_file_info* info_in,
+                                          fuse_off_t offset_in,
+                                          const char* path_out,
+                                          fuse_file_info* info_out,
+                                          fuse_off_t offset_out,
+                                          size_t size,
+                                          int flags);
     static int static_getpath(const char* path, char* buf, size_t size, fuse_file_info* info);
 };
 }    // namespace securefs
@@ -0,0 +1,1684 @@
+#include "fuse_low_level_frontend.h"
+#include "exceptions.h"
+#include "fuse_tracer_v2.h"
+#include "lock_guard.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+#include <fuse_lowlevel.h>
+
+#include <climits>
+#include <cstdlib>
+#include <memory>
+#include <typeinfo>
+#endif
+
+namespace securefs
+{
+InodeTable::InodeTable() : next_ino_(kRootInode + 1)
+{
+    nodes_.emplace(kRootInode, Node{0, "", 1, 0, true});
+}
+
+InodeTable::Node& InodeTable::get_node(uint64_t ino)
+{
+    auto it = nodes_.find(ino);
+    if (it == nodes_.end())
+    {
+        throwVFSException(ESTALE);
+    }
+    return it->second;
+}
+
+uint64_t InodeTable::lookup(uint64_t parent, std::string_view name)
+{
+    LockGuard<Mutex> lg(mu_);
+    (void)get_node(parent);
+    auto [it, inserted] = children_.try_emplace(ChildKey(parent, std::string(name)), 0);
+    if (inserted)
+    {
+        it->second = next_ino_++;
+        nodes_.emplace(it->second, Node{parent, std::string(name), 0, 0, true});
+        ++get_node(parent).nchildren;
+    }
+    ++get_node(it->second).nlookup;
+    return it->second;
+}
+
+std::optional<uint64_t> InodeTable::find(uint64_t parent, std::string_view name)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto it = children_.find(ChildKey(parent, std::string(name)));
+    if (it == children_.end())
+    {
+        return {};
+    }
+    return it->second;
+}
+
+void InodeTable::forget(uint64_t ino, uint64_t nlookup)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto it = nodes_.find(ino);
+    if (it == nodes_.end())
+    {
+        return;
+    }
+    it->second.nlookup -= std::min(nlookup, it->second.nlookup);
+    maybe_drop(ino);
+}
+
+void InodeTable::remove(uint64_t parent, std::string_view name)
+{
+    LockGuard<Mutex> lg(mu_);
+    detach(parent, name);
+}
+
+void InodeTable::rename(uint64_t parent,
+                        std::string_view name,
+                        uint64_t new_parent,
+                        std::string_view new_name)
+{
+    LockGuard<Mutex> lg(mu_);
+    ++rename_epoch_;
+    detach(new_parent, new_name);
+    auto it = children_.find(ChildKey(parent, std::string(name)));
+    if (it == children_.end())
+    {
+        return;
+    }
+    auto ino = it->second;
+    children_.erase(it);
+    children_.insert_or_assign(ChildKey(new_parent, std::string(new_name)), ino);
+
+    auto& node = get_node(ino);
+    node.name = std::string(new_name);
+    if (node.parent == new_parent)
+    {
+        return;
+    }
+    auto old_parent = node.parent;
+    node.parent = new_parent;
+    ++get_node(new_parent).nchildren;
+    --get_node(old_parent).nchildren;
+    maybe_drop(old_parent);
+}
+
+std::string InodeTable::get_path(uint64_t ino)
+{
+    LockGuard<Mutex> lg(mu_);
+    return build_path(ino);
+}
+
+std::string InodeTable::get_child_path(uint64_t parent, std::string_view name)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto path = build_path(parent);
+    if (path.size() > 1)
+    {
+        path.push_back('/');
+    }
+    path.append(name);
+    return path;
+}
+
+void InodeTable::set_backing_ino(uint64_t ino, uint64_t backing_ino)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto& node = get_node(ino);
+    if (node.backing_ino == backing_ino)
+    {
+        return;
+    }
+    unlink_backing_ino(ino, node.backing_ino);
+    node.backing_ino = backing_ino;
+    if (backing_ino != 0)
+    {
+        by_backing_ino_[backing_ino].push_back(ino);
+    }
+}
+
+std::vector<InodeTable::Alias> InodeTable::get_aliases(uint64_t ino)
+{
+    LockGuard<Mutex> lg(mu_);
+    std::vector<Alias> result;
+    auto node_it = nodes_.find(ino);
+    if (node_it == nodes_.end() || node_it->second.backing_ino == 0)
+    {
+        return result;
+    }
+    auto it = by_backing_ino_.find(node_it->second.backing_ino);
+    if (it == by_backing_ino_.end())
+    {
+        return result;
+    }
+    for (uint64_t other : it->second)
+    {
+        if (other == ino)
+        {
+            continue;
+        }
+        const auto& node = get_node(other);
+        result.push_back(Alias{other, node.parent, node.name});
+    }
+    return result;
+}
+
+uint64_t InodeTable::rename_epoch()
+{
+    LockGuard<Mutex> lg(mu_);
+    return rename_epoch_;
+}
+
+std::optional<std::string> InodeTable::get_resolved(uint64_t ino)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto it = nodes_.find(ino);
+    if (it == nodes_.end() || it->second.resolved_epoch != rename_epoch_ + 1)
+    {
+        return {};
+    }
+    return it->second.resolved;
+}
+
+void InodeTable::set_resolved(uint64_t ino, uint64_t epoch, std::string resolved)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto it = nodes_.find(ino);
+    if (it == nodes_.end() || epoch != rename_epoch_)
+    {
+        return;
+    }
+    it->second.resolved = std::move(resolved);
+    it->second.resolved_epoch = epoch + 1;
+}
+
+size_t InodeTable::size()
+{
+    LockGuard<Mutex> lg(mu_);
+    return nodes_.size();
+}
+
+void InodeTable::detach(uint64_t parent, std::string_view name)
+{
+    auto it = children_.find(ChildKey(parent, std::string(name)));
+    if (it == children_.end())
+    {
+        return;
+    }
+    auto ino = it->second;
+    children_.erase(it);
+    get_node(ino).attached = false;
+    maybe_drop(ino);
+}
+
+void InodeTable::maybe_drop(uint64_t ino)
+{
+    while (ino != kRootInode)
+    {
+        auto it = nodes_.find(ino);
+        if (it == nodes_.end() || it->second.nlookup > 0 || it->second.nchildren > 0)
+        {
+            return;
+        }
+        if (it->second.attached)
+        {
+            children_.erase(ChildKey(it->second.parent, it->second.name));
+        }
+        unlink_backing_ino(ino, it->second.backing_ino);
+        auto parent = it->second.parent;
+        nodes_.erase(it);
+        auto parent_it = nodes_.find(parent);
+        if (parent_it == nodes_.end())
+        {
+            return;
+        }
+        --parent_it->second.nchildren;
+        ino = parent;
+    }
+}
+
+void InodeTable::unlink_backing_ino(uint64_t ino, uint64_t backing_ino)
+{
+    if (backing_ino == 0)
+    {
+        return;
+    }
+    auto it = by_backing_ino_.find(backing_ino);
+    if (it == by_backing_ino_.end())
+    {
+        return;
+    }
+    auto& inos = it->second;
+    inos.erase(std::remove(inos.begin(), inos.end(), ino), inos.end());
+    if (inos.empty())
+    {
+        by_backing_ino_.erase(it);
+    }
+}
+
+std::string InodeTable::build_path(uint64_t ino)
+{
+    if (ino == kRootInode)
+    {
+        return "/";
+    }
+    std::vector<std::string_view> components;
+    while (ino != kRootInode)
+    {
+        const auto& node = get_node(ino);
+        components.emplace_back(node.name);
+        ino = node.parent;
+    }
+    std::string result;
+    for (auto it = components.rbegin(); it != components.rend(); ++it)
+    {
+        result.push_back('/');
+        result.append(*it);
+    }
+    return result;
+}
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+namespace
+{
+    struct DirHandle
+    {
+        fuse_file_info info;
+        std::vector<std::pair<std::string, fuse_stat>> entries;
+        bool filled = false;
+    };
+
+    DirHandle* get_dir_handle(fuse_file_info* fi)
+    {
+        return reinterpret_cast<DirHandle*>(static_cast<uintptr_t>(fi->fh));
+    }
+
+    int collect_dir_entry(void* buf, const char* name, const fuse_stat* st, fuse_off_t)
+    {
+        auto handle = static_cast<DirHandle*>(buf);
+        handle->entries.emplace_back(name, st ? *st : fuse_stat{});
+        return 0;
+    }
+
+    void reply_error_if_failed(fuse_req_t req, int rc)
+    {
+        if (rc < 0)
+        {
+            fuse_reply_err(req, -rc);
+        }
+    }
+
+    uint64_t to_u64(fuse_ino_t ino) { return static_cast<uint64_t>(ino); }
+}    // namespace
+
+void KernelCacheInvalidator::start(Target* target)
+{
+    {
+        LockGuard<Mutex> lg(mu_);
+        target_ = target;
+        stopping_ = false;
+    }
+    worker_ = std::thread([this]() { run(); });
+}
+
+void KernelCacheInvalidator::stop()
+{
+    {
+        LockGuard<Mutex> lg(mu_);
+        stopping_ = true;
+    }
+    if (worker_.joinable())
+    {
+        worker_.join();
+    }
+    LockGuard<Mutex> lg(mu_);
+    target_ = nullptr;
+    queue_.clear();
+}
+
+void KernelCacheInvalidator::invalidate_inode(uint64_t ino, bool data)
+{
+    enqueue(Request{ino, {}, data});
+}
+
+void KernelCacheInvalidator::invalidate_entry(uint64_t parent, std::string name)
+{
+    if (name.empty())
+    {
+        return;
+    }
+    enqueue(Request{parent, std::move(name), false});
+}
+
+void KernelCacheInvalidator::enqueue(Request request)
+{
+    LockGuard<Mutex> lg(mu_);
+    if (!target_ || stopping_)
+    {
+        return;
+    }
+    queue_.push_back(std::move(request));
+}
+
+void KernelCacheInvalidator::run()
+{
+    std::vector<Request> batch;
+    while (true)
+    {
+        mu_.LockWhen(absl::Condition(
+            +[](KernelCacheInvalidator* self) ABSL_EXCLUSIVE_LOCKS_REQUIRED(self->mu_)
+            { return self->stopping_ || !self->queue_.empty(); },
+            this));
+        if (stopping_)
+        {
+            mu_.Unlock();
+            return;
+        }
+        batch.swap(queue_);
+        Target* target = target_;
+        mu_.Unlock();
+
+        for (const auto& r : batch)
+        {
+            // A negative offset only invalidates the attributes.
+            int rc = r.name.empty()
+                ? fuse_lowlevel_notify_inval_inode(target, r.ino, r.data ? 0 : -1, 0)
+                : fuse_lowlevel_notify_inval_entry(target, r.ino, r.name.data(), r.name.size());
+            // The kernel may have already forgotten about the node, which is fine.
+            if (rc < 0 && rc != -ENOENT)
+            {
+                VERBOSE_LOG("Failed to invalidate the kernel cache of node %d: %s",
+                            r.ino,
+                            OSService::stringify_system_error(-rc));
+            }
+        }
+        batch.clear();
+    }
+}
+
+FuseLowLevelFrontend* FuseLowLevelFrontend::get(fuse_req_t req)
+{
+    return static_cast<FuseLowLevelFrontend*>(fuse_req_userdata(req));
+}
+
+fuse_context FuseLowLevelFrontend::make_context(fuse_req_t req)
+{
+    const fuse_ctx* c = fuse_req_ctx(req);
+    fuse_context ctx{};
+    ctx.uid = c->uid;
+    ctx.gid = c->gid;
+    ctx.pid = c->pid;
+    ctx.umask = c->umask;
+    ctx.private_data = &ops_;
+    return ctx;
+}
+
+void FuseLowLevelFrontend::fixup_attr(uint64_t ino, fuse_stat* st) const noexcept
+{
+    if (!options_.use_ino)
+    {
+        st->st_ino = ino;
+    }
+}
+
+void FuseLowLevelFrontend::invalidate_aliases(uint64_t ino, bool data)
+{
+    for (auto&& alias : table_.get_aliases(ino))
+    {
+        invalidator_.invalidate_inode(alias.ino, data);
+    }
+}
+
+void FuseLowLevelFrontend::invalidate_removed(uint64_t parent, const char* name)
+{
+    auto ino = table_.find(parent, name);
+    if (!ino.has_value())
+    {
+        return;
+    }
+    // For hard links the other names are still valid, but the kernel only has to look them up
+    // again.
+    for (auto&& alias : table_.get_aliases(*ino))
+    {
+        invalidator_.invalidate_entry(alias.parent, std::move(alias.name));
+        invalidator_.invalidate_inode(alias.ino, false);
+    }
+}
+
+int FuseLowLevelFrontend::reply_entry(fuse_req_t req,
+                                      uint64_t parent,
+                                      const char* name,
+                                      const fuse_context& ctx)
+{
+    fuse_entry_param e{};
+    int rc = fill_entry(parent, name, ctx, &e);
+    if (rc == -ENOENT)
+    {
+        // A zero node id caches the negative lookup for `negative_timeout`.
+        e = fuse_entry_param{};
+        e.entry_timeout = options_.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return 0;
+    }
+    if (rc < 0)
+    {
+        return rc;
+    }
+    if (fuse_reply_entry(req, &e) != 0)
+    {
+        // The kernel never learnt about the node, so undo the lookup.
+        table_.forget(e.ino, 1);
+    }
+    return 0;
+}
+
+std::optional<std::string> FuseLowLevelFrontend::resolve(uint64_t ino)
+{
+    if (!ops_.has_resolve())
+    {
+        return {};
+    }
+    auto resolved = table_.get_resolved(ino);
+    if (resolved.has_value())
+    {
+        return resolved;
+    }
+    // Read before the path, so that a rename in between voids what is stored.
+    auto epoch = table_.rename_epoch();
+    resolved = ops_.vresolve(table_.get_path(ino).c_str());
+    if (resolved.has_value())
+    {
+        table_.set_resolved(ino, epoch, *resolved);
+    }
+    return resolved;
+}
+
+int FuseLowLevelFrontend::fill_entry(uint64_t parent,
+                                     const char* name,
+                                     const fuse_context& ctx,
+                                     fuse_entry_param* e)
+{
+    // A node that the kernel already knows may have its path resolved from an earlier lookup.
+    std::optional<std::string> resolved;
+    if (auto existing = table_.find(parent, name); existing.has_value() && ops_.has_resolve())
+    {
+        resolved = table_.get_resolved(*existing);
+    }
+    bool fresh = !resolved.has_value();
+    auto epoch = table_.rename_epoch();
+    if (fresh && ops_.has_resolve())
+    {
+        resolved = ops_.vresolve(table_.get_child_path(parent, name).c_str());
+    }
+    int rc = resolved.has_value()
+        ? ops_.vgetattr_resolved(*resolved, &e->attr, &ctx)
+        : ops_.vgetattr(table_.get_child_path(parent, name).c_str(), &e->attr, &ctx);
+    if (rc < 0)
+    {
+        return rc;
+    }
+    e->ino = table_.lookup(parent, name);
+    if (fresh && resolved.has_value())
+    {
+        table_.set_resolved(e->ino, epoch, std::move(*resolved));
+    }
+    e->generation = 1;
+    e->attr_timeout = options_.attr_timeout;
+    e->entry_timeout = options_.entry_timeout;
+    table_.set_backing_ino(e->ino, e->attr.st_ino);
+    fixup_attr(e->ino, &e->attr);
+    return 0;
+}
+
+int FuseLowLevelFrontend::reply_dir(
+    fuse_req_t req, uint64_t ino, size_t size, off_t off, fuse_file_info* fi, bool plus)
+{
+    auto ctx = make_context(req);
+    auto handle = get_dir_handle(fi);
+    if (off == 0 || !handle->filled)
+    {
+        handle->entries.clear();
+        int rc = ops_.vreaddir(nullptr, handle, &collect_dir_entry, 0, &handle->info, &ctx);
+        if (rc < 0)
+        {
+            return rc;
+        }
+        handle->filled = true;
+    }
+    std::vector<char> buffer(size);
+    size_t used = 0;
+    // The nodes handed to the kernel in the reply, each with one lookup to undo if it is lost.
+    std::vector<uint64_t> looked_up;
+    for (size_t i = static_cast<size_t>(std::max<off_t>(off, 0)); i < handle->entries.size(); ++i)
+    {
+        auto& [name, st] = handle->entries[i];
+        if (!options_.use_ino)
+        {
+            st.st_ino = static_cast<fuse_ino_t>(-1);
+        }
+        size_t entry_size;
+        uint64_t entry_ino = 0;
+#if FUSE_USE_VERSION >= 30
+        if (plus)
+        {
+            fuse_entry_param e{};
+            // The kernel does not link "." and "..", nor the entries with a zero node id, so
+            // those are left without a lookup.
+            if (name == "." || name == ".." || fill_entry(ino, name.c_str(), ctx, &e) < 0)
+            {
+                e = fuse_entry_param{};
+                e.attr = st;
+            }
+            entry_size = fuse_add_direntry_plus(req,
+                                                buffer.data() + used,
+                                                buffer.size() - used,
+                                                name.c_str(),
+                                                &e,
+                                                static_cast<off_t>(i + 1));
+            entry_ino = e.ino;
+        }
+        else
+#endif
+        {
+            entry_size = fuse_add_direntry(req,
+                                           buffer.data() + used,
+                                           buffer.size() - used,
+                                           name.c_str(),
+                                           &st,
+                                           static_cast<off_t>(i + 1));
+        }
+        if (entry_size > buffer.size() - used)
+        {
+            if (entry_ino != 0)
+            {
+                table_.forget(entry_ino, 1);
+            }
+            break;
+        }
+        used += entry_size;
+        if (entry_ino != 0)
+        {
+            looked_up.push_back(entry_ino);
+        }
+    }
+    if (fuse_reply_buf(req, buffer.data(), used) != 0)
+    {
+        for (uint64_t node : looked_up)
+        {
+            table_.forget(node, 1);
+        }
+    }
+    return 0;
+}
+
+template <class Body>
+void FuseLowLevelFrontend::schedule(uint64_t ino, fuse_file_info* fi, Body body)
+{
+    if (!scheduler_)
+    {
+        body(fi);
+        return;
+    }
+    scheduler_->submit(
+        ino,
+        [&]() { body(fi); },
+        [&]() -> RequestScheduler::Task
+        { return [body, info = *fi]() mutable { body(&info); }; });
+}
+
+fuse_lowlevel_ops FuseLowLevelFrontend::build_ops(bool enable_xattr)
+{
+    fuse_lowlevel_ops ops{};
+
+    ops.init = [](void* userdata, fuse_conn_info* conn)
+    {
+        FuseHighLevelOpsBase::enable_common_capabilities(conn);
+#if FUSE_USE_VERSION >= 30
+        // Only this frontend fills in the attributes of the entries, so only it asks for the
+        // listings with them.
+        for (auto cap : {FUSE_CAP_READDIRPLUS, FUSE_CAP_READDIRPLUS_AUTO})
+        {
+            if (conn->capable & cap)
+            {
+                conn->want |= cap;
+            }
+        }
+#endif
+        auto self = static_cast<FuseLowLevelFrontend*>(userdata);
+        self->ops_.initialize(conn);
+        INFO_LOG("Fuse low level operations initialized");
+        TRACE_LOG("Initalize with fuse op class %s", typeid(self->ops_).name());
+    };
+    ops.destroy = [](void*) { INFO_LOG("Fuse low level operations destroyed"); };
+    ops.lookup = [](fuse_req_t req, fuse_ino_t parent, const char* name)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call([&]() { return self->reply_entry(req, parent, name, ctx); },
+                                           "lookup",
+                                           __LINE__,
+                                           {{"parent", {to_u64(parent)}}, {"name", {name}}}));
+    };
+    ops.forget = [](fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+    {
+        get(req)->table_.forget(ino, nlookup);
+        fuse_reply_none(req);
+    };
+#if FUSE_VERSION >= 29
+    ops.forget_multi = [](fuse_req_t req, size_t count, fuse_forget_data* forgets)
+    {
+        auto self = get(req);
+        for (size_t i = 0; i < count; ++i)
+        {
+            self->table_.forget(forgets[i].ino, forgets[i].nlookup);
+        }
+        fuse_reply_none(req);
+    };
+#endif
+    ops.getattr = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(req,
+                              trace::FuseTracer::traced_call(
+                                  [&]()
+                                  {
+                                      fuse_stat st{};
+                                      int rc;
+                                      std::optional<std::string> resolved;
+                                      if (!fi)
+                                      {
+                                          resolved = self->resolve(ino);
+                                      }
+                                      if (resolved.has_value())
+                                      {
+                                          rc = self->ops_.vgetattr_resolved(*resolved, &st, &ctx);
+                                      }
+                                      else
+                                      {
+                                          auto path = self->table_.get_path(ino);
+                                          rc = fi
+                                              ? self->ops_.vfgetattr(path.c_str(), &st, fi, &ctx)
+                                              : self->ops_.vgetattr(path.c_str(), &st, &ctx);
+                                      }
+                                      if (rc < 0)
+                                      {
+                                          return rc;
+                                      }
+                                      self->fixup_attr(ino, &st);
+                                      fuse_reply_attr(req, &st, self->options_.attr_timeout);
+                                      return 0;
+                                  },
+                                  "getattr",
+                                  __LINE__,
+                                  {{"ino", {to_u64(ino)}}, {"fi", {fi}}}));
+    };
+    ops.setattr = [](fuse_req_t req, fuse_ino_t ino, fuse_stat* attr, int to_set, fuse_file_info* fi)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call(
+                [&]()
+                {
+                    auto path = self->table_.get_path(ino);
+                    auto& ops = self->ops_;
+                    int rc = 0;
+                    if (to_set & FUSE_SET_ATTR_MODE)
+                    {
+                        rc = ops.vchmod(path.c_str(), attr->st_mode, &ctx);
+                    }
+                    if (rc == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+                    {
+                        rc = ops.vchown(
+                            path.c_str(),
+                            (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : static_cast<uid_t>(-1),
+                            (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : static_cast<gid_t>(-1),
+                            &ctx);
+                    }
+                    if (rc == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+                    {
+                        rc = fi ? ops.vftruncate(path.c_str(), attr->st_size, fi, &ctx)
+                                : ops.vtruncate(path.c_str(), attr->st_size, &ctx);
+                    }
+                    if (rc == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+                    {
+                        fuse_timespec ts[2];
+                        ts[0] = attr->st_atim;
+                        ts[1] = attr->st_mtim;
+                        if (!(to_set & FUSE_SET_ATTR_ATIME))
+                            ts[0].tv_nsec = UTIME_OMIT;
+                        if (!(to_set & FUSE_SET_ATTR_MTIME))
+                            ts[1].tv_nsec = UTIME_OMIT;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+                        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                            ts[0].tv_nsec = UTIME_NOW;
+                        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                            ts[1].tv_nsec = UTIME_NOW;
+#endif
+                        rc = ops.vutimens(path.c_str(), ts, &ctx);
+                    }
+                    if (rc < 0)
+                    {
+                        return rc;
+                    }
+                    self->invalidate_aliases(ino, to_set & FUSE_SET_ATTR_SIZE);
+                    fuse_stat st{};
+                    rc = fi ? ops.vfgetattr(path.c_str(), &st, fi, &ctx)
+                            : ops.vgetattr(path.c_str(), &st, &ctx);
+                    if (rc < 0)
+                    {
+                        return rc;
+                    }
+                    self->fixup_attr(ino, &st);
+                    fuse_reply_attr(req, &st, self->options_.attr_timeout);
+                    return 0;
+                },
+                "setattr",
+                __LINE__,
+                {{"ino", {to_u64(ino)}}, {"to_set", {to_set}}, {"fi", {fi}}}));
+    };
+    ops.readlink = [](fuse_req_t req, fuse_ino_t ino)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(req,
+                              trace::FuseTracer::traced_call(
+                                  [&]()
+                                  {
+                                      auto path = self->table_.get_path(ino);
+                                      std::vector<char> buffer(PATH_MAX + 1);
+                                      int rc = self->ops_.vreadlink(
+                                          path.c_str(), buffer.data(), buffer.size(), &ctx);
+                                      if (rc < 0)
+                                      {
+                                          return rc;
+                                      }
+                                      buffer.back() = 0;
+                                      fuse_reply_readlink(req, buffer.data());
+                                      return 0;
+                                  },
+                                  "readlink",
+                                  __LINE__,
+                                  {{"ino", {to_u64(ino)}}}));
+    };
+    ops.mkdir = [](fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call(
+                [&]()
+                {
+                    auto path = self->table_.get_child_path(parent, name);
+                    int rc = self->ops_.vmkdir(path.c_str(), mode, &ctx);
+                    return rc < 0 ? rc : self->reply_entry(req, parent, name, ctx);
+                },
+                "mkdir",
+                __LINE__,
+                {{"parent", {to_u64(parent)}}, {"name", {name}}, {"mode", {unsigned(mode)}}}));
+    };
+    ops.unlink = [](fuse_req_t req, fuse_ino_t parent, const char* name)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        fuse_reply_err(req,
+                       -trace::FuseTracer::traced_call(
+                           [&]()
+                           {
+                               auto path = self->table_.get_child_path(parent, name);
+                               int rc = self->ops_.vunlink(path.c_str(), &ctx);
+                               if (rc == 0)
+                               {
+                                   self->invalidate_removed(parent, name);
+                                   self->table_.remove(parent, name);
+                               }
+                               return rc;
+                           },
+                           "unlink",
+                           __LINE__,
+                           {{"parent", {to_u64(parent)}}, {"name", {name}}}));
+    };
+    ops.rmdir = [](fuse_req_t req, fuse_ino_t parent, const char* name)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        fuse_reply_err(req,
+                       -trace::FuseTracer::traced_call(
+                           [&]()
+                           {
+                               auto path = self->table_.get_child_path(parent, name);
+                               int rc = self->ops_.vrmdir(path.c_str(), &ctx);
+                               if (rc == 0)
+                               {
+                                   self->invalidate_removed(parent, name);
+                                   self->table_.remove(parent, name);
+                               }
+                               return rc;
+                           },
+                           "rmdir",
+                           __LINE__,
+                           {{"parent", {to_u64(parent)}}, {"name", {name}}}));
+    };
+    ops.symlink = [](fuse_req_t req, const char* link, fuse_ino_t parent, const char* name)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call(
+                [&]()
+                {
+                    auto path = self->table_.get_child_path(parent, name);
+                    int rc = self->ops_.vsymlink(link, path.c_str(), &ctx);
+                    return rc < 0 ? rc : self->reply_entry(req, parent, name, ctx);
+                },
+                "symlink",
+                __LINE__,
+                {{"link", {link}}, {"parent", {to_u64(parent)}}, {"name", {name}}}));
+    };
+    ops.rename = [](fuse_req_t req,
+                    fuse_ino_t parent,
+                    const char* name,
+                    fuse_ino_t newparent,
+#if FUSE_USE_VERSION >= 30
+                    const char* newname,
+                    unsigned int flags)
+#else
+                    const char* newname)
+#endif
+    {
+#if FUSE_USE_VERSION >= 30
+        if (flags)
+        {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+#endif
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        fuse_reply_err(req,
+                       -trace::FuseTracer::traced_call(
+                           [&]()
+                           {
+                               auto from = self->table_.get_child_path(parent, name);
+                               auto to = self->table_.get_child_path(newparent, newname);
+                               int rc = self->ops_.vrename(from.c_str(), to.c_str(), &ctx);
+                               if (rc == 0)
+                               {
+                                   self->invalidate_removed(parent, name);
+                                   self->invalidate_removed(newparent, newname);
+                                   self->table_.rename(parent, name, newparent, newname);
+                               }
+                               return rc;
+                           },
+                           "rename",
+                           __LINE__,
+                           {{"parent", {to_u64(parent)}},
+                            {"name", {name}},
+                            {"newparent", {to_u64(newparent)}},
+                            {"newname", {newname}}}));
+    };
+    ops.link = [](fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(req,
+                              trace::FuseTracer::traced_call(
+                                  [&]()
+                                  {
+                                      auto src = self->table_.get_path(ino);
+                                      auto dest = self->table_.get_child_path(newparent, newname);
+                                      int rc = self->ops_.vlink(src.c_str(), dest.c_str(), &ctx);
+                                      if (rc < 0)
+                                      {
+                                          return rc;
+                                      }
+                                      self->invalidate_aliases(ino, false);
+                                      return self->reply_entry(req, newparent, newname, ctx);
+                                  },
+                                  "link",
+                                  __LINE__,
+                                  {{"ino", {to_u64(ino)}},
+                                   {"newparent", {to_u64(newparent)}},
+                                   {"newname", {newname}}}));
+    };
+    ops.open = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(req,
+                              trace::FuseTracer::traced_call(
+                                  [&]()
+                                  {
+                                      auto resolved = self->resolve(ino);
+                                      int rc = resolved.has_value()
+                                          ? self->ops_.vopen_resolved(*resolved, fi, &ctx)
+                                          : self->ops_.vopen(
+                                              self->table_.get_path(ino).c_str(), fi, &ctx);
+                                      if (rc < 0)
+                                      {
+                                          return rc;
+                                      }
+                                      // With `FUSE_CAP_ATOMIC_O_TRUNC` the open itself truncates,
+                                      // which the kernel only knows about for this node id.
+                                      if (fi->flags & O_TRUNC)
+                                      {
+                                          self->invalidate_aliases(ino, true);
+                                      }
+                                      if (fuse_reply_open(req, fi) != 0)
+                                      {
+                                          self->ops_.vrelease(
+                                              self->table_.get_path(ino).c_str(), fi, &ctx);
+                                      }
+                                      return 0;
+                                  },
+                                  "open",
+                                  __LINE__,
+                                  {{"ino", {to_u64(ino)}}, {"fi", {fi}}}));
+    };
+    ops.create = [](fuse_req_t req,
+                    fuse_ino_t parent,
+                    const char* name,
+                    mode_t mode,
+                    fuse_file_info* fi)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call(
+                [&]()
+                {
+                    auto path = self->table_.get_child_path(parent, name);
+                    int rc = self->ops_.vcreate(path.c_str(), mode, fi, &ctx);
+                    if (rc < 0)
+                    {
+                        return rc;
+                    }
+                    fuse_entry_param e{};
+                    rc = self->ops_.vfgetattr(path.c_str(), &e.attr, fi, &ctx);
+                    if (rc < 0)
+                    {
+                        self->ops_.vrelease(path.c_str(), fi, &ctx);
+                        return rc;
+                    }
+                    e.ino = self->table_.lookup(parent, name);
+                    e.generation = 1;
+                    e.attr_timeout = self->options_.attr_timeout;
+                    e.entry_timeout = self->options_.entry_timeout;
+                    self->table_.set_backing_ino(e.ino, e.attr.st_ino);
+                    self->fixup_attr(e.ino, &e.attr);
+                    if (fuse_reply_create(req, &e, fi) != 0)
+                    {
+                        self->ops_.vrelease(path.c_str(), fi, &ctx);
+                        self->table_.forget(e.ino, 1);
+                    }
+                    return 0;
+                },
+                "create",
+                __LINE__,
+                {{"parent", {to_u64(parent)}},
+                 {"name", {name}},
+                 {"mode", {unsigned(mode)}},
+                 {"fi", {fi}}}));
+    };
+    ops.read = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi)
+    {
+        get(req)->schedule(
+            ino,
+            fi,
+            [=](fuse_file_info* fi)
+            {
+                auto self = get(req);
+                auto ctx = self->make_context(req);
+                thread_local std::vector<char> buffer;
+                reply_error_if_failed(
+                    req,
+                    trace::FuseTracer::traced_call(
+                        [&]()
+                        {
+                            if (buffer.size() < size)
+                            {
+                                buffer.resize(size);
+                            }
+                            int rc
+                                = self->ops_.vread(nullptr, buffer.data(), size, off, fi, &ctx);
+                            if (rc < 0)
+                            {
+                                return rc;
+                            }
+                            fuse_reply_buf(req, buffer.data(), static_cast<size_t>(rc));
+                            // Returned for the statistics, as the reply is already sent.
+                            return rc;
+                        },
+                        "read",
+                        __LINE__,
+                        {{"ino", {to_u64(ino)}},
+                         {"size", {size}},
+                         {"off", {int64_t(off)}},
+                         {"fi", {fi}}}));
+            });
+    };
+    ops.write = [](fuse_req_t req,
+                   fuse_ino_t ino,
+                   const char* buf,
+                   size_t size,
+                   off_t off,
+                   fuse_file_info* fi)
+    {
+        auto write = [=](fuse_file_info* fi, const char* buf)
+        {
+            auto self = get(req);
+            auto ctx = self->make_context(req);
+            reply_error_if_failed(req,
+                                  trace::FuseTracer::traced_call(
+                                      [&]()
+                                      {
+                                          int rc = self->ops_.vwrite(
+                                              nullptr, buf, size, off, fi, &ctx);
+                                          if (rc < 0)
+                                          {
+                                              return rc;
+                                          }
+                                          self->invalidate_aliases(ino, true);
+                                          fuse_reply_write(req, static_cast<size_t>(rc));
+                                          return rc;
+                                      },
+                                      "write",
+                                      __LINE__,
+                                      {{"ino", {to_u64(ino)}},
+                                       {"size", {size}},
+                                       {"off", {int64_t(off)}},
+                                       {"fi", {fi}}}));
+        };
+        auto self = get(req);
+        if (!self->scheduler_)
+        {
+            write(fi, buf);
+            return;
+        }
+        self->scheduler_->submit(
+            ino,
+            [&]() { write(fi, buf); },
+            [&]() -> RequestScheduler::Task
+            {
+                return [write, info = *fi, data = std::string(buf, size)]() mutable
+                { write(&info, data.data()); };
+            });
+    };
+    ops.write_buf = [](fuse_req_t req,
+                       fuse_ino_t ino,
+                       fuse_bufvec* bufv,
+                       off_t off,
+                       fuse_file_info* fi)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        auto write_buf = [&]()
+        {
+            reply_error_if_failed(req,
+                                  trace::FuseTracer::traced_call(
+                                      [&]()
+                                      {
+                                          int rc = self->ops_.vwrite_buf(
+                                              nullptr, bufv, off, fi, &ctx);
+                                          if (rc < 0)
+                                          {
+                                              return rc;
+                                          }
+                                          self->invalidate_aliases(ino, true);
+                                          fuse_reply_write(req, static_cast<size_t>(rc));
+                                          return rc;
+                                      },
+                                      "write_buf",
+                                      __LINE__,
+                                      {{"ino", {to_u64(ino)}},
+                                       {"off", {int64_t(off)}},
+                                       {"fi", {fi}}}));
+        };
+        if (!self->scheduler_)
+        {
+            write_buf();
+            return;
+        }
+        self->scheduler_->submit(
+            ino,
+            write_buf,
+            [&]() -> RequestScheduler::Task
+            {
+                // The data may still be in the pipe from the kernel, which is reused for the next
+                // request once we return, so it is drained into memory first.
+                std::string data(fuse_buf_size(bufv), '\0');
+                fuse_bufvec dest = FUSE_BUFVEC_INIT(data.size());
+                dest.buf[0].mem = data.data();
+                ssize_t copied = fuse_buf_copy(&dest, bufv, FUSE_BUF_NO_SPLICE);
+                return [req, ino, off, info = *fi, data = std::move(data), copied]() mutable
+                {
+                    if (copied < 0)
+                    {
+                        fuse_reply_err(req, static_cast<int>(-copied));
+                        return;
+                    }
+                    auto self = get(req);
+                    auto ctx = self->make_context(req);
+                    reply_error_if_failed(
+                        req,
+                        trace::FuseTracer::traced_call(
+                            [&]()
+                            {
+                                int rc = self->ops_.vwrite(nullptr,
+                                                           data.data(),
+                                                           static_cast<size_t>(copied),
+                                                           off,
+                                                           &info,
+                                                           &ctx);
+                                if (rc < 0)
+                                {
+                                    return rc;
+                                }
+                                self->invalidate_aliases(ino, true);
+                                fuse_reply_write(req, static_cast<size_t>(rc));
+                                return rc;
+                            },
+                            "write_buf",
+                            __LINE__,
+                            {{"ino", {to_u64(ino)}}, {"off", {int64_t(off)}}, {"fi", {&info}}}));
+                };
+            });
+    };
+    ops.flush = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+    {
+        get(req)->schedule(ino,
+                           fi,
+                           [=](fuse_file_info* fi)
+                           {
+                               auto self = get(req);
+                               auto ctx = self->make_context(req);
+                               fuse_reply_err(
+                                   req,
+                                   -trace::FuseTracer::traced_call(
+                                       [&]() { return self->ops_.vflush(nullptr, fi, &ctx); },
+                                       "flush",
+                                       __LINE__,
+                                       {{"ino", {to_u64(ino)}}, {"fi", {fi}}}));
+                           });
+    };
+    ops.release = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+    {
+        // Scheduled as well, so that it comes after the requests still queued on the file.
+        get(req)->schedule(ino,
+                           fi,
+                           [=](fuse_file_info* fi)
+                           {
+                               auto self = get(req);
+                               auto ctx = self->make_context(req);
+                               fuse_reply_err(
+                                   req,
+                                   -trace::FuseTracer::traced_call(
+                                       [&]() { return self->ops_.vrelease(nullptr, fi, &ctx); },
+                                       "release",
+                                       __LINE__,
+                                       {{"ino", {to_u64(ino)}}, {"fi", {fi}}}));
+                           });
+    };
+    ops.fsync = [](fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* fi)
+    {
+        get(req)->schedule(
+            ino,
+            fi,
+            [=](fuse_file_info* fi)
+            {
+                auto self = get(req);
+                auto ctx = self->make_context(req);
+                fuse_reply_err(
+                    req,
+                    -trace::FuseTracer::traced_call(
+                        [&]() { return self->ops_.vfsync(nullptr, datasync, fi, &ctx); },
+                        "fsync",
+                        __LINE__,
+                        {{"ino", {to_u64(ino)}}, {"datasync", {datasync}}, {"fi", {fi}}}));
+            });
+    };
+    ops.fallocate = [](fuse_req_t req,
+                       fuse_ino_t ino,
+                       int mode,
+                       off_t offset,
+                       off_t length,
+                       fuse_file_info* fi)
+    {
+        get(req)->schedule(
+            ino,
+            fi,
+            [=](fuse_file_info* fi)
+            {
+                auto self = get(req);
+                auto ctx = self->make_context(req);
+                fuse_reply_err(req,
+                               -trace::FuseTracer::traced_call(
+                                   [&]()
+                                   {
+                                       int rc = self->ops_.vfallocate(
+                                           nullptr, mode, offset, length, fi, &ctx);
+                                       if (rc == 0)
+                                       {
+                                           // The size may have changed.
+                                           self->invalidate_aliases(ino, true);
+                                       }
+                                       return rc;
+                                   },
+                                   "fallocate",
+                                   __LINE__,
+                                   {{"ino", {to_u64(ino)}},
+                                    {"mode", {mode}},
+                                    {"offset", {int64_t(offset)}},
+                                    {"length", {int64_t(length)}},
+                                    {"fi", {fi}}}));
+            });
+    };
+#if FUSE_USE_VERSION >= 30
+    ops.lseek = [](fuse_req_t req, fuse_ino_t ino, off_t off, int whence, fuse_file_info* fi)
+    {
+        get(req)->schedule(
+            ino,
+            fi,
+            [=](fuse_file_info* fi)
+            {
+                auto self = get(req);
+                auto ctx = self->make_context(req);
+                reply_error_if_failed(
+                    req,
+                    trace::FuseTracer::traced_call(
+                        [&]()
+                        {
+                            fuse_off_t result = 0;
+                            int rc = self->ops_.vlseek(nullptr, off, whence, &result, fi, &ctx);
+                            if (rc == 0)
+                            {
+                                fuse_reply_lseek(req, result);
+                            }
+                            return rc;
+                        },
+                        "lseek",
+                        __LINE__,
+                        {{"ino", {to_u64(ino)}},
+                         {"off", {int64_t(off)}},
+                         {"whence", {whence}},
+                         {"fi", {fi}}}));
+            });
+    };
+    // Ordered with the other requests on the destination, which is the one that changes.
+    ops.copy_file_range = [](fuse_req_t req,
+                             fuse_ino_t ino_in,
+                             off_t off_in,
+                             fuse_file_info* fi_in,
+                             fuse_ino_t ino_out,
+                             off_t off_out,
+                             fuse_file_info* fi_out,
+                             size_t len,
+                             int flags)
+    {
+        get(req)->schedule(
+            ino_out,
+            fi_out,
+            [=, info_in = *fi_in](fuse_file_info* fi_out) mutable
+            {
+                auto self = get(req);
+                auto ctx = self->make_context(req);
+                reply_error_if_failed(
+                    req,
+                    trace::FuseTracer::traced_call(
+                        [&]()
+                        {
+                            int rc = self->ops_.vcopy_file_range(
+                                nullptr,
+                                &info_in,
+                                off_in,
+                                nullptr,
+                                fi_out,
+                                off_out,
+                                std::min(len, FuseHighLevelOpsBase::kMaxCopyLength),
+                                flags,
+                                &ctx);
+                            if (rc < 0)
+                            {
+                                return rc;
+                            }
+                            self->invalidate_aliases(ino_out, true);
+                            fuse_reply_write(req, static_cast<size_t>(rc));
+                            return rc;
+                        },
+                        "copy_file_range",
+                        __LINE__,
+                        {{"ino_in", {to_u64(ino_in)}},
+                         {"off_in", {int64_t(off_in)}},
+                         {"fi_in", {&info_in}},
+                         {"ino_out", {to_u64(ino_out)}},
+                         {"off_out", {int64_t(off_out)}},
+                         {"fi_out", {fi_out}},
+                         {"len", {len}},
+                         {"flags", {flags}}}));
+            });
+    };
+#endif
+    ops.opendir = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(req,
+                              trace::FuseTracer::traced_call(
+                                  [&]()
+                                  {
+                                      auto path = self->table_.get_path(ino);
+                                      auto handle = std::make_unique<DirHandle>();
+                                      handle->info = *fi;
+                                      int rc
+                                          = self->ops_.vopendir(path.c_str(), &handle->info, &ctx);
+                                      if (rc < 0)
+                                      {
+                                          return rc;
+                                      }
+                                      fi->fh = reinterpret_cast<uintptr_t>(handle.get());
+                                      if (fuse_reply_open(req, fi) != 0)
+                                      {
+                                          self->ops_.vreleasedir(
+                                              path.c_str(), &handle->info, &ctx);
+                                          return 0;
+                                      }
+                                      handle.release();
+                                      return 0;
+                                  },
+                                  "opendir",
+                                  __LINE__,
+                                  {{"ino", {to_u64(ino)}}, {"fi", {fi}}}));
+    };
+    ops.readdir = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi)
+    {
+        auto self = get(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call(
+                [&]() { return self->reply_dir(req, ino, size, off, fi, false); },
+                "readdir",
+                __LINE__,
+                {{"ino", {to_u64(ino)}},
+                 {"size", {size}},
+                 {"off", {int64_t(off)}},
+                 {"fi", {fi}}}));
+    };
+#if FUSE_USE_VERSION >= 30
+    // Answers a directory listing together with the lookups of its entries, which spares the
+    // kernel one round trip per entry when it lists and then stats a directory.
+    ops.readdirplus = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi)
+    {
+        auto self = get(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call(
+                [&]() { return self->reply_dir(req, ino, size, off, fi, true); },
+                "readdirplus",
+                __LINE__,
+                {{"ino", {to_u64(ino)}},
+                 {"size", {size}},
+                 {"off", {int64_t(off)}},
+                 {"fi", {fi}}}));
+    };
+#endif
+    ops.releasedir = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        std::unique_ptr<DirHandle> handle(get_dir_handle(fi));
+        fuse_reply_err(req,
+                       -trace::FuseTracer::traced_call(
+                           [&]() { return self->ops_.vreleasedir(nullptr, &handle->info, &ctx); },
+                           "releasedir",
+                           __LINE__,
+                           {{"ino", {to_u64(ino)}}, {"fi", {fi}}}));
+    };
+    ops.statfs = [](fuse_req_t req, fuse_ino_t ino)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(req,
+                              trace::FuseTracer::traced_call(
+                                  [&]()
+                                  {
+                                      fuse_statvfs buf{};
+                                      int rc = self->ops_.vstatfs("/", &buf, &ctx);
+                                      if (rc < 0)
+                                      {
+                                          return rc;
+                                      }
+                                      fuse_reply_statfs(req, &buf);
+                                      return 0;
+                                  },
+                                  "statfs",
+                                  __LINE__,
+                                  {{"ino", {to_u64(ino)}}}));
+    };
+
+    if (!enable_xattr)
+        return ops;
+
+    // A zero `size` asks for the size of the value or list, which the operations report the same
+    // way when given no buffer.
+    ops.getxattr = [](fuse_req_t req, fuse_ino_t ino, const char* name, size_t size)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(
+            req,
+            trace::FuseTracer::traced_call(
+                [&]()
+                {
+                    auto path = self->table_.get_path(ino);
+                    std::vector<char> buffer(size);
+                    int rc = self->ops_.vgetxattr(
+                        path.c_str(), name, size ? buffer.data() : nullptr, size, 0, &ctx);
+                    if (rc < 0)
+                    {
+                        return rc;
+                    }
+                    if (size == 0)
+                    {
+                        fuse_reply_xattr(req, static_cast<size_t>(rc));
+                    }
+                    else
+                    {
+                        fuse_reply_buf(req, buffer.data(), static_cast<size_t>(rc));
+                    }
+                    return 0;
+                },
+                "getxattr",
+                __LINE__,
+                {{"ino", {to_u64(ino)}}, {"name", {name}}, {"size", {size}}}));
+    };
+    ops.listxattr = [](fuse_req_t req, fuse_ino_t ino, size_t size)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        reply_error_if_failed(req,
+                              trace::FuseTracer::traced_call(
+                                  [&]()
+                                  {
+                                      auto path = self->table_.get_path(ino);
+                                      std::vector<char> buffer(size);
+                                      int rc = self->ops_.vlistxattr(
+                                          path.c_str(), size ? buffer.data() : nullptr, size, &ctx);
+                                      if (rc < 0)
+                                      {
+                                          return rc;
+                                      }
+                                      if (size == 0)
+                                      {
+                                          fuse_reply_xattr(req, static_cast<size_t>(rc));
+                                      }
+                                      else
+                                      {
+                                          fuse_reply_buf(
+                                              req, buffer.data(), static_cast<size_t>(rc));
+                                      }
+                                      return 0;
+                                  },
+                                  "listxattr",
+                                  __LINE__,
+                                  {{"ino", {to_u64(ino)}}, {"size", {size}}}));
+    };
+    ops.setxattr = [](fuse_req_t req,
+                      fuse_ino_t ino,
+                      const char* name,
+                      const char* value,
+                      size_t size,
+                      int flags)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        fuse_reply_err(req,
+                       -trace::FuseTracer::traced_call(
+                           [&]()
+                           {
+                               auto path = self->table_.get_path(ino);
+                               return self->ops_.vsetxattr(
+                                   path.c_str(), name, value, size, flags, 0, &ctx);
+                           },
+                           "setxattr",
+                           __LINE__,
+                           {{"ino", {to_u64(ino)}},
+                            {"name", {name}},
+                            {"size", {size}},
+                            {"flags", {flags}}}));
+    };
+    ops.removexattr = [](fuse_req_t req, fuse_ino_t ino, const char* name)
+    {
+        auto self = get(req);
+        auto ctx = self->make_context(req);
+        fuse_reply_err(req,
+                       -trace::FuseTracer::traced_call(
+                           [&]()
+                           {
+                               auto path = self->table_.get_path(ino);
+                               return self->ops_.vremovexattr(path.c_str(), name, &ctx);
+                           },
+                           "removexattr",
+                           __LINE__,
+                           {{"ino", {to_u64(ino)}}, {"name", {name}}}));
+    };
+    return ops;
+}
+
+int FuseLowLevelFrontend::run(int argc, char** argv)
+{
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    DEFER(fuse_opt_free_args(&args));
+
+#if FUSE_USE_VERSION >= 30
+    fuse_cmdline_opts opts{};
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+    {
+        return 1;
+    }
+    DEFER(free(opts.mountpoint));
+
+    auto ops = build_ops(options_.enable_xattr);
+    fuse_session* session = fuse_session_new(&args, &ops, sizeof(ops), this);
+    if (!session)
+    {
+        return 3;
+    }
+    DEFER(fuse_session_destroy(session));
+
+    if (fuse_set_signal_handlers(session) != 0)
+    {
+        return 4;
+    }
+    DEFER(fuse_remove_signal_handlers(session));
+
+    if (fuse_session_mount(session, opts.mountpoint) != 0)
+    {
+        return 2;
+    }
+    DEFER(fuse_session_unmount(session));
+
+    if (fuse_daemonize(opts.foreground) != 0)
+    {
+        return 5;
+    }
+    invalidator_.start(session);
+    DEFER(invalidator_.stop());
+    if (opts.singlethread)
+    {
+        return fuse_session_loop(session);
+    }
+    scheduler_.emplace(options_.scheduler_threads);
+    // Drained before the session is destroyed, as the queued requests still have to be replied.
+    DEFER(scheduler_.reset());
+    fuse_loop_config* config = fuse_loop_cfg_create();
+    if (!config)
+    {
+        return 6;
+    }
+    DEFER(fuse_loop_cfg_destroy(config));
+    fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+    fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+    fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+    return fuse_session_loop_mt(session, config);
+#else
+    char* mountpoint = nullptr;
+    int multithreaded = 0, foreground = 0;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0)
+    {
+        return 1;
+    }
+    DEFER(free(mountpoint));
+
+    fuse_chan* channel = fuse_mount(mountpoint, &args);
+    if (!channel)
+    {
+        return 2;
+    }
+    DEFER(fuse_unmount(mountpoint, channel));
+
+    auto ops = build_ops(options_.enable_xattr);
+    fuse_session* session = fuse_lowlevel_new(&args, &ops, sizeof(ops), this);
+    if (!session)
+    {
+        return 3;
+    }
+    DEFER(fuse_session_destroy(session));
+
+    if (fuse_set_signal_handlers(session) != 0)
+    {
+        return 4;
+    }
+    DEFER(fuse_remove_signal_handlers(session));
+
+    fuse_session_add_chan(session, channel);
+    DEFER(fuse_session_remove_chan(channel));
+
+    if (fuse_daemonize(foreground) != 0)
+    {
+        return 5;
+    }
+    invalidator_.start(channel);
+    DEFER(invalidator_.stop());
+    if (!multithreaded)
+    {
+        return fuse_session_loop(session);
+    }
+    scheduler_.emplace(options_.scheduler_threads);
+    DEFER(scheduler_.reset());
+    return fuse_session_loop_mt(session);
+#endif
+}
+#endif
+}    // namespace securefs
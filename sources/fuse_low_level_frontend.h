@@ -0,0 +1,231 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+#include "request_scheduler.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace securefs
+{
+/// Maps the node ids of the low level FUSE API to virtual paths. Each node only records its parent
+/// and its own name, so that renaming a directory does not need to touch its descendants.
+class InodeTable
+{
+public:
+    static constexpr uint64_t kRootInode = 1;
+
+    InodeTable();
+    DISABLE_COPY_MOVE(InodeTable)
+
+    /// Returns the node id of `name` under `parent`, allocating one if necessary, and increments
+    /// its lookup count.
+    uint64_t lookup(uint64_t parent, std::string_view name);
+
+    /// Returns the node id of `name` under `parent` if the kernel currently knows it.
+    std::optional<uint64_t> find(uint64_t parent, std::string_view name);
+
+    /// Decrements the lookup count, and drops the node once nothing refers to it any more.
+    void forget(uint64_t ino, uint64_t nlookup);
+
+    /// Detaches `name` from `parent` after it is unlinked. The node itself lives on until the
+    /// kernel forgets it, and keeps reporting its last path.
+    void remove(uint64_t parent, std::string_view name);
+
+    void rename(uint64_t parent,
+                std::string_view name,
+                uint64_t new_parent,
+                std::string_view new_name);
+
+    /// Throws `VFSException(ESTALE)` if the node id is unknown.
+    std::string get_path(uint64_t ino);
+    std::string get_child_path(uint64_t parent, std::string_view name);
+
+    /// Records the inode number that the operations report for the node. Different paths may lead
+    /// to the same file, through hard links or name normalization, and so end up with distinct
+    /// node ids that share one inode number.
+    void set_backing_ino(uint64_t ino, uint64_t backing_ino);
+
+    struct Alias
+    {
+        uint64_t ino;
+        uint64_t parent;
+        std::string name;
+    };
+
+    /// Returns the other nodes that share the inode number of `ino`.
+    std::vector<Alias> get_aliases(uint64_t ino);
+
+    /// Counts the renames, each of which may move any number of nodes and so voids every resolved
+    /// path stored before it.
+    uint64_t rename_epoch();
+    /// Returns the path of `ino` as resolved by `FuseHighLevelOpsBase::vresolve`, if one was
+    /// stored since the last rename.
+    std::optional<std::string> get_resolved(uint64_t ino);
+    /// Stores the resolved path of `ino`, computed from its path as of `epoch`. It is dropped if a
+    /// rename happened since.
+    void set_resolved(uint64_t ino, uint64_t epoch, std::string resolved);
+
+    size_t size();
+
+private:
+    struct Node
+    {
+        uint64_t parent;
+        std::string name;
+        uint64_t nlookup;
+        // Number of child nodes that still refer to this node as their parent.
+        uint64_t nchildren;
+        bool attached;
+        // Zero if unknown.
+        uint64_t backing_ino = 0;
+        std::string resolved;
+        // One more than the rename epoch at which `resolved` was computed, or zero if unset.
+        uint64_t resolved_epoch = 0;
+    };
+
+    using ChildKey = std::pair<uint64_t, std::string>;
+
+    Mutex mu_;
+    uint64_t next_ino_ ABSL_GUARDED_BY(mu_);
+    uint64_t rename_epoch_ ABSL_GUARDED_BY(mu_) = 0;
+    absl::flat_hash_map<uint64_t, Node> nodes_ ABSL_GUARDED_BY(mu_);
+    absl::flat_hash_map<ChildKey, uint64_t> children_ ABSL_GUARDED_BY(mu_);
+    absl::flat_hash_map<uint64_t, std::vector<uint64_t>> by_backing_ino_ ABSL_GUARDED_BY(mu_);
+
+private:
+    Node& get_node(uint64_t ino) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void detach(uint64_t parent, std::string_view name) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void maybe_drop(uint64_t ino) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void unlink_backing_ino(uint64_t ino, uint64_t backing_ino) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    std::string build_path(uint64_t ino) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+};
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+/// Sends cache invalidations to the kernel from a dedicated thread. The kernel may hold locks on
+/// behalf of the request that causes an invalidation, so they must never be sent inline.
+class KernelCacheInvalidator
+{
+public:
+#if FUSE_USE_VERSION >= 30
+    using Target = fuse_session;
+#else
+    using Target = fuse_chan;
+#endif
+
+    KernelCacheInvalidator() = default;
+    ~KernelCacheInvalidator() { stop(); }
+    DISABLE_COPY_MOVE(KernelCacheInvalidator)
+
+    void start(Target* target);
+    /// Pending invalidations are dropped, as the filesystem is going away.
+    void stop();
+
+    /// Drops the cached attributes of `ino`, and also its cached content if `data` is true.
+    void invalidate_inode(uint64_t ino, bool data);
+    void invalidate_entry(uint64_t parent, std::string name);
+
+private:
+    struct Request
+    {
+        uint64_t ino;
+        // Non empty for entry invalidations, where `ino` is the parent.
+        std::string name;
+        bool data;
+    };
+
+    Mutex mu_;
+    Target* target_ ABSL_GUARDED_BY(mu_) = nullptr;
+    std::vector<Request> queue_ ABSL_GUARDED_BY(mu_);
+    bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+    std::thread worker_;
+
+private:
+    void enqueue(Request request);
+    void run();
+};
+
+/// Serves a `FuseHighLevelOpsBase` through the low level libfuse API. The kernel node ids are
+/// tracked by our own `InodeTable` instead of the path cache inside libfuse's high level layer.
+///
+/// For operations that resolve paths (lite, to its encrypted paths), each node keeps its resolved
+/// path, so lookup, getattr and open do not translate it again until a rename. The other
+/// operations, and the formats that do not resolve paths (full), get the virtual path rebuilt
+/// from the table.
+class FuseLowLevelFrontend
+{
+public:
+    struct Options
+    {
+        double entry_timeout = 1;
+        double attr_timeout = 1;
+        double negative_timeout = 1;
+        // Whether to report the inode numbers of `ops` to the kernel, rather than the node ids.
+        bool use_ino = false;
+        // Whether to serve the extended attribute operations, which otherwise fail with ENOSYS.
+        bool enable_xattr = true;
+        // The workers of the `RequestScheduler` that serves the reads and writes in multithreaded
+        // mode. Zero means the number of CPU cores.
+        unsigned scheduler_threads = 0;
+    };
+
+    FuseLowLevelFrontend(FuseHighLevelOpsBase& ops, const Options& options)
+        : ops_(ops), options_(options)
+    {
+    }
+    DISABLE_COPY_MOVE(FuseLowLevelFrontend)
+
+    /// Mounts and serves the filesystem until it is unmounted. `argv` follows the format of
+    /// `fuse_main`.
+    int run(int argc, char** argv);
+
+    InodeTable& inode_table() noexcept { return table_; }
+
+private:
+    FuseHighLevelOpsBase& ops_;
+    Options options_;
+    InodeTable table_;
+    KernelCacheInvalidator invalidator_;
+    std::optional<RequestScheduler> scheduler_;
+
+private:
+    static fuse_lowlevel_ops build_ops(bool enable_xattr);
+    static FuseLowLevelFrontend* get(fuse_req_t req);
+
+    fuse_context make_context(fuse_req_t req);
+    void fixup_attr(uint64_t ino, fuse_stat* st) const noexcept;
+    int reply_entry(fuse_req_t req, uint64_t parent, const char* name, const fuse_context& ctx);
+    // The path of `ino` as resolved by `ops_`, kept in its node, or nullopt if it must be served
+    // by virtual path.
+    std::optional<std::string> resolve(uint64_t ino);
+    // Looks up `name` under `parent` on behalf of the kernel, which then owns one lookup of
+    // `e->ino`. Nothing is looked up when it fails.
+    int fill_entry(uint64_t parent, const char* name, const fuse_context& ctx, fuse_entry_param* e);
+    // Replies to a readdir, or to a readdirplus if `plus` is true.
+    int reply_dir(
+        fuse_req_t req, uint64_t ino, size_t size, off_t off, fuse_file_info* fi, bool plus);
+
+    // Runs `body` with `fi` through the scheduler, so that a request on a file that is busy waits
+    // in its queue instead of on its lock.
+    template <class Body>
+    void schedule(uint64_t ino, fuse_file_info* fi, Body body);
+
+    // Other node ids may refer to the same file as `ino`, and the kernel cannot know that they
+    // are affected by a change through `ino`.
+    void invalidate_aliases(uint64_t ino, bool data);
+    // Called before `name` is removed from `parent`, so that the kernel drops the names that
+    // refer to the same file under a different spelling.
+    void invalidate_removed(uint64_t parent, const char* name);
+};
+#endif
+}    // namespace securefs
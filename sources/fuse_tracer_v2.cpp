@@ -6,6 +6,7 @@
 #include <absl/strings/str_format.h>
 #include <absl/time/time.h>
 
+#include <algorithm>
 #include <ctime>
 #include <type_traits>
 #include <variant>
@@ -211,4 +212,56 @@ void FuseTracer::print_function_exception(Logger* logger,
     }
 }
 
+void FuseTracer::record_binary(size_t op,
+                               OpStats::Clock::time_point start,
+                               uint64_t duration_ns,
+                               const WrappedFuseArg* args,
+                               size_t arg_size,
+                               int64_t rc) noexcept
+{
+    BinaryTraceRecord record;
+    record.start_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count());
+    record.duration_ns = duration_ns;
+    record.rc = static_cast<int32_t>(std::clamp<int64_t>(rc, INT32_MIN, INT32_MAX));
+    record.op = static_cast<uint16_t>(op);
+    uint64_t inode = 0;
+    for (size_t i = 0; i < arg_size; ++i)
+    {
+        const auto& arg = args[i];
+        std::visit(
+            [&](auto value)
+            {
+                using T = decltype(value);
+                if constexpr (std::is_same_v<T, const fuse_file_info*>)
+                {
+                    if (value)
+                    {
+                        record.handle = value->fh;
+                    }
+                }
+                else if constexpr (std::is_integral_v<T>)
+                {
+                    if (arg.name == "offset" || arg.name == "off")
+                    {
+                        record.offset = static_cast<uint64_t>(value);
+                    }
+                    else if (arg.name == "size" || arg.name == "len")
+                    {
+                        record.size = static_cast<uint64_t>(value);
+                    }
+                    else if (arg.name == "ino" || (arg.name == "parent" && inode == 0))
+                    {
+                        inode = static_cast<uint64_t>(value);
+                    }
+                }
+            },
+            arg.value);
+    }
+    if (record.handle == 0)
+    {
+        record.handle = inode;
+    }
+    BinaryTracer::global().record(record);
+}
 }    // namespace securefs::trace
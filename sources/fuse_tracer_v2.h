@@ -1,6 +1,8 @@
 #pragma once
+#include "binary_tracer.h"
 #include "exceptions.h"
 #include "logger.h"
+#include "op_stats.h"
 #include "platform.h"    // IWYU pragma: keep
 
 #include <cstdint>
@@ -53,6 +55,13 @@ private:
                                          const std::exception& e,
                                          int rc);
 
+    static void record_binary(size_t op,
+                              OpStats::Clock::time_point start,
+                              uint64_t duration_ns,
+                              const WrappedFuseArg* args,
+                              size_t arg_size,
+                              int64_t rc) noexcept;
+
 public:
     template <class ActualFunction>
     static inline auto traced_call(ActualFunction&& func,
@@ -60,6 +69,30 @@ public:
                                    int lineno,
                                    const std::initializer_list<WrappedFuseArg>& args,
                                    Logger* logger = global_logger) -> decltype(func())
+    {
+        // Every call site passes a lambda of a distinct type, so this is only evaluated once per
+        // call site.
+        static const size_t op = OpStats::global().register_op(funcsig);
+        auto start = OpStats::Clock::now();
+        auto rc = logged_call(std::forward<ActualFunction>(func), funcsig, lineno, args, logger);
+        auto duration_ns = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(OpStats::Clock::now() - start)
+                .count());
+        OpStats::global().record(op, duration_ns, rc);
+        if (BinaryTracer::global().enabled())
+        {
+            record_binary(op, start, duration_ns, args.begin(), args.size(), rc);
+        }
+        return rc;
+    }
+
+private:
+    template <class ActualFunction>
+    static inline auto logged_call(ActualFunction&& func,
+                                   const char* funcsig,
+                                   int lineno,
+                                   const std::initializer_list<WrappedFuseArg>& args,
+                                   Logger* logger) -> decltype(func())
     {
         print_function_starts(logger, funcsig, lineno, args.begin(), args.size());
         try
@@ -78,12 +111,14 @@ public:
         {
             int rc = -e.error_number();
             print_function_exception(logger, funcsig, lineno, args.begin(), args.size(), e, rc);
+            BinaryTracer::request_dump();
             return rc;
         }
         catch (const std::exception& e)
         {
             int rc = -EPERM;
             print_function_exception(logger, funcsig, lineno, args.begin(), args.size(), e, rc);
+            BinaryTracer::request_dump();
             return rc;
         }
     }
@@ -0,0 +1,433 @@
+#include "io_uring.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "op_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <memory>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Missing from older C library headers. The numbers are the same on all architectures.
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#endif
+
+namespace securefs
+{
+namespace
+{
+    std::atomic_bool io_uring_flag{false};
+}    // namespace
+
+bool is_io_uring_enabled() { return io_uring_flag.load(); }
+
+#ifndef __linux__
+bool set_io_uring_enabled(bool value)
+{
+    (void)value;
+    return false;
+}
+#else
+bool set_io_uring_enabled(bool value)
+{
+    value = value && IoUring::is_supported();
+    io_uring_flag.store(value);
+    return value;
+}
+
+namespace
+{
+    int sys_io_uring_setup(unsigned entries, io_uring_params* params)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return static_cast<int>(
+            ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+
+    struct Registry
+    {
+        Mutex mu;
+        std::vector<IoUring*> rings ABSL_GUARDED_BY(mu);
+    };
+
+    Registry& registry()
+    {
+        // Leaked, since the rings of other threads may be destroyed after the static objects.
+        static auto* r = new Registry();
+        return *r;
+    }
+
+    struct IoUringCounters
+    {
+        // Their ratio is the number of requests batched into each submission.
+        OpStats::Counter submissions{"io_uring_submissions"};
+        OpStats::Counter requests{"io_uring_requests"};
+    };
+
+    const IoUringCounters& counters()
+    {
+        static const IoUringCounters c;
+        return c;
+    }
+
+    template <class T>
+    T* at_offset(void* base, unsigned offset)
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+}    // namespace
+
+bool IoUring::is_supported()
+{
+    static const bool supported = []()
+    {
+        io_uring_params params{};
+        int fd = sys_io_uring_setup(4, &params);
+        if (fd < 0)
+        {
+            VERBOSE_LOG("io_uring is unavailable: %s", OSService::stringify_system_error(errno));
+            return false;
+        }
+        DEFER(::close(fd));
+        // `io_uring_probe` ends with a flexible array of operations.
+        constexpr unsigned kMaxOps = 256;
+        std::vector<io_uring_probe_op> storage(
+            kMaxOps + sizeof(io_uring_probe) / sizeof(io_uring_probe_op) + 1);
+        auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, kMaxOps) < 0)
+        {
+            VERBOSE_LOG("io_uring is too old to probe: %s",
+                        OSService::stringify_system_error(errno));
+            return false;
+        }
+        for (unsigned op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC})
+        {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            {
+                VERBOSE_LOG("io_uring does not support operation %u", op);
+                return false;
+            }
+        }
+        return true;
+    }();
+    return supported;
+}
+
+IoUring* IoUring::of_this_thread()
+{
+    thread_local std::unique_ptr<IoUring> ring;
+    thread_local bool failed = false;
+    if (ring && ring->retired_)
+    {
+        WARN_LOG("Falling back to synchronous I/O on this thread after an io_uring failure");
+        ring.reset();
+        failed = true;
+    }
+    if (!ring && !failed && is_supported())
+    {
+        try
+        {
+            ring.reset(new IoUring());
+        }
+        catch (const std::exception& e)
+        {
+            failed = true;
+            WARN_LOG("Falling back to synchronous I/O on this thread: %s", e.what());
+        }
+    }
+    return ring.get();
+}
+
+void IoUring::forget_file(uint64_t file_id)
+{
+    auto& r = registry();
+    LockGuard<Mutex> lg(r.mu);
+    for (IoUring* ring : r.rings)
+    {
+        ring->drop_fixed_file(file_id);
+    }
+}
+
+IoUring::IoUring()
+{
+    try
+    {
+        io_uring_params params{};
+        ring_fd_ = sys_io_uring_setup(kEntries, &params);
+        if (ring_fd_ < 0)
+        {
+            THROW_POSIX_EXCEPTION(errno, "io_uring_setup");
+        }
+        auto map = [this](size_t size, off_t offset)
+        {
+            void* p = ::mmap(
+                nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+            if (p == MAP_FAILED)
+            {
+                THROW_POSIX_EXCEPTION(errno, "mmap of io_uring");
+            }
+            return p;
+        };
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+        {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = map(sqes_size_, IORING_OFF_SQES);
+        sq_entries_ = params.sq_entries;
+        sq_tail_ = at_offset<unsigned>(sq_ring_, params.sq_off.tail);
+        sq_mask_ = at_offset<unsigned>(sq_ring_, params.sq_off.ring_mask);
+        sq_array_ = at_offset<unsigned>(sq_ring_, params.sq_off.array);
+        cq_head_ = at_offset<unsigned>(cq_ring_, params.cq_off.head);
+        cq_tail_ = at_offset<unsigned>(cq_ring_, params.cq_off.tail);
+        cq_mask_ = at_offset<unsigned>(cq_ring_, params.cq_off.ring_mask);
+        cqes_ = at_offset<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+        // An optimization, which the limit on locked memory may deny.
+        std::vector<int> fds(kFixedFiles, -1);
+        has_fixed_files_
+            = sys_io_uring_register(ring_fd_, IORING_REGISTER_FILES, fds.data(), kFixedFiles) == 0;
+        {
+            LockGuard<Mutex> lg(files_mu_);
+            slot_owners_.assign(kFixedFiles, 0);
+        }
+
+        auto& r = registry();
+        LockGuard<Mutex> lg(r.mu);
+        r.rings.push_back(this);
+    }
+    catch (...)
+    {
+        release_resources();
+        throw;
+    }
+}
+
+IoUring::~IoUring()
+{
+    {
+        auto& r = registry();
+        LockGuard<Mutex> lg(r.mu);
+        r.rings.erase(std::find(r.rings.begin(), r.rings.end(), this));
+    }
+    release_resources();
+}
+
+void IoUring::release_resources() noexcept
+{
+    if (sqes_)
+    {
+        ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+    {
+        ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_)
+    {
+        ::munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_fd_ >= 0)
+    {
+        // Also drops the registered files and buffers.
+        ::close(ring_fd_);
+    }
+}
+
+void IoUring::drop_fixed_file(uint64_t file_id)
+{
+    LockGuard<Mutex> lg(files_mu_);
+    auto it = fixed_slots_.find(file_id);
+    if (it == fixed_slots_.end())
+    {
+        return;
+    }
+    unsigned slot = it->second;
+    fixed_slots_.erase(it);
+    slot_owners_[slot] = 0;
+    int fd = -1;
+    io_uring_files_update update{};
+    update.offset = slot;
+    update.fds = reinterpret_cast<uintptr_t>(&fd);
+    (void)sys_io_uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
+
+int IoUring::fixed_slot(const Request& request, const std::bitset<kFixedFiles>& pinned)
+{
+    if (!has_fixed_files_ || request.file_id == 0)
+    {
+        return -1;
+    }
+    LockGuard<Mutex> lg(files_mu_);
+    auto it = fixed_slots_.find(request.file_id);
+    if (it != fixed_slots_.end())
+    {
+        return static_cast<int>(it->second);
+    }
+    // The slots taken by the requests about to be submitted must stay as they are.
+    for (unsigned tries = 0; tries < kFixedFiles; ++tries)
+    {
+        unsigned slot = next_slot_++ % kFixedFiles;
+        if (pinned.test(slot))
+        {
+            continue;
+        }
+        if (slot_owners_[slot] != 0)
+        {
+            fixed_slots_.erase(slot_owners_[slot]);
+            slot_owners_[slot] = 0;
+        }
+        int fd = request.fd;
+        io_uring_files_update update{};
+        update.offset = slot;
+        update.fds = reinterpret_cast<uintptr_t>(&fd);
+        if (sys_io_uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1)
+        {
+            return -1;
+        }
+        slot_owners_[slot] = request.file_id;
+        fixed_slots_.emplace(request.file_id, slot);
+        return static_cast<int>(slot);
+    }
+    return -1;
+}
+
+void IoUring::run(absl::Span<Request> requests)
+{
+    LockGuard<Mutex> lg(mu_);
+    while (!requests.empty())
+    {
+        auto chunk = requests.subspan(0, sq_entries_);
+        submit_and_wait(chunk);
+        requests.remove_prefix(chunk.size());
+    }
+}
+
+void IoUring::submit_and_wait(absl::Span<Request> requests)
+{
+    std::bitset<kFixedFiles> pinned;
+    unsigned tail = *sq_tail_;
+    for (size_t i = 0; i < requests.size(); ++i)
+    {
+        const auto& r = requests[i];
+        unsigned index = tail & *sq_mask_;
+        auto* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = i;
+        int slot = fixed_slot(r, pinned);
+        if (slot >= 0)
+        {
+            pinned.set(slot);
+            sqe->fd = slot;
+            sqe->flags = IOSQE_FIXED_FILE;
+        }
+        else
+        {
+            sqe->fd = r.fd;
+        }
+        if (r.op == Request::Op::kFsync)
+        {
+            sqe->opcode = IORING_OP_FSYNC;
+        }
+        else
+        {
+            sqe->opcode = r.op == Request::Op::kRead ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->off = r.offset;
+            sqe->addr = reinterpret_cast<uintptr_t>(r.buffer);
+            sqe->len = r.length;
+        }
+        sq_array_[index] = index;
+        ++tail;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    // Once submitted, a request writes into its buffer until it completes, so all the submitted
+    // ones are waited for even after an error, before the caller may free their buffers.
+    int error = 0;
+    size_t submitted = 0;
+    while (submitted < requests.size())
+    {
+        auto to_submit = static_cast<unsigned>(requests.size() - submitted);
+        int rc = sys_io_uring_enter(ring_fd_, to_submit, to_submit, IORING_ENTER_GETEVENTS);
+        if (rc < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                continue;
+            }
+            error = errno;
+            break;
+        }
+        submitted += static_cast<size_t>(rc);
+    }
+    counters().submissions.add(1);
+    counters().requests.add(static_cast<int64_t>(submitted));
+
+    size_t completed = 0;
+    unsigned head = *cq_head_;
+    while (completed < submitted)
+    {
+        unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        if (head == cq_tail)
+        {
+            if (sys_io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            {
+                // The completions still arrive, as any return from the kernel runs the work that
+                // posts them.
+                error = error ? error : errno;
+                sched_yield();
+            }
+            continue;
+        }
+        for (; head != cq_tail; ++head)
+        {
+            const auto& cqe = static_cast<io_uring_cqe*>(cqes_)[head & *cq_mask_];
+            requests[cqe.user_data].result = cqe.res;
+            ++completed;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    if (error)
+    {
+        // The requests that were never submitted are still in the queue, and would go out with
+        // the next batch, so the ring is not used again.
+        retired_ = true;
+        THROW_POSIX_EXCEPTION(error, "io_uring_enter");
+    }
+}
+#endif
+}    // namespace securefs
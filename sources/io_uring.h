@@ -0,0 +1,108 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/types/span.h>
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace securefs
+{
+/// Makes the files opened afterwards do their I/O through io_uring instead of the synchronous
+/// system calls. Returns whether io_uring is in use afterwards, which is false when the kernel
+/// does not support it (or forbids it, as container runtimes often do).
+bool set_io_uring_enabled(bool value);
+bool is_io_uring_enabled();
+
+#ifdef __linux__
+/// An io_uring(7) instance, driven through the raw system calls. Each thread that does I/O owns
+/// one, created on first use, with a table of registered ("fixed") files that spares the kernel
+/// from looking up the file descriptor on every request.
+class IoUring
+{
+public:
+    struct Request
+    {
+        enum class Op : uint8_t
+        {
+            kRead,
+            kWrite,
+            kFsync,
+        };
+
+        Op op;
+        int fd;
+        // Identifies the open file across the reuse of its descriptor, for the fixed file table.
+        uint64_t file_id;
+        void* buffer;
+        uint64_t offset;
+        uint32_t length;
+        // The number of bytes transferred, or a negative errno.
+        int64_t result;
+    };
+
+    /// Whether the kernel supports all the operations used here. Probed once.
+    static bool is_supported();
+
+    /// The ring of the calling thread, or null when it cannot be set up.
+    static IoUring* of_this_thread();
+
+    /// Drops the file from the fixed file tables of all threads, which would otherwise keep it
+    /// open (and keep its locks held). Must be called before its descriptor is closed. Does not
+    /// wait for the I/O in flight on the rings, as the kernel keeps its own reference to the file
+    /// of each submitted request.
+    static void forget_file(uint64_t file_id);
+
+    /// Submits all the requests at once and waits for all of them to complete. When the kernel
+    /// refuses a submission, the requests already submitted are still waited for before throwing,
+    /// and the thread stops using the ring.
+    void run(absl::Span<Request> requests);
+
+    ~IoUring();
+    DISABLE_COPY_MOVE(IoUring)
+
+private:
+    static constexpr unsigned kEntries = 64;
+    static constexpr unsigned kFixedFiles = 64;
+
+    // Held across each submission and the wait for its completions.
+    Mutex mu_;
+    // Guards the fixed file table only, so that other threads can drop their files from it without
+    // waiting for the I/O in flight on this ring.
+    Mutex files_mu_;
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    void* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned sq_entries_ = 0;
+    // Inside the shared rings.
+    unsigned *sq_tail_ = nullptr, *sq_mask_ = nullptr, *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr, *cq_mask_ = nullptr;
+    void* cqes_ = nullptr;
+    bool has_fixed_files_ = false;
+    // Set after a failed submission, after which the thread falls back to the usual system calls.
+    // Only touched by the owning thread.
+    bool retired_ = false;
+    absl::flat_hash_map<uint64_t, unsigned> fixed_slots_ ABSL_GUARDED_BY(files_mu_);
+    std::vector<uint64_t> slot_owners_ ABSL_GUARDED_BY(files_mu_);
+    unsigned next_slot_ ABSL_GUARDED_BY(files_mu_) = 0;
+
+private:
+    IoUring();
+    void release_resources() noexcept;
+    int fixed_slot(const Request& request, const std::bitset<kFixedFiles>& pinned)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) ABSL_LOCKS_EXCLUDED(files_mu_);
+    void drop_fixed_file(uint64_t file_id) ABSL_LOCKS_EXCLUDED(files_mu_);
+    void submit_and_wait(absl::Span<Request> requests) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+};
+#endif
+}    // namespace securefs
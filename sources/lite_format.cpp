@@ -7,10 +7,14 @@
 #include "logger.h"
 #include "mystring.h"
 #include "myutils.h"
+#include "op_stats.h"
 #include "platform.h"
+#include "stat_workaround.h"
 #include "tags.h"
+#include "tunables.h"
 
 #include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/container/inlined_vector.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
@@ -67,6 +71,32 @@ unsigned StreamOpener::compute_padding(const std::array<unsigned char, 16>& id)
         max_padding_size_, padding_ecb.get(), id.data(), id.size());
 }
 
+length_type StreamOpener::compute_virtual_size(length_type physical_size,
+                                               unsigned padding) const noexcept
+{
+    if (physical_size <= lite::AESGCMCryptStream::get_id_size() + padding)
+    {
+        return 0;
+    }
+    return lite::AESGCMCryptStream::calculate_real_size(
+        physical_size - padding, block_size_, iv_size_);
+}
+
+unsigned StreamOpener::read_padding(StreamBase& stream)
+{
+    std::array<unsigned char, lite::AESGCMCryptStream::get_id_size()> id;
+    auto rc = stream.read(id.data(), 0, id.size());
+    if (rc == 0)
+    {
+        return 0;
+    }
+    if (rc != id.size())
+    {
+        throwInvalidArgumentException("Underlying stream has invalid ID size");
+    }
+    return compute_padding(id);
+}
+
 void StreamOpener::validate()
 {
     warn_if_key_not_random(content_master_key_, __FILE__, __LINE__);
@@ -76,6 +106,200 @@ void StreamOpener::validate()
     }
 }
 
+const std::atomic<uint64_t>& PaddingCache::max_entries_
+    = Tunables::global().define("padding_cache_max_entries", kMaxEntries, 1, 1 << 24);
+
+length_type PaddingCache::compute_virtual_size(const std::string& abs_path, const fuse_stat& st)
+{
+    if (opener_.can_compute_virtual_size())
+    {
+        return opener_.compute_virtual_size(st.st_size);
+    }
+    static const OpStats::Counter hits("padding_cache_hits"), misses("padding_cache_misses");
+    auto mtime = get_mtim(st);
+    {
+        LockGuard<Mutex> lg(mu_);
+        auto it = entries_.find(abs_path);
+        if (it != entries_.end() && it->second.physical_size == st.st_size
+            && it->second.mtime.tv_sec == mtime.tv_sec
+            && it->second.mtime.tv_nsec == mtime.tv_nsec)
+        {
+            hits.add(1);
+            return opener_.compute_virtual_size(st.st_size, it->second.padding);
+        }
+    }
+    misses.add(1);
+    unsigned padding
+        = opener_.read_padding(*OSService::get_default().open_file_stream(abs_path, O_RDONLY, 0));
+    {
+        LockGuard<Mutex> lg(mu_);
+        if (entries_.size() >= max_entries_.load(std::memory_order_relaxed))
+        {
+            entries_.clear();
+        }
+        entries_.insert_or_assign(
+            abs_path, Entry{mtime, static_cast<length_type>(st.st_size), padding});
+    }
+    return opener_.compute_virtual_size(st.st_size, padding);
+}
+
+void PaddingCache::invalidate(const std::string& abs_path)
+{
+    LockGuard<Mutex> lg(mu_);
+    entries_.erase(abs_path);
+}
+
+OpenFileCounter::Key OpenFileCounter::identify(FileStream& stream)
+{
+    fuse_stat st{};
+    stream.fstat(&st);
+    return {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino)};
+}
+
+void OpenFileCounter::add(const Key& key)
+{
+    auto not_rewriting = [this, &key]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+    { return !rewriting_.contains(key); };
+    mu_.LockWhen(absl::Condition(&not_rewriting));
+    ++counts_[key];
+    mu_.Unlock();
+}
+
+void OpenFileCounter::remove(const Key& key)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto it = counts_.find(key);
+    if (it != counts_.end() && --it->second == 0)
+    {
+        counts_.erase(it);
+    }
+}
+
+bool OpenFileCounter::run_if_only_open(const Key& key, absl::FunctionRef<void()> func)
+{
+    {
+        LockGuard<Mutex> lg(mu_);
+        auto it = counts_.find(key);
+        if (it == counts_.end() || it->second != 1 || !rewriting_.insert(key).second)
+        {
+            return false;
+        }
+    }
+    DEFER({
+        LockGuard<Mutex> lg(mu_);
+        rewriting_.erase(key);
+    });
+    func();
+    return true;
+}
+
+File::File(std::shared_ptr<securefs::FileStream> file_stream,
+           StreamOpener& opener,
+           OpenFileCounter& open_files)
+    : m_file_stream(std::move(file_stream))
+    , m_opener(opener)
+    , m_open_files(open_files)
+    , m_identity(OpenFileCounter::identify(*m_file_stream))
+{
+    // Counted before the header is read, so that no copy replaces it in between.
+    m_open_files.add(m_identity);
+    try
+    {
+        LockGuard<FileStream> lock_guard(*m_file_stream, true);
+        m_crypt_stream = opener.open(m_file_stream);
+    }
+    catch (...)
+    {
+        m_open_files.remove(m_identity);
+        throw;
+    }
+}
+
+File::~File() { m_open_files.remove(m_identity); }
+
+bool File::share_header_with(File& source)
+{
+    auto header_size = source.m_crypt_stream->get_header_size();
+    std::vector<byte> header(header_size), own_header(header_size);
+    if (source.m_file_stream->read(header.data(), 0, header_size) != header_size)
+    {
+        return false;
+    }
+    if (m_crypt_stream->get_header_size() == header_size
+        && m_file_stream->read(own_header.data(), 0, header_size) == header_size
+        && own_header == header)
+    {
+        return true;
+    }
+    if (size() > 0)
+    {
+        return false;
+    }
+    return m_open_files.run_if_only_open(m_identity,
+                                         [&]() ABSL_NO_THREAD_SAFETY_ANALYSIS
+                                         {
+                                             m_file_stream->resize(0);
+                                             m_file_stream->write(header.data(), 0, header_size);
+                                             m_crypt_stream = m_opener.open(m_file_stream);
+                                         });
+}
+
+length_type File::copy_range_from(File& source,
+                                  offset_type source_offset,
+                                  offset_type offset,
+                                  length_type length)
+{
+    auto source_size = source.size();
+    if (source_offset >= source_size)
+    {
+        return 0;
+    }
+    length = std::min(length, source_size - source_offset);
+    auto end = offset + length;
+    auto block_size = m_crypt_stream->get_block_size();
+    auto start_block = (offset + block_size - 1) / block_size;
+    // The partial last block of the source may only become the last block of this file.
+    auto end_block = end == source_size && end >= size() ? (end + block_size - 1) / block_size
+                                                         : end / block_size;
+    if (&source == this || source_offset != offset || start_block >= end_block
+        || !share_header_with(source))
+    {
+        return m_crypt_stream->copy_range_from(
+            *source.m_crypt_stream, source_offset, offset, length);
+    }
+
+    if (size() < start_block * block_size)
+    {
+        m_crypt_stream->resize(start_block * block_size);
+    }
+    auto header_size = m_crypt_stream->get_header_size();
+    auto underlying_block_size = m_crypt_stream->get_underlying_block_size();
+    auto clone_start = header_size + start_block * underlying_block_size;
+    auto clone_length = std::min(header_size + end_block * underlying_block_size,
+                                 source.m_file_stream->size())
+        - clone_start;
+    if (m_file_stream->copy_range_from(
+            *source.m_file_stream, clone_start, clone_start, clone_length)
+        != clone_length)
+    {
+        throwVFSException(EIO);
+    }
+    static const OpStats::Counter cloned_blocks("lite_blocks_copied_without_reencryption");
+    cloned_blocks.add(static_cast<int64_t>(end_block - start_block));
+
+    // Only the partial blocks at either end of the range are reencrypted.
+    m_crypt_stream->copy_range_from(
+        *source.m_crypt_stream, offset, offset, start_block * block_size - offset);
+    if (end > end_block * block_size)
+    {
+        m_crypt_stream->copy_range_from(*source.m_crypt_stream,
+                                        end_block * block_size,
+                                        end_block * block_size,
+                                        end - end_block * block_size);
+    }
+    return length;
+}
+
 std::vector<byte> XattrCryptor::encrypt(const char* value, size_t size)
 {
     std::vector<byte> result(infer_encrypted_size(size));
@@ -611,17 +835,13 @@ namespace
     public:
         DirectoryImpl(std::string dir_abs_path,
                       NameTranslator& name_trans,
-                      StreamOpener& opener,
+                      PaddingCache& padding_cache,
                       bool readdir_plus)
             : dir_abs_path_(std::move(dir_abs_path))
             , name_trans_(name_trans)
-            , opener_(opener)
+            , padding_cache_(padding_cache)
             , readdir_plus_(readdir_plus)
         {
-            if (readdir_plus && !opener_.can_compute_virtual_size())
-            {
-                throw_runtime_error("Readdir plus should only be used without padding");
-            }
             under_traverser_ = OSService::get_default().create_traverser(dir_abs_path_);
         }
 
@@ -649,13 +869,10 @@ namespace
                         name->swap(under_name);
                     return true;
                 }
-                if (stbuf && readdir_plus_ && (stbuf->st_mode & S_IFMT) == S_IFREG)
-                {
-                    stbuf->st_size = opener_.compute_virtual_size(stbuf->st_size);
-                }
                 if (name_trans_.is_no_op())
                 {
                     // Plain text name mode
+                    adjust_size(under_name, stbuf);
                     name->swap(under_name);
                     return true;
                 }
@@ -687,12 +904,98 @@ namespace
                              e.what());
                     continue;
                 }
+                adjust_size(under_name, stbuf);
                 return true;
             }
         }
         void rewind() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { under_traverser_->rewind(); }
 
+        void validate() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+        {
+            if (name_trans_.is_no_op())
+            {
+                return;
+            }
+            auto traverser = OSService::get_default().create_traverser(dir_abs_path_);
+            absl::flat_hash_set<std::string> long_names;
+            std::string under_name;
+            while (traverser->next(&under_name, nullptr))
+            {
+                if (under_name.empty() || under_name[0] == '.')
+                    continue;
+                auto decoded = name_trans_.decrypt_path_component(under_name);
+                if (std::holds_alternative<InvalidNameTag>(decoded))
+                {
+                    throw_runtime_error(
+                        absl::StrCat("Name ", under_name, " fails to decrypt or authenticate"));
+                }
+                if (!std::holds_alternative<LongNameTag>(decoded))
+                    continue;
+                auto&& table = lazy_get_table();
+                std::string encrypted_name;
+                {
+                    LockGuard<LongNameLookupTable> lg(table);
+                    encrypted_name = table.lookup(under_name);
+                }
+                if (encrypted_name.empty())
+                {
+                    throw_runtime_error(
+                        absl::StrCat("Long name ", under_name, " is missing from the table"));
+                }
+                if (!std::holds_alternative<std::string>(
+                        name_trans_.decrypt_path_component(encrypted_name)))
+                {
+                    throw_runtime_error(absl::StrCat(
+                        "Long name ", under_name, " fails to decrypt or authenticate"));
+                }
+                long_names.insert(under_name);
+            }
+
+            fuse_stat st;
+            if (!OSService::get_default().stat(
+                    OSService::concat_and_norm_narrowed(dir_abs_path_, kLongNameTableFileName),
+                    &st))
+            {
+                return;
+            }
+            auto&& table = lazy_get_table();
+            std::vector<std::string> hashes;
+            {
+                LockGuard<LongNameLookupTable> lg(table);
+                hashes = table.list_hashes();
+            }
+            for (const auto& hash : hashes)
+            {
+                if (!long_names.contains(hash))
+                {
+                    throw_runtime_error(
+                        absl::StrCat("The long name table has a stale mapping for ", hash));
+                }
+            }
+        }
+
     private:
+        void adjust_size(const std::string& under_name, fuse_stat* stbuf)
+        {
+            if (!stbuf || !readdir_plus_ || (stbuf->st_mode & S_IFMT) != S_IFREG
+                || stbuf->st_size <= 0)
+            {
+                return;
+            }
+            try
+            {
+                stbuf->st_size = padding_cache_.compute_virtual_size(
+                    OSService::concat_and_norm_narrowed(dir_abs_path_, under_name), *stbuf);
+            }
+            catch (const std::exception& e)
+            {
+                WARN_LOG("Failed to compute the size of %s/%s: %s",
+                         dir_abs_path_,
+                         under_name,
+                         e.what());
+            }
+        }
+
         LongNameLookupTable& lazy_get_table() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
         {
             if (long_table_.has_value())
@@ -709,7 +1012,7 @@ namespace
         std::string dir_abs_path_;
         std::unique_ptr<DirectoryTraverser> under_traverser_ ABSL_GUARDED_BY(*this);
         NameTranslator& name_trans_;
-        StreamOpener& opener_;
+        PaddingCache& padding_cache_;
         bool readdir_plus_;
     };
 
@@ -743,7 +1046,7 @@ void FuseHighLevelOps::initialize(fuse_conn_info* info)
 {
     (void)info;
 #ifdef FSP_FUSE_CAP_READDIR_PLUS
-    if (opener_.can_compute_virtual_size() && (info->capable & FSP_FUSE_CAP_READDIR_PLUS))
+    if (info->capable & FSP_FUSE_CAP_READDIR_PLUS)
     {
         info->want |= FSP_FUSE_CAP_READDIR_PLUS;
         read_dir_plus_ = true;
@@ -759,7 +1062,16 @@ int FuseHighLevelOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_co
 }
 int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* buf, const fuse_context* ctx)
 {
-    auto enc_path = name_trans_.encrypt_full_path(path, nullptr);
+    return vgetattr_resolved(name_trans_.encrypt_full_path(path, nullptr), buf, ctx);
+}
+std::optional<std::string> FuseHighLevelOps::vresolve(const char* path)
+{
+    return name_trans_.encrypt_full_path(path, nullptr);
+}
+int FuseHighLevelOps::vgetattr_resolved(const std::string& enc_path,
+                                        fuse_stat* buf,
+                                        const fuse_context* ctx)
+{
     if (!root_.stat(enc_path, buf))
         return -ENOENT;
     if (buf->st_size <= 0)
@@ -796,24 +1108,17 @@ int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* buf, const fuse_cont
     case S_IFREG:
         if (buf->st_size > 0)
         {
-            if (opener_.can_compute_virtual_size())
+            try
             {
-                buf->st_size = opener_.compute_virtual_size(buf->st_size);
+                buf->st_size
+                    = padding_cache_.compute_virtual_size(root_.norm_path_narrowed(enc_path), *buf);
             }
-            else
+            catch (const std::exception& e)
             {
-                try
-                {
-                    auto virtual_file = opener_.open(root_.open_file_stream(enc_path, O_RDONLY, 0));
-                    buf->st_size = virtual_file->size();
-                }
-                catch (const std::exception& e)
-                {
-                    ERROR_LOG("Encountered exception %s when opening file %s for read: %s",
-                              get_type_name(e).get(),
-                              path,
-                              e.what());
-                }
+                ERROR_LOG("Encountered exception %s when opening file %s for read: %s",
+                          get_type_name(e).get(),
+                          enc_path,
+                          e.what());
             }
         }
         break;
@@ -837,7 +1142,7 @@ int FuseHighLevelOps::vopendir(const char* path, fuse_file_info* info, const fus
     auto dir = std::make_unique<DirectoryImpl>(
         root_.norm_path_narrowed(name_trans_.encrypt_full_path(path, nullptr)),
         name_trans_,
-        opener_,
+        padding_cache_,
         read_dir_plus_);
     info->fh = reinterpret_cast<uintptr_t>(dir.release());
     return 0;
@@ -885,6 +1190,20 @@ int FuseHighLevelOps::vopen(const char* path, fuse_file_info* info, const fuse_c
     info->fh = reinterpret_cast<uintptr_t>(open(path, info->flags, 0).release());
     return 0;
 }
+int FuseHighLevelOps::vopen_resolved(const std::string& enc_path,
+                                     fuse_file_info* info,
+                                     const fuse_context* ctx)
+{
+    // The kernel never passes O_CREAT to open, so there is no long name to record.
+    auto fp = open_encrypted(enc_path, info->flags & ~O_CREAT, 0);
+    if (info->flags & O_TRUNC)
+    {
+        LockGuard<File> lock_guard(*fp, true);
+        fp->resize(0);
+    }
+    info->fh = reinterpret_cast<uintptr_t>(fp.release());
+    return 0;
+}
 int FuseHighLevelOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
     delete get_base(info);
@@ -934,7 +1253,11 @@ int FuseHighLevelOps::vunlink(const char* path, const fuse_context* ctx)
 {
     process_possible_long_name(path,
                                LongNameComponentAction::kDelete,
-                               [&](std::string&& enc_path) { root_.remove_file(enc_path); });
+                               [&](std::string&& enc_path)
+                               {
+                                   root_.remove_file(enc_path);
+                                   padding_cache_.invalidate(root_.norm_path_narrowed(enc_path));
+                               });
     return 0;
 };
 int FuseHighLevelOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx)
@@ -1014,6 +1337,8 @@ int FuseHighLevelOps::vrename(const char* from, const char* to, const fuse_conte
     {
         // Neither are long name, so fast path.
         root_.rename(enc_from, enc_to);
+        padding_cache_.invalidate(root_.norm_path_narrowed(enc_from));
+        padding_cache_.invalidate(root_.norm_path_narrowed(enc_to));
         return 0;
     }
 
@@ -1031,6 +1356,8 @@ int FuseHighLevelOps::vrename(const char* from, const char* to, const fuse_conte
                                       encrypted_last_component_to);
     }
     root_.rename(enc_from, enc_to);
+    padding_cache_.invalidate(root_.norm_path_narrowed(enc_from));
+    padding_cache_.invalidate(root_.norm_path_narrowed(enc_to));
     return 0;
 }
 int FuseHighLevelOps::vfsync(const char* path,
@@ -1140,32 +1467,104 @@ int FuseHighLevelOps::vremovexattr(const char* path, const char* name, const fus
     }
     return root_.removexattr(name_trans_.encrypt_full_path(path, nullptr).c_str(), name);
 }
-std::unique_ptr<File> FuseHighLevelOps::open(std::string_view path, int flags, unsigned mode)
+int FuseHighLevelOps::vfallocate(const char* path,
+                                 int mode,
+                                 fuse_off_t offset,
+                                 fuse_off_t length,
+                                 fuse_file_info* info,
+                                 const fuse_context* ctx)
 {
-    if (flags & O_APPEND)
+    if (offset < 0 || length <= 0)
     {
-        flags &= ~((unsigned)O_APPEND);
-        // Clear append flags. Workaround for FUSE bug.
-        // See https://github.com/netheril96/securefs/issues/58.
+        return -EINVAL;
+    }
+    auto fp = get_file_checked(info);
+    LockGuard<File> lg(*fp);
+    switch (mode)
+    {
+    case 0:
+    case kFallocKeepSize:
+        fp->preallocate(offset, length, mode == kFallocKeepSize);
+        return 0;
+    case kFallocPunchHole | kFallocKeepSize:
+        fp->punch_hole(offset, length);
+        return 0;
+    default:
+        return -EOPNOTSUPP;
     }
+}
+int FuseHighLevelOps::vlseek(const char* path,
+                             fuse_off_t offset,
+                             int whence,
+                             fuse_off_t* result,
+                             fuse_file_info* info,
+                             const fuse_context* ctx)
+{
+    if (whence != kSeekData && whence != kSeekHole)
+    {
+        return -EINVAL;
+    }
+    auto fp = get_file_checked(info);
+    LockGuard<File> lg(*fp);
+    // As with lseek(), there is neither data nor a hole at or past the end.
+    auto size = fp->size();
+    if (offset < 0 || static_cast<length_type>(offset) >= size)
+    {
+        return -ENXIO;
+    }
+    auto found = whence == kSeekData ? fp->next_data(offset) : fp->next_hole(offset);
+    if (found >= size && whence == kSeekData)
+    {
+        return -ENXIO;
+    }
+    *result = static_cast<fuse_off_t>(std::min(found, size));
+    return 0;
+}
 
-    // Files cannot be opened write-only because the header must be read in order to derive the
-    // session key
-    if ((flags & O_ACCMODE) == O_WRONLY)
+int FuseHighLevelOps::vcopy_file_range(const char* path_in,
+                                       fuse_file_info* info_in,
+                                       fuse_off_t offset_in,
+                                       const char* path_out,
+                                       fuse_file_info* info_out,
+                                       fuse_off_t offset_out,
+                                       size_t size,
+                                       int flags,
+                                       const fuse_context* ctx)
+{
+    if (flags != 0 || offset_in < 0 || offset_out < 0)
     {
-        flags = (flags & ~O_ACCMODE) | O_RDWR;
+        return -EINVAL;
     }
-    if ((flags & O_CREAT))
+    auto out = get_file_checked(info_out);
+    auto in = get_file_checked(info_in);
+    // Two handles on one underlying file would contend for its file lock, so the copy goes
+    // through one of them, and overlapping ranges are refused as by copy_file_range().
+    if (in->identity() == out->identity())
     {
-        mode |= S_IRUSR;
+        if (offset_in < offset_out + static_cast<fuse_off_t>(size)
+            && offset_out < offset_in + static_cast<fuse_off_t>(size))
+        {
+            return -EINVAL;
+        }
+        in = out;
     }
+    DoubleFileLockGuard lg(*out, *in);
+    return static_cast<int>(out->copy_range_from(*in, offset_in, offset_out, size));
+}
+void FuseHighLevelOps::validate_directory(fuse_file_info* info)
+{
+    auto dir = get_dir_checked(info);
+    LockGuard<Directory> lg(*dir);
+    dir->validate();
+}
+std::unique_ptr<File> FuseHighLevelOps::open(std::string_view path, int flags, unsigned mode)
+{
     std::unique_ptr<File> fp;
 
     process_possible_long_name(
         path,
         (flags & O_CREAT) ? LongNameComponentAction::kCreate : LongNameComponentAction::kIgnore,
-        [&](std::string&& enc_path)
-        { fp = std::make_unique<File>(root_.open_file_stream(enc_path, flags, mode), opener_); });
+        [&](std::string&& enc_path) { fp = open_encrypted(enc_path, flags, mode); });
 
     if (flags & O_TRUNC)
     {
@@ -1174,6 +1573,29 @@ std::unique_ptr<File> FuseHighLevelOps::open(std::string_view path, int flags, u
     }
     return fp;
 }
+std::unique_ptr<File>
+FuseHighLevelOps::open_encrypted(const std::string& enc_path, int flags, unsigned mode)
+{
+    if (flags & O_APPEND)
+    {
+        flags &= ~((unsigned)O_APPEND);
+        // Clear append flags. Workaround for FUSE bug.
+        // See https://github.com/netheril96/securefs/issues/58.
+    }
+
+    // Files cannot be opened write-only because the header must be read in order to derive the
+    // session key
+    if ((flags & O_ACCMODE) == O_WRONLY)
+    {
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    if ((flags & O_CREAT))
+    {
+        mode |= S_IRUSR;
+    }
+    return std::make_unique<File>(
+        root_.open_data_file_stream(enc_path, flags, mode), opener_, open_files_);
+}
 std::string FuseHighLevelOps::long_name_table_file_name(absl::string_view enc_path)
 {
     return root_.norm_path_narrowed(
@@ -9,9 +9,13 @@
 #include "tags.h"
 #include "thread_local.h"
 
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/functional/function_ref.h>
 #include <absl/strings/string_view.h>
 #include <array>
+#include <atomic>
 #include <cryptopp/aes.h>
 #include <cryptopp/gcm.h>
 #include <cryptopp/modes.h>
@@ -21,7 +25,10 @@
 #include <fruit/macro.h>
 
 #include <memory>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -66,6 +73,12 @@ public:
 
     bool can_compute_virtual_size() const noexcept { return max_padding_size_ <= 0; }
 
+    // Computes the virtual size when the padding of the file is already known.
+    length_type compute_virtual_size(length_type physical_size, unsigned padding) const noexcept;
+
+    // Reads the file id from the header of `stream` and derives its padding size from it.
+    unsigned read_padding(StreamBase& stream);
+
     void compute_session_key(const std::array<unsigned char, 16>& id,
                              std::array<unsigned char, 16>& outkey) override;
     unsigned compute_padding(const std::array<unsigned char, 16>& id) override;
@@ -81,6 +94,62 @@ private:
     ThreadLocal<AES_ECB> content_ecb, padding_ecb;
 };
 
+// Remembers the padding sizes of files in a padded repository, so that their virtual sizes can be
+// computed from the underlying `stat` alone, without opening each file and decrypting its header.
+// Entries are keyed by the absolute underlying path and validated by mtime and physical size.
+class PaddingCache
+{
+public:
+    INJECT(PaddingCache(StreamOpener& opener)) : opener_(opener) {}
+
+    // `st` must be the result of `stat` on the regular file at `abs_path`.
+    length_type compute_virtual_size(const std::string& abs_path, const fuse_stat& st);
+    void invalidate(const std::string& abs_path);
+
+    // The default of the `padding_cache_max_entries` tunable.
+    static constexpr size_t kMaxEntries = 1 << 16;
+    static const std::atomic<uint64_t>& max_entries_;
+
+private:
+    struct Entry
+    {
+        fuse_timespec mtime;
+        length_type physical_size;
+        unsigned padding;
+    };
+
+    StreamOpener& opener_;
+    Mutex mu_;
+    absl::flat_hash_map<std::string, Entry> entries_ ABSL_GUARDED_BY(mu_);
+};
+
+// Counts the `File` objects open on each underlying file, which only know about the others here.
+class OpenFileCounter
+{
+public:
+    using Key = std::pair<uint64_t, uint64_t>;
+
+    // Identifies the underlying file by its device and inode numbers.
+    static Key identify(FileStream& stream);
+
+    OpenFileCounter() = default;
+    DISABLE_COPY_MOVE(OpenFileCounter)
+
+    void add(const Key& key);
+    void remove(const Key& key);
+
+    // Runs `func` and returns true if exactly one `File` is open on `key`, with no other one
+    // opening in the meantime. `func` runs without the lock, so that the opening and closing of
+    // other files do not wait for its I/O; only the files opening on `key` do.
+    bool run_if_only_open(const Key& key, absl::FunctionRef<void()> func);
+
+private:
+    Mutex mu_;
+    absl::flat_hash_map<Key, unsigned> counts_ ABSL_GUARDED_BY(mu_);
+    // The keys whose only `File` is inside `run_if_only_open`.
+    absl::flat_hash_set<Key> rewriting_ ABSL_GUARDED_BY(mu_);
+};
+
 class File;
 class Directory;
 
@@ -107,6 +176,10 @@ public:
     // Redeclare the methods in `DirectoryTraverser` to add thread safe annotations.
     bool next(std::string* name, fuse_stat* st) override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) = 0;
     void rewind() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) = 0;
+
+    // Throws if a name in the directory fails to decrypt, which `next` silently skips, or if the
+    // long name table has mappings that no name in the directory uses.
+    virtual void validate() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) = 0;
 };
 
 class ABSL_LOCKABLE File final : public Base
@@ -115,16 +188,29 @@ private:
     std::unique_ptr<lite::AESGCMCryptStream> m_crypt_stream ABSL_GUARDED_BY(*this);
     std::shared_ptr<securefs::FileStream> m_file_stream ABSL_GUARDED_BY(*this);
     securefs::Mutex m_lock;
+    StreamOpener& m_opener;
+    OpenFileCounter& m_open_files;
+    OpenFileCounter::Key m_identity;
+
+    // Returns whether this file has the same header as `source`, which an empty one takes on if
+    // no other `File` has it open, as they would keep the session key of the current header.
+    bool share_header_with(File& source) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this, source);
 
 public:
-    File(std::shared_ptr<securefs::FileStream> file_stream, StreamOpener& opener)
-        : m_file_stream(std::move(file_stream))
-    {
-        LockGuard<FileStream> lock_guard(*m_file_stream, true);
-        m_crypt_stream = opener.open(m_file_stream);
-    }
+    File(std::shared_ptr<securefs::FileStream> file_stream,
+         StreamOpener& opener,
+         OpenFileCounter& open_files);
+
+    ~File();
+
+    const OpenFileCounter::Key& identity() const noexcept { return m_identity; }
 
-    ~File() = default;
+    // Same as `StreamBase::copy_range_from`. Files sharing a header encrypt alike, so the whole
+    // blocks of a range at the same offset in both are cloned underneath rather than reencrypted.
+    length_type copy_range_from(File& source,
+                                offset_type source_offset,
+                                offset_type offset,
+                                length_type length) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this, source);
 
     length_type size() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { return m_crypt_stream->size(); }
     void flush() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { m_crypt_stream->flush(); }
@@ -136,6 +222,23 @@ public:
     {
         m_crypt_stream->resize(len);
     }
+    void punch_hole(offset_type off, length_type len) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        m_crypt_stream->punch_hole(off, len);
+    }
+    void preallocate(offset_type off, length_type len, bool keep_size)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        m_crypt_stream->preallocate(off, len, keep_size);
+    }
+    offset_type next_data(offset_type off) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        return m_crypt_stream->next_data(off);
+    }
+    offset_type next_hole(offset_type off) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        return m_crypt_stream->next_hole(off);
+    }
     length_type read(void* output, offset_type off, length_type len)
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
@@ -177,6 +280,51 @@ public:
     File* as_file() noexcept override { return this; }
 };
 
+// Locks two files, or just one if both are the same. They are locked in the order of their
+// underlying files, as the file locks of those hold off every other handle on them too, so that
+// copies each way between the same two files do not deadlock.
+class ABSL_SCOPED_LOCKABLE DoubleFileLockGuard
+{
+private:
+    File* m_first;
+    File* m_second = nullptr;
+
+public:
+    explicit DoubleFileLockGuard(File& f1, File& f2) ABSL_EXCLUSIVE_LOCK_FUNCTION(f1, f2)
+        ABSL_NO_THREAD_SAFETY_ANALYSIS : m_first(&f1)
+    {
+        if (&f1 != &f2)
+        {
+            bool in_order = std::make_pair(f1.identity(), &f1) < std::make_pair(f2.identity(), &f2);
+            m_first = in_order ? &f1 : &f2;
+            m_second = in_order ? &f2 : &f1;
+        }
+        m_first->lock();
+        if (!m_second)
+        {
+            return;
+        }
+        try
+        {
+            m_second->lock();
+        }
+        catch (...)
+        {
+            m_first->unlock();
+            throw;
+        }
+    }
+    ~DoubleFileLockGuard() ABSL_UNLOCK_FUNCTION() ABSL_NO_THREAD_SAFETY_ANALYSIS
+    {
+        if (m_second)
+        {
+            m_second->unlock();
+        }
+        m_first->unlock();
+    }
+    DISABLE_COPY_MOVE(DoubleFileLockGuard)
+};
+
 struct InvalidNameTag
 {
 };
@@ -271,9 +419,14 @@ class FuseHighLevelOps : public ::securefs::FuseHighLevelOpsBase
 public:
     INJECT(FuseHighLevelOps(::securefs::OSService& root,
                             StreamOpener& opener,
+                            PaddingCache& padding_cache,
                             NameTranslator& name_trans,
                             XattrCryptor& xattr))
-        : root_(root), opener_(opener), name_trans_(name_trans), xattr_(xattr)
+        : root_(root)
+        , opener_(opener)
+        , padding_cache_(padding_cache)
+        , name_trans_(name_trans)
+        , xattr_(xattr)
     {
     }
 
@@ -343,16 +496,54 @@ public:
                   uint32_t position,
                   const fuse_context* ctx) override;
     int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    int vfallocate(const char* path,
+                   int mode,
+                   fuse_off_t offset,
+                   fuse_off_t length,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vlseek(const char* path,
+               fuse_off_t offset,
+               int whence,
+               fuse_off_t* result,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vcopy_file_range(const char* path_in,
+                         fuse_file_info* info_in,
+                         fuse_off_t offset_in,
+                         const char* path_out,
+                         fuse_file_info* info_out,
+                         fuse_off_t offset_out,
+                         size_t size,
+                         int flags,
+                         const fuse_context* ctx) override;
+    // Resolves to the encrypted path, so that the nodes of the low level frontend keep it instead
+    // of encrypting their names again for each operation.
+    bool has_resolve() const override { return true; }
+    std::optional<std::string> vresolve(const char* path) override;
+    int vgetattr_resolved(const std::string& resolved,
+                          fuse_stat* st,
+                          const fuse_context* ctx) override;
+    int vopen_resolved(const std::string& resolved,
+                       fuse_file_info* info,
+                       const fuse_context* ctx) override;
+
+    // Checks the names and the long name table of a directory opened by `vopendir`.
+    void validate_directory(fuse_file_info* info);
 
 private:
     ::securefs::OSService& root_;
     StreamOpener& opener_;
+    PaddingCache& padding_cache_;
     NameTranslator& name_trans_;
     XattrCryptor& xattr_;
     bool read_dir_plus_ = false;
+    OpenFileCounter open_files_;
 
 private:
     std::unique_ptr<File> open(std::string_view path, int flags, unsigned mode);
+    // Opens the file at the encrypted path without truncating it, after adjusting `flags`.
+    std::unique_ptr<File> open_encrypted(const std::string& enc_path, int flags, unsigned mode);
 
     enum class LongNameComponentAction : unsigned char
     {
@@ -2,10 +2,10 @@
 #include "crypto.h"
 #include "logger.h"
 #include "myutils.h"
+#include "op_stats.h"
 
 #include <algorithm>
 #include <cryptopp/aes.h>
-#include <cryptopp/integer.h>
 #include <cryptopp/modes.h>
 #include <cryptopp/osrng.h>
 
@@ -146,23 +146,58 @@ bool AESGCMCryptStream::is_sparse() const noexcept { return m_stream->is_sparse(
 length_type
 AESGCMCryptStream::read_multi_blocks(offset_type start_block, offset_type end_block, void* output)
 {
-    if (end_block > MAX_BLOCKS)
-        throw StreamTooLongException(MAX_BLOCKS * get_block_size(), end_block * get_block_size());
-    std::vector<unsigned char> buffer((end_block - start_block) * get_underlying_block_size());
-    length_type rc = m_stream->read(buffer.data(),
-                                    get_header_size() + get_underlying_block_size() * start_block,
-                                    buffer.size());
+    BlockRange range{start_block, end_block, output};
+    read_block_ranges({&range, 1});
+    return range.result;
+}
+
+void AESGCMCryptStream::read_block_ranges(absl::Span<BlockRange> ranges)
+{
+    struct Staged
+    {
+        std::vector<unsigned char> buffer;
+        length_type read_len = 0;
+    };
+    absl::InlinedVector<Staged, 3> staged(ranges.size());
+    ReadBatch batch;
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        const auto& r = ranges[i];
+        if (r.end_block > MAX_BLOCKS)
+            throw StreamTooLongException(MAX_BLOCKS * get_block_size(),
+                                         r.end_block * get_block_size());
+        staged[i].buffer.resize((r.end_block - r.start_block) * get_underlying_block_size());
+        m_stream->read_batched(batch,
+                               staged[i].buffer.data(),
+                               get_header_size() + get_underlying_block_size() * r.start_block,
+                               staged[i].buffer.size(),
+                               &staged[i].read_len);
+    }
+    batch.run();
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        ranges[i].result = decrypt_blocks(
+            ranges[i].start_block, staged[i].buffer.data(), staged[i].read_len, ranges[i].output);
+    }
+}
+
+length_type AESGCMCryptStream::decrypt_blocks(offset_type start_block,
+                                              const byte* buffer,
+                                              length_type underlying_length,
+                                              void* output)
+{
     length_type transformed_read_len = 0;
 
-    for (length_type i = 0; i < rc; i += get_underlying_block_size())
+    for (length_type i = 0; i < underlying_length; i += get_underlying_block_size())
     {
-        auto this_block_underlying_size = std::min(get_underlying_block_size(), rc - i);
+        auto this_block_underlying_size
+            = std::min(get_underlying_block_size(), underlying_length - i);
         if (this_block_underlying_size <= get_mac_size() + get_iv_size())
         {
             return transformed_read_len;
         }
         auto this_block_virtual_size = this_block_underlying_size - get_mac_size() - get_iv_size();
-        auto* start_data = buffer.data() + i;
+        auto* start_data = buffer + i;
         auto* end_data = start_data + this_block_underlying_size;
 
         transformed_read_len += this_block_virtual_size;
@@ -181,6 +216,8 @@ AESGCMCryptStream::read_multi_blocks(offset_type start_block, offset_type end_bl
             to_little_endian(
                 static_cast<std::uint32_t>(i / get_underlying_block_size() + start_block),
                 m_auxiliary.data());
+            static const OpStats::Counter bytes_decrypted("bytes_decrypted");
+            bytes_decrypted.add(static_cast<int64_t>(this_block_virtual_size));
             bool success = m_decryptor.DecryptAndVerify(static_cast<byte*>(output),
                                                         end_data - get_mac_size(),
                                                         get_mac_size(),
@@ -227,6 +264,8 @@ void AESGCMCryptStream::write_multi_blocks(offset_type start_block,
             {
                 generate_random(iv, get_iv_size());
             } while (is_all_zeros(iv, get_iv_size()));
+            static const OpStats::Counter bytes_encrypted("bytes_encrypted");
+            bytes_encrypted.add(static_cast<int64_t>(this_block_virtual_size));
             m_encryptor.EncryptAndAuthenticate(ciphertext,
                                                mac,
                                                get_mac_size(),
@@ -245,6 +284,24 @@ void AESGCMCryptStream::write_multi_blocks(offset_type start_block,
                     buffer.size());
 }
 
+void AESGCMCryptStream::punch_blocks(offset_type start_block, offset_type end_block)
+{
+    if (end_block > MAX_BLOCKS)
+        throw StreamTooLongException(MAX_BLOCKS * get_block_size(), end_block * get_block_size());
+    // An underlying block that is all zeros reads as a block of zeros.
+    m_stream->punch_hole(get_header_size() + start_block * get_underlying_block_size(),
+                         (end_block - start_block) * get_underlying_block_size());
+}
+
+void AESGCMCryptStream::preallocate_blocks(offset_type start_block, offset_type end_block)
+{
+    if (end_block > MAX_BLOCKS)
+        throw StreamTooLongException(MAX_BLOCKS * get_block_size(), end_block * get_block_size());
+    m_stream->preallocate(get_header_size() + start_block * get_underlying_block_size(),
+                          (end_block - start_block) * get_underlying_block_size(),
+                          true);
+}
+
 length_type AESGCMCryptStream::size() const
 {
     auto underlying_size = m_stream->size();
@@ -286,10 +343,7 @@ unsigned default_compute_padding(unsigned max_padding,
     }
     CryptoPP::FixedSizeAlignedSecBlock<byte, 16> transformed;
     padding_aes.ProcessData(transformed.data(), id, id_size);
-    CryptoPP::Integer integer(transformed.data(),
-                              transformed.size(),
-                              CryptoPP::Integer::UNSIGNED,
-                              CryptoPP::BIG_ENDIAN_ORDER);
-    return static_cast<unsigned>(integer.Modulo(max_padding + 1));
+    return big_endian_modulo(
+        transformed.data(), transformed.size(), static_cast<uint64_t>(max_padding) + 1);
 }
 }    // namespace securefs::lite
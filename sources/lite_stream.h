@@ -71,6 +71,23 @@ protected:
 
     void adjust_logical_size(length_type length) override;
 
+    void read_block_ranges(absl::Span<BlockRange> ranges) override;
+
+    void punch_blocks(offset_type start_block, offset_type end_block) override;
+
+    void preallocate_blocks(offset_type start_block, offset_type end_block) override;
+
+    BlockLayout block_layout() const override
+    {
+        return {m_stream.get(), get_header_size(), get_underlying_block_size()};
+    }
+
+private:
+    length_type decrypt_blocks(offset_type start_block,
+                               const byte* buffer,
+                               length_type underlying_length,
+                               void* output);
+
 public:
     explicit AESGCMCryptStream(std::shared_ptr<StreamBase> stream,
                                const key_type& master_key,
@@ -1,9 +1,18 @@
 #include "logger.h"
 #include "exceptions.h"
+#include "lock_guard.h"
 #include "myutils.h"
 #include "platform.h"
+#include "thread_local.h"
 
+#include <absl/strings/str_cat.h>
+#include <absl/time/time.h>
+
+#include <algorithm>
+#include <atomic>
 #include <stdio.h>
+#include <thread>
+#include <vector>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -23,6 +32,218 @@ static const void* current_thread_id(void) { return (void*)(pthread_self()); }
 
 namespace securefs
 {
+namespace
+{
+    void append_prefix(std::string* out, LoggingLevel level, const char* funcsig, int lineno)
+    {
+        struct tm now;
+        int now_ns = 0;
+        OSService::get_current_time_in_tm(&now, &now_ns);
+        absl::StrAppendFormat(out,
+                              "[%s] [%p] [%d-%02d-%02d %02d:%02d:%02d.%09d UTC] [%s:%d]    ",
+                              stringify(level),
+                              current_thread_id(),
+                              now.tm_year + 1900,
+                              now.tm_mon + 1,
+                              now.tm_mday,
+                              now.tm_hour,
+                              now.tm_min,
+                              now.tm_sec,
+                              now_ns,
+                              funcsig,
+                              lineno);
+    }
+}    // namespace
+
+/// Owns one single producer single consumer queue per logging thread, and the thread that drains
+/// them into the log file. The queue of an exiting thread is moved into a retired one.
+class Logger::AsyncWriter
+{
+public:
+    AsyncWriter(FILE* fp, size_t queue_capacity)
+        : m_fp(fp)
+        , m_queues([queue_capacity]() { return std::make_unique<Queue>(queue_capacity); },
+                   [this](Queue& from, Queue& into) { retire(from, into); })
+    {
+        m_worker = std::thread([this]() { run(); });
+    }
+
+    ~AsyncWriter() { stop(); }
+
+    DISABLE_COPY_MOVE(AsyncWriter)
+
+    /// Stops the background thread after writing out everything queued. Later messages, and those
+    /// racing with this call, are written synchronously.
+    void stop() noexcept
+    {
+        if (m_stopped.exchange(true))
+        {
+            return;
+        }
+        // Pairs with the fence in `push()`: either we see the message queued there, or it sees
+        // `m_stopped` and drains the queue itself.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            LockGuard<Mutex> lg(m_mu);
+            m_stopping = true;
+        }
+        m_worker.join();
+        LockGuard<Mutex> lg(m_mu);
+        drain_locked("");
+    }
+
+    void push(std::string line) noexcept
+    {
+        if (m_stopped.load())
+        {
+            write_sync(line);
+            return;
+        }
+        Queue* q;
+        try
+        {
+            q = &m_queues.local();
+        }
+        catch (...)
+        {
+            count_dropped();
+            return;
+        }
+        if (!q->try_push(line))
+        {
+            count_dropped();
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_stopped.load(std::memory_order_relaxed))
+        {
+            write_sync("");
+        }
+    }
+
+    /// Writes `line` after everything queued so far, and flushes before returning.
+    void write_sync(std::string_view line) noexcept
+    {
+        LockGuard<Mutex> lg(m_mu);
+        drain_locked(line);
+    }
+
+    uint64_t dropped() const noexcept { return m_total_dropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Queue
+    {
+        explicit Queue(size_t capacity) : slots(capacity) {}
+
+        // Only advanced by the consumer, which holds `m_mu`.
+        std::atomic<uint64_t> head{0};
+        // Only advanced by the owning thread.
+        std::atomic<uint64_t> tail{0};
+        std::vector<std::string> slots;
+
+        // Called by the owning thread only. Returns false if the queue is full.
+        bool try_push(std::string& line) noexcept
+        {
+            auto t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) >= slots.size())
+            {
+                return false;
+            }
+            slots[t % slots.size()].swap(line);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+    };
+
+    FILE* m_fp;
+    // Messages dropped since the last time the writer reported them.
+    std::atomic<uint64_t> m_dropped{0};
+    std::atomic<uint64_t> m_total_dropped{0};
+    std::atomic<bool> m_stopped{false};
+    Mutex m_mu;
+    bool m_stopping ABSL_GUARDED_BY(m_mu) = false;
+    // Visited with `m_mu` held.
+    PerThread<Queue> m_queues;
+    std::string m_batch ABSL_GUARDED_BY(m_mu);
+    std::thread m_worker;
+
+private:
+    void count_dropped() noexcept
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        m_total_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Called by an exiting thread, which no longer pushes to `from`, while no drain is running.
+    void retire(Queue& from, Queue& into) noexcept
+    {
+        auto head = from.head.load(std::memory_order_relaxed);
+        auto tail = from.tail.load(std::memory_order_relaxed);
+        for (; head < tail; ++head)
+        {
+            if (!into.try_push(from.slots[head % from.slots.size()]))
+            {
+                count_dropped();
+            }
+        }
+        from.head.store(tail, std::memory_order_relaxed);
+    }
+
+    void drain_locked(std::string_view extra) noexcept ABSL_EXCLUSIVE_LOCKS_REQUIRED(m_mu)
+    {
+        try
+        {
+            m_batch.clear();
+            m_queues.for_each(
+                [this](Queue& q) ABSL_EXCLUSIVE_LOCKS_REQUIRED(m_mu)
+                {
+                    auto head = q.head.load(std::memory_order_relaxed);
+                    auto tail = q.tail.load(std::memory_order_acquire);
+                    for (; head < tail; ++head)
+                    {
+                        auto& slot = q.slots[head % q.slots.size()];
+                        m_batch.append(slot);
+                        slot.clear();
+                    }
+                    q.head.store(tail, std::memory_order_release);
+                });
+            auto dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0)
+            {
+                append_prefix(&m_batch, LoggingLevel::kLogWarning, FULL_FUNCTION_NAME, __LINE__);
+                absl::StrAppendFormat(
+                    &m_batch, "%d log messages were dropped because of a full queue\n", dropped);
+            }
+            m_batch.append(extra);
+            if (m_batch.empty())
+            {
+                return;
+            }
+            fwrite(m_batch.data(), 1, m_batch.size(), m_fp);
+            fflush(m_fp);
+        }
+        catch (...)
+        {
+            // Nowhere to report the failure of the logger itself.
+        }
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            m_mu.LockWhenWithTimeout(absl::Condition(&m_stopping), absl::Milliseconds(20));
+            bool stopping = m_stopping;
+            drain_locked("");
+            m_mu.Unlock();
+            if (stopping)
+            {
+                return;
+            }
+        }
+    }
+};
+
 Logger::Logger(FILE* fp, bool close_on_exit)
     : m_level(LoggingLevel::kLogInfo), m_fp(fp), m_close_on_exit(close_on_exit)
 {
@@ -34,9 +255,14 @@ void Logger::prelog(LoggingLevel level, const char* funcsig, int lineno) noexcep
     if (!m_fp || level < this->get_level())
         return;
 
-    struct tm now;
-    int now_ns = 0;
-    OSService::get_current_time_in_tm(&now, &now_ns);
+    std::string prefix;
+    try
+    {
+        append_prefix(&prefix, level, funcsig, lineno);
+    }
+    catch (...)
+    {
+    }
 
     flockfile(m_fp);
     if (m_console_color)
@@ -54,19 +280,7 @@ void Logger::prelog(LoggingLevel level, const char* funcsig, int lineno) noexcep
         }
     }
 
-    fprintf(m_fp,
-            "[%s] [%p] [%d-%02d-%02d %02d:%02d:%02d.%09d UTC] [%s:%d]    ",
-            stringify(level),
-            current_thread_id(),
-            now.tm_year + 1900,
-            now.tm_mon + 1,
-            now.tm_mday,
-            now.tm_hour,
-            now.tm_min,
-            now.tm_sec,
-            now_ns,
-            funcsig,
-            lineno);
+    fwrite(prefix.data(), 1, prefix.size(), m_fp);
 }
 
 void Logger::postlog(LoggingLevel level) noexcept
@@ -100,8 +314,60 @@ void Logger::log_v2(LoggingLevel level,
     }
 }
 
+void Logger::log_async(LoggingLevel level,
+                       const char* funcsig,
+                       int lineno,
+                       absl::FunctionRef<void(std::string*)> output_fun) noexcept
+{
+    if (!m_fp || level < this->get_level())
+        return;
+    try
+    {
+        std::string line;
+        append_prefix(&line, level, funcsig, lineno);
+        try
+        {
+            output_fun(&line);
+        }
+        catch (const std::exception& e)
+        {
+            absl::StrAppend(&line, "Logging itself throws exception: ", e.what());
+        }
+        line.push_back('\n');
+        if (level >= LoggingLevel::kLogError)
+        {
+            m_async->write_sync(line);
+        }
+        else
+        {
+            m_async->push(std::move(line));
+        }
+    }
+    catch (...)
+    {
+    }
+}
+
+void Logger::start_async(size_t queue_capacity)
+{
+    if (!m_fp || m_async)
+        return;
+    m_async = std::make_unique<AsyncWriter>(m_fp, std::max<size_t>(queue_capacity, 1));
+}
+
+void Logger::stop_async() noexcept
+{
+    if (m_async)
+    {
+        m_async->stop();
+    }
+}
+
+uint64_t Logger::dropped_messages() const noexcept { return m_async ? m_async->dropped() : 0; }
+
 Logger::~Logger()
 {
+    m_async.reset();
     if (m_close_on_exit)
         fclose(m_fp);
 }
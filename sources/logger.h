@@ -4,6 +4,7 @@
 #include <absl/functional/function_ref.h>
 #include <absl/strings/str_format.h>
 
+#include <cstdint>
 #include <memory>
 #include <stdio.h>
 #include <string>
@@ -51,9 +52,12 @@ class Logger
     friend class trace::FuseTracer;
 
 private:
+    class AsyncWriter;
+
     LoggingLevel m_level;
     FILE* m_fp;
     std::unique_ptr<ConsoleColourSetter> m_console_color;
+    std::unique_ptr<AsyncWriter> m_async;
     bool m_close_on_exit;
 
     explicit Logger(FILE* fp, bool close_on_exit);
@@ -65,11 +69,32 @@ private:
                 const char* funcsig,
                 int lineno,
                 absl::FunctionRef<void(std::FILE*)> output_fun);
+    void log_async(LoggingLevel level,
+                   const char* funcsig,
+                   int lineno,
+                   absl::FunctionRef<void(std::string*)> output_fun) noexcept;
 
 public:
+    static constexpr size_t kDefaultAsyncQueueCapacity = 1024;
+
     static Logger* create_stderr_logger();
     static Logger* create_file_logger(const std::string& path);
 
+    /// Switches to asynchronous mode: messages are formatted on the calling thread, pushed onto a
+    /// lock free queue of that thread, and written in batches by a background thread. When a queue
+    /// is full, the message is dropped and counted. Errors are still written synchronously, after
+    /// everything queued before them. Console colours are not used in this mode.
+    ///
+    /// Must be called after the process enters the background, as the writer thread does not
+    /// survive `fork()`.
+    void start_async(size_t queue_capacity = kDefaultAsyncQueueCapacity);
+    /// Writes out all queued messages and stops the background thread. Logging calls racing with
+    /// this one, or coming after it, write synchronously to the same file. The queues themselves
+    /// live until the logger is destroyed, so no call ever sees them freed.
+    void stop_async() noexcept;
+    /// The number of messages dropped in asynchronous mode because their queue was full.
+    uint64_t dropped_messages() const noexcept;
+
     template <typename... Args>
     void log_v2(LoggingLevel level,
                 const char* funcsig,
@@ -77,6 +102,15 @@ public:
                 const absl::FormatSpec<Args...>& fms,
                 Args&&... args) noexcept
     {
+        if (m_async)
+        {
+            log_async(level,
+                      funcsig,
+                      lineno,
+                      [&](std::string* out)
+                      { absl::StrAppendFormat(out, fms, std::forward<Args>(args)...); });
+            return;
+        }
         log_v2(level,
                funcsig,
                lineno,
@@ -130,6 +130,24 @@ size_t popcount(const byte* data, size_t size) noexcept
     return res;
 }
 
+unsigned big_endian_modulo(const byte* data, size_t size, uint64_t modulus) noexcept
+{
+    // The remainder is always below 2^32, so shifting in one 32-bit word at a time never overflows.
+    uint64_t remainder = 0;
+    size_t i = 0;
+    for (; i < size % 4; ++i)
+    {
+        remainder = ((remainder << 8) | data[i]) % modulus;
+    }
+    for (; i < size; i += 4)
+    {
+        uint64_t word = (uint64_t(data[i]) << 24) | (uint64_t(data[i + 1]) << 16)
+            | (uint64_t(data[i + 2]) << 8) | uint64_t(data[i + 3]);
+        remainder = ((remainder << 32) | word) % modulus;
+    }
+    return static_cast<unsigned>(remainder);
+}
+
 void warn_if_key_not_random(const byte* key, size_t size, const char* file, int line) noexcept
 {
     size_t pp = popcount(key, size);
@@ -6,6 +6,7 @@
 #include <functional>
 #include <limits>
 #include <memory>
+#include <new>
 #include <stddef.h>
 #include <stdexcept>
 #include <stdint.h>
@@ -145,6 +146,40 @@ inline std::unique_ptr<T[]> make_unique_array(size_t size)
     return std::unique_ptr<T[]>(new T[size]);
 }
 
+/// A zero filled heap buffer whose start is aligned, as files opened with O_DIRECT require of the
+/// buffers they transfer into and out of.
+class AlignedBuffer
+{
+public:
+    static constexpr size_t kDirectIoAlignment = 4096;
+
+    AlignedBuffer() noexcept : m_data(nullptr, Deleter{kDirectIoAlignment}), m_size(0) {}
+    explicit AlignedBuffer(size_t size, size_t alignment = kDirectIoAlignment)
+        : m_data(static_cast<byte*>(::operator new(size, std::align_val_t(alignment))),
+                 Deleter{alignment})
+        , m_size(size)
+    {
+        memset(m_data.get(), 0, size);
+    }
+
+    byte* data() noexcept { return m_data.get(); }
+    const byte* data() const noexcept { return m_data.get(); }
+    size_t size() const noexcept { return m_size; }
+
+private:
+    struct Deleter
+    {
+        size_t alignment;
+        void operator()(byte* p) const noexcept
+        {
+            ::operator delete(p, std::align_val_t(alignment));
+        }
+    };
+
+    std::unique_ptr<byte, Deleter> m_data;
+    size_t m_size;
+};
+
 template <class T>
 struct _Unique_if
 {
@@ -321,6 +356,11 @@ void respond_to_user_action(
 
 size_t popcount(const byte* data, size_t size) noexcept;
 
+// Interprets `data` as an unsigned big endian integer of arbitrary width, and returns it modulo
+// `modulus`, which must be within [1, 2^32]. The result is identical to `CryptoPP::Integer::Modulo`
+// but needs no heap allocation.
+unsigned big_endian_modulo(const byte* data, size_t size, uint64_t modulus) noexcept;
+
 void warn_if_key_not_random(const byte* key, size_t size, const char* file, int line) noexcept;
 
 template <class Container>
@@ -0,0 +1,1481 @@
+#include "op_recorder.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "mystring.h"
+
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <map>
+#include <thread>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    constexpr std::string_view kOpNames[] = {
+        "statfs",   "getattr", "fgetattr",  "opendir", "releasedir", "readdir",   "create",
+        "open",     "release", "read",      "write",   "flush",      "ftruncate", "unlink",
+        "mkdir",    "rmdir",   "chmod",     "chown",   "symlink",    "link",      "readlink",
+        "rename",   "fsync",   "truncate",  "utimens", "listxattr",  "getxattr",  "setxattr",
+        "removexattr", "fallocate", "lseek", "copy_file_range",
+    };
+    constexpr size_t kNumOpKinds = sizeof(kOpNames) / sizeof(kOpNames[0]);
+    static_assert(kNumOpKinds == static_cast<size_t>(RecordedOpKind::kCopyFileRange));
+
+    // The bytes of each hashed path component that are kept.
+    constexpr size_t kAnonymizedComponentSize = 8;
+
+    std::atomic<uint32_t> next_thread_id{1};
+
+    uint32_t current_thread_id()
+    {
+        thread_local uint32_t id = next_thread_id.fetch_add(1);
+        return id;
+    }
+
+    uint64_t zigzag_encode(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    int64_t zigzag_decode(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    void append_varint(std::string& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    class Reader
+    {
+    public:
+        explicit Reader(std::string_view data) : data_(data) {}
+
+        bool empty() const noexcept { return data_.empty(); }
+
+        uint8_t read_byte() { return static_cast<uint8_t>(take(1)[0]); }
+
+        uint64_t read_varint()
+        {
+            uint64_t value = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7)
+            {
+                uint8_t byte = read_byte();
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    return value;
+                }
+            }
+            throw_runtime_error("Malformed varint in operation recording");
+        }
+
+        std::string_view take(size_t size)
+        {
+            if (data_.size() < size)
+            {
+                throw_runtime_error("Truncated operation recording");
+            }
+            auto result = data_.substr(0, size);
+            data_.remove_prefix(size);
+            return result;
+        }
+
+    private:
+        std::string_view data_;
+    };
+
+    void check(int rc)
+    {
+        if (rc < 0)
+        {
+            throwVFSException(-rc);
+        }
+    }
+
+    // Maps exceptions to return values the same way as the FUSE callbacks do.
+    template <class Fn>
+    int call_ops(Fn&& fn)
+    {
+        try
+        {
+            return fn();
+        }
+        catch (const ExceptionBase& e)
+        {
+            return -e.error_number();
+        }
+        catch (const std::exception&)
+        {
+            return -EPERM;
+        }
+    }
+
+    bool needs_handle(RecordedOpKind kind)
+    {
+        switch (kind)
+        {
+        case RecordedOpKind::kFgetattr:
+        case RecordedOpKind::kReleasedir:
+        case RecordedOpKind::kReaddir:
+        case RecordedOpKind::kRelease:
+        case RecordedOpKind::kRead:
+        case RecordedOpKind::kWrite:
+        case RecordedOpKind::kFlush:
+        case RecordedOpKind::kFtruncate:
+        case RecordedOpKind::kFsync:
+        case RecordedOpKind::kFallocate:
+        case RecordedOpKind::kLseek:
+        case RecordedOpKind::kCopyFileRange:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Whether the size is that of a buffer passed to the call, rather than a file size or the
+    // length of a range.
+    bool needs_buffer(RecordedOpKind kind)
+    {
+        switch (kind)
+        {
+        case RecordedOpKind::kRead:
+        case RecordedOpKind::kWrite:
+        case RecordedOpKind::kReadlink:
+        case RecordedOpKind::kListxattr:
+        case RecordedOpKind::kGetxattr:
+        case RecordedOpKind::kSetxattr:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    std::string_view parent_path(std::string_view path)
+    {
+        auto slash = path.rfind('/');
+        if (slash == 0 || slash == std::string_view::npos)
+        {
+            return "/";
+        }
+        return path.substr(0, slash);
+    }
+}    // namespace
+
+std::string_view recorded_op_name(RecordedOpKind kind) noexcept
+{
+    auto index = static_cast<size_t>(kind);
+    if (index == 0 || index > kNumOpKinds)
+    {
+        return "unknown";
+    }
+    return kOpNames[index - 1];
+}
+
+void OpRecordingEncoder::append_path(const std::string& path, std::string& out)
+{
+    if (path.empty())
+    {
+        append_varint(out, 0);
+        return;
+    }
+    auto [it, inserted] = path_ids_.emplace(path, path_ids_.size() + 1);
+    append_varint(out, it->second);
+    if (inserted)
+    {
+        append_varint(out, path.size());
+        out.append(path);
+    }
+}
+
+void OpRecordingEncoder::append(const RecordedOp& op, std::string& out)
+{
+    out.push_back(static_cast<char>(op.kind));
+    append_varint(out, op.thread);
+    // Operations are appended as they finish, so the start times are not monotonic.
+    append_varint(out, zigzag_encode(static_cast<int64_t>(op.start_ns - last_start_ns_)));
+    last_start_ns_ = op.start_ns;
+    append_varint(out, op.duration_ns);
+    append_varint(out, zigzag_encode(op.rc));
+    append_path(op.path, out);
+    append_path(op.path2, out);
+    append_varint(out, op.handle);
+    append_varint(out, op.offset);
+    append_varint(out, op.size);
+    append_varint(out, op.mode);
+    append_varint(out, op.flags);
+    if (op.kind == RecordedOpKind::kCopyFileRange)
+    {
+        append_varint(out, op.handle2);
+        append_varint(out, op.offset2);
+    }
+}
+
+std::string encode_op_recording(const std::vector<RecordedOp>& ops)
+{
+    std::string out(OpRecordingEncoder::kMagic);
+    OpRecordingEncoder encoder;
+    for (const auto& op : ops)
+    {
+        encoder.append(op, out);
+    }
+    return out;
+}
+
+std::vector<RecordedOp> decode_op_recording(std::string_view data)
+{
+    Reader reader(data);
+    if (data.size() < OpRecordingEncoder::kMagic.size()
+        || reader.take(OpRecordingEncoder::kMagic.size()) != OpRecordingEncoder::kMagic)
+    {
+        throw_runtime_error("Not a securefs operation recording");
+    }
+    std::vector<std::string> paths;
+    auto read_path = [&]() -> std::string
+    {
+        auto id = reader.read_varint();
+        if (id == 0)
+        {
+            return {};
+        }
+        if (id == paths.size() + 1)
+        {
+            auto size = reader.read_varint();
+            paths.emplace_back(reader.take(size));
+        }
+        else if (id > paths.size())
+        {
+            throw_runtime_error("Invalid path reference in operation recording");
+        }
+        return paths[id - 1];
+    };
+
+    std::vector<RecordedOp> ops;
+    uint64_t last_start_ns = 0;
+    while (!reader.empty())
+    {
+        RecordedOp op;
+        auto kind = reader.read_byte();
+        if (kind == 0 || kind > kNumOpKinds)
+        {
+            throw_runtime_error(
+                absl::StrFormat("Unknown operation %d in operation recording", kind));
+        }
+        op.kind = static_cast<RecordedOpKind>(kind);
+        op.thread = static_cast<uint32_t>(reader.read_varint());
+        last_start_ns += static_cast<uint64_t>(zigzag_decode(reader.read_varint()));
+        op.start_ns = last_start_ns;
+        op.duration_ns = reader.read_varint();
+        op.rc = zigzag_decode(reader.read_varint());
+        op.path = read_path();
+        op.path2 = read_path();
+        op.handle = reader.read_varint();
+        op.offset = reader.read_varint();
+        op.size = reader.read_varint();
+        op.mode = static_cast<uint32_t>(reader.read_varint());
+        op.flags = static_cast<uint32_t>(reader.read_varint());
+        if (op.kind == RecordedOpKind::kCopyFileRange)
+        {
+            op.handle2 = reader.read_varint();
+            op.offset2 = reader.read_varint();
+        }
+        ops.push_back(std::move(op));
+    }
+    return ops;
+}
+
+OpRecorder::OpRecorder(std::shared_ptr<FileStream> stream, bool anonymize)
+    : stream_(std::move(stream)), anonymize_(anonymize), start_(OpStats::Clock::now())
+{
+    if (anonymize_)
+    {
+        key_.resize(32);
+        generate_random(key_.data(), key_.size());
+    }
+    LockGuard<Mutex> lg(mu_);
+    buffer_.assign(OpRecordingEncoder::kMagic);
+}
+
+OpRecorder::~OpRecorder()
+{
+    try
+    {
+        flush();
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to write the operation recording: %s", e.what());
+    }
+}
+
+uint64_t OpRecorder::now_ns() const noexcept
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(OpStats::Clock::now() - start_)
+            .count());
+}
+
+std::string OpRecorder::anonymize_path(std::string_view path) const
+{
+    std::string result;
+    result.reserve(path.size());
+    bool first = true;
+    for (std::string_view component : absl::StrSplit(path, '/'))
+    {
+        if (!first)
+        {
+            result.push_back('/');
+        }
+        first = false;
+        if (component.empty() || component == "." || component == "..")
+        {
+            result.append(component.data(), component.size());
+            continue;
+        }
+        byte mac[kAnonymizedComponentSize];
+        hmac_sha256_calculate(
+            component.data(), component.size(), key_.data(), key_.size(), mac, sizeof(mac));
+        result.append(hexify(mac, sizeof(mac)));
+    }
+    return result;
+}
+
+void OpRecorder::record(RecordedOp op)
+{
+    op.thread = current_thread_id();
+    if (anonymize_)
+    {
+        op.path = anonymize_path(op.path);
+        op.path2 = anonymize_path(op.path2);
+    }
+    std::string chunk;
+    offset_type offset = 0;
+    {
+        LockGuard<Mutex> lg(mu_);
+        encoder_.append(op, buffer_);
+        if (buffer_.size() < kFlushSize)
+        {
+            return;
+        }
+        std::swap(chunk, buffer_);
+        offset = offset_;
+        offset_ += chunk.size();
+    }
+    // The offset is reserved, so the write itself does not block the other threads.
+    try
+    {
+        stream_->write(chunk.data(), offset, chunk.size());
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to write the operation recording: %s", e.what());
+    }
+}
+
+void OpRecorder::flush()
+{
+    LockGuard<Mutex> lg(mu_);
+    if (!buffer_.empty())
+    {
+        stream_->write(buffer_.data(), offset_, buffer_.size());
+        offset_ += buffer_.size();
+        buffer_.clear();
+    }
+    stream_->fsync();
+}
+
+uint64_t OpRecorder::open_handle(uint64_t fh)
+{
+    LockGuard<Mutex> lg(handles_mu_);
+    auto id = ++last_handle_;
+    handles_.insert_or_assign(fh, id);
+    return id;
+}
+
+uint64_t OpRecorder::find_handle(uint64_t fh)
+{
+    LockGuard<Mutex> lg(handles_mu_);
+    auto it = handles_.find(fh);
+    return it == handles_.end() ? 0 : it->second;
+}
+
+uint64_t OpRecorder::close_handle(uint64_t fh)
+{
+    LockGuard<Mutex> lg(handles_mu_);
+    auto it = handles_.find(fh);
+    if (it == handles_.end())
+    {
+        return 0;
+    }
+    auto id = it->second;
+    handles_.erase(it);
+    return id;
+}
+
+template <class Call>
+int RecordingOps::recorded(RecordedOpKind kind, const char* path, Call&& call)
+{
+    RecordedOp op;
+    op.kind = kind;
+    if (path)
+    {
+        op.path = path;
+    }
+    op.start_ns = recorder_.now_ns();
+    auto finish = [&](int64_t rc)
+    {
+        op.rc = rc;
+        op.duration_ns = recorder_.now_ns() - op.start_ns;
+        recorder_.record(std::move(op));
+    };
+    try
+    {
+        int rc = call(op);
+        finish(rc);
+        return rc;
+    }
+    catch (const ExceptionBase& e)
+    {
+        finish(-e.error_number());
+        throw;
+    }
+    catch (const std::exception&)
+    {
+        finish(-EPERM);
+        throw;
+    }
+}
+
+int RecordingOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kStatfs,
+                    path,
+                    [&](RecordedOp&) { return inner_.vstatfs(path, buf, ctx); });
+}
+
+int RecordingOps::vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kGetattr,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        int rc = inner_.vgetattr(path, st, ctx);
+                        if (rc >= 0)
+                        {
+                            op.mode = st->st_mode;
+                            op.size = st->st_size;
+                        }
+                        return rc;
+                    });
+}
+
+int RecordingOps::vfgetattr(const char* path,
+                            fuse_stat* st,
+                            fuse_file_info* info,
+                            const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kFgetattr,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        int rc = inner_.vfgetattr(path, st, info, ctx);
+                        if (rc >= 0)
+                        {
+                            op.mode = st->st_mode;
+                            op.size = st->st_size;
+                        }
+                        return rc;
+                    });
+}
+
+int RecordingOps::vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kOpendir,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.flags = info->flags;
+                        int rc = inner_.vopendir(path, info, ctx);
+                        if (rc >= 0)
+                        {
+                            op.handle = recorder_.open_handle(info->fh);
+                        }
+                        return rc;
+                    });
+}
+
+int RecordingOps::vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kReleasedir,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        // Forgotten first, since the handle value may be reused as soon as it is
+                        // released.
+                        op.handle = recorder_.close_handle(info->fh);
+                        return inner_.vreleasedir(path, info, ctx);
+                    });
+}
+
+int RecordingOps::vreaddir(const char* path,
+                           void* buf,
+                           fuse_fill_dir_t filler,
+                           fuse_off_t off,
+                           fuse_file_info* info,
+                           const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kReaddir,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        op.offset = off;
+                        return inner_.vreaddir(path, buf, filler, off, info, ctx);
+                    });
+}
+
+int RecordingOps::vcreate(const char* path,
+                          fuse_mode_t mode,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kCreate,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.mode = mode;
+                        op.flags = info->flags;
+                        int rc = inner_.vcreate(path, mode, info, ctx);
+                        if (rc >= 0)
+                        {
+                            op.handle = recorder_.open_handle(info->fh);
+                        }
+                        return rc;
+                    });
+}
+
+int RecordingOps::vopen(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kOpen,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.flags = info->flags;
+                        int rc = inner_.vopen(path, info, ctx);
+                        if (rc >= 0)
+                        {
+                            op.handle = recorder_.open_handle(info->fh);
+                        }
+                        return rc;
+                    });
+}
+
+int RecordingOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kRelease,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.close_handle(info->fh);
+                        return inner_.vrelease(path, info, ctx);
+                    });
+}
+
+int RecordingOps::vread(const char* path,
+                        char* buf,
+                        size_t size,
+                        fuse_off_t offset,
+                        fuse_file_info* info,
+                        const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kRead,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        op.offset = offset;
+                        op.size = size;
+                        return inner_.vread(path, buf, size, offset, info, ctx);
+                    });
+}
+
+int RecordingOps::vwrite(const char* path,
+                         const char* buf,
+                         size_t size,
+                         fuse_off_t offset,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kWrite,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        op.offset = offset;
+                        op.size = size;
+                        return inner_.vwrite(path, buf, size, offset, info, ctx);
+                    });
+}
+
+int RecordingOps::vflush(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kFlush,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        return inner_.vflush(path, info, ctx);
+                    });
+}
+
+int RecordingOps::vftruncate(const char* path,
+                             fuse_off_t len,
+                             fuse_file_info* info,
+                             const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kFtruncate,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        op.size = len;
+                        return inner_.vftruncate(path, len, info, ctx);
+                    });
+}
+
+int RecordingOps::vunlink(const char* path, const fuse_context* ctx)
+{
+    return recorded(
+        RecordedOpKind::kUnlink, path, [&](RecordedOp&) { return inner_.vunlink(path, ctx); });
+}
+
+int RecordingOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kMkdir,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.mode = mode;
+                        return inner_.vmkdir(path, mode, ctx);
+                    });
+}
+
+int RecordingOps::vrmdir(const char* path, const fuse_context* ctx)
+{
+    return recorded(
+        RecordedOpKind::kRmdir, path, [&](RecordedOp&) { return inner_.vrmdir(path, ctx); });
+}
+
+int RecordingOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kChmod,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.mode = mode;
+                        return inner_.vchmod(path, mode, ctx);
+                    });
+}
+
+int RecordingOps::vchown(const char* path, fuse_uid_t uid, fuse_gid_t gid, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kChown,
+                    path,
+                    [&](RecordedOp&) { return inner_.vchown(path, uid, gid, ctx); });
+}
+
+int RecordingOps::vsymlink(const char* to, const char* from, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kSymlink,
+                    from,
+                    [&](RecordedOp& op)
+                    {
+                        op.path2 = to;
+                        return inner_.vsymlink(to, from, ctx);
+                    });
+}
+
+int RecordingOps::vlink(const char* src, const char* dest, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kLink,
+                    src,
+                    [&](RecordedOp& op)
+                    {
+                        op.path2 = dest;
+                        return inner_.vlink(src, dest, ctx);
+                    });
+}
+
+int RecordingOps::vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kReadlink,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.size = size;
+                        return inner_.vreadlink(path, buf, size, ctx);
+                    });
+}
+
+int RecordingOps::vrename(const char* from, const char* to, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kRename,
+                    from,
+                    [&](RecordedOp& op)
+                    {
+                        op.path2 = to;
+                        return inner_.vrename(from, to, ctx);
+                    });
+}
+
+int RecordingOps::vfsync(const char* path,
+                         int datasync,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kFsync,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        op.flags = datasync;
+                        return inner_.vfsync(path, datasync, info, ctx);
+                    });
+}
+
+int RecordingOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kTruncate,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.size = len;
+                        return inner_.vtruncate(path, len, ctx);
+                    });
+}
+
+int RecordingOps::vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kUtimens,
+                    path,
+                    [&](RecordedOp&) { return inner_.vutimens(path, ts, ctx); });
+}
+
+int RecordingOps::vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kListxattr,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.size = size;
+                        return inner_.vlistxattr(path, list, size, ctx);
+                    });
+}
+
+int RecordingOps::vgetxattr(const char* path,
+                            const char* name,
+                            char* value,
+                            size_t size,
+                            uint32_t position,
+                            const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kGetxattr,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.path2 = name;
+                        op.offset = position;
+                        op.size = size;
+                        return inner_.vgetxattr(path, name, value, size, position, ctx);
+                    });
+}
+
+int RecordingOps::vsetxattr(const char* path,
+                            const char* name,
+                            const char* value,
+                            size_t size,
+                            int flags,
+                            uint32_t position,
+                            const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kSetxattr,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.path2 = name;
+                        op.offset = position;
+                        op.size = size;
+                        op.flags = flags;
+                        return inner_.vsetxattr(path, name, value, size, flags, position, ctx);
+                    });
+}
+
+int RecordingOps::vremovexattr(const char* path, const char* name, const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kRemovexattr,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.path2 = name;
+                        return inner_.vremovexattr(path, name, ctx);
+                    });
+}
+
+int RecordingOps::vfallocate(const char* path,
+                             int mode,
+                             fuse_off_t offset,
+                             fuse_off_t length,
+                             fuse_file_info* info,
+                             const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kFallocate,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        op.offset = offset;
+                        op.size = length;
+                        op.flags = static_cast<uint32_t>(mode);
+                        return inner_.vfallocate(path, mode, offset, length, info, ctx);
+                    });
+}
+
+int RecordingOps::vlseek(const char* path,
+                         fuse_off_t offset,
+                         int whence,
+                         fuse_off_t* result,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kLseek,
+                    path,
+                    [&](RecordedOp& op)
+                    {
+                        op.handle = recorder_.find_handle(info->fh);
+                        op.offset = offset;
+                        op.flags = static_cast<uint32_t>(whence);
+                        int rc = inner_.vlseek(path, offset, whence, result, info, ctx);
+                        if (rc == 0)
+                        {
+                            op.size = *result;
+                        }
+                        return rc;
+                    });
+}
+
+int RecordingOps::vcopy_file_range(const char* path_in,
+                                   fuse_file_info* info_in,
+                                   fuse_off_t offset_in,
+                                   const char* path_out,
+                                   fuse_file_info* info_out,
+                                   fuse_off_t offset_out,
+                                   size_t size,
+                                   int flags,
+                                   const fuse_context* ctx)
+{
+    return recorded(RecordedOpKind::kCopyFileRange,
+                    path_in,
+                    [&](RecordedOp& op)
+                    {
+                        op.path2 = path_out ? path_out : "";
+                        op.handle = recorder_.find_handle(info_in->fh);
+                        op.handle2 = recorder_.find_handle(info_out->fh);
+                        op.offset = offset_in;
+                        op.offset2 = offset_out;
+                        op.size = size;
+                        op.flags = static_cast<uint32_t>(flags);
+                        return inner_.vcopy_file_range(path_in,
+                                                       info_in,
+                                                       offset_in,
+                                                       path_out,
+                                                       info_out,
+                                                       offset_out,
+                                                       size,
+                                                       flags,
+                                                       ctx);
+                    });
+}
+
+OpReplayer::OpReplayer(FuseHighLevelOpsBase& ops, Options options) : ops_(ops), options_(options)
+{
+    ctx_.uid = OSService::getuid();
+    ctx_.gid = OSService::getgid();
+}
+
+void OpReplayer::prepare(const std::vector<RecordedOp>& ops)
+{
+    struct Entry
+    {
+        // Existed before the recording started.
+        bool needed = false;
+        // Still the entry that existed before the recording, so that later operations tell more
+        // about it.
+        bool original = false;
+        uint32_t type = S_IFREG;
+        uint64_t size = 0;
+    };
+    // Ordered so that parents are created before their children.
+    std::map<std::string, Entry, std::less<>> entries;
+    absl::flat_hash_map<uint64_t, std::string> handle_paths;
+
+    // Returns the entry of `path` while it is still the original one.
+    auto touch = [&](const std::string& path, bool exists) -> Entry*
+    {
+        if (path.empty() || path == "/")
+        {
+            return nullptr;
+        }
+        if (auto it = entries.find(path); it != entries.end())
+        {
+            return it->second.original ? &it->second : nullptr;
+        }
+        Entry entry;
+        if (exists)
+        {
+            entry.needed = entry.original = true;
+            for (size_t slash = path.find('/', 1); slash != std::string::npos;
+                 slash = path.find('/', slash + 1))
+            {
+                auto [it, inserted] = entries.emplace(path.substr(0, slash), Entry{});
+                if (inserted)
+                {
+                    it->second.needed = it->second.original = true;
+                    it->second.type = S_IFDIR;
+                }
+                else if (!it->second.original)
+                {
+                    // The parent was created during the recording, so the child was too.
+                    entry.needed = entry.original = false;
+                    break;
+                }
+            }
+        }
+        auto& result = entries.emplace(path, entry).first->second;
+        return result.original ? &result : nullptr;
+    };
+    auto created = [&](const std::string& path)
+    {
+        touch(std::string(parent_path(path)), true);
+        auto& entry = entries[path];
+        entry.original = false;
+    };
+    auto removed = [&](const std::string& path)
+    {
+        if (auto it = entries.find(path); it != entries.end())
+        {
+            it->second.original = false;
+        }
+    };
+
+    for (const auto& op : ops)
+    {
+        bool ok = op.rc >= 0;
+        bool exists = op.rc != -ENOENT;
+        switch (op.kind)
+        {
+        case RecordedOpKind::kCreate:
+        case RecordedOpKind::kMkdir:
+        case RecordedOpKind::kSymlink:
+            if (ok)
+            {
+                created(op.path);
+                if (op.kind == RecordedOpKind::kCreate)
+                {
+                    handle_paths[op.handle] = op.path;
+                }
+            }
+            else if (op.rc == -EEXIST)
+            {
+                touch(op.path, true);
+            }
+            continue;
+        case RecordedOpKind::kLink:
+            touch(op.path, exists);
+            if (ok)
+            {
+                created(op.path2);
+            }
+            continue;
+        case RecordedOpKind::kRename:
+            touch(op.path, exists);
+            if (ok)
+            {
+                removed(op.path);
+                created(op.path2);
+            }
+            continue;
+        case RecordedOpKind::kUnlink:
+        case RecordedOpKind::kRmdir:
+            if (auto entry = touch(op.path, exists); entry && op.kind == RecordedOpKind::kRmdir)
+            {
+                entry->type = S_IFDIR;
+            }
+            if (ok)
+            {
+                removed(op.path);
+            }
+            continue;
+        default:
+            break;
+        }
+
+        const std::string* path = &op.path;
+        if (path->empty() && op.handle)
+        {
+            auto it = handle_paths.find(op.handle);
+            if (it == handle_paths.end())
+            {
+                continue;
+            }
+            path = &it->second;
+        }
+        if ((op.kind == RecordedOpKind::kOpen || op.kind == RecordedOpKind::kOpendir) && ok)
+        {
+            handle_paths[op.handle] = *path;
+        }
+        auto entry = touch(*path, exists);
+        if (!entry || !ok)
+        {
+            continue;
+        }
+        switch (op.kind)
+        {
+        case RecordedOpKind::kOpendir:
+        case RecordedOpKind::kReaddir:
+            entry->type = S_IFDIR;
+            break;
+        case RecordedOpKind::kReadlink:
+            entry->type = S_IFLNK;
+            break;
+        case RecordedOpKind::kGetattr:
+        case RecordedOpKind::kFgetattr:
+            if (op.mode & S_IFMT)
+            {
+                entry->type = op.mode & S_IFMT;
+            }
+            entry->size = std::max(entry->size, op.size);
+            break;
+        case RecordedOpKind::kRead:
+            entry->size = std::max(entry->size, op.offset + static_cast<uint64_t>(op.rc));
+            break;
+        case RecordedOpKind::kWrite:
+            entry->size = std::max(entry->size, op.offset + op.size);
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (const auto& [path, entry] : entries)
+    {
+        if (!entry.needed)
+        {
+            continue;
+        }
+        switch (entry.type)
+        {
+        case S_IFDIR:
+            check(ops_.vmkdir(path.c_str(), 0755, &ctx_));
+            break;
+        case S_IFLNK:
+            check(ops_.vsymlink("target", path.c_str(), &ctx_));
+            break;
+        default:
+        {
+            fuse_file_info info{};
+            check(ops_.vcreate(path.c_str(), 0644, &info, &ctx_));
+            DEFER(ops_.vrelease(nullptr, &info, &ctx_));
+            check(ops_.vftruncate(nullptr, static_cast<fuse_off_t>(entry.size), &info, &ctx_));
+            break;
+        }
+        }
+    }
+}
+
+std::shared_ptr<fuse_file_info> OpReplayer::find_handle(uint64_t handle)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto it = handles_.find(handle);
+    return it == handles_.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<fuse_file_info> OpReplayer::take_handle(uint64_t handle)
+{
+    std::shared_ptr<fuse_file_info> result;
+    {
+        LockGuard<Mutex> lg(mu_);
+        auto it = handles_.find(handle);
+        if (it == handles_.end())
+        {
+            return nullptr;
+        }
+        result = std::move(it->second);
+        handles_.erase(it);
+    }
+    // Another replaying thread may still be in a call with the handle, which must finish before
+    // the handle is released.
+    while (result.use_count() > 1)
+    {
+        std::this_thread::yield();
+    }
+    return result;
+}
+
+std::optional<int> OpReplayer::replay_one(const RecordedOp& op, std::vector<char>& buffer)
+{
+    const char* path = op.path.empty() ? nullptr : op.path.c_str();
+    const char* path2 = op.path2.c_str();
+    std::shared_ptr<fuse_file_info> info;
+    if (op.kind == RecordedOpKind::kRelease || op.kind == RecordedOpKind::kReleasedir)
+    {
+        info = take_handle(op.handle);
+    }
+    else if (needs_handle(op.kind))
+    {
+        info = find_handle(op.handle);
+    }
+    std::shared_ptr<fuse_file_info> info2;
+    if (op.kind == RecordedOpKind::kCopyFileRange)
+    {
+        info2 = find_handle(op.handle2);
+    }
+    if ((needs_handle(op.kind) && !info) || (op.kind == RecordedOpKind::kCopyFileRange && !info2))
+    {
+        return std::nullopt;
+    }
+    if (needs_buffer(op.kind) && buffer.size() < op.size)
+    {
+        buffer.resize(op.size, 'x');
+    }
+    auto open = [&](auto&& fn)
+    {
+        auto new_info = std::make_shared<fuse_file_info>();
+        new_info->flags = static_cast<int>(op.flags);
+        int rc = fn(new_info.get());
+        if (rc >= 0 && op.handle)
+        {
+            LockGuard<Mutex> lg(mu_);
+            handles_.insert_or_assign(op.handle, std::move(new_info));
+        }
+        else if (rc >= 0)
+        {
+            // Not opened successfully in the recording.
+            if (op.kind == RecordedOpKind::kOpendir)
+            {
+                ops_.vreleasedir(path, new_info.get(), &ctx_);
+            }
+            else
+            {
+                ops_.vrelease(path, new_info.get(), &ctx_);
+            }
+        }
+        return rc;
+    };
+
+    return call_ops(
+        [&]() -> int
+        {
+            switch (op.kind)
+            {
+            case RecordedOpKind::kStatfs:
+            {
+                fuse_statvfs buf{};
+                return ops_.vstatfs(path, &buf, &ctx_);
+            }
+            case RecordedOpKind::kGetattr:
+            {
+                fuse_stat st{};
+                return ops_.vgetattr(path, &st, &ctx_);
+            }
+            case RecordedOpKind::kFgetattr:
+            {
+                fuse_stat st{};
+                return ops_.vfgetattr(path, &st, info.get(), &ctx_);
+            }
+            case RecordedOpKind::kOpendir:
+                return open([&](fuse_file_info* i) { return ops_.vopendir(path, i, &ctx_); });
+            case RecordedOpKind::kReleasedir:
+                return ops_.vreleasedir(path, info.get(), &ctx_);
+            case RecordedOpKind::kReaddir:
+                return ops_.vreaddir(
+                    path,
+                    nullptr,
+                    [](void*, const char*, const fuse_stat*, fuse_off_t) { return 0; },
+                    static_cast<fuse_off_t>(op.offset),
+                    info.get(),
+                    &ctx_);
+            case RecordedOpKind::kCreate:
+                return open(
+                    [&](fuse_file_info* i)
+                    { return ops_.vcreate(path, static_cast<fuse_mode_t>(op.mode), i, &ctx_); });
+            case RecordedOpKind::kOpen:
+                return open([&](fuse_file_info* i) { return ops_.vopen(path, i, &ctx_); });
+            case RecordedOpKind::kRelease:
+                return ops_.vrelease(path, info.get(), &ctx_);
+            case RecordedOpKind::kRead:
+                return ops_.vread(path,
+                                  buffer.data(),
+                                  op.size,
+                                  static_cast<fuse_off_t>(op.offset),
+                                  info.get(),
+                                  &ctx_);
+            case RecordedOpKind::kWrite:
+                return ops_.vwrite(path,
+                                   buffer.data(),
+                                   op.size,
+                                   static_cast<fuse_off_t>(op.offset),
+                                   info.get(),
+                                   &ctx_);
+            case RecordedOpKind::kFlush:
+                return ops_.vflush(path, info.get(), &ctx_);
+            case RecordedOpKind::kFtruncate:
+                return ops_.vftruncate(
+                    path, static_cast<fuse_off_t>(op.size), info.get(), &ctx_);
+            case RecordedOpKind::kUnlink:
+                return ops_.vunlink(path, &ctx_);
+            case RecordedOpKind::kMkdir:
+                return ops_.vmkdir(path, static_cast<fuse_mode_t>(op.mode), &ctx_);
+            case RecordedOpKind::kRmdir:
+                return ops_.vrmdir(path, &ctx_);
+            case RecordedOpKind::kChmod:
+                return ops_.vchmod(path, static_cast<fuse_mode_t>(op.mode), &ctx_);
+            case RecordedOpKind::kChown:
+                return ops_.vchown(path, ctx_.uid, ctx_.gid, &ctx_);
+            case RecordedOpKind::kSymlink:
+                return ops_.vsymlink(path2, path, &ctx_);
+            case RecordedOpKind::kLink:
+                return ops_.vlink(path, path2, &ctx_);
+            case RecordedOpKind::kReadlink:
+                return ops_.vreadlink(path, buffer.data(), op.size, &ctx_);
+            case RecordedOpKind::kRename:
+                return ops_.vrename(path, path2, &ctx_);
+            case RecordedOpKind::kFsync:
+                return ops_.vfsync(path, static_cast<int>(op.flags), info.get(), &ctx_);
+            case RecordedOpKind::kTruncate:
+                return ops_.vtruncate(path, static_cast<fuse_off_t>(op.size), &ctx_);
+            case RecordedOpKind::kUtimens:
+            {
+                fuse_timespec ts[2];
+                OSService::get_current_time(ts[0]);
+                ts[1] = ts[0];
+                return ops_.vutimens(path, ts, &ctx_);
+            }
+            case RecordedOpKind::kListxattr:
+                return ops_.vlistxattr(path, op.size ? buffer.data() : nullptr, op.size, &ctx_);
+            case RecordedOpKind::kGetxattr:
+                return ops_.vgetxattr(path,
+                                      path2,
+                                      op.size ? buffer.data() : nullptr,
+                                      op.size,
+                                      static_cast<uint32_t>(op.offset),
+                                      &ctx_);
+            case RecordedOpKind::kSetxattr:
+                return ops_.vsetxattr(path,
+                                      path2,
+                                      buffer.data(),
+                                      op.size,
+                                      static_cast<int>(op.flags),
+                                      static_cast<uint32_t>(op.offset),
+                                      &ctx_);
+            case RecordedOpKind::kRemovexattr:
+                return ops_.vremovexattr(path, path2, &ctx_);
+            case RecordedOpKind::kFallocate:
+                return ops_.vfallocate(path,
+                                       static_cast<int>(op.flags),
+                                       static_cast<fuse_off_t>(op.offset),
+                                       static_cast<fuse_off_t>(op.size),
+                                       info.get(),
+                                       &ctx_);
+            case RecordedOpKind::kLseek:
+            {
+                fuse_off_t found = 0;
+                return ops_.vlseek(path,
+                                   static_cast<fuse_off_t>(op.offset),
+                                   static_cast<int>(op.flags),
+                                   &found,
+                                   info.get(),
+                                   &ctx_);
+            }
+            case RecordedOpKind::kCopyFileRange:
+                return ops_.vcopy_file_range(path,
+                                             info.get(),
+                                             static_cast<fuse_off_t>(op.offset),
+                                             path2,
+                                             info2.get(),
+                                             static_cast<fuse_off_t>(op.offset2),
+                                             op.size,
+                                             static_cast<int>(op.flags),
+                                             &ctx_);
+            }
+            return -ENOSYS;
+        });
+}
+
+OpReplayer::Result OpReplayer::replay(const std::vector<RecordedOp>& ops)
+{
+    Result result;
+    if (ops.empty())
+    {
+        return result;
+    }
+    OpStats recorded_stats, replayed_stats;
+    for (size_t i = 0; i < kNumOpKinds; ++i)
+    {
+        recorded_stats.register_op(kOpNames[i]);
+        replayed_stats.register_op(kOpNames[i]);
+    }
+    std::vector<const RecordedOp*> sorted;
+    sorted.reserve(ops.size());
+    unsigned thread_count = 0;
+    for (const auto& op : ops)
+    {
+        sorted.push_back(&op);
+        thread_count = std::max(thread_count, op.thread + 1);
+        recorded_stats.record(static_cast<size_t>(op.kind) - 1, op.duration_ns, op.rc);
+    }
+    std::stable_sort(sorted.begin(),
+                     sorted.end(),
+                     [](const RecordedOp* a, const RecordedOp* b)
+                     { return a->start_ns < b->start_ns; });
+    unsigned threads = options_.threads ? options_.threads : thread_count;
+    // All the operations of a recorded thread go to the same replaying thread, in order.
+    std::vector<std::vector<const RecordedOp*>> queues(threads);
+    for (const auto* op : sorted)
+    {
+        queues[op->thread % threads].push_back(op);
+    }
+
+    std::atomic<uint64_t> diverged{0}, skipped{0};
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    auto first_start_ns = sorted.front()->start_ns;
+    auto start = OpStats::Clock::now();
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back(
+            [&, t]()
+            {
+                try
+                {
+                    std::vector<char> buffer;
+                    for (const auto* op : queues[t])
+                    {
+                        if (options_.original_speed)
+                        {
+                            std::this_thread::sleep_until(
+                                start + std::chrono::nanoseconds(op->start_ns - first_start_ns));
+                        }
+                        auto op_start = OpStats::Clock::now();
+                        auto rc = replay_one(*op, buffer);
+                        if (!rc)
+                        {
+                            skipped.fetch_add(1);
+                            continue;
+                        }
+                        replayed_stats.record(static_cast<size_t>(op->kind) - 1, op_start, *rc);
+                        if ((*rc < 0) != (op->rc < 0))
+                        {
+                            diverged.fetch_add(1);
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    errors[t] = std::current_exception();
+                }
+            });
+    }
+    for (auto&& w : workers)
+    {
+        w.join();
+    }
+    result.seconds = std::chrono::duration<double>(OpStats::Clock::now() - start).count();
+    for (auto&& e : errors)
+    {
+        if (e)
+        {
+            std::rethrow_exception(e);
+        }
+    }
+
+    // Handles that were still open when the recording stopped.
+    {
+        LockGuard<Mutex> lg(mu_);
+        for (auto&& [id, info] : handles_)
+        {
+            call_ops([&]() { return ops_.vrelease(nullptr, info.get(), &ctx_); });
+        }
+        handles_.clear();
+    }
+
+    result.ops = ops.size();
+    result.diverged = diverged.load();
+    result.skipped = skipped.load();
+    result.recorded = recorded_stats.snapshot();
+    result.replayed = replayed_stats.snapshot();
+    return result;
+}
+
+std::string OpReplayer::Result::format_report() const
+{
+    std::string report = absl::StrFormat(
+        "Replayed %d operations in %.3f seconds, %d diverged from the recording, %d skipped\n\n",
+        ops,
+        seconds,
+        diverged,
+        skipped);
+    absl::StrAppendFormat(&report,
+                          "%-14s %10s %12s %12s %12s %12s %12s %12s %9s\n",
+                          "op",
+                          "count",
+                          "rec_mean_us",
+                          "mean_us",
+                          "rec_p50_us",
+                          "p50_us",
+                          "rec_p99_us",
+                          "p99_us",
+                          "delta");
+    for (const auto& r : replayed)
+    {
+        auto it = std::find_if(recorded.begin(),
+                               recorded.end(),
+                               [&](const OpStats::Summary& s) { return s.name == r.name; });
+        if (it == recorded.end() || it->count == 0 || it->total_ns == 0)
+        {
+            continue;
+        }
+        double recorded_mean = it->total_ns / 1e3 / it->count;
+        double replayed_mean = r.total_ns / 1e3 / r.count;
+        absl::StrAppendFormat(&report,
+                              "%-14s %10d %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %+8.1f%%\n",
+                              r.name,
+                              r.count,
+                              recorded_mean,
+                              replayed_mean,
+                              it->percentile(0.5) / 1e3,
+                              r.percentile(0.5) / 1e3,
+                              it->percentile(0.99) / 1e3,
+                              r.percentile(0.99) / 1e3,
+                              (replayed_mean / recorded_mean - 1) * 100);
+    }
+    return report;
+}
+}    // namespace securefs
@@ -0,0 +1,335 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "myutils.h"
+#include "op_stats.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace securefs
+{
+/// The calls of `FuseHighLevelOpsBase` that are recorded. The values are stored in recording
+/// files, so new kinds are only ever appended.
+enum class RecordedOpKind : uint8_t
+{
+    kStatfs = 1,
+    kGetattr,
+    kFgetattr,
+    kOpendir,
+    kReleasedir,
+    kReaddir,
+    kCreate,
+    kOpen,
+    kRelease,
+    kRead,
+    kWrite,
+    kFlush,
+    kFtruncate,
+    kUnlink,
+    kMkdir,
+    kRmdir,
+    kChmod,
+    kChown,
+    kSymlink,
+    kLink,
+    kReadlink,
+    kRename,
+    kFsync,
+    kTruncate,
+    kUtimens,
+    kListxattr,
+    kGetxattr,
+    kSetxattr,
+    kRemovexattr,
+    kFallocate,
+    kLseek,
+    kCopyFileRange,
+};
+
+/// The name of the operation, such as "getattr".
+std::string_view recorded_op_name(RecordedOpKind kind) noexcept;
+
+/// One call into `FuseHighLevelOpsBase`. The data that it transfers is never recorded, only the
+/// size of it.
+struct RecordedOp
+{
+    RecordedOpKind kind = RecordedOpKind::kGetattr;
+    // A small number that identifies the calling thread.
+    uint32_t thread = 0;
+    // Nanoseconds since the recording started.
+    uint64_t start_ns = 0;
+    uint64_t duration_ns = 0;
+    int64_t rc = 0;
+    std::string path;
+    // The destination of rename, link and copy_file_range, the target of symlink, or the name of
+    // an extended attribute.
+    std::string path2;
+    // Identifies the file or directory handle, or zero for calls without one.
+    uint64_t handle = 0;
+    uint64_t offset = 0;
+    // The size of reads, writes, truncations, allocations, copies and buffers, the file size
+    // found by getattr, or the offset found by lseek.
+    uint64_t size = 0;
+    // The mode of mkdir, create and chmod, or the file type found by getattr.
+    uint32_t mode = 0;
+    // The flags of open, opendir, create, setxattr and copy_file_range, the datasync argument of
+    // fsync, the mode of fallocate, or the whence of lseek.
+    uint32_t flags = 0;
+    // The destination handle and offset of copy_file_range, whose source is `handle` and
+    // `offset`. Only stored for that operation.
+    uint64_t handle2 = 0;
+    uint64_t offset2 = 0;
+};
+
+/// Writes `RecordedOp` one at a time in the format of recording files: `kMagic`, and then each
+/// operation as its kind in one byte followed by varints. Start times are stored as the difference
+/// from the previous operation. Each distinct path is written in full once, and by its index
+/// afterwards, so that long running recordings stay compact.
+class OpRecordingEncoder
+{
+public:
+    static constexpr std::string_view kMagic = "securefs-op-recording-1\n";
+
+    void append(const RecordedOp& op, std::string& out);
+
+private:
+    absl::flat_hash_map<std::string, uint64_t> path_ids_;
+    uint64_t last_start_ns_ = 0;
+
+private:
+    void append_path(const std::string& path, std::string& out);
+};
+
+/// A whole recording file, as written by `OpRecorder`.
+std::string encode_op_recording(const std::vector<RecordedOp>& ops);
+/// Throws on malformed data.
+std::vector<RecordedOp> decode_op_recording(std::string_view data);
+
+/// Appends operations to a recording file, from any number of threads. The operations are
+/// buffered, and written out in large chunks and on destruction.
+class OpRecorder
+{
+public:
+    /// With `anonymize`, every component of the paths, the symbolic link targets and the names of
+    /// extended attributes is replaced by a keyed hash. The key is random and never stored, so the
+    /// shape of the tree survives but the names do not.
+    OpRecorder(std::shared_ptr<FileStream> stream, bool anonymize);
+    ~OpRecorder();
+    DISABLE_COPY_MOVE(OpRecorder)
+
+    /// Nanoseconds since the recording started.
+    uint64_t now_ns() const noexcept;
+    void record(RecordedOp op);
+    void flush();
+
+    /// Assigns a small number to the `fh` of a handle that was just opened, since the values of
+    /// `fh` are pointers that should not end up in the file.
+    uint64_t open_handle(uint64_t fh);
+    /// Zero if the handle is unknown, such as one opened before the recording started.
+    uint64_t find_handle(uint64_t fh);
+    uint64_t close_handle(uint64_t fh);
+
+    static constexpr size_t kFlushSize = 1 << 20;
+
+private:
+    std::shared_ptr<FileStream> stream_;
+    bool anonymize_;
+    std::string key_;
+    OpStats::Clock::time_point start_;
+    Mutex mu_;
+    OpRecordingEncoder encoder_ ABSL_GUARDED_BY(mu_);
+    std::string buffer_ ABSL_GUARDED_BY(mu_);
+    uint64_t offset_ ABSL_GUARDED_BY(mu_) = 0;
+    Mutex handles_mu_;
+    absl::flat_hash_map<uint64_t, uint64_t> handles_ ABSL_GUARDED_BY(handles_mu_);
+    uint64_t last_handle_ ABSL_GUARDED_BY(handles_mu_) = 0;
+
+private:
+    std::string anonymize_path(std::string_view path) const;
+};
+
+/// Records every call that passes through it into an `OpRecorder`, and forwards it to another
+/// `FuseHighLevelOpsBase`.
+class RecordingOps : public FuseHighLevelOpsBase
+{
+public:
+    RecordingOps(FuseHighLevelOpsBase& inner, OpRecorder& recorder)
+        : inner_(inner), recorder_(recorder)
+    {
+    }
+
+    void initialize(fuse_conn_info* info) override { inner_.initialize(info); }
+    int vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx) override;
+    int vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx) override;
+    int vfgetattr(const char* path,
+                  fuse_stat* st,
+                  fuse_file_info* info,
+                  const fuse_context* ctx) override;
+    int vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreaddir(const char* path,
+                 void* buf,
+                 fuse_fill_dir_t filler,
+                 fuse_off_t off,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    int vcreate(const char* path,
+                fuse_mode_t mode,
+                fuse_file_info* info,
+                const fuse_context* ctx) override;
+    int vopen(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vread(const char* path,
+              char* buf,
+              size_t size,
+              fuse_off_t offset,
+              fuse_file_info* info,
+              const fuse_context* ctx) override;
+    int vwrite(const char* path,
+               const char* buf,
+               size_t size,
+               fuse_off_t offset,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vflush(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vftruncate(const char* path,
+                   fuse_off_t len,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vunlink(const char* path, const fuse_context* ctx) override;
+    int vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vrmdir(const char* path, const fuse_context* ctx) override;
+    int vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vchown(const char* path, fuse_uid_t uid, fuse_gid_t gid, const fuse_context* ctx) override;
+    int vsymlink(const char* to, const char* from, const fuse_context* ctx) override;
+    int vlink(const char* src, const char* dest, const fuse_context* ctx) override;
+    int vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx) override;
+    int vrename(const char* from, const char* to, const fuse_context* ctx) override;
+    int
+    vfsync(const char* path, int datasync, fuse_file_info* info, const fuse_context* ctx) override;
+    int vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx) override;
+    int vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx) override;
+    int vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx) override;
+    int vgetxattr(const char* path,
+                  const char* name,
+                  char* value,
+                  size_t size,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vsetxattr(const char* path,
+                  const char* name,
+                  const char* value,
+                  size_t size,
+                  int flags,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    int vfallocate(const char* path,
+                   int mode,
+                   fuse_off_t offset,
+                   fuse_off_t length,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vlseek(const char* path,
+               fuse_off_t offset,
+               int whence,
+               fuse_off_t* result,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vcopy_file_range(const char* path_in,
+                         fuse_file_info* info_in,
+                         fuse_off_t offset_in,
+                         const char* path_out,
+                         fuse_file_info* info_out,
+                         fuse_off_t offset_out,
+                         size_t size,
+                         int flags,
+                         const fuse_context* ctx) override;
+    bool has_getpath() const override { return inner_.has_getpath(); }
+    int vgetpath(const char* path,
+                 char* buf,
+                 size_t size,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override
+    {
+        return inner_.vgetpath(path, buf, size, info, ctx);
+    }
+
+private:
+    FuseHighLevelOpsBase& inner_;
+    OpRecorder& recorder_;
+
+private:
+    // Times `call`, which fills in the details of `op` and returns the result of the inner call,
+    // and records `op` even if it throws.
+    template <class Call>
+    int recorded(RecordedOpKind kind, const char* path, Call&& call);
+};
+
+/// Replays a recording against a `FuseHighLevelOpsBase`, such as a scratch repository, and
+/// compares the latencies with the recorded ones.
+///
+/// The operations of each recorded thread are issued in order by one replaying thread, and
+/// recorded threads are spread over the replaying threads. A handle opened by one recorded thread
+/// may be used by another, so at full speed an operation can come before the open of its handle,
+/// in which case it is skipped.
+class OpReplayer
+{
+public:
+    struct Options
+    {
+        // Zero means one per recorded thread.
+        unsigned threads = 0;
+        // Waits until the recorded start time of each operation, instead of issuing it as soon as
+        // the previous one of its thread is done.
+        bool original_speed = false;
+    };
+
+    struct Result
+    {
+        double seconds = 0;
+        uint64_t ops = 0;
+        // Operations whose success or failure differs from the recording.
+        uint64_t diverged = 0;
+        // Operations on a handle that was not open at that point.
+        uint64_t skipped = 0;
+        std::vector<OpStats::Summary> recorded, replayed;
+
+        /// A table of the latency percentiles of each kind of operation, recorded against
+        /// replayed.
+        std::string format_report() const;
+    };
+
+    OpReplayer(FuseHighLevelOpsBase& ops, Options options);
+
+    /// Creates the files, directories and symbolic links that the recording uses without creating
+    /// them first, since they existed before the recording started. Files are as large as the
+    /// furthest access to them.
+    void prepare(const std::vector<RecordedOp>& ops);
+
+    Result replay(const std::vector<RecordedOp>& ops);
+
+private:
+    FuseHighLevelOpsBase& ops_;
+    Options options_;
+    fuse_context ctx_{};
+    Mutex mu_;
+    absl::flat_hash_map<uint64_t, std::shared_ptr<fuse_file_info>> handles_ ABSL_GUARDED_BY(mu_);
+
+private:
+    // Returns the result of the call, or nullopt if its handle is not open.
+    std::optional<int> replay_one(const RecordedOp& op, std::vector<char>& buffer);
+    std::shared_ptr<fuse_file_info> find_handle(uint64_t handle);
+    std::shared_ptr<fuse_file_info> take_handle(uint64_t handle);
+};
+}    // namespace securefs
@@ -0,0 +1,349 @@
+#include "op_stats.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/numeric/bits.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <cmath>
+
+#ifndef _WIN32
+#include <csignal>
+#endif
+
+namespace securefs
+{
+namespace
+{
+    void bump(std::atomic<uint64_t>& counter, uint64_t delta) noexcept
+    {
+        // Only the owning thread writes to its counters, so there is no need for an atomic
+        // read-modify-write.
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    std::atomic<bool> dump_requested{false};
+}    // namespace
+
+size_t OpStats::bucket_index(uint64_t value) noexcept
+{
+    if (value < kSubBuckets)
+    {
+        return static_cast<size_t>(value);
+    }
+    size_t exponent = 63 - absl::countl_zero(value);
+    if (exponent > kMaxExponent)
+    {
+        return kNumBuckets - 1;
+    }
+    size_t sub = static_cast<size_t>(value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+    return kSubBuckets * (exponent - kSubBucketBits + 1) + sub;
+}
+
+uint64_t OpStats::bucket_upper_bound(size_t index) noexcept
+{
+    if (index < kSubBuckets)
+    {
+        return index;
+    }
+    size_t exponent = index / kSubBuckets - 1 + kSubBucketBits;
+    size_t sub = index % kSubBuckets;
+    uint64_t lower = uint64_t(kSubBuckets + sub) << (exponent - kSubBucketBits);
+    return lower + (uint64_t(1) << (exponent - kSubBucketBits)) - 1;
+}
+
+uint64_t OpStats::Summary::percentile(double q) const noexcept
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    auto target = static_cast<uint64_t>(std::ceil(q * static_cast<double>(count)));
+    target = std::clamp<uint64_t>(target, 1, count);
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < buckets.size(); ++i)
+    {
+        cumulative += buckets[i];
+        if (cumulative >= target)
+        {
+            return std::min(bucket_upper_bound(i), max_ns);
+        }
+    }
+    return max_ns;
+}
+
+OpStats& OpStats::global()
+{
+    static OpStats stats;
+    return stats;
+}
+
+OpStats::OpStats()
+    : threads_([]() { return std::make_unique<ThreadCounters>(); },
+               [](ThreadCounters& from, ThreadCounters& into) { into.merge_from(from); })
+{
+}
+
+void OpStats::ThreadCounters::merge_from(const ThreadCounters& other) noexcept
+{
+    for (size_t i = 0; i < kMaxOps; ++i)
+    {
+        auto& c = ops[i];
+        const auto& o = other.ops[i];
+        bump(c.count, o.count.load(std::memory_order_relaxed));
+        bump(c.errors, o.errors.load(std::memory_order_relaxed));
+        bump(c.bytes, o.bytes.load(std::memory_order_relaxed));
+        bump(c.total_ns, o.total_ns.load(std::memory_order_relaxed));
+        c.max_ns.store(std::max(c.max_ns.load(std::memory_order_relaxed),
+                                o.max_ns.load(std::memory_order_relaxed)),
+                       std::memory_order_relaxed);
+        for (size_t b = 0; b < kNumBuckets; ++b)
+        {
+            bump(c.buckets[b], o.buckets[b].load(std::memory_order_relaxed));
+        }
+    }
+    for (size_t i = 0; i < kMaxCounters; ++i)
+    {
+        bump(counters[i], other.counters[i].load(std::memory_order_relaxed));
+    }
+}
+
+size_t OpStats::register_op(std::string_view name)
+{
+    LockGuard<Mutex> lg(mu_);
+    for (size_t i = 0; i < names_.size(); ++i)
+    {
+        if (names_[i] == name)
+        {
+            return i;
+        }
+    }
+    if (names_.size() >= kMaxOps)
+    {
+        return kMaxOps - 1;
+    }
+    names_.emplace_back(name);
+    return names_.size() - 1;
+}
+
+size_t OpStats::register_counter(std::string_view name)
+{
+    LockGuard<Mutex> lg(mu_);
+    for (size_t i = 0; i < counter_names_.size(); ++i)
+    {
+        if (counter_names_[i] == name)
+        {
+            return i;
+        }
+    }
+    if (counter_names_.size() >= kMaxCounters)
+    {
+        return kMaxCounters - 1;
+    }
+    counter_names_.emplace_back(name);
+    return counter_names_.size() - 1;
+}
+
+void OpStats::add(size_t counter, int64_t delta) noexcept
+{
+    ThreadCounters* counters;
+    try
+    {
+        counters = &threads_.local();
+    }
+    catch (...)
+    {
+        return;
+    }
+    // Wraps around for negative deltas, and the merged sum wraps back.
+    bump(counters->counters[std::min(counter, kMaxCounters - 1)], static_cast<uint64_t>(delta));
+}
+
+std::vector<std::pair<std::string, int64_t>> OpStats::counters()
+{
+    LockGuard<Mutex> lg(mu_);
+    std::vector<std::pair<std::string, int64_t>> result;
+    for (size_t i = 0; i < counter_names_.size(); ++i)
+    {
+        uint64_t sum = 0;
+        threads_.for_each([&](const ThreadCounters& t)
+                          { sum += t.counters[i].load(std::memory_order_relaxed); });
+        result.emplace_back(counter_names_[i], static_cast<int64_t>(sum));
+    }
+    return result;
+}
+
+std::vector<std::string> OpStats::op_names()
+{
+    LockGuard<Mutex> lg(mu_);
+    return names_;
+}
+
+void OpStats::record(size_t op, uint64_t latency_ns, int64_t rc) noexcept
+{
+    ThreadCounters* counters;
+    try
+    {
+        counters = &threads_.local();
+    }
+    catch (...)
+    {
+        return;
+    }
+    auto& c = counters->ops[std::min(op, kMaxOps - 1)];
+    bump(c.count, 1);
+    if (rc < 0)
+    {
+        bump(c.errors, 1);
+    }
+    else if (rc > 0)
+    {
+        bump(c.bytes, static_cast<uint64_t>(rc));
+    }
+    bump(c.total_ns, latency_ns);
+    if (latency_ns > c.max_ns.load(std::memory_order_relaxed))
+    {
+        c.max_ns.store(latency_ns, std::memory_order_relaxed);
+    }
+    bump(c.buckets[bucket_index(latency_ns)], 1);
+}
+
+std::vector<OpStats::Summary> OpStats::snapshot()
+{
+    LockGuard<Mutex> lg(mu_);
+    std::vector<Summary> result;
+    for (size_t i = 0; i < names_.size(); ++i)
+    {
+        Summary s;
+        s.name = names_[i];
+        threads_.for_each(
+            [&](const ThreadCounters& t)
+            {
+                const auto& c = t.ops[i];
+                s.count += c.count.load(std::memory_order_relaxed);
+                s.errors += c.errors.load(std::memory_order_relaxed);
+                s.bytes += c.bytes.load(std::memory_order_relaxed);
+                s.total_ns += c.total_ns.load(std::memory_order_relaxed);
+                s.max_ns = std::max(s.max_ns, c.max_ns.load(std::memory_order_relaxed));
+                for (size_t b = 0; b < kNumBuckets; ++b)
+                {
+                    s.buckets[b] += c.buckets[b].load(std::memory_order_relaxed);
+                }
+            });
+        if (s.count > 0)
+        {
+            result.push_back(std::move(s));
+        }
+    }
+    return result;
+}
+
+std::string OpStats::format_report()
+{
+    std::string report = absl::StrFormat("%-14s %12s %8s %14s %10s %10s %10s %10s %10s %10s\n",
+                                         "op",
+                                         "count",
+                                         "errors",
+                                         "bytes",
+                                         "mean_us",
+                                         "p50_us",
+                                         "p90_us",
+                                         "p99_us",
+                                         "p999_us",
+                                         "max_us");
+    for (const auto& s : snapshot())
+    {
+        absl::StrAppendFormat(&report,
+                              "%-14s %12d %8d %14d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                              s.name,
+                              s.count,
+                              s.errors,
+                              s.bytes,
+                              s.total_ns / 1e3 / s.count,
+                              s.percentile(0.5) / 1e3,
+                              s.percentile(0.9) / 1e3,
+                              s.percentile(0.99) / 1e3,
+                              s.percentile(0.999) / 1e3,
+                              s.max_ns / 1e3);
+    }
+    auto all_counters = counters();
+    if (all_counters.empty())
+    {
+        return report;
+    }
+    report.push_back('\n');
+    absl::flat_hash_map<std::string_view, int64_t> by_name;
+    for (const auto& [name, value] : all_counters)
+    {
+        absl::StrAppendFormat(&report, "%-32s %14d\n", name, value);
+        by_name.emplace(name, value);
+    }
+    for (const auto& [name, hits] : all_counters)
+    {
+        if (!absl::EndsWith(name, "_hits"))
+        {
+            continue;
+        }
+        auto prefix = absl::string_view(name).substr(0, name.size() - 5);
+        auto it = by_name.find(absl::StrCat(prefix, "_misses"));
+        if (it == by_name.end() || hits + it->second <= 0)
+        {
+            continue;
+        }
+        absl::StrAppendFormat(&report,
+                              "%-32s %14.3f\n",
+                              absl::StrCat(prefix, "_hit_rate"),
+                              static_cast<double>(hits) / static_cast<double>(hits + it->second));
+    }
+    return report;
+}
+
+OpStatsDumper::OpStatsDumper(std::string path, unsigned interval_seconds)
+    : path_(std::move(path))
+    , interval_(interval_seconds)
+    , next_dump_(OpStats::Clock::now() + interval_)
+{
+#ifndef _WIN32
+    install_signal_handler(SIGUSR1, [](int) { dump_requested.store(true); });
+#endif
+    poller_ = std::make_unique<PollingThread>([this]() { poll(); });
+}
+
+OpStatsDumper::~OpStatsDumper()
+{
+    poller_.reset();
+    dump();
+}
+
+void OpStatsDumper::dump()
+{
+    try
+    {
+        auto report = OpStats::global().format_report();
+        auto tmp_path = path_ + ".tmp";
+        OSService::get_default()
+            .open_file_stream(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+            ->write(report.data(), 0, report.size());
+        OSService::get_default().rename(tmp_path, path_);
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to write operation statistics to %s: %s", path_, e.what());
+    }
+}
+
+void OpStatsDumper::poll()
+{
+    auto now = OpStats::Clock::now();
+    if (dump_requested.exchange(false) || (interval_.count() > 0 && now >= next_dump_))
+    {
+        dump();
+        next_dump_ = now + interval_;
+    }
+}
+}    // namespace securefs
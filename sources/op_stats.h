@@ -0,0 +1,156 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+#include "polling_thread.h"
+#include "thread_local.h"
+
+#include <absl/base/thread_annotations.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace securefs
+{
+/// Always on statistics of the FUSE operations: counts, errors, bytes and latency histograms.
+///
+/// Each thread updates its own cache line aligned counters without any atomic read-modify-write,
+/// and readers merge the counters of all threads. The histograms are log-linear in the style of
+/// HDR histograms, with four buckets per power of two, so that percentiles are accurate to within
+/// 25%.
+class OpStats
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t kMaxOps = 64;
+    static constexpr size_t kMaxCounters = 32;
+    static constexpr size_t kSubBucketBits = 2;
+    static constexpr size_t kSubBuckets = size_t(1) << kSubBucketBits;
+    // Covers latencies up to 2^40 nanoseconds, beyond which values land in the last bucket.
+    static constexpr size_t kMaxExponent = 40;
+    static constexpr size_t kNumBuckets = kSubBuckets * (kMaxExponent - kSubBucketBits + 2);
+
+    static size_t bucket_index(uint64_t value) noexcept;
+    /// The largest value that falls into the bucket.
+    static uint64_t bucket_upper_bound(size_t index) noexcept;
+
+    struct Summary
+    {
+        std::string name;
+        uint64_t count = 0;
+        uint64_t errors = 0;
+        // Sum of the positive return values, i.e. the bytes transferred by reads and writes.
+        uint64_t bytes = 0;
+        uint64_t total_ns = 0;
+        uint64_t max_ns = 0;
+        std::array<uint64_t, kNumBuckets> buckets{};
+
+        /// Returns the upper bound of the bucket that contains the `q` quantile, in nanoseconds.
+        uint64_t percentile(double q) const noexcept;
+    };
+
+    OpStats();
+    DISABLE_COPY_MOVE(OpStats)
+
+    static OpStats& global();
+
+    /// Returns the slot for the operation named `name`. Registering the same name again returns
+    /// the same slot. When all slots are taken, the operations share the last one.
+    size_t register_op(std::string_view name);
+
+    void record(size_t op, uint64_t latency_ns, int64_t rc) noexcept;
+    void record(size_t op, Clock::time_point start, int64_t rc) noexcept
+    {
+        auto elapsed = Clock::now() - start;
+        record(op,
+               static_cast<uint64_t>(
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+               rc);
+    }
+
+    /// The registered names, indexed by slot.
+    std::vector<std::string> op_names();
+
+    /// Merges the counters of all threads. Operations that were never called are omitted.
+    std::vector<Summary> snapshot();
+
+    /// Returns the slot for a free form counter, such as the number of bytes decrypted or the
+    /// number of cached files. The slots are shared the same way as those of `register_op`.
+    size_t register_counter(std::string_view name);
+    /// Counters may go down as well as up, so that they can track gauges.
+    void add(size_t counter, int64_t delta) noexcept;
+    /// Merges the counters of all threads, in the order of registration.
+    std::vector<std::pair<std::string, int64_t>> counters();
+
+    /// A counter of `global()`, meant to be kept in a function local static variable.
+    class Counter
+    {
+    public:
+        explicit Counter(std::string_view name) : slot_(global().register_counter(name)) {}
+        void add(int64_t delta) const noexcept { global().add(slot_, delta); }
+
+    private:
+        size_t slot_;
+    };
+
+    /// A human readable table of `snapshot()`, followed by `counters()` and the hit rate of each
+    /// pair of counters named `*_hits` and `*_misses`.
+    std::string format_report();
+
+private:
+    struct alignas(64) OpCounters
+    {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+        std::array<std::atomic<uint64_t>, kNumBuckets> buckets{};
+    };
+
+    struct ThreadCounters
+    {
+        std::array<OpCounters, kMaxOps> ops;
+        alignas(64) std::array<std::atomic<uint64_t>, kMaxCounters> counters{};
+
+        // Adds the counters of an exited thread.
+        void merge_from(const ThreadCounters& other) noexcept;
+    };
+
+    Mutex mu_;
+    std::vector<std::string> names_ ABSL_GUARDED_BY(mu_);
+    std::vector<std::string> counter_names_ ABSL_GUARDED_BY(mu_);
+    PerThread<ThreadCounters> threads_;
+};
+
+/// Writes `OpStats::global().format_report()` to a file periodically, and whenever the process
+/// receives SIGUSR1.
+class OpStatsDumper
+{
+public:
+    /// With zero `interval_seconds`, the report is only written on SIGUSR1 and on destruction.
+    OpStatsDumper(std::string path, unsigned interval_seconds);
+    ~OpStatsDumper();
+    DISABLE_COPY_MOVE(OpStatsDumper)
+
+    void dump();
+
+private:
+    std::string path_;
+    std::chrono::seconds interval_;
+    OpStats::Clock::time_point next_dump_;
+    std::unique_ptr<PollingThread> poller_;
+
+private:
+    void poll();
+};
+}    // namespace securefs
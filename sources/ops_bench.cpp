@@ -0,0 +1,481 @@
+#include "ops_bench.h"
+#include "exceptions.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <random>
+#include <thread>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    constexpr std::pair<OpsBenchmark::Workload, std::string_view> kWorkloadNames[] = {
+        {OpsBenchmark::Workload::kSeqWrite, "seq_write"},
+        {OpsBenchmark::Workload::kSeqRead, "seq_read"},
+        {OpsBenchmark::Workload::kRandWrite, "rand_write"},
+        {OpsBenchmark::Workload::kRandRead, "rand_read"},
+        {OpsBenchmark::Workload::kSmallFiles, "small_files"},
+        {OpsBenchmark::Workload::kReaddir, "readdir"},
+        {OpsBenchmark::Workload::kRename, "rename"},
+    };
+
+    // The directory shared by all threads in the readdir and rename workloads.
+    constexpr const char* kSharedDir = "/shared";
+
+    std::string thread_dir(unsigned thread) { return absl::StrCat("/t", thread); }
+
+    std::string thread_file(unsigned thread, unsigned index)
+    {
+        return absl::StrCat("/t", thread, "/f", index);
+    }
+
+    std::string shared_file(unsigned thread, unsigned index)
+    {
+        return absl::StrCat(kSharedDir, "/t", thread, "-f", index);
+    }
+
+    void check(int rc)
+    {
+        if (rc < 0)
+        {
+            throwVFSException(-rc);
+        }
+    }
+
+    // Calls `fn` and records its latency and return value under `op`.
+    template <class Fn>
+    int timed(OpStats& stats, size_t op, Fn&& fn)
+    {
+        auto start = OpStats::Clock::now();
+        int rc = fn();
+        stats.record(op, start, rc);
+        check(rc);
+        return rc;
+    }
+}    // namespace
+
+std::vector<OpsBenchmark::Workload> OpsBenchmark::all_workloads()
+{
+    std::vector<Workload> result;
+    for (const auto& [workload, name] : kWorkloadNames)
+    {
+        result.push_back(workload);
+    }
+    return result;
+}
+
+std::string_view OpsBenchmark::workload_name(Workload workload) noexcept
+{
+    for (const auto& [w, name] : kWorkloadNames)
+    {
+        if (w == workload)
+        {
+            return name;
+        }
+    }
+    return "unknown";
+}
+
+OpsBenchmark::Workload OpsBenchmark::parse_workload(std::string_view name)
+{
+    for (const auto& [workload, n] : kWorkloadNames)
+    {
+        if (n == name)
+        {
+            return workload;
+        }
+    }
+    throwInvalidArgumentException(absl::StrCat("Unknown workload ", name));
+}
+
+uint64_t OpsBenchmark::Result::total_ops() const noexcept
+{
+    uint64_t total = 0;
+    for (const auto& c : calls)
+    {
+        total += c.count;
+    }
+    return total;
+}
+
+uint64_t OpsBenchmark::Result::total_bytes() const noexcept
+{
+    uint64_t total = 0;
+    for (const auto& c : calls)
+    {
+        total += c.bytes;
+    }
+    return total;
+}
+
+std::string OpsBenchmark::Result::to_json() const
+{
+    double elapsed = std::max(seconds, 1e-9);
+    auto result = absl::StrFormat(R"({"workload": "%s", "threads": %d, "seconds": %.6f, )"
+                                  R"("ops": %d, "bytes": %d, "ops_per_second": %.1f, )"
+                                  R"("mib_per_second": %.2f)",
+                                  workload_name(workload),
+                                  threads,
+                                  seconds,
+                                  total_ops(),
+                                  total_bytes(),
+                                  total_ops() / elapsed,
+                                  total_bytes() / elapsed / (1 << 20));
+    if (workload == Workload::kReaddir)
+    {
+        absl::StrAppendFormat(&result,
+                              R"(, "entries": %d, "entries_per_second": %.1f)",
+                              entries,
+                              entries / elapsed);
+    }
+    result.append(R"(, "latency_ns": {)");
+    for (size_t i = 0; i < calls.size(); ++i)
+    {
+        const auto& c = calls[i];
+        absl::StrAppendFormat(&result,
+                              R"(%s"%s": {"count": %d, "mean": %d, "p50": %d, "p90": %d, )"
+                              R"("p99": %d, "p999": %d, "max": %d})",
+                              i > 0 ? ", " : "",
+                              c.name,
+                              c.count,
+                              c.count > 0 ? c.total_ns / c.count : 0,
+                              c.percentile(0.5),
+                              c.percentile(0.9),
+                              c.percentile(0.99),
+                              c.percentile(0.999),
+                              c.max_ns);
+    }
+    result.append("}}");
+    return result;
+}
+
+OpsBenchmark::OpsBenchmark(FuseHighLevelOpsBase& ops, Options options)
+    : ops_(ops), options_(options)
+{
+    if (options_.threads == 0)
+    {
+        throwInvalidArgumentException("The number of threads must be positive");
+    }
+    if (options_.io_size == 0 || options_.file_size < options_.io_size)
+    {
+        throwInvalidArgumentException("The I/O size must be positive and at most the file size");
+    }
+    ctx_.uid = OSService::getuid();
+    ctx_.gid = OSService::getgid();
+}
+
+OpsBenchmark::Result OpsBenchmark::run(Workload workload)
+{
+    OpStats stats;
+    Result result;
+    result.workload = workload;
+    result.threads = options_.threads;
+    switch (workload)
+    {
+    case Workload::kSeqWrite:
+    case Workload::kSeqRead:
+    case Workload::kRandWrite:
+    case Workload::kRandRead:
+        result.seconds = run_io(workload, stats);
+        break;
+    case Workload::kSmallFiles:
+        result.seconds = run_small_files(stats);
+        break;
+    case Workload::kReaddir:
+        result.seconds = run_readdir(stats, &result.entries);
+        break;
+    case Workload::kRename:
+        result.seconds = run_rename(stats);
+        break;
+    }
+    result.calls = stats.snapshot();
+    return result;
+}
+
+double OpsBenchmark::run_threads(absl::FunctionRef<void(unsigned)> body)
+{
+    std::vector<std::exception_ptr> errors(options_.threads);
+    std::vector<std::thread> threads;
+    threads.reserve(options_.threads);
+    auto start = OpStats::Clock::now();
+    for (unsigned t = 0; t < options_.threads; ++t)
+    {
+        threads.emplace_back(
+            [&, t]()
+            {
+                try
+                {
+                    body(t);
+                }
+                catch (...)
+                {
+                    errors[t] = std::current_exception();
+                }
+            });
+    }
+    for (auto&& t : threads)
+    {
+        t.join();
+    }
+    auto elapsed = std::chrono::duration<double>(OpStats::Clock::now() - start).count();
+    for (auto&& e : errors)
+    {
+        if (e)
+        {
+            std::rethrow_exception(e);
+        }
+    }
+    return elapsed;
+}
+
+void OpsBenchmark::mkdir(const std::string& path)
+{
+    check(ops_.vmkdir(path.c_str(), 0755, &ctx_));
+}
+
+void OpsBenchmark::rmdir(const std::string& path) { check(ops_.vrmdir(path.c_str(), &ctx_)); }
+
+void OpsBenchmark::unlink(const std::string& path) { check(ops_.vunlink(path.c_str(), &ctx_)); }
+
+void OpsBenchmark::create_file(const std::string& path, uint64_t size)
+{
+    fuse_file_info info{};
+    info.flags = O_RDWR;
+    check(ops_.vcreate(path.c_str(), 0644, &info, &ctx_));
+    std::vector<char> buffer(std::min<uint64_t>(size, 1 << 20), 'x');
+    for (uint64_t offset = 0; offset < size; offset += buffer.size())
+    {
+        auto length = std::min<uint64_t>(buffer.size(), size - offset);
+        check(ops_.vwrite(nullptr,
+                          buffer.data(),
+                          length,
+                          static_cast<fuse_off_t>(offset),
+                          &info,
+                          &ctx_));
+    }
+    check(ops_.vrelease(nullptr, &info, &ctx_));
+}
+
+double OpsBenchmark::run_io(Workload workload, OpStats& stats)
+{
+    bool is_write = workload == Workload::kSeqWrite || workload == Workload::kRandWrite;
+    bool is_random = workload == Workload::kRandWrite || workload == Workload::kRandRead;
+    bool is_fresh = workload == Workload::kSeqWrite;
+    uint64_t io_size = options_.io_size;
+    uint64_t io_count = options_.file_size / io_size;
+
+    // Random writes overwrite existing data, as in a database file or a VM image.
+    run_threads(
+        [&](unsigned t)
+        {
+            mkdir(thread_dir(t));
+            if (!is_fresh)
+            {
+                create_file(thread_file(t, 0), io_count * io_size);
+            }
+        });
+
+    auto open_op = stats.register_op(is_fresh ? "create" : "open");
+    auto io_op = stats.register_op(is_write ? "write" : "read");
+    auto release_op = stats.register_op("release");
+    double seconds = run_threads(
+        [&](unsigned t)
+        {
+            std::vector<char> buffer(io_size, 'x');
+            std::mt19937_64 engine(t);
+            std::uniform_int_distribution<uint64_t> block_dist(0, io_count - 1);
+            auto path = thread_file(t, 0);
+            fuse_file_info info{};
+            info.flags = O_RDWR;
+            if (is_fresh)
+            {
+                timed(stats,
+                      open_op,
+                      [&]() { return ops_.vcreate(path.c_str(), 0644, &info, &ctx_); });
+            }
+            else
+            {
+                timed(stats, open_op, [&]() { return ops_.vopen(path.c_str(), &info, &ctx_); });
+            }
+            for (uint64_t i = 0; i < io_count; ++i)
+            {
+                auto block = is_random ? block_dist(engine) : i;
+                auto offset = static_cast<fuse_off_t>(block * io_size);
+                if (is_write)
+                {
+                    timed(stats,
+                          io_op,
+                          [&]()
+                          {
+                              return ops_.vwrite(
+                                  nullptr, buffer.data(), io_size, offset, &info, &ctx_);
+                          });
+                }
+                else
+                {
+                    timed(stats,
+                          io_op,
+                          [&]()
+                          {
+                              return ops_.vread(
+                                  nullptr, buffer.data(), io_size, offset, &info, &ctx_);
+                          });
+                }
+            }
+            timed(stats, release_op, [&]() { return ops_.vrelease(nullptr, &info, &ctx_); });
+        });
+
+    run_threads(
+        [&](unsigned t)
+        {
+            unlink(thread_file(t, 0));
+            rmdir(thread_dir(t));
+        });
+    return seconds;
+}
+
+double OpsBenchmark::run_small_files(OpStats& stats)
+{
+    run_threads([&](unsigned t) { mkdir(thread_dir(t)); });
+
+    auto create_op = stats.register_op("create");
+    auto release_op = stats.register_op("release");
+    auto getattr_op = stats.register_op("getattr");
+    auto unlink_op = stats.register_op("unlink");
+    double seconds = run_threads(
+        [&](unsigned t)
+        {
+            for (unsigned i = 0; i < options_.file_count; ++i)
+            {
+                auto path = thread_file(t, i);
+                fuse_file_info info{};
+                info.flags = O_RDWR;
+                timed(stats,
+                      create_op,
+                      [&]() { return ops_.vcreate(path.c_str(), 0644, &info, &ctx_); });
+                timed(stats, release_op, [&]() { return ops_.vrelease(nullptr, &info, &ctx_); });
+            }
+            for (unsigned i = 0; i < options_.file_count; ++i)
+            {
+                auto path = thread_file(t, i);
+                fuse_stat st{};
+                timed(stats,
+                      getattr_op,
+                      [&]() { return ops_.vgetattr(path.c_str(), &st, &ctx_); });
+            }
+            for (unsigned i = 0; i < options_.file_count; ++i)
+            {
+                auto path = thread_file(t, i);
+                timed(stats, unlink_op, [&]() { return ops_.vunlink(path.c_str(), &ctx_); });
+            }
+        });
+
+    run_threads([&](unsigned t) { rmdir(thread_dir(t)); });
+    return seconds;
+}
+
+double OpsBenchmark::run_readdir(OpStats& stats, uint64_t* entries)
+{
+    auto entry_name = [](unsigned index) { return absl::StrCat(kSharedDir, "/e", index); };
+
+    mkdir(kSharedDir);
+    run_threads(
+        [&](unsigned t)
+        {
+            for (unsigned i = t; i < options_.dir_entries; i += options_.threads)
+            {
+                create_file(entry_name(i), 0);
+            }
+        });
+
+    auto opendir_op = stats.register_op("opendir");
+    auto readdir_op = stats.register_op("readdir");
+    auto releasedir_op = stats.register_op("releasedir");
+    std::atomic<uint64_t> total_entries{0};
+    double seconds = run_threads(
+        [&](unsigned t)
+        {
+            fuse_file_info info{};
+            timed(stats, opendir_op, [&]() { return ops_.vopendir(kSharedDir, &info, &ctx_); });
+            uint64_t count = 0;
+            timed(stats,
+                  readdir_op,
+                  [&]()
+                  {
+                      return ops_.vreaddir(
+                          kSharedDir,
+                          &count,
+                          [](void* buf, const char* name, const fuse_stat* st, fuse_off_t off)
+                          {
+                              ++*static_cast<uint64_t*>(buf);
+                              return 0;
+                          },
+                          0,
+                          &info,
+                          &ctx_);
+                  });
+            timed(stats,
+                  releasedir_op,
+                  [&]() { return ops_.vreleasedir(kSharedDir, &info, &ctx_); });
+            total_entries += count;
+        });
+    *entries = total_entries.load();
+
+    run_threads(
+        [&](unsigned t)
+        {
+            for (unsigned i = t; i < options_.dir_entries; i += options_.threads)
+            {
+                unlink(entry_name(i));
+            }
+        });
+    rmdir(kSharedDir);
+    return seconds;
+}
+
+double OpsBenchmark::run_rename(OpStats& stats)
+{
+    mkdir(kSharedDir);
+    run_threads(
+        [&](unsigned t)
+        {
+            mkdir(thread_dir(t));
+            for (unsigned i = 0; i < options_.file_count; ++i)
+            {
+                create_file(thread_file(t, i), 0);
+            }
+        });
+
+    auto rename_op = stats.register_op("rename");
+    double seconds = run_threads(
+        [&](unsigned t)
+        {
+            for (unsigned i = 0; i < options_.file_count; ++i)
+            {
+                auto from = thread_file(t, i), to = shared_file(t, i);
+                timed(stats,
+                      rename_op,
+                      [&]() { return ops_.vrename(from.c_str(), to.c_str(), &ctx_); });
+            }
+        });
+
+    run_threads(
+        [&](unsigned t)
+        {
+            for (unsigned i = 0; i < options_.file_count; ++i)
+            {
+                unlink(shared_file(t, i));
+            }
+            rmdir(thread_dir(t));
+        });
+    rmdir(kSharedDir);
+    return seconds;
+}
+}    // namespace securefs
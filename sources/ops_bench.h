@@ -0,0 +1,100 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "op_stats.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/functional/function_ref.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace securefs
+{
+/// Runs synthetic workloads directly against the `v*` methods of a `FuseHighLevelOpsBase`, so that
+/// the cost of securefs itself can be measured without the kernel and libfuse in the way.
+///
+/// Each thread works in its own directory, except in the readdir workload where all threads list
+/// the same one. The files that a workload needs are prepared before, and removed after, the
+/// timed phase.
+class OpsBenchmark
+{
+public:
+    enum class Workload
+    {
+        kSeqWrite,
+        kSeqRead,
+        kRandWrite,
+        kRandRead,
+        // Creates, stats and unlinks many empty files.
+        kSmallFiles,
+        // Lists a directory with many entries.
+        kReaddir,
+        // Moves many files into a directory shared by all threads.
+        kRename,
+    };
+
+    static std::vector<Workload> all_workloads();
+    static std::string_view workload_name(Workload workload) noexcept;
+    /// Throws on unknown names.
+    static Workload parse_workload(std::string_view name);
+
+    struct Options
+    {
+        unsigned threads = 1;
+        // Size of the file of each thread in the read and write workloads.
+        uint64_t file_size = 64 << 20;
+        // Size of each read and write.
+        uint32_t io_size = 128 << 10;
+        // Number of files of each thread in the small file and rename workloads.
+        unsigned file_count = 1000;
+        // Number of entries in the directory of the readdir workload.
+        unsigned dir_entries = 100000;
+    };
+
+    struct Result
+    {
+        Workload workload = Workload::kSeqWrite;
+        unsigned threads = 0;
+        double seconds = 0;
+        // Directory entries returned by the readdir workload.
+        uint64_t entries = 0;
+        // The counts and latencies of each kind of call, such as "create", "getattr" and "unlink"
+        // for the small file workload.
+        std::vector<OpStats::Summary> calls;
+
+        uint64_t total_ops() const noexcept;
+        uint64_t total_bytes() const noexcept;
+        /// A JSON object with the throughput and the latency percentiles of each kind of call.
+        std::string to_json() const;
+    };
+
+    OpsBenchmark(FuseHighLevelOpsBase& ops, Options options);
+
+    Result run(Workload workload);
+
+private:
+    FuseHighLevelOpsBase& ops_;
+    Options options_;
+    fuse_context ctx_{};
+
+private:
+    // Runs `body(thread_index)` on `options_.threads` threads, rethrows the first failure, and
+    // returns the elapsed seconds.
+    double run_threads(absl::FunctionRef<void(unsigned)> body);
+
+    void mkdir(const std::string& path);
+    void rmdir(const std::string& path);
+    void create_file(const std::string& path, uint64_t size);
+    void unlink(const std::string& path);
+
+    // Each of these returns the seconds spent in the timed phase.
+    double run_io(Workload workload, OpStats& stats);
+    double run_small_files(OpStats& stats);
+    double run_readdir(OpStats& stats, uint64_t* entries);
+    double run_rename(OpStats& stats);
+};
+}    // namespace securefs
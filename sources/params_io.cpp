@@ -10,6 +10,7 @@
 #include <absl/functional/function_ref.h>
 #include <absl/strings/escaping.h>
 #include <absl/strings/str_format.h>
+#include <absl/time/clock.h>
 #include <absl/types/span.h>
 #include <algorithm>
 #include <argon2.h>
@@ -23,6 +24,7 @@
 
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 namespace securefs
@@ -357,4 +359,54 @@ DecryptedSecurefsParams decrypt(std::string_view content,
     }
     return decrypt(legacy, password, key_stream);
 }
+
+EncryptedSecurefsParams::Argon2idParams
+calibrate_argon2id(absl::Duration target, unsigned memory_cost, unsigned parallelism)
+{
+    if (parallelism == 0)
+    {
+        parallelism = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Argon2 needs at least 8 KiB per lane.
+    memory_cost = std::max(memory_cost, 8 * parallelism);
+
+    byte password[32], salt[kParamSaltSize], key[32];
+    generate_random(password, sizeof(password));
+    generate_random(salt, sizeof(salt));
+    auto time_one_pass = [&]()
+    {
+        auto start = absl::Now();
+        int rc = ::argon2id_hash_raw(1,
+                                     memory_cost,
+                                     parallelism,
+                                     password,
+                                     sizeof(password),
+                                     salt,
+                                     sizeof(salt),
+                                     key,
+                                     sizeof(key));
+        if (rc)
+        {
+            throw_runtime_error(
+                absl::StrFormat("argon2id key derivation fails with error code %d", rc));
+        }
+        return absl::Now() - start;
+    };
+
+    const unsigned min_memory_cost = std::max(kMinCalibratedMemoryCost, 8 * parallelism);
+    auto one_pass = time_one_pass();
+    while (one_pass > target && memory_cost / 2 >= min_memory_cost)
+    {
+        memory_cost /= 2;
+        one_pass = time_one_pass();
+    }
+    // The time cost is the number of passes over the memory, each of which takes about as long.
+    auto passes = absl::IDivDuration(target, std::max(one_pass, absl::Nanoseconds(1)), nullptr);
+
+    EncryptedSecurefsParams::Argon2idParams result;
+    result.set_time_cost(static_cast<uint32_t>(std::clamp<int64_t>(passes, 1, UINT32_MAX)));
+    result.set_memory_cost(memory_cost);
+    result.set_parallelism(parallelism);
+    return result;
+}
 }    // namespace securefs
@@ -5,6 +5,7 @@
 #include "platform.h"
 #include "streams.h"
 
+#include <absl/time/time.h>
 #include <absl/types/span.h>
 
 #include <exception>
@@ -32,6 +33,14 @@ EncryptedSecurefsParams encrypt(const DecryptedSecurefsParams& decparams,
                                 absl::Span<const byte> password,
                                 /* nullable */ StreamBase* key_stream);
 
+/// Chooses argon2id parameters for a key derivation that takes about `target` on this machine
+/// with `memory_cost` KiB. Zero `parallelism` means one lane per CPU core, which the derivation
+/// runs on as many threads. The time cost is raised to fill `target`, or if even a single pass is
+/// too slow, the memory cost is halved down to `kMinCalibratedMemoryCost`.
+EncryptedSecurefsParams::Argon2idParams
+calibrate_argon2id(absl::Duration target, unsigned memory_cost, unsigned parallelism);
+inline constexpr unsigned kMinCalibratedMemoryCost = 1 << 16;
+
 inline std::shared_ptr<FileStream> maybe_open_key_stream(const std::string& keyfile)
 {
     if (keyfile.empty())
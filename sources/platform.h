@@ -105,6 +105,12 @@ namespace securefs
 extern const char* PATH_SEPARATOR_STRING;
 extern const char PATH_SEPARATOR_CHAR;
 
+#if !defined(_WIN32) && FUSE_USE_VERSION >= 30
+// libfuse3 adds a flags argument to the directory filler. Our operations keep filling entries the
+// libfuse2 way, and the libfuse3 callbacks adapt between the two.
+using fuse_fill_dir_t = int (*)(void* buf, const char* name, const fuse_stat* st, fuse_off_t off);
+#endif
+
 class FileStream : public StreamBase
 {
 public:
@@ -185,6 +191,12 @@ public:
     ~OSService();
     std::shared_ptr<FileStream>
     open_file_stream(const std::string& path, int flags, unsigned mode) const;
+    /// Opens a file holding encrypted contents, which bypasses the page cache of the underlying
+    /// filesystem when direct I/O is enabled, since the kernel already caches the plaintext.
+    std::shared_ptr<FileStream>
+    open_data_file_stream(const std::string& path, int flags, unsigned mode) const;
+    static void set_direct_io_enabled(bool value);
+    static bool is_direct_io_enabled();
     bool remove_file_nothrow(const std::string& path) const noexcept;
     bool remove_directory_nothrow(const std::string& path) const noexcept;
     void remove_file(const std::string& path) const;
@@ -195,6 +207,8 @@ public:
     void ensure_directory(const std::string& path, unsigned mode) const;
     void mkdir(const std::string& path, unsigned mode) const;
     void statfs(fuse_statvfs*) const;
+    // Flushes every pending write of the filesystem that contains the root to disk.
+    void syncfs() const;
     void utimens(const std::string& path, const fuse_timespec ts[2]) const;
 
     // Returns false when the path does not exist; throw exceptions on other errors
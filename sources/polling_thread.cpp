@@ -0,0 +1,59 @@
+#include "polling_thread.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+
+#include <absl/time/time.h>
+
+#include <cstring>
+
+#ifndef _WIN32
+#include <csignal>
+#endif
+
+namespace securefs
+{
+PollingThread::PollingThread(std::function<void()> tick) : tick_(std::move(tick))
+{
+    worker_ = std::thread([this]() { run(); });
+}
+
+PollingThread::~PollingThread()
+{
+    {
+        LockGuard<Mutex> lg(mu_);
+        stopping_ = true;
+    }
+    worker_.join();
+}
+
+void PollingThread::run()
+{
+    while (true)
+    {
+        mu_.LockWhenWithTimeout(absl::Condition(&stopping_), absl::Seconds(1));
+        bool stopping = stopping_;
+        mu_.Unlock();
+        if (stopping)
+        {
+            return;
+        }
+        tick_();
+    }
+}
+
+#ifndef _WIN32
+void install_signal_handler(int signum, void (*handler)(int))
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(signum, &sa, nullptr))
+    {
+        THROW_POSIX_EXCEPTION(errno,
+                              absl::StrFormat("Failed to install handler for signal %d", signum));
+    }
+}
+#endif
+}    // namespace securefs
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/base/thread_annotations.h>
+
+#include <functional>
+#include <thread>
+
+namespace securefs
+{
+/// Calls `tick` on a background thread about once a second until destroyed. Signal handlers can
+/// only set a flag, not wake a thread, so the work they request is picked up from here.
+class PollingThread
+{
+public:
+    explicit PollingThread(std::function<void()> tick);
+    ~PollingThread();
+    DISABLE_COPY_MOVE(PollingThread)
+
+private:
+    std::function<void()> tick_;
+    Mutex mu_;
+    bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+    std::thread worker_;
+
+private:
+    void run();
+};
+
+#ifndef _WIN32
+/// Installs `handler` for `signum`, with interrupted system calls restarted.
+void install_signal_handler(int signum, void (*handler)(int));
+#endif
+}    // namespace securefs
@@ -0,0 +1,149 @@
+#include "request_scheduler.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "op_stats.h"
+
+#include <algorithm>
+#include <exception>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    struct SchedulerCounters
+    {
+        // Requests that waited behind another request on the same file, rather than running at
+        // once.
+        OpStats::Counter deferred{"scheduler_deferred"};
+        OpStats::Counter queued{"scheduler_queued"};
+        OpStats::Counter busy_files{"scheduler_busy_files"};
+    };
+
+    const SchedulerCounters& counters()
+    {
+        static const SchedulerCounters c;
+        return c;
+    }
+}    // namespace
+
+RequestScheduler::RequestScheduler(unsigned threads)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers_.reserve(threads);
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers_.emplace_back([this]() { work(); });
+    }
+}
+
+RequestScheduler::~RequestScheduler()
+{
+    {
+        LockGuard<Mutex> lg(mu_);
+        stopping_ = true;
+    }
+    for (auto&& t : workers_)
+    {
+        t.join();
+    }
+}
+
+void RequestScheduler::submit(uint64_t key,
+                              absl::FunctionRef<void()> run_now,
+                              absl::FunctionRef<Task()> make_task)
+{
+    bool idle;
+    {
+        LockGuard<Mutex> lg(mu_);
+        idle = keys_.try_emplace(key).second;
+    }
+    if (idle)
+    {
+        counters().busy_files.add(1);
+        DEFER(finish(key));
+        run_now();
+        return;
+    }
+    // Outside of the lock, since the task may copy the data of a large write.
+    auto task = make_task();
+    {
+        LockGuard<Mutex> lg(mu_);
+        auto [it, inserted] = keys_.try_emplace(key);
+        if (!inserted)
+        {
+            it->second.push_back(std::move(task));
+            ++queued_;
+            counters().deferred.add(1);
+            counters().queued.add(1);
+            return;
+        }
+        counters().busy_files.add(1);
+    }
+    // The other requests finished in the meantime.
+    DEFER(finish(key));
+    task();
+}
+
+size_t RequestScheduler::queue_depth()
+{
+    LockGuard<Mutex> lg(mu_);
+    return queued_;
+}
+
+void RequestScheduler::finish(uint64_t key)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto it = keys_.find(key);
+    if (it == keys_.end())
+    {
+        return;
+    }
+    if (it->second.empty())
+    {
+        keys_.erase(it);
+        counters().busy_files.add(-1);
+        return;
+    }
+    // The key stays busy until a worker runs its next request.
+    ready_.push_back(key);
+}
+
+void RequestScheduler::work()
+{
+    while (true)
+    {
+        mu_.LockWhen(absl::Condition(
+            +[](RequestScheduler* self) ABSL_EXCLUSIVE_LOCKS_REQUIRED(self->mu_)
+            { return self->stopping_ || !self->ready_.empty(); },
+            this));
+        if (ready_.empty())
+        {
+            mu_.Unlock();
+            return;
+        }
+        auto key = ready_.front();
+        ready_.pop_front();
+        auto& pending = keys_[key];
+        Task task = std::move(pending.front());
+        pending.pop_front();
+        --queued_;
+        mu_.Unlock();
+
+        counters().queued.add(-1);
+        try
+        {
+            task();
+        }
+        catch (const std::exception& e)
+        {
+            ERROR_LOG("Scheduled request failed: %s", e.what());
+        }
+        // Queued at the back of `ready_` if there is more, so that each busy file gets its turn.
+        finish(key);
+    }
+}
+}    // namespace securefs
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/functional/function_ref.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+/// Keeps the requests on one file from piling up on its lock.
+///
+/// A request whose file is idle runs at once on the thread that submits it. A request on a file
+/// that is busy is queued instead, so that the submitting thread goes back to serve other files
+/// rather than block. Whenever a request finishes, the next one queued on the same file is handed
+/// to a pool of workers, which take the files in turn, so that a hot file does not starve the
+/// others.
+class RequestScheduler
+{
+public:
+    using Task = std::function<void()>;
+
+    /// Zero `threads` means the number of CPU cores.
+    explicit RequestScheduler(unsigned threads);
+    /// Waits for the queued requests to finish.
+    ~RequestScheduler();
+    DISABLE_COPY_MOVE(RequestScheduler)
+
+    /// Calls `run_now` on the calling thread if there is no other request on `key`. Otherwise
+    /// calls `make_task`, which must copy whatever the request borrows from the caller, and queues
+    /// the task behind the other requests on `key`.
+    void submit(uint64_t key,
+                absl::FunctionRef<void()> run_now,
+                absl::FunctionRef<Task()> make_task);
+
+    /// The number of requests that are queued and not yet running.
+    size_t queue_depth();
+
+private:
+    Mutex mu_;
+    // The requests queued behind the running one, for each key that has a running request.
+    absl::flat_hash_map<uint64_t, std::deque<Task>> keys_ ABSL_GUARDED_BY(mu_);
+    // Keys whose running request has finished, so that the next one is ready for the workers.
+    std::deque<uint64_t> ready_ ABSL_GUARDED_BY(mu_);
+    size_t queued_ ABSL_GUARDED_BY(mu_) = 0;
+    bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+    std::vector<std::thread> workers_;
+
+private:
+    void finish(uint64_t key);
+    void work();
+};
+}    // namespace securefs
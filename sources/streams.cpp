@@ -2,6 +2,7 @@
 #include "crypto.h"
 #include "exceptions.h"
 #include "myutils.h"
+#include "op_stats.h"
 
 #include <algorithm>
 #include <array>
@@ -27,6 +28,54 @@
 
 namespace securefs
 {
+void StreamBase::punch_hole(offset_type offset, length_type length)
+{
+    auto current_size = size();
+    if (offset >= current_size)
+    {
+        return;
+    }
+    length = std::min(length, current_size - offset);
+    std::vector<byte> zeros(std::min<length_type>(length, 64 << 10), 0);
+    while (length > 0)
+    {
+        auto this_length = std::min<length_type>(length, zeros.size());
+        write(zeros.data(), offset, this_length);
+        offset += this_length;
+        length -= this_length;
+    }
+}
+
+void StreamBase::preallocate(offset_type offset, length_type length, bool keep_size)
+{
+    if (!keep_size && offset + length > size())
+    {
+        resize(offset + length);
+    }
+}
+
+length_type StreamBase::copy_range_from(StreamBase& source,
+                                        offset_type source_offset,
+                                        offset_type offset,
+                                        length_type length)
+{
+    std::vector<byte> buffer(std::min<length_type>(length, 1 << 20));
+    length_type copied = 0;
+    while (copied < length)
+    {
+        auto read_len = source.read(buffer.data(),
+                                    source_offset + copied,
+                                    std::min<length_type>(length - copied, buffer.size()));
+        if (read_len == 0)
+        {
+            break;
+        }
+        write(buffer.data(), offset + copied, read_len);
+        copied += read_len;
+    }
+    return copied;
+}
+
 namespace internal
 {
     class InvalidHMACStreamException : public InvalidFormatException
@@ -141,6 +190,15 @@ namespace internal
             return m_stream->read(output, off + hmac_length, len);
         }
 
+        void read_batched(ReadBatch& batch,
+                          void* output,
+                          offset_type off,
+                          length_type len,
+                          length_type* result) override
+        {
+            m_stream->read_batched(batch, output, off + hmac_length, len, result);
+        }
+
         void write(const void* input, offset_type off, length_type len) override
         {
             m_stream->write(input, off + hmac_length, len);
@@ -153,6 +211,16 @@ namespace internal
             is_dirty = true;
         }
 
+        // Holes are punched with the default, which writes zeros that the HMAC covers.
+        void preallocate(offset_type off, length_type len, bool keep_size) override
+        {
+            m_stream->preallocate(off + hmac_length, len, keep_size);
+            if (!keep_size)
+            {
+                is_dirty = true;
+            }
+        }
+
         bool is_sparse() const noexcept override { return m_stream->is_sparse(); }
     };
 }    // namespace internal
@@ -165,6 +233,27 @@ std::shared_ptr<StreamBase> make_stream_hmac(const key_type& key_,
     return std::make_shared<internal::HMACStream>(key_, id_, std::move(stream), check);
 }
 
+void ReadBatch::defer(Runner runner, const Read& read)
+{
+    if (runner_ && runner_ != runner)
+    {
+        run();
+    }
+    runner_ = runner;
+    reads_.push_back(read);
+}
+
+void ReadBatch::run()
+{
+    if (reads_.empty())
+    {
+        return;
+    }
+    auto reads = std::move(reads_);
+    reads_.clear();
+    std::exchange(runner_, nullptr)(reads);
+}
+
 namespace
 {
     template <typename T>
@@ -174,29 +263,125 @@ namespace
     }
 }    // namespace
 
+void BlockBasedStream::read_block_ranges(absl::Span<BlockRange> ranges)
+{
+    for (auto&& r : ranges)
+    {
+        r.result = read_multi_blocks(r.start_block, r.end_block, r.output);
+    }
+}
+
 length_type BlockBasedStream::read(void* output, offset_type offset, length_type length)
 {
     if (length <= 0)
     {
         return length;
     }
+    // Large reads of sparse streams only read the runs of full blocks between the holes, which
+    // means knowing where the stream ends beforehand.
+    auto layout = length >= kMinHoleQueryBlocks * m_block_size && is_sparse() ? block_layout()
+                                                                               : BlockLayout{};
+    if (layout.stream)
+    {
+        auto current_size = size();
+        if (offset >= current_size)
+        {
+            return 0;
+        }
+        length = std::min(length, current_size - offset);
+    }
     auto [start_block, start_residue] = divmod(offset, m_block_size);
     auto [end_block, end_residue] = divmod(offset + length, m_block_size);
-    if (start_residue == 0 && end_residue == 0)
+    if (start_residue == 0 && end_residue == 0 && !layout.stream)
     {
         return read_multi_blocks(start_block, end_block, output);
     }
 
-    CryptoPP::AlignedSecByteBlock buffer((end_block - start_block + (end_residue > 0))
-                                         * m_block_size);
-    auto read_len = read_multi_blocks(start_block, end_block + (end_residue > 0), buffer.data());
-    if (read_len <= start_residue)
+    // Only the partial blocks at either end go through a staging buffer. The full blocks in
+    // between are decrypted directly into `output`. All of them are read together.
+    auto* out = static_cast<byte*>(output);
+    bool has_head = start_residue > 0;
+    auto middle_start = start_block + has_head;
+    bool has_middle = middle_start < end_block;
+    bool has_tail = end_residue > 0 && middle_start <= end_block;
+    CryptoPP::AlignedSecByteBlock buffer((has_head + has_tail) * m_block_size);
+    auto* tail_buffer = buffer.data() + has_head * m_block_size;
+
+    absl::InlinedVector<BlockRange, 3> ranges;
+    if (has_head)
+    {
+        ranges.push_back({start_block, start_block + 1, buffer.data()});
+    }
+    auto* middle_out = out + has_head * (m_block_size - start_residue);
+    size_t middle_ranges = 0;
+    if (has_middle && !layout.stream)
+    {
+        ranges.push_back({middle_start, end_block, middle_out});
+        middle_ranges = 1;
+    }
+    else if (has_middle)
+    {
+        static const OpStats::Counter bytes_skipped_in_holes("bytes_skipped_in_holes");
+        for (auto block = middle_start; block < end_block;)
+        {
+            auto data_block = next_data_block(layout, block, end_block);
+            if (data_block > block)
+            {
+                auto hole_length = (data_block - block) * m_block_size;
+                memset(middle_out + (block - middle_start) * m_block_size, 0, hole_length);
+                bytes_skipped_in_holes.add(static_cast<int64_t>(hole_length));
+            }
+            if (data_block >= end_block)
+            {
+                break;
+            }
+            block = next_hole_block(layout, data_block + 1, end_block);
+            ranges.push_back(
+                {data_block, block, middle_out + (data_block - middle_start) * m_block_size});
+            ++middle_ranges;
+        }
+    }
+    if (has_tail)
+    {
+        ranges.push_back({end_block, end_block + 1, tail_buffer});
+    }
+    read_block_ranges(absl::MakeSpan(ranges));
+
+    length_type total = 0;
+    const auto* range = ranges.data();
+    if (has_head)
+    {
+        auto read_len = (range++)->result;
+        if (read_len <= start_residue)
+        {
+            return 0;
+        }
+        total = std::min(read_len - start_residue, length);
+        memcpy(out, buffer.data() + start_residue, total);
+        if (total == length || read_len < m_block_size)
+        {
+            return total;
+        }
+    }
+    if (has_middle)
+    {
+        // The holes between the runs have been zeroed already.
+        for (size_t i = 0; i < middle_ranges; ++i, ++range)
+        {
+            if (range->result < (range->end_block - range->start_block) * m_block_size)
+            {
+                return total + (range->start_block - middle_start) * m_block_size + range->result;
+            }
+        }
+        total += (end_block - middle_start) * m_block_size;
+    }
+    if (has_tail)
     {
-        return 0;
+        auto copy_len = std::min(range->result, end_residue);
+        memcpy(out + total, tail_buffer, copy_len);
+        total += copy_len;
     }
-    auto copy_len = std::min(read_len - start_residue, length);
-    memcpy(output, buffer.data() + start_residue, copy_len);
-    return copy_len;
+    return total;
 }
 
 void BlockBasedStream::write(const void* input, offset_type offset, length_type length)
@@ -239,18 +424,22 @@ void BlockBasedStream::unchecked_write(std::variant<const void*, ZeroFillTag> in
     CryptoPP::AlignedSecByteBlock buffer((end_block - start_block + (end_residue > 0))
                                          * m_block_size);
     std::fill(buffer.begin(), buffer.end(), 0);
+    // The head and the tail blocks are read together.
+    absl::InlinedVector<BlockRange, 2> ranges;
     if (start_residue > 0 && start_block < end_block)
     {
-        (void)read_multi_blocks(start_block, start_block + 1, buffer.data());
+        ranges.push_back({start_block, start_block + 1, buffer.data()});
     }
+    if (end_residue > 0)
+    {
+        ranges.push_back(
+            {end_block, end_block + 1, buffer.data() + (end_block - start_block) * m_block_size});
+    }
+    read_block_ranges(absl::MakeSpan(ranges));
     length_type effective_end_residue = 0;
     if (end_residue > 0)
     {
-        effective_end_residue
-            = std::max(end_residue,
-                       read_multi_blocks(end_block,
-                                         end_block + 1,
-                                         buffer.data() + (end_block - start_block) * m_block_size));
+        effective_end_residue = std::max(end_residue, ranges.back().result);
     }
     assert(start_residue + length <= buffer.size());
     std::visit(Overload{[](const ZeroFillTag&) {},
@@ -267,6 +456,113 @@ void BlockBasedStream::zero_fill(offset_type offset, offset_type finish)
 
 void BlockBasedStream::resize(length_type new_size) { unchecked_resize(size(), new_size); }
 
+void BlockBasedStream::punch_hole(offset_type offset, length_type length)
+{
+    auto current_size = size();
+    if (offset >= current_size || length <= 0)
+    {
+        return;
+    }
+    auto end = std::min(offset + length, current_size);
+    // Only the blocks wholly inside the range become holes. The partial last block of the stream
+    // counts as whole when the range reaches the end.
+    auto start_block = (offset + m_block_size - 1) / m_block_size;
+    auto end_block = end == current_size ? (end + m_block_size - 1) / m_block_size
+                                         : end / m_block_size;
+    // Unlike `zero_fill`, which is only meant for the region past the end, this overwrites the
+    // partial blocks at either end with zeros.
+    if (start_block >= end_block)
+    {
+        return StreamBase::punch_hole(offset, end - offset);
+    }
+    StreamBase::punch_hole(offset, start_block * m_block_size - offset);
+    if (end_block * m_block_size < end)
+    {
+        StreamBase::punch_hole(end_block * m_block_size, end - end_block * m_block_size);
+    }
+    punch_blocks(start_block, end_block);
+}
+
+void BlockBasedStream::preallocate(offset_type offset, length_type length, bool keep_size)
+{
+    if (length <= 0)
+    {
+        return;
+    }
+    preallocate_blocks(offset / m_block_size, (offset + length + m_block_size - 1) / m_block_size);
+    if (!keep_size && offset + length > size())
+    {
+        // Extends sparse streams with holes, which the blocks preallocated above stay under.
+        resize(offset + length);
+    }
+}
+
+offset_type BlockBasedStream::next_data_block(const BlockLayout& layout,
+                                              offset_type block,
+                                              offset_type end_block)
+{
+    if (block >= end_block)
+    {
+        return end_block;
+    }
+    auto data = layout.stream->next_data(layout.offset + block * layout.block_size);
+    return std::min<offset_type>((data - layout.offset) / layout.block_size, end_block);
+}
+
+offset_type BlockBasedStream::next_hole_block(const BlockLayout& layout,
+                                              offset_type block,
+                                              offset_type end_block)
+{
+    while (block < end_block)
+    {
+        auto hole = layout.stream->next_hole(layout.offset + block * layout.block_size);
+        // The first block that starts in the hole, which is only skipped if it ends there too.
+        block = (hole - layout.offset + layout.block_size - 1) / layout.block_size;
+        if (block >= end_block)
+        {
+            break;
+        }
+        auto block_offset = layout.offset + block * layout.block_size;
+        if (layout.stream->next_data(block_offset) >= block_offset + layout.block_size)
+        {
+            return block;
+        }
+        ++block;
+    }
+    return end_block;
+}
+
+offset_type BlockBasedStream::next_data(offset_type offset)
+{
+    auto layout = block_layout();
+    auto current_size = size();
+    if (!layout.stream || offset >= current_size)
+    {
+        return offset;
+    }
+    auto block = next_data_block(
+        layout, offset / m_block_size, (current_size + m_block_size - 1) / m_block_size);
+    return std::max(offset, std::min(block * m_block_size, current_size));
+}
+
+offset_type BlockBasedStream::next_hole(offset_type offset)
+{
+    auto layout = block_layout();
+    auto current_size = size();
+    if (!layout.stream || offset >= current_size)
+    {
+        return std::max(offset, current_size);
+    }
+    auto block = next_hole_block(
+        layout, offset / m_block_size, (current_size + m_block_size - 1) / m_block_size);
+    return std::max(offset, std::min(block * m_block_size, current_size));
+}
+
+void BlockBasedStream::punch_blocks(offset_type start_block, offset_type end_block)
+{
+    StreamBase::punch_hole(start_block * m_block_size, (end_block - start_block) * m_block_size);
+}
+
 void BlockBasedStream::unchecked_resize(length_type current_size, length_type new_size)
 {
     if (new_size == current_size)
@@ -374,8 +670,9 @@ namespace internal
         {
             check_block_number(end_block);
 
-            std::vector<byte> buffer((m_block_size + get_meta_size()) * (end_block - start_block)
-                                     + (end_residue <= 0 ? 0 : end_residue + get_meta_size()));
+            // Aligned, so that a data stream opened with O_DIRECT can transfer it as is.
+            AlignedBuffer buffer((m_block_size + get_meta_size()) * (end_block - start_block)
+                                 + (end_residue <= 0 ? 0 : end_residue + get_meta_size()));
             auto* data_buffer = buffer.data();
             auto data_buffer_size = m_block_size * (end_block - start_block) + end_residue;
             auto* meta_buffer = buffer.data() + data_buffer_size;
@@ -391,6 +688,8 @@ namespace internal
                 auto this_block_size = std::min(m_block_size, data_buffer_size - i);
                 assert(data_buffer + this_block_size <= buffer.data() + buffer.size());
                 assert(meta_buffer + get_meta_size() <= buffer.data() + buffer.size());
+                static const OpStats::Counter bytes_encrypted("bytes_encrypted");
+                bytes_encrypted.add(static_cast<int64_t>(this_block_size));
                 m_enc.EncryptAndAuthenticate(data_buffer,
                                              meta_buffer + get_iv_size(),
                                              get_mac_size(),
@@ -414,19 +713,70 @@ namespace internal
         length_type
         read_multi_blocks(offset_type start_block, offset_type end_block, void* output) override
         {
-            if (start_block == end_block)
-                return 0;
-            check_block_number(end_block);
-            std::vector<byte> buffer((end_block - start_block) * (m_block_size + get_meta_size()));
-            auto* data_buffer = buffer.data();
+            BlockRange range{start_block, end_block, output};
+            read_block_ranges({&range, 1});
+            return range.result;
+        }
+
+        void read_block_ranges(absl::Span<BlockRange> ranges) override
+        {
+            // The data and the meta of every range are read in one batch.
+            struct Staged
+            {
+                AlignedBuffer buffer;
+                length_type data_read_len = 0, meta_read_len = 0;
+            };
+            absl::InlinedVector<Staged, 3> staged(ranges.size());
+            ReadBatch batch;
+            for (size_t i = 0; i < ranges.size(); ++i)
+            {
+                const auto& r = ranges[i];
+                if (r.start_block == r.end_block)
+                    continue;
+                check_block_number(r.end_block);
+                auto& buffer = staged[i].buffer;
+                buffer = AlignedBuffer((r.end_block - r.start_block)
+                                       * (m_block_size + get_meta_size()));
+                auto data_buffer_size = (r.end_block - r.start_block) * m_block_size;
+                m_stream->read_batched(batch,
+                                       buffer.data(),
+                                       r.start_block * m_block_size,
+                                       data_buffer_size,
+                                       &staged[i].data_read_len);
+                m_metastream.read_batched(batch,
+                                          buffer.data() + data_buffer_size,
+                                          meta_position_for_iv(r.start_block),
+                                          buffer.size() - data_buffer_size,
+                                          &staged[i].meta_read_len);
+            }
+            batch.run();
+            for (size_t i = 0; i < ranges.size(); ++i)
+            {
+                auto& r = ranges[i];
+                if (r.start_block == r.end_block)
+                {
+                    r.result = 0;
+                    continue;
+                }
+                r.result = decrypt_blocks(r.start_block,
+                                          r.end_block,
+                                          staged[i].buffer.data(),
+                                          staged[i].data_read_len,
+                                          staged[i].meta_read_len,
+                                          r.output);
+            }
+        }
+
+    private:
+        length_type decrypt_blocks(offset_type start_block,
+                                   offset_type end_block,
+                                   byte* data_buffer,
+                                   length_type data_read_len,
+                                   length_type meta_read_len,
+                                   void* output)
+        {
             auto data_buffer_size = (end_block - start_block) * m_block_size;
             auto* meta_buffer = data_buffer + data_buffer_size;
-            auto meta_buffer_size = buffer.size() - data_buffer_size;
-
-            auto data_read_len
-                = m_stream->read(data_buffer, start_block * m_block_size, data_buffer_size);
-            auto meta_read_len = m_metastream.read(
-                meta_buffer, meta_position_for_iv(start_block), meta_buffer_size);
             if (data_read_len <= 0)
             {
                 return 0;
@@ -451,6 +801,8 @@ namespace internal
                 {
                     continue;
                 }
+                static const OpStats::Counter bytes_decrypted("bytes_decrypted");
+                bytes_decrypted.add(static_cast<int64_t>(this_block_size));
                 bool success = m_dec.DecryptAndVerify(static_cast<byte*>(output),
                                                       meta_buffer + get_iv_size(),
                                                       get_mac_size(),
@@ -468,6 +820,7 @@ namespace internal
             return data_read_len;
         }
 
+    protected:
         void adjust_logical_size(length_type length) override
         {
             m_stream->resize(length);
@@ -475,6 +828,26 @@ namespace internal
             m_metastream.resize(meta_position_for_iv(block_num));
         }
 
+        // A block is a hole when both its data and its meta are all zeros.
+        void punch_blocks(offset_type start_block, offset_type end_block) override
+        {
+            check_block_number(end_block);
+            m_stream->punch_hole(start_block * m_block_size,
+                                 (end_block - start_block) * m_block_size);
+            m_metastream.punch_hole(meta_position_for_iv(start_block),
+                                    (end_block - start_block) * get_meta_size());
+        }
+
+        void preallocate_blocks(offset_type start_block, offset_type end_block) override
+        {
+            check_block_number(end_block);
+            m_stream->preallocate(
+                start_block * m_block_size, (end_block - start_block) * m_block_size, true);
+            m_metastream.preallocate(meta_position_for_iv(start_block),
+                                     (end_block - start_block) * get_meta_size(),
+                                     true);
+        }
+
     public:
         bool is_sparse() const noexcept override
         {
@@ -4,12 +4,17 @@
 #include "object.h"
 
 #include <absl/container/fixed_array.h>
+#include <absl/container/inlined_vector.h>
+#include <absl/types/span.h>
+
+#include <algorithm>
 #include <memory>
 #include <utility>
 #include <variant>
 
 namespace securefs
 {
+class ReadBatch;
 
 /**
  * Base classes for byte streams.
@@ -39,6 +44,40 @@ public:
      **/
     virtual void resize(length_type) = 0;
 
+    /**
+     * Similar to fallocate() with FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE.
+     * The range reads as zeros afterwards, and the size never changes. Sparse streams release the
+     * storage of the range where they can. The default writes zeros.
+     **/
+    virtual void punch_hole(offset_type offset, length_type length);
+
+    /**
+     * Similar to fallocate() with a mode of 0, or FALLOC_FL_KEEP_SIZE when `keep_size`.
+     * Reserves the storage of the range, so that writing to it later does not run out of space,
+     * and extends the stream with zeros to cover it unless `keep_size`. The default only extends.
+     **/
+    virtual void preallocate(offset_type offset, length_type length, bool keep_size);
+
+    /**
+     * Similar to lseek() with SEEK_DATA and SEEK_HOLE respectively. `next_data` returns the first
+     * offset at or after `offset` that may hold data, and `next_hole` the first one in a hole,
+     * where the end of the stream counts as one. Neither returns less than `offset`, and both
+     * return at least `size()` when there is no such offset before the end. The defaults know of
+     * no holes.
+     **/
+    virtual offset_type next_data(offset_type offset) { return offset; }
+    virtual offset_type next_hole(offset_type offset) { return std::max(offset, size()); }
+
+    /**
+     * Similar to copy_file_range(). Copies `length` bytes at `source_offset` of `source` to
+     * `offset`, or up to the end of `source` if that comes first, and returns how many. Streams
+     * may let the two ranges share their storage instead. The default reads and writes.
+     **/
+    virtual length_type copy_range_from(StreamBase& source,
+                                        offset_type source_offset,
+                                        offset_type offset,
+                                        length_type length);
+
     /**
      * Sparse streams can be extended with zeros in constant time.
      * Some algorithms may be specialized on sparse streams.
@@ -50,6 +89,21 @@ public:
      */
     virtual length_type optimal_block_size() const noexcept { return 1; }
 
+    /**
+     * Same as `read()`, except that the read may be deferred until `batch.run()`, so that the
+     * reads one operation needs are submitted together. `*result` is only valid after that.
+     * The default reads at once.
+     **/
+    virtual void read_batched(ReadBatch& batch,
+                              void* output,
+                              offset_type offset,
+                              length_type length,
+                              length_type* result)
+    {
+        (void)batch;
+        *result = read(output, offset, length);
+    }
+
     // Convienience methods.
     std::string as_string()
     {
@@ -62,6 +116,36 @@ public:
     }
 };
 
+/**
+ * The reads deferred by `StreamBase::read_batched`, to be submitted at once by the backend of the
+ * streams that deferred them.
+ **/
+class ReadBatch
+{
+public:
+    struct Read
+    {
+        StreamBase* stream;
+        void* output;
+        offset_type offset;
+        length_type length;
+        length_type* result;
+    };
+    /// Serves all the reads deferred to it, or throws.
+    using Runner = void (*)(absl::Span<const Read> reads);
+
+    ReadBatch() = default;
+    DISABLE_COPY_MOVE(ReadBatch)
+
+    /// Reads deferred with a different runner than the pending ones run the pending ones first.
+    void defer(Runner runner, const Read& read);
+    void run();
+
+private:
+    Runner runner_ = nullptr;
+    absl::InlinedVector<Read, 4> reads_;
+};
+
 /**
  * Interface that supports a fixed size buffer to store headers for files
  */
@@ -97,6 +181,14 @@ class BlockBasedStream : public StreamBase
 protected:
     length_type m_block_size;
 
+    struct BlockRange
+    {
+        offset_type start_block, end_block;
+        void* output;
+        // The return value of `read_multi_blocks`.
+        length_type result = 0;
+    };
+
 protected:
     virtual length_type
     read_multi_blocks(offset_type start_block, offset_type end_block, void* output)
@@ -107,6 +199,34 @@ protected:
                                     const void* input)
         = 0;
     virtual void adjust_logical_size(length_type length) = 0;
+    /// Reads several ranges of blocks as `read_multi_blocks` does. Overridden to batch the reads
+    /// of the underlying streams, so that the partial blocks of an unaligned read or write cost
+    /// one submission along with the rest.
+    virtual void read_block_ranges(absl::Span<BlockRange> ranges);
+    /// Makes whole blocks read as zeros, which a block that is all zeros underneath does. The last
+    /// block of the stream may be partial. The default writes encrypted zeros.
+    virtual void punch_blocks(offset_type start_block, offset_type end_block);
+    /// Reserves the underlying storage of the blocks, without changing the size. The default does
+    /// nothing.
+    virtual void preallocate_blocks(offset_type start_block, offset_type end_block)
+    {
+        (void)start_block;
+        (void)end_block;
+    }
+
+    struct BlockLayout
+    {
+        StreamBase* stream = nullptr;
+        offset_type offset = 0;
+        length_type block_size = 0;
+    };
+    /// Where the blocks are stored, so that large reads skip the holes there: block `n` starts at
+    /// `offset + n * block_size` of `stream`. Only blocks that lie wholly in a hole are skipped, so
+    /// such blocks must read as zeros. The default has no `stream`, and knows of no holes.
+    virtual BlockLayout block_layout() const { return {}; }
+
+    /// Reads spanning at least this many blocks of a sparse stream look for holes first.
+    static constexpr length_type kMinHoleQueryBlocks = 8;
 
 private:
     struct ZeroFillTag
@@ -118,6 +238,11 @@ private:
                          length_type length);
     void zero_fill(offset_type offset, length_type length);
     void unchecked_resize(length_type current_size, length_type new_size);
+    // Both look in [block, end_block), and return `end_block` when they find nothing.
+    offset_type
+    next_data_block(const BlockLayout& layout, offset_type block, offset_type end_block);
+    offset_type
+    next_hole_block(const BlockLayout& layout, offset_type block, offset_type end_block);
 
 public:
     BlockBasedStream(length_type block_size) : m_block_size(block_size) {}
@@ -126,6 +251,10 @@ public:
     length_type read(void* output, offset_type offset, length_type length) override;
     void write(const void* input, offset_type offset, length_type length) override;
     void resize(length_type new_length) override;
+    void punch_hole(offset_type offset, length_type length) override;
+    void preallocate(offset_type offset, length_type length, bool keep_size) override;
+    offset_type next_data(offset_type offset) override;
+    offset_type next_hole(offset_type offset) override;
     length_type optimal_block_size() const noexcept override { return m_block_size; }
 };
 
@@ -157,6 +286,15 @@ public:
         return m_delegate->read(output, offset + m_padding_size, length);
     }
 
+    void read_batched(ReadBatch& batch,
+                      void* output,
+                      offset_type offset,
+                      length_type length,
+                      length_type* result) override
+    {
+        m_delegate->read_batched(batch, output, offset + m_padding_size, length, result);
+    }
+
     void write(const void* input, offset_type offset, length_type length) override
     {
         return m_delegate->write(input, offset + m_padding_size, length);
@@ -172,6 +310,26 @@ public:
 
     void resize(length_type size) override { return m_delegate->resize(size + m_padding_size); }
 
+    void punch_hole(offset_type offset, length_type length) override
+    {
+        return m_delegate->punch_hole(offset + m_padding_size, length);
+    }
+
+    void preallocate(offset_type offset, length_type length, bool keep_size) override
+    {
+        return m_delegate->preallocate(offset + m_padding_size, length, keep_size);
+    }
+
+    offset_type next_data(offset_type offset) override
+    {
+        return m_delegate->next_data(offset + m_padding_size) - m_padding_size;
+    }
+
+    offset_type next_hole(offset_type offset) override
+    {
+        return m_delegate->next_hole(offset + m_padding_size) - m_padding_size;
+    }
+
     bool is_sparse() const noexcept override { return m_delegate->is_sparse(); }
 
     length_type optimal_block_size() const noexcept override
@@ -210,6 +368,27 @@ public:
         flush_cache();
         delegate_->resize(size);
     }
+    void punch_hole(offset_type offset, length_type length) override
+    {
+        flush_cache();
+        delegate_->punch_hole(offset, length);
+    }
+    void preallocate(offset_type offset, length_type length, bool keep_size) override
+    {
+        flush_cache();
+        delegate_->preallocate(offset, length, keep_size);
+    }
+    // The cached writes are not in the delegate yet, and could be taken for holes.
+    offset_type next_data(offset_type offset) override
+    {
+        flush_cache();
+        return delegate_->next_data(offset);
+    }
+    offset_type next_hole(offset_type offset) override
+    {
+        flush_cache();
+        return delegate_->next_hole(offset);
+    }
     bool is_sparse() const noexcept override { return delegate_->is_sparse(); }
     length_type optimal_block_size() const noexcept override { return buffer_.size(); }
 
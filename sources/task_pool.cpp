@@ -0,0 +1,137 @@
+#include "task_pool.h"
+#include "lock_guard.h"
+
+#include <absl/time/clock.h>
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    // The pool and the index of the worker that the current thread runs, if any.
+    thread_local const TaskPool* current_pool = nullptr;
+    thread_local size_t current_worker = 0;
+}    // namespace
+
+TaskPool::TaskPool(unsigned threads)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+}
+
+void TaskPool::submit(Task task)
+{
+    size_t index = current_pool == this ? current_worker
+                                        : next_worker_.fetch_add(1) % workers_.size();
+    // Counted before it is queued, so that no worker sees zero while the task is pending.
+    pending_.fetch_add(1);
+    auto& worker = *workers_[index];
+    LockGuard<Mutex> lg(worker.mu);
+    worker.tasks.push_back(std::move(task));
+}
+
+std::optional<TaskPool::Task> TaskPool::take(size_t self)
+{
+    {
+        auto& worker = *workers_[self];
+        LockGuard<Mutex> lg(worker.mu);
+        if (!worker.tasks.empty())
+        {
+            auto task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            return task;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); ++i)
+    {
+        auto& victim = *workers_[(self + i) % workers_.size()];
+        LockGuard<Mutex> lg(victim.mu);
+        if (!victim.tasks.empty())
+        {
+            auto task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return task;
+        }
+    }
+    return std::nullopt;
+}
+
+void TaskPool::work(size_t self)
+{
+    current_pool = this;
+    current_worker = self;
+    while (pending_.load() > 0)
+    {
+        auto task = take(self);
+        if (!task)
+        {
+            // The remaining tasks are running on other threads, and may submit more.
+            absl::SleepFor(absl::Microseconds(100));
+            continue;
+        }
+        if (!failed_.load())
+        {
+            try
+            {
+                (*task)();
+            }
+            catch (...)
+            {
+                LockGuard<Mutex> lg(error_mu_);
+                if (!error_)
+                {
+                    error_ = std::current_exception();
+                }
+                failed_.store(true);
+            }
+        }
+        // Destroy the task before it is counted as done, since it may own resources.
+        task.reset();
+        pending_.fetch_sub(1);
+    }
+    current_pool = nullptr;
+}
+
+void TaskPool::run(absl::FunctionRef<void()> on_tick, absl::Duration tick)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(workers_.size());
+    for (size_t i = 0; i < workers_.size(); ++i)
+    {
+        threads.emplace_back([this, i]() { work(i); });
+    }
+    auto next_tick = absl::Now() + tick;
+    while (pending_.load() > 0)
+    {
+        absl::SleepFor(absl::Milliseconds(10));
+        if (absl::Now() >= next_tick)
+        {
+            on_tick();
+            next_tick += tick;
+        }
+    }
+    for (auto&& t : threads)
+    {
+        t.join();
+    }
+    std::exception_ptr error;
+    {
+        LockGuard<Mutex> lg(error_mu_);
+        std::swap(error, error_);
+    }
+    failed_.store(false);
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+}    // namespace securefs
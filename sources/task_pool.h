@@ -0,0 +1,69 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/base/thread_annotations.h>
+#include <absl/functional/function_ref.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace securefs
+{
+/// Runs tasks that may submit more tasks, such as the traversal of a directory tree, on a fixed
+/// number of threads.
+///
+/// Each thread has its own deque. Tasks submitted by a task go to the deque of its thread, which
+/// is processed newest first for locality, and idle threads steal the oldest tasks of the others,
+/// so that one deep subtree does not keep the other threads idle.
+class TaskPool
+{
+public:
+    using Task = std::function<void()>;
+
+    /// Zero `threads` means the number of CPU cores.
+    explicit TaskPool(unsigned threads);
+    DISABLE_COPY_MOVE(TaskPool)
+
+    unsigned thread_count() const noexcept { return static_cast<unsigned>(workers_.size()); }
+
+    /// May be called before `run()`, or from within a task.
+    void submit(Task task);
+
+    /// Runs until all the tasks, including those that they submit, are done, and calls `on_tick`
+    /// on the calling thread every `tick` in the meantime. After a task throws, the remaining
+    /// tasks are discarded and the exception is rethrown here.
+    void run(absl::FunctionRef<void()> on_tick, absl::Duration tick);
+    void run()
+    {
+        run([]() {}, absl::InfiniteDuration());
+    }
+
+private:
+    struct Worker
+    {
+        Mutex mu;
+        std::deque<Task> tasks ABSL_GUARDED_BY(mu);
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    // Submitted but not yet finished tasks. The workers exit when it drops to zero.
+    std::atomic<size_t> pending_{0};
+    std::atomic<size_t> next_worker_{0};
+    std::atomic<bool> failed_{false};
+    Mutex error_mu_;
+    std::exception_ptr error_ ABSL_GUARDED_BY(error_mu_);
+
+private:
+    std::optional<Task> take(size_t self);
+    void work(size_t self);
+};
+}    // namespace securefs
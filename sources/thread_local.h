@@ -1,10 +1,17 @@
 #pragma once
+#include "lock_guard.h"
+#include "myutils.h"
 #include "object.h"
+#include "platform.h"    // IWYU pragma: keep
 
+#include <absl/base/thread_annotations.h>
+
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <vector>
 
 namespace securefs
 {
@@ -77,4 +84,95 @@ public:
         return *static_cast<T*>(holder.data);
     }
 };
+
+/// One `T` for each thread that uses it, all of which the owner can visit, such as counters that
+/// each thread updates without locking and a reader merges.
+///
+/// When a thread exits, its `T` is merged into a retired one and freed, so that threads coming
+/// and going, as FUSE worker threads do, take no more memory than the live ones.
+template <typename T>
+class PerThread
+{
+public:
+    using Initializer = std::function<std::unique_ptr<T>()>;
+    // Called with the `T` of an exiting thread and the retired one, by the exiting thread.
+    using Merger = std::function<void(T& from, T& into)>;
+
+    PerThread(Initializer init, Merger merge)
+        : init_(std::move(init))
+        , shared_(std::make_shared<Shared>(init_(), std::move(merge)))
+        , local_([this]() { return std::make_unique<Entry>(shared_, init_()); })
+    {
+    }
+
+    ~PerThread()
+    {
+        // The threads that exit later may no longer call into the owner.
+        LockGuard<Mutex> lg(shared_->mu);
+        shared_->merge = nullptr;
+    }
+
+    DISABLE_COPY_MOVE(PerThread)
+
+    /// The `T` of the calling thread, created on first use. Throws if that fails.
+    T& local() { return *local_.get().value; }
+
+    /// Calls `func` on the `T` of every live thread and then on the retired one. No thread exits
+    /// or starts using this object in the meantime.
+    template <class Func>
+    void for_each(Func&& func)
+    {
+        LockGuard<Mutex> lg(shared_->mu);
+        for (T* value : shared_->live)
+        {
+            func(*value);
+        }
+        func(*shared_->retired);
+    }
+
+private:
+    struct Shared
+    {
+        Shared(std::unique_ptr<T> retired, Merger merge)
+            : retired(std::move(retired)), merge(std::move(merge))
+        {
+        }
+
+        Mutex mu;
+        std::vector<T*> live ABSL_GUARDED_BY(mu);
+        std::unique_ptr<T> retired ABSL_GUARDED_BY(mu);
+        Merger merge ABSL_GUARDED_BY(mu);
+    };
+
+    // Outlives the `PerThread` when a thread exits after it, hence the shared ownership.
+    struct Entry
+    {
+        Entry(std::shared_ptr<Shared> shared, std::unique_ptr<T> value)
+            : shared(std::move(shared)), value(std::move(value))
+        {
+            LockGuard<Mutex> lg(this->shared->mu);
+            this->shared->live.push_back(this->value.get());
+        }
+
+        ~Entry()
+        {
+            LockGuard<Mutex> lg(shared->mu);
+            auto& live = shared->live;
+            live.erase(std::find(live.begin(), live.end(), value.get()));
+            if (shared->merge)
+            {
+                shared->merge(*value, *shared->retired);
+            }
+        }
+
+        DISABLE_COPY_MOVE(Entry)
+
+        std::shared_ptr<Shared> shared;
+        std::unique_ptr<T> value;
+    };
+
+    Initializer init_;
+    std::shared_ptr<Shared> shared_;
+    ThreadLocal<Entry> local_;
+};
 }    // namespace securefs
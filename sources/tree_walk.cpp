@@ -0,0 +1,956 @@
+#include "tree_walk.h"
+#include "exceptions.h"
+#include "full_format.h"
+#include "lite_format.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "stat_workaround.h"
+
+#include <absl/strings/escaping.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+
+namespace securefs
+{
+namespace
+{
+    constexpr size_t kReadChunkSize = 1 << 20;
+    constexpr size_t kMaxLinkSize = 1 << 16;
+
+    void check(int rc)
+    {
+        if (rc < 0)
+        {
+            throwVFSException(-rc);
+        }
+    }
+
+    std::string child_path(const std::string& dir, const std::string& name)
+    {
+        return dir == "/" ? absl::StrCat("/", name) : absl::StrCat(dir, "/", name);
+    }
+}    // namespace
+
+OpsTreeSource::OpsTreeSource(FuseHighLevelOpsBase& ops) : ops_(ops)
+{
+    ctx_.uid = OSService::getuid();
+    ctx_.gid = OSService::getgid();
+}
+
+fuse_stat OpsTreeSource::stat(const std::string& path)
+{
+    fuse_stat st{};
+    check(ops_.vgetattr(path.c_str(), &st, &ctx_));
+    return st;
+}
+
+std::vector<std::string> OpsTreeSource::list(const std::string& path)
+{
+    fuse_file_info info{};
+    check(ops_.vopendir(path.c_str(), &info, &ctx_));
+    DEFER(ops_.vreleasedir(path.c_str(), &info, &ctx_));
+    std::vector<std::string> names;
+    check(ops_.vreaddir(
+        path.c_str(),
+        &names,
+        [](void* buf, const char* name, const fuse_stat* st, fuse_off_t off)
+        {
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            {
+                static_cast<std::vector<std::string>*>(buf)->emplace_back(name);
+            }
+            return 0;
+        },
+        0,
+        &info,
+        &ctx_));
+    return names;
+}
+
+uint64_t OpsTreeSource::read_file(const std::string& path,
+                                  absl::FunctionRef<void(const char*, size_t)> sink)
+{
+    fuse_file_info info{};
+    info.flags = O_RDONLY;
+    check(ops_.vopen(path.c_str(), &info, &ctx_));
+    DEFER(ops_.vrelease(path.c_str(), &info, &ctx_));
+    std::vector<char> buffer(kReadChunkSize);
+    uint64_t total = 0;
+    while (true)
+    {
+        int rc = ops_.vread(path.c_str(), buffer.data(), buffer.size(), total, &info, &ctx_);
+        check(rc);
+        if (rc == 0)
+        {
+            return total;
+        }
+        sink(buffer.data(), rc);
+        total += rc;
+    }
+}
+
+std::string OpsTreeSource::read_link(const std::string& path)
+{
+    std::vector<char> buffer(kMaxLinkSize);
+    check(ops_.vreadlink(path.c_str(), buffer.data(), buffer.size(), &ctx_));
+    return std::string(buffer.data(), strnlen(buffer.data(), buffer.size()));
+}
+
+Xattrs OpsTreeSource::read_xattrs(const std::string& path)
+{
+    Xattrs result;
+    int rc = ops_.vlistxattr(path.c_str(), nullptr, 0, &ctx_);
+    if (rc == -ENOTSUP)
+    {
+        return result;
+    }
+    check(rc);
+    std::string names(rc, '\0');
+    rc = ops_.vlistxattr(path.c_str(), names.data(), names.size(), &ctx_);
+    check(rc);
+    names.resize(rc);
+    for (size_t start = 0; start < names.size();)
+    {
+        std::string name(names.c_str() + start);
+        start += name.size() + 1;
+        if (name.empty())
+        {
+            continue;
+        }
+        rc = ops_.vgetxattr(path.c_str(), name.c_str(), nullptr, 0, 0, &ctx_);
+        check(rc);
+        std::string value(rc, '\0');
+        rc = ops_.vgetxattr(path.c_str(), name.c_str(), value.data(), value.size(), 0, &ctx_);
+        check(rc);
+        value.resize(rc);
+        result.emplace_back(std::move(name), std::move(value));
+    }
+    return result;
+}
+
+void OpsTreeSource::check_directory(const std::string& path)
+{
+    fuse_file_info info{};
+    check(ops_.vopendir(path.c_str(), &info, &ctx_));
+    DEFER(ops_.vreleasedir(path.c_str(), &info, &ctx_));
+    if (auto full = dynamic_cast<full_format::FuseHighLevelOps*>(&ops_))
+    {
+        full->validate_directory(&info);
+    }
+    else if (auto lite = dynamic_cast<lite_format::FuseHighLevelOps*>(&ops_))
+    {
+        lite->validate_directory(&info);
+    }
+}
+
+std::string OSTreeSource::relative(const std::string& path)
+{
+    return path == "/" ? "." : path.substr(1);
+}
+
+fuse_stat OSTreeSource::stat(const std::string& path)
+{
+    fuse_stat st{};
+    if (!root_.stat(relative(path), &st))
+    {
+        throwVFSException(ENOENT);
+    }
+    return st;
+}
+
+std::vector<std::string> OSTreeSource::list(const std::string& path)
+{
+    auto traverser = root_.create_traverser(relative(path));
+    std::vector<std::string> names;
+    std::string name;
+    while (traverser->next(&name, nullptr))
+    {
+        if (name != "." && name != "..")
+        {
+            names.push_back(std::move(name));
+        }
+    }
+    return names;
+}
+
+uint64_t OSTreeSource::read_file(const std::string& path,
+                                 absl::FunctionRef<void(const char*, size_t)> sink)
+{
+    auto stream = root_.open_file_stream(relative(path), O_RDONLY, 0);
+    std::vector<char> buffer(kReadChunkSize);
+    uint64_t total = 0;
+    while (true)
+    {
+        auto size = stream->read(buffer.data(), total, buffer.size());
+        if (size == 0)
+        {
+            return total;
+        }
+        sink(buffer.data(), size);
+        total += size;
+    }
+}
+
+std::string OSTreeSource::read_link(const std::string& path)
+{
+    std::vector<char> buffer(kMaxLinkSize);
+    auto size = root_.readlink(relative(path), buffer.data(), buffer.size());
+    return std::string(buffer.data(), size);
+}
+
+Xattrs OSTreeSource::read_xattrs(const std::string& path)
+{
+    Xattrs result;
+    auto rel = relative(path);
+    auto rc = root_.listxattr(rel.c_str(), nullptr, 0);
+    if (rc == -ENOTSUP)
+    {
+        return result;
+    }
+    check(rc);
+    std::string names(rc, '\0');
+    rc = root_.listxattr(rel.c_str(), names.data(), names.size());
+    check(rc);
+    names.resize(rc);
+    for (size_t start = 0; start < names.size();)
+    {
+        std::string name(names.c_str() + start);
+        start += name.size() + 1;
+        if (name.empty())
+        {
+            continue;
+        }
+        rc = root_.getxattr(rel.c_str(), name.c_str(), nullptr, 0);
+        check(rc);
+        std::string value(rc, '\0');
+        rc = root_.getxattr(rel.c_str(), name.c_str(), value.data(), value.size());
+        check(rc);
+        value.resize(rc);
+        result.emplace_back(std::move(name), std::move(value));
+    }
+    return result;
+}
+
+namespace
+{
+    void apply_attributes(FuseHighLevelOpsBase& ops,
+                          const std::string& path,
+                          const fuse_stat& st,
+                          const fuse_context& ctx)
+    {
+        check(ops.vchmod(path.c_str(), st.st_mode & 07777, &ctx));
+        fuse_timespec ts[2] = {get_atim(st), get_mtim(st)};
+        check(ops.vutimens(path.c_str(), ts, &ctx));
+    }
+
+    void apply_xattrs(FuseHighLevelOpsBase& ops,
+                      const std::string& path,
+                      const Xattrs& xattrs,
+                      const fuse_context& ctx)
+    {
+        for (const auto& [name, value] : xattrs)
+        {
+            check(ops.vsetxattr(
+                path.c_str(), name.c_str(), value.data(), value.size(), 0, 0, &ctx));
+        }
+    }
+
+    class OpsWriter : public TreeSink::Writer
+    {
+    public:
+        OpsWriter(FuseHighLevelOpsBase& ops,
+                  std::string path,
+                  const fuse_stat& st,
+                  const fuse_context& ctx)
+            : ops_(ops), path_(std::move(path)), st_(st), ctx_(ctx)
+        {
+            info_.flags = O_WRONLY | O_CREAT | O_EXCL;
+            check(ops_.vcreate(path_.c_str(), 0600, &info_, &ctx_));
+        }
+
+        ~OpsWriter() override
+        {
+            if (!open_)
+            {
+                return;
+            }
+            try
+            {
+                ops_.vrelease(path_.c_str(), &info_, &ctx_);
+            }
+            catch (const std::exception& e)
+            {
+                WARN_LOG("Failed to close %s: %s", path_, e.what());
+            }
+        }
+
+        DISABLE_COPY_MOVE(OpsWriter)
+
+        void append(const char* data, size_t size) override
+        {
+            check(ops_.vwrite(path_.c_str(), data, size, offset_, &info_, &ctx_));
+            offset_ += size;
+        }
+
+        void close() override
+        {
+            open_ = false;
+            check(ops_.vflush(path_.c_str(), &info_, &ctx_));
+            check(ops_.vrelease(path_.c_str(), &info_, &ctx_));
+            apply_attributes(ops_, path_, st_, ctx_);
+        }
+
+    private:
+        FuseHighLevelOpsBase& ops_;
+        std::string path_;
+        fuse_stat st_;
+        const fuse_context& ctx_;
+        fuse_file_info info_{};
+        fuse_off_t offset_ = 0;
+        bool open_ = true;
+    };
+
+    class OSWriter : public TreeSink::Writer
+    {
+    public:
+        OSWriter(const OSService& root, std::string path, const fuse_stat& st)
+            : root_(root), path_(std::move(path)), st_(st)
+        {
+            stream_ = root_.open_file_stream(path_, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        }
+
+        void append(const char* data, size_t size) override
+        {
+            stream_->write(data, offset_, size);
+            offset_ += size;
+        }
+
+        void close() override
+        {
+            fuse_timespec ts[2] = {get_atim(st_), get_mtim(st_)};
+            stream_->utimens(ts);
+            stream_.reset();
+            root_.chmod(path_, st_.st_mode & 07777);
+        }
+
+    private:
+        const OSService& root_;
+        std::string path_;
+        fuse_stat st_;
+        std::shared_ptr<FileStream> stream_;
+        offset_type offset_ = 0;
+    };
+
+    constexpr size_t kTarBlockSize = 512;
+    constexpr char kZeros[kTarBlockSize] = {};
+
+    // Writes `value` into a ustar numeric field of `width` bytes, which is octal and NUL
+    // terminated. Returns false if it does not fit.
+    bool put_octal(char* field, size_t width, uint64_t value)
+    {
+        auto text = absl::StrFormat("%0*o", static_cast<int>(width - 1), value);
+        if (text.size() >= width)
+        {
+            return false;
+        }
+        memcpy(field, text.data(), text.size());
+        return true;
+    }
+
+    // Appends a pax record, "<length> <key>=<value>\n", where the length counts itself.
+    void append_pax_record(std::string& records, const std::string& key, const std::string& value)
+    {
+        size_t length = key.size() + value.size() + 3;
+        size_t digits = 1;
+        while (absl::StrCat(length + digits).size() != digits)
+        {
+            ++digits;
+        }
+        absl::StrAppend(&records, length + digits, " ", key, "=", value, "\n");
+    }
+
+    std::string make_ustar_block(const std::string& name,
+                                 unsigned mode,
+                                 uint64_t uid,
+                                 uint64_t gid,
+                                 uint64_t size,
+                                 int64_t mtime,
+                                 char type,
+                                 const std::string& link_target)
+    {
+        std::string block(kTarBlockSize, '\0');
+        memcpy(&block[0], name.data(), std::min<size_t>(name.size(), 100));
+        put_octal(&block[100], 8, mode);
+        put_octal(&block[108], 8, uid);
+        put_octal(&block[116], 8, gid);
+        put_octal(&block[124], 12, size);
+        put_octal(&block[136], 12, std::max<int64_t>(mtime, 0));
+        block[156] = type;
+        memcpy(&block[157], link_target.data(), std::min<size_t>(link_target.size(), 100));
+        memcpy(&block[257], "ustar", 6);
+        memcpy(&block[263], "00", 2);
+        // The checksum is computed with its own field filled with spaces.
+        memset(&block[148], ' ', 8);
+        unsigned checksum = 0;
+        for (char c : block)
+        {
+            checksum += static_cast<unsigned char>(c);
+        }
+        put_octal(&block[148], 7, checksum);
+        return block;
+    }
+}    // namespace
+
+bool TreeSink::clear_leftover(const std::string& path) { throwVFSException(ENOTSUP); }
+
+OpsTreeSink::OpsTreeSink(FuseHighLevelOpsBase& ops, const std::string& data_dir)
+    : ops_(ops), data_dir_(data_dir)
+{
+    ctx_.uid = OSService::getuid();
+    ctx_.gid = OSService::getgid();
+}
+
+void OpsTreeSink::make_directory(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+{
+    check(ops_.vmkdir(path.c_str(), 0700, &ctx_));
+    apply_xattrs(ops_, path, xattrs, ctx_);
+}
+
+void OpsTreeSink::finish_directory(const std::string& path, const fuse_stat& st)
+{
+    apply_attributes(ops_, path, st, ctx_);
+}
+
+std::unique_ptr<TreeSink::Writer>
+OpsTreeSink::create_file(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+{
+    auto writer = std::make_unique<OpsWriter>(ops_, path, st, ctx_);
+    apply_xattrs(ops_, path, xattrs, ctx_);
+    return writer;
+}
+
+void OpsTreeSink::make_symlink(const std::string& path,
+                               const std::string& target,
+                               const fuse_stat& st,
+                               const Xattrs& xattrs)
+{
+    check(ops_.vsymlink(target.c_str(), path.c_str(), &ctx_));
+    apply_xattrs(ops_, path, xattrs, ctx_);
+}
+
+void OpsTreeSink::sync() { data_dir_.syncfs(); }
+
+bool OpsTreeSink::clear_leftover(const std::string& path)
+{
+    fuse_stat st{};
+    try
+    {
+        int rc = ops_.vgetattr(path.c_str(), &st, &ctx_);
+        if (rc == -ENOENT)
+        {
+            return false;
+        }
+        check(rc);
+    }
+    catch (const VFSException& e)
+    {
+        if (e.error_number() == ENOENT)
+        {
+            return false;
+        }
+        throw;
+    }
+    if ((st.st_mode & S_IFMT) == S_IFDIR)
+    {
+        return true;
+    }
+    check(ops_.vunlink(path.c_str(), &ctx_));
+    return false;
+}
+
+std::string OSTreeSink::relative(const std::string& path)
+{
+    return path == "/" ? "." : path.substr(1);
+}
+
+void OSTreeSink::set_xattrs(const std::string& path, const Xattrs& xattrs)
+{
+    for (const auto& [name, value] : xattrs)
+    {
+        check(root_.setxattr(path.c_str(),
+                             name.c_str(),
+                             const_cast<char*>(value.data()),
+                             value.size(),
+                             0));
+    }
+}
+
+void OSTreeSink::make_directory(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+{
+    root_.mkdir(relative(path), 0700);
+    set_xattrs(relative(path), xattrs);
+}
+
+void OSTreeSink::finish_directory(const std::string& path, const fuse_stat& st)
+{
+    root_.chmod(relative(path), st.st_mode & 07777);
+    fuse_timespec ts[2] = {get_atim(st), get_mtim(st)};
+    root_.utimens(relative(path), ts);
+}
+
+std::unique_ptr<TreeSink::Writer>
+OSTreeSink::create_file(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+{
+    auto writer = std::make_unique<OSWriter>(root_, relative(path), st);
+    set_xattrs(relative(path), xattrs);
+    return writer;
+}
+
+void OSTreeSink::make_symlink(const std::string& path,
+                              const std::string& target,
+                              const fuse_stat& st,
+                              const Xattrs& xattrs)
+{
+    root_.symlink(target, relative(path));
+    set_xattrs(relative(path), xattrs);
+}
+
+std::string TarTreeSink::make_header(const std::string& path,
+                                     const fuse_stat& st,
+                                     char type,
+                                     const std::string& link_target,
+                                     const Xattrs& xattrs)
+{
+    auto name = path.substr(1);
+    if (type == '5')
+    {
+        name.push_back('/');
+    }
+    uint64_t size = type == '0' ? st.st_size : 0;
+    char probe[12];
+    std::string records;
+    if (name.size() > 100)
+    {
+        append_pax_record(records, "path", name);
+    }
+    if (link_target.size() > 100)
+    {
+        append_pax_record(records, "linkpath", link_target);
+    }
+    if (!put_octal(probe, sizeof(probe), size))
+    {
+        append_pax_record(records, "size", absl::StrCat(size));
+    }
+    if (!put_octal(probe, 8, st.st_uid))
+    {
+        append_pax_record(records, "uid", absl::StrCat(st.st_uid));
+    }
+    if (!put_octal(probe, 8, st.st_gid))
+    {
+        append_pax_record(records, "gid", absl::StrCat(st.st_gid));
+    }
+    for (const auto& [xattr_name, value] : xattrs)
+    {
+        append_pax_record(records, absl::StrCat("SCHILY.xattr.", xattr_name), value);
+    }
+
+    auto mtime = get_mtim(st).tv_sec;
+    auto header = make_ustar_block(
+        name, st.st_mode & 07777, st.st_uid, st.st_gid, size, mtime, type, link_target);
+    if (records.empty())
+    {
+        return header;
+    }
+    auto pax_name = absl::StrCat("PaxHeader/", name);
+    auto result = make_ustar_block(pax_name, 0644, 0, 0, records.size(), mtime, 'x', {});
+    result.append(records);
+    result.append((kTarBlockSize - records.size() % kTarBlockSize) % kTarBlockSize, '\0');
+    result.append(header);
+    return result;
+}
+
+class TarTreeSink::FileWriter : public TreeSink::Writer
+{
+public:
+    FileWriter(TarTreeSink& sink, std::string header, uint64_t size)
+        : sink_(sink)
+        , header_(std::move(header))
+        , size_(size)
+        , streaming_(size > kMaxBufferedFileSize)
+    {
+        if (streaming_)
+        {
+            sink_.mu_.Lock();
+            try
+            {
+                sink_.write(header_.data(), header_.size());
+            }
+            catch (...)
+            {
+                sink_.mu_.Unlock();
+                throw;
+            }
+        }
+        else
+        {
+            buffer_.reserve(size);
+        }
+    }
+
+    ~FileWriter() override
+    {
+        if (closed_)
+        {
+            return;
+        }
+        try
+        {
+            finish();
+        }
+        catch (const std::exception& e)
+        {
+            WARN_LOG("Failed to finish a tar entry: %s", e.what());
+        }
+    }
+
+    DISABLE_COPY_MOVE(FileWriter)
+
+    void append(const char* data, size_t size) override ABSL_NO_THREAD_SAFETY_ANALYSIS
+    {
+        if (size > size_ - written_)
+        {
+            throw_runtime_error("The file is larger than it was when archiving started");
+        }
+        if (streaming_)
+        {
+            sink_.write(data, size);
+        }
+        else
+        {
+            buffer_.append(data, size);
+        }
+        written_ += size;
+    }
+
+    void close() override
+    {
+        closed_ = true;
+        finish();
+        if (written_ != size_)
+        {
+            throw_runtime_error("The file is smaller than it was when archiving started");
+        }
+    }
+
+private:
+    TarTreeSink& sink_;
+    std::string header_;
+    std::string buffer_;
+    uint64_t size_;
+    uint64_t written_ = 0;
+    // Whether the archive is locked for the life of the writer.
+    bool streaming_;
+    bool closed_ = false;
+
+private:
+    // Fills a short file with zeros, so that the archive stays consistent with its header.
+    void finish() ABSL_NO_THREAD_SAFETY_ANALYSIS
+    {
+        if (!streaming_)
+        {
+            sink_.mu_.Lock();
+        }
+        DEFER(sink_.mu_.Unlock());
+        if (!streaming_)
+        {
+            sink_.write(header_.data(), header_.size());
+            sink_.write(buffer_.data(), buffer_.size());
+        }
+        for (uint64_t remaining = size_ - written_; remaining > 0;)
+        {
+            auto length = std::min<uint64_t>(remaining, sizeof(kZeros));
+            sink_.write(kZeros, length);
+            remaining -= length;
+        }
+        sink_.pad(size_);
+    }
+};
+
+void TarTreeSink::write(const char* data, size_t size)
+{
+    if (fwrite(data, 1, size, out_) != size)
+    {
+        THROW_POSIX_EXCEPTION(errno, "writing the tar archive");
+    }
+}
+
+void TarTreeSink::pad(uint64_t size)
+{
+    write(kZeros, (kTarBlockSize - size % kTarBlockSize) % kTarBlockSize);
+}
+
+void TarTreeSink::make_directory(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+{
+    auto header = make_header(path, st, '5', {}, xattrs);
+    LockGuard<Mutex> lg(mu_);
+    write(header.data(), header.size());
+}
+
+std::unique_ptr<TreeSink::Writer>
+TarTreeSink::create_file(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+{
+    return std::make_unique<FileWriter>(*this, make_header(path, st, '0', {}, xattrs), st.st_size);
+}
+
+void TarTreeSink::make_symlink(const std::string& path,
+                               const std::string& target,
+                               const fuse_stat& st,
+                               const Xattrs& xattrs)
+{
+    auto header = make_header(path, st, '2', target, xattrs);
+    LockGuard<Mutex> lg(mu_);
+    write(header.data(), header.size());
+}
+
+void TarTreeSink::sync()
+{
+    LockGuard<Mutex> lg(mu_);
+    // The end of an archive is two blocks of zeros.
+    write(kZeros, sizeof(kZeros));
+    write(kZeros, sizeof(kZeros));
+    if (fflush(out_) != 0)
+    {
+        THROW_POSIX_EXCEPTION(errno, "writing the tar archive");
+    }
+}
+
+ParallelTreeWalker::ParallelTreeWalker(TreeSource& source, unsigned threads, bool keep_going)
+    : source_(source), pool_(threads), keep_going_(keep_going)
+{
+}
+
+void ParallelTreeWalker::walk(Visitor visit,
+                              absl::FunctionRef<void()> on_tick,
+                              absl::Duration tick)
+{
+    pool_.submit([this, visit]() { visit_entry("/", visit); });
+    pool_.run(on_tick, tick);
+}
+
+std::vector<std::string> ParallelTreeWalker::errors() const
+{
+    LockGuard<Mutex> lg(mu_);
+    return errors_;
+}
+
+void ParallelTreeWalker::visit_entry(std::string path, Visitor visit)
+{
+    try
+    {
+        auto st = source_.stat(path);
+        visit(path, st);
+        switch (st.st_mode & S_IFMT)
+        {
+        case S_IFDIR:
+            ++progress_.directories;
+            for (auto&& name : source_.list(path))
+            {
+                pool_.submit([this, visit, child = child_path(path, name)]()
+                             { visit_entry(child, visit); });
+            }
+            break;
+        case S_IFLNK:
+            ++progress_.symlinks;
+            break;
+        default:
+            ++progress_.files;
+            break;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        if (!keep_going_)
+        {
+            throw;
+        }
+        ++progress_.errors;
+        LockGuard<Mutex> lg(mu_);
+        if (errors_.size() < kMaxRecordedErrors)
+        {
+            errors_.push_back(absl::StrCat(path, ": ", e.what()));
+        }
+    }
+}
+
+TreeCheckpoint::TreeCheckpoint(std::shared_ptr<FileStream> stream) : stream_(std::move(stream))
+{
+    auto content = stream_->as_string();
+    // Drops the last line if it was cut short by a crash.
+    content.resize(content.rfind('\n') + 1);
+    offset_ = content.size();
+    for (std::string_view line : absl::StrSplit(content, '\n', absl::SkipEmpty()))
+    {
+        std::string path;
+        if (!absl::CUnescape(line, &path))
+        {
+            throw_runtime_error("The checkpoint file is corrupted");
+        }
+        done_.insert(std::move(path));
+    }
+}
+
+void TreeCheckpoint::add(std::string path)
+{
+    LockGuard<Mutex> lg(mu_);
+    pending_.push_back(std::move(path));
+}
+
+void TreeCheckpoint::commit(TreeSink& sink)
+{
+    std::vector<std::string> pending;
+    {
+        LockGuard<Mutex> lg(mu_);
+        pending.swap(pending_);
+    }
+    sink.sync();
+    if (pending.empty())
+    {
+        return;
+    }
+    std::string lines;
+    for (const auto& path : pending)
+    {
+        absl::StrAppend(&lines, absl::CEscape(path), "\n");
+    }
+    stream_->write(lines.data(), offset_, lines.size());
+    stream_->fsync();
+    offset_ += lines.size();
+}
+
+ParallelTreeCopier::ParallelTreeCopier(TreeSource& source,
+                                       TreeSink& sink,
+                                       unsigned threads,
+                                       bool keep_going)
+    : source_(source), sink_(sink), walker_(source, threads, keep_going)
+{
+}
+
+void ParallelTreeCopier::copy(absl::FunctionRef<void()> on_tick, absl::Duration tick)
+{
+    try
+    {
+        walker_.walk(
+            [this](const std::string& path, const fuse_stat& st) { copy_entry(path, st); },
+            [&]()
+            {
+                if (checkpoint_)
+                {
+                    checkpoint_->commit(sink_);
+                }
+                on_tick();
+            },
+            tick);
+    }
+    catch (...)
+    {
+        // Keep what is done so far for the next run.
+        if (checkpoint_)
+        {
+            checkpoint_->commit(sink_);
+        }
+        throw;
+    }
+
+    std::vector<std::pair<std::string, fuse_stat>> directories;
+    {
+        LockGuard<Mutex> lg(mu_);
+        directories.swap(directories_);
+    }
+    // A path sorts after its parent, so the reverse order handles children first.
+    std::sort(directories.begin(),
+              directories.end(),
+              [](const auto& a, const auto& b) { return a.first > b.first; });
+    for (const auto& [path, st] : directories)
+    {
+        sink_.finish_directory(path, st);
+    }
+    if (checkpoint_)
+    {
+        checkpoint_->commit(sink_);
+    }
+    else
+    {
+        sink_.sync();
+    }
+}
+
+void ParallelTreeCopier::copy_entry(const std::string& path, const fuse_stat& st)
+{
+    // The root already exists, and keeps its own attributes.
+    if (path == "/")
+    {
+        return;
+    }
+    if (checkpoint_ && checkpoint_->contains(path))
+    {
+        if ((st.st_mode & S_IFMT) == S_IFDIR)
+        {
+            add_directory(path, st);
+        }
+        return;
+    }
+    if (checkpoint_ && checkpoint_->resuming() && sink_.clear_leftover(path))
+    {
+        add_directory(path, st);
+    }
+    else
+    {
+        copy_new_entry(path, st);
+    }
+    if (checkpoint_)
+    {
+        checkpoint_->add(path);
+    }
+}
+
+void ParallelTreeCopier::add_directory(const std::string& path, const fuse_stat& st)
+{
+    LockGuard<Mutex> lg(mu_);
+    directories_.emplace_back(path, st);
+}
+
+void ParallelTreeCopier::copy_new_entry(const std::string& path, const fuse_stat& st)
+{
+    auto xattrs = source_.read_xattrs(path);
+    switch (st.st_mode & S_IFMT)
+    {
+    case S_IFDIR:
+        sink_.make_directory(path, st, xattrs);
+        add_directory(path, st);
+        break;
+    case S_IFLNK:
+        sink_.make_symlink(path, source_.read_link(path), st, xattrs);
+        break;
+    case S_IFREG:
+    {
+        auto writer = sink_.create_file(path, st, xattrs);
+        source_.read_file(path,
+                          [&](const char* data, size_t size)
+                          {
+                              writer->append(data, size);
+                              walker_.progress().bytes += size;
+                          });
+        writer->close();
+        break;
+    }
+    default:
+        throwVFSException(ENOTSUP);
+    }
+}
+}    // namespace securefs
@@ -0,0 +1,327 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "myutils.h"
+#include "object.h"
+#include "platform.h"    // IWYU pragma: keep
+#include "task_pool.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/functional/function_ref.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace securefs
+{
+/// Extended attributes as pairs of name and value.
+using Xattrs = std::vector<std::pair<std::string, std::string>>;
+
+/// A directory tree that is read entry by entry. Paths start with "/" and are relative to the root
+/// of the tree. All methods throw on errors, and may be called from several threads at once.
+class TreeSource : public Object
+{
+public:
+    /// Does not follow symbolic links.
+    virtual fuse_stat stat(const std::string& path) = 0;
+    /// The names in a directory, without "." and "..".
+    virtual std::vector<std::string> list(const std::string& path) = 0;
+    /// Passes the content of a regular file to `sink` in order, and returns its total size.
+    virtual uint64_t read_file(const std::string& path,
+                               absl::FunctionRef<void(const char*, size_t)> sink)
+        = 0;
+    virtual std::string read_link(const std::string& path) = 0;
+    /// Empty when extended attributes are not supported.
+    virtual Xattrs read_xattrs(const std::string& path) = 0;
+    /// Checks what the listing of a directory does not cover, such as the pages of its B-tree.
+    virtual void check_directory(const std::string& path) { (void)path; }
+};
+
+/// Reads the plain text view of a repository through its `FuseHighLevelOpsBase`.
+class OpsTreeSource : public TreeSource
+{
+public:
+    explicit OpsTreeSource(FuseHighLevelOpsBase& ops);
+
+    fuse_stat stat(const std::string& path) override;
+    std::vector<std::string> list(const std::string& path) override;
+    uint64_t read_file(const std::string& path,
+                       absl::FunctionRef<void(const char*, size_t)> sink) override;
+    std::string read_link(const std::string& path) override;
+    Xattrs read_xattrs(const std::string& path) override;
+    void check_directory(const std::string& path) override;
+
+private:
+    FuseHighLevelOpsBase& ops_;
+    fuse_context ctx_{};
+};
+
+/// Reads a plain directory on the local filesystem.
+class OSTreeSource : public TreeSource
+{
+public:
+    explicit OSTreeSource(const std::string& root) : root_(root) {}
+
+    fuse_stat stat(const std::string& path) override;
+    std::vector<std::string> list(const std::string& path) override;
+    uint64_t read_file(const std::string& path,
+                       absl::FunctionRef<void(const char*, size_t)> sink) override;
+    std::string read_link(const std::string& path) override;
+    Xattrs read_xattrs(const std::string& path) override;
+
+private:
+    OSService root_;
+
+private:
+    static std::string relative(const std::string& path);
+};
+
+/// The destination of `ParallelTreeCopier`. Paths are the same as those of `TreeSource`, and
+/// each entry is created with the attributes and extended attributes of its source. All methods
+/// throw on errors, and may be called from several threads at once.
+class TreeSink : public Object
+{
+public:
+    class Writer
+    {
+    public:
+        virtual ~Writer() = default;
+        virtual void append(const char* data, size_t size) = 0;
+        /// Reports the errors that the destructor would swallow.
+        virtual void close() = 0;
+    };
+
+    /// Called before the entries of the directory are created, so the sink may have to keep the
+    /// directory writable until `finish_directory`.
+    virtual void
+    make_directory(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+        = 0;
+    /// Called on every directory after all the entries are created, deepest first.
+    virtual void finish_directory(const std::string& path, const fuse_stat& st) = 0;
+    /// `st.st_size` is the number of bytes that will be appended.
+    virtual std::unique_ptr<Writer>
+    create_file(const std::string& path, const fuse_stat& st, const Xattrs& xattrs)
+        = 0;
+    virtual void make_symlink(const std::string& path,
+                              const std::string& target,
+                              const fuse_stat& st,
+                              const Xattrs& xattrs)
+        = 0;
+    /// Makes all the entries created so far durable.
+    virtual void sync() = 0;
+    /// Cleans up what an interrupted copy may have left at `path` before it is created again. A
+    /// partial file or symbolic link is removed, while a directory is kept along with its entries,
+    /// which are resumed on their own. Returns whether `path` is such a directory. Only needed to
+    /// resume from a `TreeCheckpoint`, and unsupported by default.
+    virtual bool clear_leftover(const std::string& path);
+};
+
+/// Writes into a repository through its `FuseHighLevelOpsBase`, which encrypts on the way.
+class OpsTreeSink : public TreeSink
+{
+public:
+    /// `data_dir` is where the repository is stored, for `sync()`.
+    OpsTreeSink(FuseHighLevelOpsBase& ops, const std::string& data_dir);
+
+    void
+    make_directory(const std::string& path, const fuse_stat& st, const Xattrs& xattrs) override;
+    void finish_directory(const std::string& path, const fuse_stat& st) override;
+    std::unique_ptr<Writer>
+    create_file(const std::string& path, const fuse_stat& st, const Xattrs& xattrs) override;
+    void make_symlink(const std::string& path,
+                      const std::string& target,
+                      const fuse_stat& st,
+                      const Xattrs& xattrs) override;
+    void sync() override;
+    bool clear_leftover(const std::string& path) override;
+
+private:
+    FuseHighLevelOpsBase& ops_;
+    OSService data_dir_;
+    fuse_context ctx_{};
+};
+
+/// Writes plain files into a directory on the local filesystem.
+class OSTreeSink : public TreeSink
+{
+public:
+    explicit OSTreeSink(const std::string& root) : root_(root) {}
+
+    void
+    make_directory(const std::string& path, const fuse_stat& st, const Xattrs& xattrs) override;
+    void finish_directory(const std::string& path, const fuse_stat& st) override;
+    std::unique_ptr<Writer>
+    create_file(const std::string& path, const fuse_stat& st, const Xattrs& xattrs) override;
+    void make_symlink(const std::string& path,
+                      const std::string& target,
+                      const fuse_stat& st,
+                      const Xattrs& xattrs) override;
+    void sync() override { root_.syncfs(); }
+
+private:
+    OSService root_;
+
+private:
+    static std::string relative(const std::string& path);
+    void set_xattrs(const std::string& relative_path, const Xattrs& xattrs);
+};
+
+/// Writes a POSIX (pax) tar archive into a `FILE*`, such as stdout. Extended attributes are
+/// stored as SCHILY.xattr records, which GNU and BSD tar understand.
+///
+/// Entries are written whole, one at a time. Files up to `kMaxBufferedFileSize` are buffered so
+/// that they can be read in parallel, while larger ones hold the archive until they are done.
+class TarTreeSink : public TreeSink
+{
+public:
+    explicit TarTreeSink(FILE* out) : out_(out) {}
+
+    void
+    make_directory(const std::string& path, const fuse_stat& st, const Xattrs& xattrs) override;
+    void finish_directory(const std::string& path, const fuse_stat& st) override {}
+    std::unique_ptr<Writer>
+    create_file(const std::string& path, const fuse_stat& st, const Xattrs& xattrs) override;
+    void make_symlink(const std::string& path,
+                      const std::string& target,
+                      const fuse_stat& st,
+                      const Xattrs& xattrs) override;
+    /// Ends the archive, so nothing may be added afterwards.
+    void sync() override;
+
+    static constexpr size_t kMaxBufferedFileSize = 1 << 20;
+
+    /// The header blocks of an entry, which is a pax extended header followed by a ustar header
+    /// if the entry does not fit in the latter alone. `type` is the ustar type flag.
+    static std::string make_header(const std::string& path,
+                                   const fuse_stat& st,
+                                   char type,
+                                   const std::string& link_target,
+                                   const Xattrs& xattrs);
+
+private:
+    class FileWriter;
+
+    Mutex mu_;
+    FILE* out_ ABSL_GUARDED_BY(mu_);
+
+private:
+    void write(const char* data, size_t size) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    // Pads the archive with zeros after an entry of `size` bytes.
+    void pad(uint64_t size) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+};
+
+/// Visits every entry of a `TreeSource` on a `TaskPool`, one task per entry, so that large trees
+/// are processed at the speed of the disk rather than that of one core.
+class ParallelTreeWalker
+{
+public:
+    struct Progress
+    {
+        std::atomic<uint64_t> directories{0}, files{0}, symlinks{0}, bytes{0}, errors{0};
+    };
+
+    using Visitor = absl::FunctionRef<void(const std::string& path, const fuse_stat& st)>;
+
+    /// With `keep_going`, a failed entry is recorded and skipped. Otherwise the first failure stops
+    /// the walk and is rethrown from `walk()`.
+    ParallelTreeWalker(TreeSource& source, unsigned threads, bool keep_going);
+    DISABLE_COPY_MOVE(ParallelTreeWalker)
+
+    /// Calls `visit` on every entry, starting with the root "/". A directory is visited before its
+    /// entries, and they are skipped if its visit fails. `on_tick` is called on the calling thread
+    /// every `tick` until the walk is done.
+    void walk(Visitor visit, absl::FunctionRef<void()> on_tick, absl::Duration tick);
+
+    unsigned thread_count() const noexcept { return pool_.thread_count(); }
+    /// Visitors may add to `bytes`. The other counters are maintained by the walker.
+    Progress& progress() noexcept { return progress_; }
+    /// The first failures, each formatted as "path: message".
+    std::vector<std::string> errors() const;
+
+    static constexpr size_t kMaxRecordedErrors = 100;
+
+private:
+    TreeSource& source_;
+    TaskPool pool_;
+    bool keep_going_;
+    Progress progress_;
+    mutable Mutex mu_;
+    std::vector<std::string> errors_ ABSL_GUARDED_BY(mu_);
+
+private:
+    void visit_entry(std::string path, Visitor visit);
+};
+
+/// The entries that a `ParallelTreeCopier` has finished, kept in a file so that an interrupted copy
+/// can resume where it stopped. Each line of the file is a C-escaped path.
+///
+/// New entries are only written out by `commit()`, after the sink has made them durable, so that
+/// the file never lists an entry that a crash could still lose.
+class TreeCheckpoint
+{
+public:
+    /// Loads the entries already in `stream`, which is appended to by `commit()`.
+    explicit TreeCheckpoint(std::shared_ptr<FileStream> stream);
+    DISABLE_COPY_MOVE(TreeCheckpoint)
+
+    /// Whether `path` was finished by an earlier run.
+    bool contains(const std::string& path) const { return done_.contains(path); }
+    /// Whether there was an earlier run, which may have left partial entries behind.
+    bool resuming() const noexcept { return !done_.empty(); }
+
+    void add(std::string path);
+    /// Syncs `sink` and then writes out the entries added before the call. Must not be called from
+    /// several threads at once.
+    void commit(TreeSink& sink);
+
+private:
+    std::shared_ptr<FileStream> stream_;
+    offset_type offset_ = 0;
+    absl::flat_hash_set<std::string> done_;
+    Mutex mu_;
+    std::vector<std::string> pending_ ABSL_GUARDED_BY(mu_);
+};
+
+/// Copies every entry of a `TreeSource` into a `TreeSink`, on top of `ParallelTreeWalker`.
+///
+/// Each file is streamed from the source to the sink in chunks by one task, so the memory in use is
+/// bounded by the number of threads rather than by the size of the files. Without a checkpoint,
+/// nothing is synced until all the entries are written.
+class ParallelTreeCopier
+{
+public:
+    ParallelTreeCopier(TreeSource& source, TreeSink& sink, unsigned threads, bool keep_going);
+    DISABLE_COPY_MOVE(ParallelTreeCopier)
+
+    void copy(absl::FunctionRef<void()> on_tick, absl::Duration tick);
+
+    ParallelTreeWalker& walker() noexcept { return walker_; }
+
+    /// Skips the entries in `checkpoint`, and adds those that are copied to it. The checkpoint is
+    /// committed on every tick and at the end of `copy()`, even if it fails.
+    void set_checkpoint(TreeCheckpoint* checkpoint) noexcept { checkpoint_ = checkpoint; }
+
+private:
+    TreeSource& source_;
+    TreeSink& sink_;
+    ParallelTreeWalker walker_;
+    TreeCheckpoint* checkpoint_ = nullptr;
+    Mutex mu_;
+    std::vector<std::pair<std::string, fuse_stat>> directories_ ABSL_GUARDED_BY(mu_);
+
+private:
+    void copy_entry(const std::string& path, const fuse_stat& st);
+    void copy_new_entry(const std::string& path, const fuse_stat& st);
+    // Remembers a directory to be finished after all the entries are copied.
+    void add_directory(const std::string& path, const fuse_stat& st);
+};
+}    // namespace securefs
@@ -0,0 +1,69 @@
+#include "tunables.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+
+
+namespace securefs
+{
+Tunables& Tunables::global()
+{
+    static Tunables tunables;
+    return tunables;
+}
+
+Tunables::Knob* Tunables::find(std::string_view name)
+{
+    for (auto& knob : knobs_)
+    {
+        if (knob.name == name)
+        {
+            return &knob;
+        }
+    }
+    return nullptr;
+}
+
+const std::atomic<uint64_t>& Tunables::define(std::string_view name,
+                                              uint64_t default_value,
+                                              uint64_t min_value,
+                                              uint64_t max_value)
+{
+    LockGuard<Mutex> lg(mu_);
+    if (auto knob = find(name))
+    {
+        return knob->value;
+    }
+    auto& knob = knobs_.emplace_back();
+    knob.name = std::string(name);
+    knob.min_value = min_value;
+    knob.max_value = max_value;
+    knob.value.store(default_value, std::memory_order_relaxed);
+    return knob.value;
+}
+
+void Tunables::set(std::string_view name, uint64_t value)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto knob = find(name);
+    if (!knob)
+    {
+        throwVFSException(EINVAL);
+    }
+    if (value < knob->min_value || value > knob->max_value)
+    {
+        throwVFSException(ERANGE);
+    }
+    knob->value.store(value, std::memory_order_relaxed);
+}
+
+std::vector<std::pair<std::string, uint64_t>> Tunables::list()
+{
+    LockGuard<Mutex> lg(mu_);
+    std::vector<std::pair<std::string, uint64_t>> result;
+    for (const auto& knob : knobs_)
+    {
+        result.emplace_back(knob.name, knob.value.load(std::memory_order_relaxed));
+    }
+    return result;
+}
+}    // namespace securefs
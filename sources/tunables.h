@@ -0,0 +1,56 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/base/thread_annotations.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace securefs
+{
+/// Process wide knobs that may be changed while the filesystem is mounted, through the control
+/// file under `/.securefs`.
+///
+/// The owners define their knobs into static references at namespace or class scope, so that every
+/// knob is listed and can be set from the start, even before the code that uses it first runs.
+/// They read the returned atomic on every use without any locking.
+class Tunables
+{
+public:
+    Tunables() = default;
+    DISABLE_COPY_MOVE(Tunables)
+
+    static Tunables& global();
+
+    /// Defining the same name again returns the existing knob.
+    const std::atomic<uint64_t>&
+    define(std::string_view name, uint64_t default_value, uint64_t min_value, uint64_t max_value);
+
+    /// Throws when the name is unknown or the value is out of range.
+    void set(std::string_view name, uint64_t value);
+
+    std::vector<std::pair<std::string, uint64_t>> list();
+
+private:
+    struct Knob
+    {
+        std::string name;
+        uint64_t min_value, max_value;
+        std::atomic<uint64_t> value;
+    };
+
+    Mutex mu_;
+    // A deque keeps the references handed out by `define` stable.
+    std::deque<Knob> knobs_ ABSL_GUARDED_BY(mu_);
+
+private:
+    Knob* find(std::string_view name) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+};
+}    // namespace securefs
@@ -1,14 +1,22 @@
 #ifndef _WIN32
 #define _DARWIN_BETTER_REALPATH 1
+#include "access_hints.h"
 #include "exceptions.h"
+#include "io_uring.h"
 #include "lock_enabled.h"
 #include "logger.h"
+#include "op_stats.h"
 #include "platform.h"
+#include "tunables.h"
 
+#include <absl/container/inlined_vector.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
 
+#include <atomic>
+#include <cstdint>
+
 #include <cxxabi.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -31,18 +39,87 @@
 #include <sys/xattr.h>
 #endif
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
 namespace securefs
 {
-class UnixFileStream final : public FileStream
+namespace
 {
-private:
+    const std::atomic<uint64_t>& access_hints_window_kib
+        = Tunables::global().define("access_hints_window_kib", 2048, 64, 1 << 20);
+
+    length_type access_hints_window()
+    {
+        return access_hints_window_kib.load(std::memory_order_relaxed) << 10;
+    }
+
+    // The hints are only advisory, so their failures are ignored.
+    void give_access_hints(int fd, const AccessPatternTracker::Hints& hints)
+    {
+        using Advice = AccessPatternTracker::Hints::Advice;
+        static const OpStats::Counter prefetched("access_hints_prefetched_bytes"),
+            dropped("access_hints_dropped_bytes");
+#ifdef POSIX_FADV_SEQUENTIAL
+        if (hints.advice != Advice::kUnchanged)
+            (void)::posix_fadvise(fd,
+                                  0,
+                                  0,
+                                  hints.advice == Advice::kSequential ? POSIX_FADV_SEQUENTIAL
+                                                                      : POSIX_FADV_NORMAL);
+        if (hints.prefetch_length > 0)
+        {
+#ifdef __linux__
+            (void)::readahead(fd, hints.prefetch_offset, hints.prefetch_length);
+#else
+            (void)::posix_fadvise(
+                fd, hints.prefetch_offset, hints.prefetch_length, POSIX_FADV_WILLNEED);
+#endif
+            prefetched.add(static_cast<int64_t>(hints.prefetch_length));
+        }
+        if (hints.drop_length > 0)
+        {
+            (void)::posix_fadvise(fd, hints.drop_offset, hints.drop_length, POSIX_FADV_DONTNEED);
+            dropped.add(static_cast<int64_t>(hints.drop_length));
+        }
+#elif defined(__APPLE__)
+        // There is neither a sequential advice nor a way to drop the cache here, only prefetching.
+        (void)dropped;
+        if (hints.prefetch_length > 0)
+        {
+            struct radvisory advisory;
+            advisory.ra_offset = static_cast<off_t>(hints.prefetch_offset);
+            advisory.ra_count
+                = static_cast<int>(std::min<length_type>(hints.prefetch_length, INT_MAX));
+            (void)::fcntl(fd, F_RDADVISE, &advisory);
+            prefetched.add(advisory.ra_count);
+        }
+#endif
+    }
+}    // namespace
+
+class UnixFileStream : public FileStream
+{
+protected:
     int m_fd;
+    // Null unless access hints are enabled.
+    std::unique_ptr<AccessPatternTracker> m_tracker;
+
+    void note_read(offset_type offset, length_type length)
+    {
+        if (m_tracker)
+            give_access_hints(m_fd, m_tracker->on_read(offset, length, access_hints_window()));
+    }
 
 public:
     explicit UnixFileStream(int fd) : m_fd(fd)
     {
         if (fd < 0)
             throwVFSException(EBADF);
+        if (is_access_hints_enabled())
+            m_tracker = std::make_unique<AccessPatternTracker>();
     }
 
     ~UnixFileStream() { this->close(); }
@@ -94,6 +171,7 @@ public:
 
     length_type read(void* output, offset_type offset, length_type length) override
     {
+        note_read(offset, length);
         auto rc = ::pread(m_fd, output, length, offset);
         if (rc < 0)
             THROW_POSIX_EXCEPTION(errno, "pread");
@@ -135,6 +213,126 @@ public:
             THROW_POSIX_EXCEPTION(errno, "truncate");
     }
 
+#ifdef __linux__
+    // Filesystems without support for the mode fall back to writing zeros, or to only extending.
+    void punch_hole(offset_type offset, length_type length) override
+    {
+        if (length <= 0)
+            return;
+        int rc = ::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+        if (rc < 0 && errno != EOPNOTSUPP)
+            THROW_POSIX_EXCEPTION(errno, "fallocate");
+        if (rc < 0)
+            FileStream::punch_hole(offset, length);
+    }
+
+    void preallocate(offset_type offset, length_type length, bool keep_size) override
+    {
+        if (length <= 0)
+            return;
+        int rc = ::fallocate(m_fd, keep_size ? FALLOC_FL_KEEP_SIZE : 0, offset, length);
+        if (rc < 0 && errno != EOPNOTSUPP)
+            THROW_POSIX_EXCEPTION(errno, "fallocate");
+        if (rc < 0)
+            FileStream::preallocate(offset, length, keep_size);
+    }
+#endif
+
+#ifdef SEEK_DATA
+    // Both move the file position, which only `sequential_read` and `sequential_write` use.
+    offset_type next_data(offset_type offset) override
+    {
+        auto rc = ::lseek(m_fd, static_cast<off_t>(offset), SEEK_DATA);
+        if (rc >= 0)
+            return static_cast<offset_type>(rc);
+        if (errno == ENXIO)
+            return std::max(offset, size());
+        if (errno != EINVAL)
+            THROW_POSIX_EXCEPTION(errno, "lseek");
+        return FileStream::next_data(offset);
+    }
+
+    offset_type next_hole(offset_type offset) override
+    {
+        auto rc = ::lseek(m_fd, static_cast<off_t>(offset), SEEK_HOLE);
+        if (rc >= 0)
+            return static_cast<offset_type>(rc);
+        if (errno != ENXIO && errno != EINVAL)
+            THROW_POSIX_EXCEPTION(errno, "lseek");
+        return FileStream::next_hole(offset);
+    }
+#endif
+
+#ifdef __linux__
+    // Reflinks need offsets aligned to the blocks of the filesystem, and a length too unless the
+    // range reaches the end of the source. When both offsets are aligned alike, the aligned middle
+    // of the range is cloned, and only the ends are copied. copy_file_range still saves the round
+    // trip through user space, and some filesystems share storage through it as well.
+    length_type copy_range_from(StreamBase& source,
+                                offset_type source_offset,
+                                offset_type offset,
+                                length_type length) override
+    {
+        auto* unix_source = dynamic_cast<UnixFileStream*>(&source);
+        auto source_size = source.size();
+        if (!unix_source || source_offset >= source_size)
+            return StreamBase::copy_range_from(source, source_offset, offset, length);
+        length = std::min(length, source_size - source_offset);
+
+        static const OpStats::Counter cloned("bytes_cloned"),
+            copied_in_kernel("bytes_copied_in_kernel");
+        auto copy_in_kernel = [&](length_type begin, length_type end) -> length_type
+        {
+            length_type copied = begin;
+            while (copied < end)
+            {
+                off64_t in = static_cast<off64_t>(source_offset + copied);
+                off64_t out = static_cast<off64_t>(offset + copied);
+                auto rc = ::copy_file_range(unix_source->m_fd, &in, m_fd, &out, end - copied, 0);
+                if (rc < 0)
+                {
+                    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+                        THROW_POSIX_EXCEPTION(errno, "copy_file_range");
+                    return copied
+                        + StreamBase::copy_range_from(
+                               source, source_offset + copied, offset + copied, end - copied)
+                        - begin;
+                }
+                if (rc == 0)
+                    break;
+                copied += static_cast<length_type>(rc);
+                copied_in_kernel.add(rc);
+            }
+            return copied - begin;
+        };
+
+        struct stat st;
+        if (::fstat(m_fd, &st) < 0)
+            THROW_POSIX_EXCEPTION(errno, "fstat");
+        auto alignment = static_cast<length_type>(std::max<blksize_t>(st.st_blksize, 1));
+        length_type clone_begin = (alignment - offset % alignment) % alignment;
+        if (source_offset % alignment == offset % alignment && clone_begin < length)
+        {
+            length_type clone_end = source_offset + length == source_size
+                ? length
+                : length - (offset + length) % alignment;
+            struct file_clone_range range{};
+            range.src_fd = unix_source->m_fd;
+            range.src_offset = source_offset + clone_begin;
+            range.src_length = clone_end - clone_begin;
+            range.dest_offset = offset + clone_begin;
+            if (clone_begin < clone_end && ::ioctl(m_fd, FICLONERANGE, &range) == 0)
+            {
+                cloned.add(static_cast<int64_t>(clone_end - clone_begin));
+                if (copy_in_kernel(0, clone_begin) != clone_begin)
+                    throwVFSException(EIO);
+                return clone_end + copy_in_kernel(clone_end, length);
+            }
+        }
+        return copy_in_kernel(0, length);
+    }
+#endif
+
     length_type size() const override
     {
         struct stat st;
@@ -185,6 +383,241 @@ public:
 #endif
 };
 
+#ifdef __linux__
+// Does the positional reads and writes through the io_uring of the calling thread, and defers the
+// batched reads so that they are submitted together. Threads whose ring cannot be set up use the
+// system calls of `UnixFileStream` instead.
+class IoUringFileStream : public UnixFileStream
+{
+private:
+    using Request = IoUring::Request;
+
+    // Larger transfers do not fit in a request, and gain nothing from batching anyway.
+    static constexpr length_type kMaxLength = 1 << 30;
+
+    uint64_t m_id;
+
+    static uint64_t next_id()
+    {
+        static std::atomic<uint64_t> id{0};
+        return ++id;
+    }
+
+    Request make_request(Request::Op op, const void* buffer, offset_type offset, length_type length)
+    {
+        return Request{op,
+                       m_fd,
+                       m_id,
+                       const_cast<void*>(buffer),
+                       static_cast<uint64_t>(offset),
+                       static_cast<uint32_t>(length),
+                       0};
+    }
+
+    static void run_batch(absl::Span<const ReadBatch::Read> reads)
+    {
+        absl::InlinedVector<Request, 4> requests;
+        for (const auto& read : reads)
+        {
+            auto* stream = static_cast<IoUringFileStream*>(read.stream);
+            requests.push_back(
+                stream->make_request(Request::Op::kRead, read.output, read.offset, read.length));
+        }
+        IoUring::of_this_thread()->run(absl::MakeSpan(requests));
+        for (size_t i = 0; i < reads.size(); ++i)
+        {
+            if (requests[i].result < 0)
+                THROW_POSIX_EXCEPTION(static_cast<int>(-requests[i].result), "io_uring read");
+            *reads[i].result = static_cast<length_type>(requests[i].result);
+        }
+    }
+
+public:
+    explicit IoUringFileStream(int fd) : UnixFileStream(fd), m_id(next_id()) {}
+
+    ~IoUringFileStream() { this->close(); }
+
+    void close() noexcept override
+    {
+        if (m_fd >= 0)
+        {
+            IoUring::forget_file(m_id);
+        }
+        UnixFileStream::close();
+    }
+
+    void fsync() override
+    {
+        auto* ring = IoUring::of_this_thread();
+        if (!ring)
+            return UnixFileStream::fsync();
+        auto request = make_request(Request::Op::kFsync, nullptr, 0, 0);
+        ring->run({&request, 1});
+        if (request.result < 0)
+            THROW_POSIX_EXCEPTION(static_cast<int>(-request.result), "io_uring fsync");
+    }
+
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        auto* ring = IoUring::of_this_thread();
+        if (!ring || length > kMaxLength)
+            return UnixFileStream::read(output, offset, length);
+        note_read(offset, length);
+        auto request = make_request(Request::Op::kRead, output, offset, length);
+        ring->run({&request, 1});
+        if (request.result < 0)
+            THROW_POSIX_EXCEPTION(static_cast<int>(-request.result), "io_uring read");
+        return static_cast<length_type>(request.result);
+    }
+
+    void read_batched(ReadBatch& batch,
+                      void* output,
+                      offset_type offset,
+                      length_type length,
+                      length_type* result) override
+    {
+        if (!IoUring::of_this_thread() || length > kMaxLength)
+        {
+            *result = UnixFileStream::read(output, offset, length);
+            return;
+        }
+        note_read(offset, length);
+        batch.defer(&run_batch, {this, output, offset, length, result});
+    }
+
+    void write(const void* input, offset_type offset, length_type length) override
+    {
+        auto* ring = IoUring::of_this_thread();
+        if (!ring || length > kMaxLength)
+            return UnixFileStream::write(input, offset, length);
+        // Unlike pwrite, a write through io_uring may come back short, so the rest is resubmitted.
+        while (length > 0)
+        {
+            auto request = make_request(Request::Op::kWrite, input, offset, length);
+            ring->run({&request, 1});
+            if (request.result < 0)
+                THROW_POSIX_EXCEPTION(static_cast<int>(-request.result), "io_uring write");
+            if (request.result == 0)
+                throwVFSException(EIO);
+            auto written = static_cast<length_type>(request.result);
+            input = static_cast<const char*>(input) + written;
+            offset += written;
+            length -= written;
+        }
+    }
+};
+#endif
+
+#ifdef O_DIRECT
+// Files opened with O_DIRECT only take transfers whose offset, length and buffer address are all
+// aligned. The others go through an aligned bounce buffer here, which a write fills with the
+// existing contents of the partial sectors at both ends first, except that the partial sector at
+// the end of the file is written through the page cache.
+template <class Base>
+class DirectFileStream final : public Base
+{
+private:
+    static constexpr length_type kAlignment = AlignedBuffer::kDirectIoAlignment;
+
+    static bool is_aligned(const void* buffer, offset_type offset, length_type length) noexcept
+    {
+        return reinterpret_cast<uintptr_t>(buffer) % kAlignment == 0 && offset % kAlignment == 0
+            && length % kAlignment == 0;
+    }
+
+    static offset_type align_down(offset_type x) noexcept { return x / kAlignment * kAlignment; }
+    static offset_type align_up(offset_type x) noexcept { return align_down(x + kAlignment - 1); }
+
+public:
+    explicit DirectFileStream(int fd) : Base(fd)
+    {
+        // Hints about the page cache would only fill it with pages that are never used.
+        this->m_tracker.reset();
+    }
+
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        if (is_aligned(output, offset, length))
+            return Base::read(output, offset, length);
+        auto start = align_down(offset);
+        AlignedBuffer buffer(align_up(offset + length) - start);
+        auto read_len = Base::read(buffer.data(), start, buffer.size());
+        if (read_len <= offset - start)
+            return 0;
+        auto copy_len = std::min(read_len - (offset - start), length);
+        memcpy(output, buffer.data() + (offset - start), copy_len);
+        return copy_len;
+    }
+
+    void read_batched(ReadBatch& batch,
+                      void* output,
+                      offset_type offset,
+                      length_type length,
+                      length_type* result) override
+    {
+        if (is_aligned(output, offset, length))
+            return Base::read_batched(batch, output, offset, length, result);
+        *result = read(output, offset, length);
+    }
+
+    void write(const void* input, offset_type offset, length_type length) override
+    {
+        if (length == 0)
+            return;
+        if (is_aligned(input, offset, length))
+            return Base::write(input, offset, length);
+        auto old_size = this->size();
+        auto start = align_down(offset), end = offset + length;
+        // A whole sector written across the end of the file would extend it, if only until the
+        // file is truncated back, so the partial sector there goes through the page cache.
+        auto direct_end = align_up(end) <= old_size ? align_up(end) : align_down(end);
+        if (direct_end > offset)
+        {
+            AlignedBuffer buffer(direct_end - start);
+            bool has_head = start < offset && start < old_size;
+            if (has_head)
+                (void)Base::read(buffer.data(), start, kAlignment);
+            auto last = direct_end - kAlignment;
+            if (direct_end > end && !(has_head && last == start))
+                (void)Base::read(buffer.data() + (last - start), last, kAlignment);
+            memcpy(buffer.data() + (offset - start), input, std::min(end, direct_end) - offset);
+            Base::write(buffer.data(), start, buffer.size());
+        }
+        auto buffered_start = std::max(offset, direct_end);
+        if (buffered_start < end)
+            write_buffered(static_cast<const byte*>(input) + (buffered_start - offset),
+                           buffered_start,
+                           end - buffered_start);
+    }
+
+private:
+    void write_buffered(const void* input, offset_type offset, length_type length)
+    {
+        int flags = ::fcntl(this->m_fd, F_GETFL);
+        if (flags < 0)
+            THROW_POSIX_EXCEPTION(errno, "fcntl");
+        if (::fcntl(this->m_fd, F_SETFL, flags & ~O_DIRECT) < 0)
+            THROW_POSIX_EXCEPTION(errno, "fcntl");
+        // The kernel writes back the cached pages before the next direct transfer that overlaps
+        // them, so the two kinds of I/O stay coherent.
+        DEFER((void)::fcntl(this->m_fd, F_SETFL, flags));
+        Base::write(input, offset, length);
+    }
+};
+#endif
+
+namespace
+{
+    std::shared_ptr<FileStream> make_file_stream(int fd)
+    {
+#ifdef __linux__
+        if (is_io_uring_enabled())
+            return std::make_shared<IoUringFileStream>(fd);
+#endif
+        return std::make_shared<UnixFileStream>(fd);
+    }
+}    // namespace
+
 class UnixDirectoryTraverser : public DirectoryTraverser
 {
 private:
@@ -287,7 +720,43 @@ OSService::open_file_stream(const std::string& path, int flags, unsigned mode) c
     if (fd < 0)
         THROW_POSIX_EXCEPTION(errno,
                               absl::StrFormat("Opening %s with flags %#o", norm_path(path), flags));
-    return std::make_shared<UnixFileStream>(fd);
+    return make_file_stream(fd);
+}
+
+std::shared_ptr<FileStream>
+OSService::open_data_file_stream(const std::string& path, int flags, unsigned mode) const
+{
+    if (!is_direct_io_enabled())
+        return open_file_stream(path, flags, mode);
+    int fd = ::openat(m_dir_fd, path.c_str(), flags, mode);
+    if (fd < 0)
+        THROW_POSIX_EXCEPTION(errno,
+                              absl::StrFormat("Opening %s with flags %#o", norm_path(path), flags));
+#if defined(O_DIRECT)
+    // Set after opening rather than passed to openat, because a filesystem that refuses O_DIRECT
+    // (such as tmpfs before Linux 6.6) would otherwise fail a creation after creating the file.
+    int fl = ::fcntl(fd, F_GETFL);
+    if (fl < 0 || ::fcntl(fd, F_SETFL, fl | O_DIRECT) < 0)
+    {
+        static std::atomic_bool warned{false};
+        if (!warned.exchange(true))
+            WARN_LOG("The underlying filesystem does not support O_DIRECT (%s), so its page cache "
+                     "stays in use",
+                     OSService::stringify_system_error(errno));
+        return make_file_stream(fd);
+    }
+#ifdef __linux__
+    if (is_io_uring_enabled())
+        return std::make_shared<DirectFileStream<IoUringFileStream>>(fd);
+#endif
+    return std::make_shared<DirectFileStream<UnixFileStream>>(fd);
+#elif defined(__APPLE__)
+    // Unlike O_DIRECT, this has no alignment requirements.
+    (void)::fcntl(fd, F_NOCACHE, 1);
+    return make_file_stream(fd);
+#else
+    return make_file_stream(fd);
+#endif
 }
 
 void OSService::remove_file(const std::string& path) const
@@ -366,6 +835,17 @@ void OSService::statfs(fuse_statvfs* fs_info) const
         THROW_POSIX_EXCEPTION(errno, "statvfs");
 }
 
+void OSService::syncfs() const
+{
+#ifdef __linux__
+    int rc = ::syncfs(m_dir_fd);
+    if (rc < 0)
+        THROW_POSIX_EXCEPTION(errno, "syncfs");
+#else
+    ::sync();
+#endif
+}
+
 void OSService::rename(const std::string& a, const std::string& b) const
 {
     int rc = ::renameat(m_dir_fd, a.c_str(), m_dir_fd, b.c_str());
@@ -810,6 +810,13 @@ OSService::open_file_stream(const std::string& path, int flags, unsigned mode) c
     return std::make_shared<WindowsFileStream>(norm_path(path), flags, mode);
 }
 
+std::shared_ptr<FileStream>
+OSService::open_data_file_stream(const std::string& path, int flags, unsigned mode) const
+{
+    // Unbuffered I/O on Windows needs sector aligned transfers, which is not worth it yet.
+    return open_file_stream(path, flags, mode);
+}
+
 void OSService::remove_file(const std::string& path) const
 {
     CHECK_CALL(DeleteFileW(norm_path(path).c_str()));
@@ -886,6 +893,12 @@ void OSService::statfs(fuse_statvfs* fs_info) const
     fs_info->f_namemax = namemax;
 }
 
+void OSService::syncfs() const
+{
+    // Flushing a whole volume requires administrator privileges on Windows, so we leave it to the
+    // system.
+}
+
 void OSService::utimens(const std::string& path, const fuse_timespec ts[2]) const
 {
     FILETIME atime, mtime;
@@ -0,0 +1,86 @@
+#include "access_hints.h"
+
+#include <doctest/doctest.h>
+
+namespace securefs
+{
+namespace
+{
+    using Advice = AccessPatternTracker::Hints::Advice;
+
+    constexpr length_type kWindow = 1 << 20;
+
+    TEST_CASE("AccessPatternTracker prefetches ahead of sequential reads and drops behind them")
+    {
+        AccessPatternTracker tracker;
+        offset_type prefetched_end = 0, dropped_end = 0;
+        bool advised = false;
+        // Rereads the tail of the previous read, as unaligned plaintext reads do with blocks.
+        for (offset_type offset = 0; offset < 64 * kWindow; offset += 60000)
+        {
+            auto hints = tracker.on_read(offset, 65536, kWindow);
+            if (hints.advice == Advice::kSequential)
+            {
+                CHECK(!advised);
+                advised = true;
+            }
+            else
+            {
+                CHECK(hints.advice == Advice::kUnchanged);
+            }
+            if (hints.prefetch_length > 0)
+            {
+                CHECK(hints.prefetch_offset >= prefetched_end);
+                CHECK(hints.prefetch_offset + hints.prefetch_length > offset + 65536);
+                prefetched_end = hints.prefetch_offset + hints.prefetch_length;
+            }
+            if (hints.drop_length > 0)
+            {
+                CHECK(hints.drop_offset == dropped_end);
+                CHECK(hints.drop_offset + hints.drop_length + kWindow <= offset);
+                dropped_end = hints.drop_offset + hints.drop_length;
+            }
+            if (advised)
+            {
+                CHECK(prefetched_end >= offset + 65536 + kWindow / 2);
+            }
+        }
+        CHECK(advised);
+        CHECK(dropped_end + 3 * kWindow > 64 * kWindow);
+
+        // A random read reverts the advice, and drops nothing of the new position.
+        auto hints = tracker.on_read(5 * kWindow, 4096, kWindow);
+        CHECK(hints.advice == Advice::kNormal);
+        CHECK(hints.prefetch_length == 0);
+        CHECK(hints.drop_length == 0);
+    }
+
+    TEST_CASE("AccessPatternTracker gives no hints for random reads")
+    {
+        AccessPatternTracker tracker;
+        offset_type offsets[] = {7 * kWindow, 3 * kWindow, 100, 9 * kWindow, 2 * kWindow, 0};
+        for (auto offset : offsets)
+        {
+            auto hints = tracker.on_read(offset, 4096, kWindow);
+            CHECK(hints.advice == Advice::kUnchanged);
+            CHECK(hints.prefetch_length == 0);
+            CHECK(hints.drop_length == 0);
+        }
+    }
+
+    TEST_CASE("AccessPatternTracker counts small reads in a row as sequential")
+    {
+        AccessPatternTracker tracker;
+        for (unsigned i = 0; i + 1 < AccessPatternTracker::kSequentialReads; ++i)
+        {
+            CHECK(tracker.on_read(i * 32, 32, kWindow).advice == Advice::kUnchanged);
+        }
+        auto hints
+            = tracker.on_read((AccessPatternTracker::kSequentialReads - 1) * 32, 32, kWindow);
+        CHECK(hints.advice == Advice::kSequential);
+        CHECK(hints.prefetch_offset == AccessPatternTracker::kSequentialReads * 32);
+        CHECK(hints.prefetch_offset + hints.prefetch_length
+              == AccessPatternTracker::kSequentialReads * 32 + kWindow);
+    }
+}    // namespace
+}    // namespace securefs
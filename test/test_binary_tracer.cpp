@@ -0,0 +1,142 @@
+#include "binary_tracer.h"
+#include "platform.h"
+
+#include <absl/strings/str_cat.h>
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace securefs::trace
+{
+namespace
+{
+    TEST_CASE("BinaryTracer keeps the most recent records of each thread")
+    {
+        BinaryTracer tracer;
+        constexpr uint64_t kCount = BinaryTracer::kRingCapacity + 100;
+        std::atomic<int> finished{0};
+        std::atomic<bool> done{false};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 2; ++t)
+        {
+            threads.emplace_back(
+                [&, t]()
+                {
+                    for (uint64_t i = 0; i < kCount; ++i)
+                    {
+                        BinaryTraceRecord r;
+                        r.start_ns = i * 2 + t;
+                        r.offset = i;
+                        r.op = static_cast<uint16_t>(t);
+                        tracer.record(r);
+                    }
+                    // Stay alive, so that the rings are not retired before the snapshot.
+                    ++finished;
+                    while (!done)
+                    {
+                        std::this_thread::yield();
+                    }
+                });
+        }
+        while (finished < 2)
+        {
+            std::this_thread::yield();
+        }
+        auto records = tracer.snapshot();
+        done = true;
+        for (auto&& t : threads)
+        {
+            t.join();
+        }
+        // The oldest slot of each ring is always discarded, since a writer may be overwriting it.
+        REQUIRE(records.size() == 2 * (BinaryTracer::kRingCapacity - 1));
+        for (size_t i = 1; i < records.size(); ++i)
+        {
+            CHECK(records[i - 1].start_ns < records[i].start_ns);
+        }
+        CHECK(records.front().offset == kCount - BinaryTracer::kRingCapacity + 1);
+        CHECK(records.back().offset == kCount - 1);
+        CHECK(records[0].thread != records[1].thread);
+    }
+
+    TEST_CASE("BinaryTracer keeps the records of exited threads")
+    {
+        BinaryTracer tracer;
+        for (uint64_t t = 0; t < 3; ++t)
+        {
+            std::thread(
+                [&tracer, t]()
+                {
+                    for (uint64_t i = 0; i < 10; ++i)
+                    {
+                        BinaryTraceRecord r;
+                        r.start_ns = t * 10 + i;
+                        tracer.record(r);
+                    }
+                })
+                .join();
+        }
+        auto records = tracer.snapshot();
+        REQUIRE(records.size() == 30);
+        CHECK(records.front().start_ns == 0);
+        CHECK(records.back().start_ns == 29);
+        CHECK(records.front().thread != records.back().thread);
+    }
+
+    TEST_CASE("BinaryTrace encode and decode")
+    {
+        BinaryTrace trace;
+        trace.op_names = {"read", "write"};
+        trace.wall_clock_offset_ns = -123456789;
+        BinaryTraceRecord r;
+        r.start_ns = 1000;
+        r.duration_ns = 250;
+        r.handle = 0xdeadbeef;
+        r.offset = 4096;
+        r.size = 512;
+        r.rc = -5;
+        r.op = 1;
+        r.thread = 70000;
+        trace.records.push_back(r);
+
+        auto encoded = trace.encode();
+        auto decoded = BinaryTrace::decode(encoded);
+        CHECK(decoded.op_names == trace.op_names);
+        CHECK(decoded.wall_clock_offset_ns == trace.wall_clock_offset_ns);
+        REQUIRE(decoded.records.size() == 1);
+        const auto& d = decoded.records[0];
+        CHECK(d.start_ns == r.start_ns);
+        CHECK(d.duration_ns == r.duration_ns);
+        CHECK(d.handle == r.handle);
+        CHECK(d.offset == r.offset);
+        CHECK(d.size == r.size);
+        CHECK(d.rc == r.rc);
+        CHECK(d.op == r.op);
+        CHECK(d.thread == r.thread);
+        CHECK(decoded.format().find("op=write") != std::string::npos);
+
+        CHECK_THROWS(BinaryTrace::decode(encoded.substr(0, encoded.size() - 1)));
+        CHECK_THROWS(BinaryTrace::decode("garbage"));
+    }
+
+    TEST_CASE("BinaryTraceDumper reuses a fixed set of files")
+    {
+        auto prefix = absl::StrCat("tmp/", OSService::temp_name("trace", ""));
+        {
+            BinaryTraceDumper dumper(prefix);
+            for (int i = 0; i < 20; ++i)
+            {
+                dumper.dump();
+            }
+        }
+        fuse_stat st;
+        for (int i = 1; i <= 8; ++i)
+        {
+            CHECK(OSService::get_default().stat(absl::StrCat(prefix, ".", i), &st));
+        }
+        CHECK(!OSService::get_default().stat(absl::StrCat(prefix, ".9"), &st));
+    }
+}    // namespace
+}    // namespace securefs::trace
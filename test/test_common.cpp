@@ -5,8 +5,10 @@
 #include "lite_long_name_lookup_table.h"
 #include "logger.h"
 #include "myutils.h"
+#include "tags.h"
 
 #include <cryptopp/osrng.h>
+#include <fruit/fruit.h>
 #include <fuse.h>
 
 #include <cstddef>
@@ -300,4 +302,30 @@ void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_in
         CHECK(getxattr(ops, "/cbd", "org.securefs.test") == "blah");
     }
 }
+
+fruit::Component<lite_format::FuseHighLevelOps> get_lite_ops_component(OSService* root)
+{
+    return fruit::createComponent()
+        .registerProvider(
+            []()
+            {
+                lite_format::NameNormalizationFlags flags{};
+                flags.long_name_threshold = 128;
+                return flags;
+            })
+        .install(lite_format::get_name_translator_component)
+        .registerProvider<fruit::Annotated<tContentMasterKey, key_type>()>(
+            []() { return key_type(100); })
+        .registerProvider<fruit::Annotated<tPaddingMasterKey, key_type>()>(
+            []() { return key_type(111); })
+        .registerProvider<fruit::Annotated<tNameMasterKey, key_type>()>(
+            []() { return key_type(122); })
+        .registerProvider<fruit::Annotated<tXattrMasterKey, key_type>()>(
+            []() { return key_type(108); })
+        .registerProvider<fruit::Annotated<tVerify, bool>()>([]() { return true; })
+        .registerProvider<fruit::Annotated<tBlockSize, unsigned>()>([]() { return 4096u; })
+        .registerProvider<fruit::Annotated<tIvSize, unsigned>()>([]() { return 12u; })
+        .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>()>([]() { return 0u; })
+        .bindInstance(*root);
+}
 }    // namespace securefs::testing
@@ -7,6 +7,7 @@
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_join.h>
 #include <doctest/doctest.h>
+#include <fruit/fruit_forward_decls.h>
 #include <string_view>
 
 #include <random>
@@ -38,7 +39,16 @@ struct doctest::StringMaker<std::vector<std::string>>
     }
 };
 
+namespace securefs::lite_format
+{
+class FuseHighLevelOps;
+}
+
 namespace securefs::testing
 {
 void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_insensitive = false);
+
+/// A lite format filesystem stored under `root`, with fixed keys and no padding, for the tests
+/// that only need working operations to run against.
+fruit::Component<lite_format::FuseHighLevelOps> get_lite_ops_component(OSService* root);
 }
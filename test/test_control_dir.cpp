@@ -0,0 +1,66 @@
+#include "control_dir.h"
+#include "exceptions.h"
+#include "tunables.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Tunables")
+    {
+        Tunables tunables;
+        const auto& knob = tunables.define("knob", 10, 1, 100);
+        CHECK(&tunables.define("knob", 20, 0, 1) == &knob);
+        CHECK(knob.load() == 10);
+        tunables.set("knob", 42);
+        CHECK(knob.load() == 42);
+        CHECK_THROWS_AS(tunables.set("knob", 0), VFSException);
+        CHECK_THROWS_AS(tunables.set("knob", 101), VFSException);
+        CHECK_THROWS_AS(tunables.set("nonexistent", 1), VFSException);
+        auto list = tunables.list();
+        REQUIRE(list.size() == 1);
+        CHECK(list[0].first == "knob");
+        CHECK(list[0].second == 42);
+    }
+
+    TEST_CASE("Control file commands")
+    {
+        const auto& knob = Tunables::global().define("test_control_dir_knob", 5, 0, 1000);
+        ControlDirOps::execute_commands("# comment\n\n  test_control_dir_knob   7  \n");
+        CHECK(knob.load() == 7);
+        ControlDirOps::execute_commands("test_control_dir_knob 8");
+        CHECK(knob.load() == 8);
+        CHECK_THROWS_AS(ControlDirOps::execute_commands("test_control_dir_knob"), VFSException);
+        CHECK_THROWS_AS(ControlDirOps::execute_commands("test_control_dir_knob x"), VFSException);
+        CHECK_THROWS_AS(ControlDirOps::execute_commands("test_control_dir_knob 1 2"),
+                        VFSException);
+        CHECK(knob.load() == 8);
+
+        auto stats = ControlDirOps::render_stats();
+        CHECK(stats.find("test_control_dir_knob") != std::string::npos);
+    }
+
+    TEST_CASE("Tunables are defined before their first use")
+    {
+        std::vector<std::string> names;
+        for (auto&& [name, value] : Tunables::global().list())
+        {
+            names.push_back(name);
+        }
+        auto has = [&](std::string_view name)
+        { return std::find(names.begin(), names.end(), name) != names.end(); };
+        CHECK(has("file_table_max_cached_per_shard"));
+        CHECK(has("padding_cache_max_entries"));
+#ifndef _WIN32
+        CHECK(has("access_hints_window_kib"));
+#endif
+    }
+}    // namespace
+}    // namespace securefs
@@ -0,0 +1,151 @@
+#include "exceptions.h"
+#include "fuse_low_level_frontend.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("InodeTable lookup and forget")
+    {
+        InodeTable table;
+        CHECK(table.get_path(InodeTable::kRootInode) == "/");
+
+        auto dir = table.lookup(InodeTable::kRootInode, "dir");
+        CHECK(dir != InodeTable::kRootInode);
+        CHECK(table.lookup(InodeTable::kRootInode, "dir") == dir);
+        auto file = table.lookup(dir, "file");
+        CHECK(table.get_path(dir) == "/dir");
+        CHECK(table.get_path(file) == "/dir/file");
+        CHECK(table.get_child_path(file, "x") == "/dir/file/x");
+        CHECK(table.get_child_path(InodeTable::kRootInode, "y") == "/y");
+        CHECK(table.find(dir, "file") == file);
+        CHECK(!table.find(dir, "nonexistent").has_value());
+        CHECK(table.size() == 3);
+
+        // The directory is kept alive by its child even after the kernel forgets it.
+        table.forget(dir, 2);
+        CHECK(table.get_path(file) == "/dir/file");
+        table.forget(file, 1);
+        CHECK(table.size() == 1);
+        CHECK_THROWS_AS(table.get_path(file), VFSException);
+        CHECK_THROWS_AS(table.get_path(dir), VFSException);
+    }
+
+    TEST_CASE("InodeTable rename and remove")
+    {
+        InodeTable table;
+        auto a = table.lookup(InodeTable::kRootInode, "a");
+        auto b = table.lookup(InodeTable::kRootInode, "b");
+        auto child = table.lookup(a, "child");
+        auto target = table.lookup(b, "target");
+
+        table.rename(a, "child", b, "target");
+        CHECK(table.get_path(child) == "/b/target");
+        CHECK(table.find(b, "target") == child);
+        CHECK(!table.find(a, "child").has_value());
+        // The overwritten node still reports its last path until forgotten.
+        CHECK(table.get_path(target) == "/b/target");
+        table.forget(target, 1);
+        CHECK_THROWS_AS(table.get_path(target), VFSException);
+
+        table.rename(InodeTable::kRootInode, "b", InodeTable::kRootInode, "c");
+        CHECK(table.get_path(child) == "/c/target");
+
+        table.remove(b, "target");
+        CHECK(!table.find(b, "target").has_value());
+        CHECK(table.get_path(child) == "/c/target");
+        table.forget(child, 1);
+        table.forget(a, 1);
+        table.forget(b, 1);
+        CHECK(table.size() == 1);
+    }
+
+    TEST_CASE("InodeTable aliases")
+    {
+        InodeTable table;
+        auto a = table.lookup(InodeTable::kRootInode, "a");
+        auto b = table.lookup(InodeTable::kRootInode, "B");
+        auto c = table.lookup(InodeTable::kRootInode, "c");
+        table.set_backing_ino(a, 100);
+        table.set_backing_ino(b, 100);
+        table.set_backing_ino(c, 200);
+
+        auto aliases = table.get_aliases(a);
+        REQUIRE(aliases.size() == 1);
+        CHECK(aliases[0].ino == b);
+        CHECK(aliases[0].parent == InodeTable::kRootInode);
+        CHECK(aliases[0].name == "B");
+        CHECK(table.get_aliases(c).empty());
+
+        table.set_backing_ino(c, 100);
+        CHECK(table.get_aliases(a).size() == 2);
+        table.forget(b, 1);
+        aliases = table.get_aliases(a);
+        REQUIRE(aliases.size() == 1);
+        CHECK(aliases[0].ino == c);
+        table.set_backing_ino(c, 300);
+        CHECK(table.get_aliases(a).empty());
+    }
+
+    TEST_CASE("InodeTable resolved paths")
+    {
+        InodeTable table;
+        auto dir = table.lookup(InodeTable::kRootInode, "dir");
+        auto file = table.lookup(dir, "file");
+        CHECK(!table.get_resolved(file).has_value());
+
+        auto epoch = table.rename_epoch();
+        table.set_resolved(file, epoch, "enc/file");
+        table.set_resolved(dir, epoch, "enc");
+        CHECK(table.get_resolved(file) == "enc/file");
+
+        // A rename anywhere may move the node, so every resolved path is dropped.
+        table.rename(InodeTable::kRootInode, "dir", InodeTable::kRootInode, "moved");
+        CHECK(!table.get_resolved(file).has_value());
+        CHECK(!table.get_resolved(dir).has_value());
+
+        // A path resolved before the rename is not stored after it.
+        table.set_resolved(file, epoch, "enc/file");
+        CHECK(!table.get_resolved(file).has_value());
+        table.set_resolved(file, table.rename_epoch(), "enc2/file");
+        CHECK(table.get_resolved(file) == "enc2/file");
+    }
+
+    TEST_CASE("InodeTable aliases of a truncated file")
+    {
+        // Truncating through one node id must reach the other names of the file, a hard link in
+        // another directory and another spelling of the same name, whose cached sizes and pages
+        // are otherwise stale until their attributes time out.
+        InodeTable table;
+        auto dir = table.lookup(InodeTable::kRootInode, "dir");
+        auto file = table.lookup(InodeTable::kRootInode, "file");
+        auto link = table.lookup(dir, "link");
+        auto spelling = table.lookup(InodeTable::kRootInode, "FILE");
+        for (auto ino : {file, link, spelling})
+        {
+            table.set_backing_ino(ino, 42);
+        }
+        table.set_backing_ino(dir, 43);
+
+        auto aliases = table.get_aliases(file);
+        REQUIRE(aliases.size() == 2);
+        std::vector<uint64_t> inos{aliases[0].ino, aliases[1].ino};
+        std::sort(inos.begin(), inos.end());
+        std::vector<uint64_t> expected{link, spelling};
+        std::sort(expected.begin(), expected.end());
+        CHECK(inos == expected);
+        CHECK(table.get_aliases(dir).empty());
+
+        // Once the kernel forgets a name, it has no cache left to invalidate.
+        table.forget(link, 1);
+        aliases = table.get_aliases(spelling);
+        REQUIRE(aliases.size() == 1);
+        CHECK(aliases[0].ino == file);
+    }
+}    // namespace
+}    // namespace securefs
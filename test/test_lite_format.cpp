@@ -1,6 +1,8 @@
 #include "lite_format.h"
+#include "crypto.h"
 #include "mystring.h"
 #include "myutils.h"
+#include "op_stats.h"
 #include "platform.h"
 #include "tags.h"
 #include "test_common.h"
@@ -17,8 +19,10 @@
 #include <fruit/injector.h>
 
 #include <array>
+#include <random>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace securefs::lite_format
 {
@@ -105,30 +109,206 @@ namespace
                                       nullptr));
     }
 
-    TEST_CASE("Lite FuseHighLevelOps")
+    TEST_CASE("Padding cache")
     {
-        auto whole_component = [](OSService* os) -> fruit::Component<FuseHighLevelOps>
+        fruit::Injector<StreamOpener, PaddingCache> injector(
+            +[]() -> fruit::Component<StreamOpener, PaddingCache>
+            { return fruit::createComponent().install(get_test_component); });
+        auto& opener = injector.get<StreamOpener&>();
+        auto& cache = injector.get<PaddingCache&>();
+        REQUIRE(!opener.can_compute_virtual_size());
+
+        std::uniform_int_distribution<size_t> size_dist(1, 1000);
+        for (int i = 0; i < 20; ++i)
         {
-            return fruit::createComponent()
-                .registerProvider(
-                    []()
-                    {
-                        NameNormalizationFlags flags{};
-                        flags.long_name_threshold = 133;
-                        return flags;
-                    })
-                .install(get_name_translator_component)
-                .install(get_test_component)
-                .bindInstance(*os);
-        };
+            auto filename = OSService::temp_name("tmp/padding", ".dat");
+            std::vector<byte> data(size_dist(get_random_number_engine()));
+            generate_random(data.data(), data.size());
+            {
+                auto fs = OSService::get_default().open_file_stream(
+                    filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+                opener.open(fs)->write(data.data(), 0, data.size());
+            }
+            fuse_stat st{};
+            REQUIRE(OSService::get_default().stat(filename, &st));
+            CHECK(cache.compute_virtual_size(filename, st) == data.size());
+            // The second lookup is served from the cache.
+            CHECK(cache.compute_virtual_size(filename, st) == data.size());
 
+            {
+                auto fs = OSService::get_default().open_file_stream(filename, O_RDWR, 0);
+                opener.open(fs)->resize(data.size() / 2);
+            }
+            REQUIRE(OSService::get_default().stat(filename, &st));
+            CHECK(cache.compute_virtual_size(filename, st) == data.size() / 2);
+        }
+    }
+
+    fruit::Component<FuseHighLevelOps> get_whole_component(OSService* os)
+    {
+        return fruit::createComponent()
+            .registerProvider(
+                []()
+                {
+                    NameNormalizationFlags flags{};
+                    flags.long_name_threshold = 133;
+                    return flags;
+                })
+            .install(get_name_translator_component)
+            .install(get_test_component)
+            .bindInstance(*os);
+    }
+
+    TEST_CASE("Lite FuseHighLevelOps")
+    {
         auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
         OSService::get_default().ensure_directory(temp_dir_name, 0755);
         OSService root(temp_dir_name);
 
-        fruit::Injector<FuseHighLevelOps> injector(+whole_component, &root);
+        fruit::Injector<FuseHighLevelOps> injector(get_whole_component, &root);
         auto& ops = injector.get<FuseHighLevelOps&>();
         testing::test_fuse_ops(ops, root);
     }
+
+    TEST_CASE("Lite resolved paths")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+
+        fruit::Injector<FuseHighLevelOps> injector(get_whole_component, &root);
+        auto& ops = injector.get<FuseHighLevelOps&>();
+        fuse_context ctx{};
+
+        REQUIRE(ops.has_resolve());
+        REQUIRE(ops.vmkdir("/dir", 0755, &ctx) == 0);
+        fuse_file_info info{};
+        REQUIRE(ops.vcreate("/dir/file", 0644, &info, &ctx) == 0);
+        REQUIRE(ops.vwrite(nullptr, "hello", 5, 0, &info, &ctx) == 5);
+        REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+        auto resolved = ops.vresolve("/dir/file");
+        REQUIRE(resolved.has_value());
+        fuse_stat by_path{}, by_resolved{};
+        REQUIRE(ops.vgetattr("/dir/file", &by_path, &ctx) == 0);
+        REQUIRE(ops.vgetattr_resolved(*resolved, &by_resolved, &ctx) == 0);
+        CHECK(by_resolved.st_size == 5);
+        CHECK(by_resolved.st_ino == by_path.st_ino);
+        CHECK(by_resolved.st_mode == by_path.st_mode);
+
+        info = {};
+        info.flags = O_RDWR | O_TRUNC;
+        REQUIRE(ops.vopen_resolved(*resolved, &info, &ctx) == 0);
+        char buffer[8];
+        CHECK(ops.vread(nullptr, buffer, sizeof(buffer), 0, &info, &ctx) == 0);
+        CHECK(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+        CHECK(ops.vgetattr_resolved(*ops.vresolve("/dir/missing"), &by_resolved, &ctx) == -ENOENT);
+    }
+
+    TEST_CASE("Lite copy_file_range")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+
+        fruit::Injector<FuseHighLevelOps> injector(get_whole_component, &root);
+        auto& ops = injector.get<FuseHighLevelOps&>();
+        fuse_context ctx{};
+
+        auto cloned_blocks = []() -> int64_t
+        {
+            for (const auto& [name, value] : OpStats::global().counters())
+            {
+                if (name == "lite_blocks_copied_without_reencryption")
+                {
+                    return value;
+                }
+            }
+            return 0;
+        };
+        auto read_all = [&](fuse_file_info* info)
+        {
+            fuse_stat st{};
+            REQUIRE(ops.vfgetattr(nullptr, &st, info, &ctx) == 0);
+            std::string content(st.st_size, '\0');
+            REQUIRE(ops.vread(nullptr, content.data(), content.size(), 0, info, &ctx)
+                    == content.size());
+            return content;
+        };
+
+        // The block size of the test component is 64.
+        std::string source(1000, '\0');
+        generate_random(source.data(), source.size());
+        fuse_file_info src{};
+        REQUIRE(ops.vcreate("/src", 0644, &src, &ctx) == 0);
+        REQUIRE(ops.vwrite(nullptr, source.data(), source.size(), 0, &src, &ctx)
+                == source.size());
+
+        {
+            // The empty destination takes the header of the source.
+            fuse_file_info dst{};
+            REQUIRE(ops.vcreate("/dst1", 0644, &dst, &ctx) == 0);
+            auto before = cloned_blocks();
+            CHECK(ops.vcopy_file_range(nullptr, &src, 0, nullptr, &dst, 0, 5000, 0, &ctx)
+                  == source.size());
+            CHECK(cloned_blocks() - before == 16);
+            CHECK(read_all(&dst) == source);
+
+            // Only the blocks from 2 to 8 are whole in the range.
+            std::string zeros(source.size(), '\0'), expected = zeros;
+            REQUIRE(ops.vwrite(nullptr, zeros.data(), zeros.size(), 0, &dst, &ctx)
+                    == zeros.size());
+            before = cloned_blocks();
+            CHECK(ops.vcopy_file_range(nullptr, &src, 100, nullptr, &dst, 100, 500, 0, &ctx)
+                  == 500);
+            CHECK(cloned_blocks() - before == 7);
+            expected.replace(100, 500, source, 100, 500);
+            CHECK(read_all(&dst) == expected);
+            CHECK(ops.vrelease(nullptr, &dst, &ctx) == 0);
+        }
+        {
+            // Ranges at different offsets are reencrypted.
+            fuse_file_info dst{};
+            REQUIRE(ops.vcreate("/dst2", 0644, &dst, &ctx) == 0);
+            auto before = cloned_blocks();
+            CHECK(ops.vcopy_file_range(nullptr, &src, 10, nullptr, &dst, 2000, 300, 0, &ctx)
+                  == 300);
+            CHECK(cloned_blocks() == before);
+            std::string expected(2300, '\0');
+            expected.replace(2000, 300, source, 10, 300);
+            CHECK(read_all(&dst) == expected);
+            CHECK(ops.vrelease(nullptr, &dst, &ctx) == 0);
+        }
+        {
+            // A destination open elsewhere keeps its header.
+            fuse_file_info dst{}, other{};
+            REQUIRE(ops.vcreate("/dst3", 0644, &dst, &ctx) == 0);
+            other.flags = O_RDONLY;
+            REQUIRE(ops.vopen("/dst3", &other, &ctx) == 0);
+            auto before = cloned_blocks();
+            CHECK(ops.vcopy_file_range(nullptr, &src, 0, nullptr, &dst, 0, 1000, 0, &ctx)
+                  == 1000);
+            CHECK(cloned_blocks() == before);
+            CHECK(read_all(&other) == source);
+            CHECK(ops.vrelease(nullptr, &other, &ctx) == 0);
+            CHECK(ops.vrelease(nullptr, &dst, &ctx) == 0);
+        }
+        {
+            // Copies within one file, through another handle.
+            fuse_file_info other{};
+            other.flags = O_RDWR;
+            REQUIRE(ops.vopen("/src", &other, &ctx) == 0);
+            CHECK(ops.vcopy_file_range(nullptr, &src, 0, nullptr, &other, 500, 600, 0, &ctx)
+                  == -EINVAL);
+            CHECK(ops.vcopy_file_range(nullptr, &src, 0, nullptr, &other, 1000, 600, 0, &ctx)
+                  == 600);
+            CHECK(read_all(&src) == source + source.substr(0, 600));
+            CHECK(ops.vcopy_file_range(nullptr, &src, 0, nullptr, &other, 0, 10, 1, &ctx)
+                  == -EINVAL);
+            CHECK(ops.vrelease(nullptr, &other, &ctx) == 0);
+        }
+        CHECK(ops.vrelease(nullptr, &src, &ctx) == 0);
+    }
 }    // namespace
 }    // namespace securefs::lite_format
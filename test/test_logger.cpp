@@ -0,0 +1,109 @@
+#include "logger.h"
+#include "platform.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <doctest/doctest.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    std::vector<std::string> read_lines(const std::string& path)
+    {
+        auto content
+            = OSService::get_default().open_file_stream(path, O_RDONLY, 0)->as_string();
+        return absl::StrSplit(content, '\n', absl::SkipEmpty());
+    }
+
+    TEST_CASE("Async logger")
+    {
+        auto path = absl::StrCat("tmp/", OSService::temp_name("log", ".txt"));
+        std::unique_ptr<Logger> logger(Logger::create_file_logger(path));
+        logger->start_async(1000);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back(
+                [&logger, t]()
+                {
+                    for (int i = 0; i < 100; ++i)
+                    {
+                        logger->log_v2(
+                            LoggingLevel::kLogInfo, __func__, __LINE__, "message %d %d", t, i);
+                    }
+                });
+        }
+        for (auto&& t : threads)
+        {
+            t.join();
+        }
+        // Errors are written synchronously after everything queued before them.
+        logger->log_v2(LoggingLevel::kLogError, __func__, __LINE__, "%s", "fatal");
+        auto lines = read_lines(path);
+        REQUIRE(lines.size() == 401);
+        CHECK(absl::EndsWith(lines.back(), "fatal"));
+        CHECK(logger->dropped_messages() == 0);
+        logger->stop_async();
+    }
+
+    TEST_CASE("Async logger can be stopped while other threads are logging")
+    {
+        auto path = absl::StrCat("tmp/", OSService::temp_name("log", ".txt"));
+        std::unique_ptr<Logger> logger(Logger::create_file_logger(path));
+        logger->start_async(10000);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back(
+                [&logger, t]()
+                {
+                    for (int i = 0; i < 1000; ++i)
+                    {
+                        logger->log_v2(
+                            LoggingLevel::kLogInfo, __func__, __LINE__, "message %d %d", t, i);
+                    }
+                });
+        }
+        logger->stop_async();
+        for (auto&& t : threads)
+        {
+            t.join();
+        }
+        logger->log_v2(LoggingLevel::kLogInfo, __func__, __LINE__, "%s", "after stop");
+        CHECK(logger->dropped_messages() == 0);
+        auto lines = read_lines(path);
+        CHECK(lines.size() == 4001);
+        CHECK(absl::EndsWith(lines.back(), "after stop"));
+    }
+
+    TEST_CASE("Async logger drops messages when the queue is full")
+    {
+        auto path = absl::StrCat("tmp/", OSService::temp_name("log", ".txt"));
+        std::unique_ptr<Logger> logger(Logger::create_file_logger(path));
+        logger->start_async(1);
+        constexpr uint64_t kCount = 10000;
+        for (uint64_t i = 0; i < kCount; ++i)
+        {
+            logger->log_v2(LoggingLevel::kLogInfo, __func__, __LINE__, "message %d", i);
+        }
+        auto dropped = logger->dropped_messages();
+        logger.reset();
+
+        uint64_t written = 0;
+        for (const auto& line : read_lines(path))
+        {
+            if (absl::StrContains(line, "message "))
+            {
+                ++written;
+            }
+        }
+        CHECK(written + dropped == kCount);
+    }
+}    // namespace
+}    // namespace securefs
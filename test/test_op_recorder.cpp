@@ -0,0 +1,175 @@
+#include "op_recorder.h"
+#include "lite_format.h"
+#include "platform.h"
+#include "test_common.h"
+
+#include <absl/strings/str_cat.h>
+#include <doctest/doctest.h>
+#include <fruit/fruit.h>
+
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Operation recording encoding")
+    {
+        std::vector<RecordedOp> ops(3);
+        ops[0].kind = RecordedOpKind::kWrite;
+        ops[0].thread = 2;
+        ops[0].start_ns = 1000;
+        ops[0].duration_ns = 345;
+        ops[0].rc = 4096;
+        ops[0].path = "/a/b";
+        ops[0].handle = 7;
+        ops[0].offset = uint64_t(1) << 40;
+        ops[0].size = 4096;
+        // Finished after the next one started.
+        ops[1].kind = RecordedOpKind::kRename;
+        ops[1].start_ns = 500;
+        ops[1].rc = -ENOENT;
+        ops[1].path = "/a/b";
+        ops[1].path2 = "/c";
+        ops[2].kind = RecordedOpKind::kGetattr;
+        ops[2].start_ns = 2000;
+        ops[2].path = "/c";
+        ops[2].mode = S_IFDIR | 0755;
+
+        auto encoded = encode_op_recording(ops);
+        auto decoded = decode_op_recording(encoded);
+        REQUIRE(decoded.size() == ops.size());
+        for (size_t i = 0; i < ops.size(); ++i)
+        {
+            CHECK(decoded[i].kind == ops[i].kind);
+            CHECK(decoded[i].thread == ops[i].thread);
+            CHECK(decoded[i].start_ns == ops[i].start_ns);
+            CHECK(decoded[i].duration_ns == ops[i].duration_ns);
+            CHECK(decoded[i].rc == ops[i].rc);
+            CHECK(decoded[i].path == ops[i].path);
+            CHECK(decoded[i].path2 == ops[i].path2);
+            CHECK(decoded[i].handle == ops[i].handle);
+            CHECK(decoded[i].offset == ops[i].offset);
+            CHECK(decoded[i].size == ops[i].size);
+            CHECK(decoded[i].mode == ops[i].mode);
+        }
+        CHECK(recorded_op_name(decoded[1].kind) == "rename");
+        // Repeated paths are stored once.
+        CHECK(encoded.size() < OpRecordingEncoder::kMagic.size() + 60);
+        CHECK_THROWS(decode_op_recording(encoded.substr(0, encoded.size() - 1)));
+        CHECK_THROWS(decode_op_recording("not a recording"));
+
+        // Only copies have a second handle and offset.
+        RecordedOp copy;
+        copy.kind = RecordedOpKind::kCopyFileRange;
+        copy.path = "/a";
+        copy.path2 = "/b";
+        copy.handle = 3;
+        copy.handle2 = 4;
+        copy.offset = 100;
+        copy.offset2 = 200;
+        copy.size = 300;
+        decoded = decode_op_recording(encode_op_recording({ops[0], copy, ops[2]}));
+        REQUIRE(decoded.size() == 3);
+        CHECK(decoded[1].handle2 == 4);
+        CHECK(decoded[1].offset2 == 200);
+        CHECK(decoded[1].size == 300);
+        CHECK(decoded[2].path == "/c");
+        CHECK(recorded_op_name(decoded[1].kind) == "copy_file_range");
+    }
+
+    TEST_CASE("Record and replay lite format operations")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/record", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+        fruit::Injector<lite_format::FuseHighLevelOps> injector(testing::get_lite_ops_component,
+                                                                &root);
+        auto& ops = injector.get<lite_format::FuseHighLevelOps&>();
+
+        fuse_context ctx{};
+        ctx.uid = OSService::getuid();
+        ctx.gid = OSService::getgid();
+        // Existed before the recording.
+        REQUIRE(ops.vmkdir("/pre", 0755, &ctx) == 0);
+        {
+            fuse_file_info info{};
+            REQUIRE(ops.vcreate("/pre/file", 0644, &info, &ctx) == 0);
+            std::string content(10000, 'p');
+            REQUIRE(ops.vwrite(nullptr, content.data(), content.size(), 0, &info, &ctx) == 10000);
+            REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+        }
+
+        auto recording_path = temp_dir_name + "/.recording";
+        for (bool anonymize : {false, true})
+        {
+            {
+                OpRecorder recorder(OSService::get_default().open_file_stream(
+                                        recording_path, O_RDWR | O_CREAT | O_TRUNC, 0600),
+                                    anonymize);
+                RecordingOps recording(ops, recorder);
+                std::string dir = absl::StrCat("/new", anonymize);
+                std::string file = dir + "/file";
+                char buffer[8192] = {};
+                fuse_stat st;
+                fuse_file_info info{};
+                REQUIRE(recording.vmkdir(dir.c_str(), 0755, &ctx) == 0);
+                REQUIRE(recording.vcreate(file.c_str(), 0644, &info, &ctx) == 0);
+                for (int i = 0; i < 4; ++i)
+                {
+                    REQUIRE(recording.vwrite(nullptr, buffer, 4096, i * 4096, &info, &ctx) == 4096);
+                }
+                REQUIRE(recording.vrelease(nullptr, &info, &ctx) == 0);
+                REQUIRE(recording.vgetattr("/pre/file", &st, &ctx) == 0);
+                REQUIRE(recording.vopen("/pre/file", &info, &ctx) == 0);
+                REQUIRE(recording.vread(nullptr, buffer, sizeof(buffer), 4096, &info, &ctx)
+                        == 5904);
+                REQUIRE(recording.vrelease(nullptr, &info, &ctx) == 0);
+                REQUIRE(recording.vgetattr("/missing", &st, &ctx) == -ENOENT);
+                REQUIRE(recording.vrename(file.c_str(), (dir + "/renamed").c_str(), &ctx) == 0);
+            }
+
+            auto recorded = decode_op_recording(OSService::get_default()
+                                                    .open_file_stream(recording_path, O_RDONLY, 0)
+                                                    ->as_string());
+            REQUIRE(recorded.size() == 13);
+            CHECK(recorded[0].kind == RecordedOpKind::kMkdir);
+            CHECK(recorded[2].handle == recorded[1].handle);
+            CHECK((recorded[7].mode & S_IFMT) == S_IFREG);
+            CHECK(recorded[7].size == 10000);
+            CHECK(recorded[11].rc == -ENOENT);
+            if (anonymize)
+            {
+                CHECK(recorded[7].path.find("pre") == std::string::npos);
+                // The hashes keep the shape of the tree.
+                CHECK(recorded[1].path.substr(0, recorded[0].path.size() + 1)
+                      == recorded[0].path + "/");
+                continue;
+            }
+            CHECK(recorded[7].path == "/pre/file");
+
+            auto replay_dir_name = OSService::temp_name("tmp/replay", "dir");
+            OSService::get_default().ensure_directory(replay_dir_name, 0755);
+            OSService replay_root(replay_dir_name);
+            fruit::Injector<lite_format::FuseHighLevelOps> replay_injector(
+                testing::get_lite_ops_component, &replay_root);
+            auto& replay_ops = replay_injector.get<lite_format::FuseHighLevelOps&>();
+            OpReplayer replayer(replay_ops, {});
+            replayer.prepare(recorded);
+            fuse_stat st;
+            REQUIRE(replay_ops.vgetattr("/pre/file", &st, &ctx) == 0);
+            CHECK(st.st_size == 10000);
+            CHECK(replay_ops.vgetattr("/new0", &st, &ctx) == -ENOENT);
+
+            auto result = replayer.replay(recorded);
+            CHECK(result.ops == recorded.size());
+            CHECK(result.diverged == 0);
+            CHECK(result.skipped == 0);
+            CHECK(replay_ops.vgetattr("/new0/renamed", &st, &ctx) == 0);
+            CHECK(st.st_size == 16384);
+            CHECK(result.format_report().find("write") != std::string::npos);
+        }
+    }
+}    // namespace
+}    // namespace securefs
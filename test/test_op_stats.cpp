@@ -0,0 +1,123 @@
+#include "op_stats.h"
+#include "test_common.h"
+
+#include <doctest/doctest.h>
+
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("OpStats buckets")
+    {
+        for (uint64_t v = 0; v < 4096; ++v)
+        {
+            auto index = OpStats::bucket_index(v);
+            REQUIRE(index < OpStats::kNumBuckets);
+            CHECK(OpStats::bucket_upper_bound(index) >= v);
+            if (v > 0)
+            {
+                CHECK(OpStats::bucket_index(v - 1) <= index);
+            }
+        }
+        std::uniform_int_distribution<uint64_t> dist(0, uint64_t(1) << 40);
+        for (int i = 0; i < 10000; ++i)
+        {
+            uint64_t v = dist(get_random_number_engine());
+            auto upper = OpStats::bucket_upper_bound(OpStats::bucket_index(v));
+            CHECK(upper >= v);
+            CHECK(upper - v <= v / 4);
+        }
+        CHECK(OpStats::bucket_index(UINT64_MAX) == OpStats::kNumBuckets - 1);
+    }
+
+    TEST_CASE("OpStats records and merges across threads")
+    {
+        OpStats stats;
+        auto read_op = stats.register_op("read");
+        auto write_op = stats.register_op("write");
+        CHECK(stats.register_op("read") == read_op);
+        CHECK(write_op != read_op);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back(
+                [&]()
+                {
+                    for (uint64_t latency = 1; latency <= 1000; ++latency)
+                    {
+                        stats.record(read_op, latency * 1000, 4096);
+                    }
+                    stats.record(write_op, 500, -5);
+                });
+        }
+        for (auto&& t : threads)
+        {
+            t.join();
+        }
+
+        auto summaries = stats.snapshot();
+        REQUIRE(summaries.size() == 2);
+        const auto& read = summaries[0];
+        CHECK(read.name == "read");
+        CHECK(read.count == 4000);
+        CHECK(read.errors == 0);
+        CHECK(read.bytes == 4000 * 4096);
+        CHECK(read.max_ns == 1000 * 1000);
+        auto p50 = read.percentile(0.5);
+        CHECK(p50 >= 500 * 1000);
+        CHECK(p50 <= 625 * 1000);
+        CHECK(read.percentile(1) == read.max_ns);
+
+        const auto& write = summaries[1];
+        CHECK(write.name == "write");
+        CHECK(write.count == 4);
+        CHECK(write.errors == 4);
+        CHECK(write.bytes == 0);
+
+        CHECK(stats.format_report().find("read") != std::string::npos);
+    }
+
+    TEST_CASE("OpStats counters")
+    {
+        OpStats stats;
+        auto hits = stats.register_counter("cache_hits");
+        auto misses = stats.register_counter("cache_misses");
+        auto live = stats.register_counter("live");
+        CHECK(stats.register_counter("cache_hits") == hits);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back(
+                [&]()
+                {
+                    for (int i = 0; i < 100; ++i)
+                    {
+                        stats.add(hits, 3);
+                        stats.add(misses, 1);
+                        stats.add(live, 1);
+                    }
+                    // Gauges may be decremented on a different thread than the one that
+                    // incremented them.
+                    stats.add(live, -150);
+                });
+        }
+        for (auto&& t : threads)
+        {
+            t.join();
+        }
+
+        auto counters = stats.counters();
+        REQUIRE(counters.size() == 3);
+        CHECK(counters[0] == std::make_pair(std::string("cache_hits"), int64_t(1200)));
+        CHECK(counters[1] == std::make_pair(std::string("cache_misses"), int64_t(400)));
+        CHECK(counters[2] == std::make_pair(std::string("live"), int64_t(-200)));
+        CHECK(stats.format_report().find("cache_hit_rate") != std::string::npos);
+    }
+}    // namespace
+}    // namespace securefs
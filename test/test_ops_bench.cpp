@@ -0,0 +1,68 @@
+#include "ops_bench.h"
+#include "lite_format.h"
+#include "platform.h"
+#include "test_common.h"
+
+#include <doctest/doctest.h>
+#include <fruit/fruit.h>
+
+#include <string>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("OpsBenchmark workloads")
+    {
+        CHECK(OpsBenchmark::parse_workload("rand_read") == OpsBenchmark::Workload::kRandRead);
+        CHECK_THROWS(OpsBenchmark::parse_workload("nonexistent"));
+
+        auto temp_dir_name = OSService::temp_name("tmp/bench", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+        fruit::Injector<lite_format::FuseHighLevelOps> injector(testing::get_lite_ops_component,
+                                                                &root);
+
+        OpsBenchmark::Options options;
+        options.threads = 3;
+        options.file_size = 64 << 10;
+        options.io_size = 4096;
+        options.file_count = 20;
+        options.dir_entries = 50;
+        OpsBenchmark bench(injector.get<lite_format::FuseHighLevelOps&>(), options);
+        for (auto workload : OpsBenchmark::all_workloads())
+        {
+            CAPTURE(OpsBenchmark::workload_name(workload));
+            auto result = bench.run(workload);
+            CHECK(result.threads == 3);
+            CHECK(result.total_ops() > 0);
+            switch (workload)
+            {
+            case OpsBenchmark::Workload::kSeqWrite:
+            case OpsBenchmark::Workload::kSeqRead:
+            case OpsBenchmark::Workload::kRandWrite:
+            case OpsBenchmark::Workload::kRandRead:
+                CHECK(result.total_bytes() == 3 * options.file_size);
+                break;
+            case OpsBenchmark::Workload::kReaddir:
+                // Each thread also sees "." and "..".
+                CHECK(result.entries == 3 * (options.dir_entries + 2));
+                break;
+            default:
+                CHECK(result.total_bytes() == 0);
+                break;
+            }
+            auto json = result.to_json();
+            CHECK(json.find(std::string(OpsBenchmark::workload_name(workload)))
+                  != std::string::npos);
+            CHECK(json.find("p99") != std::string::npos);
+        }
+
+        // Every workload cleans up after itself.
+        unsigned leftover = 0;
+        root.recursive_traverse(
+            ".", [&](const std::string&, const std::string&, int) { ++leftover; });
+        CHECK(leftover == 0);
+    }
+}    // namespace
+}    // namespace securefs
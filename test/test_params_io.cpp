@@ -12,9 +12,11 @@
 #include <google/protobuf/util/json_util.h>
 #include <google/protobuf/util/message_differencer.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace securefs
@@ -111,5 +113,19 @@ namespace
 
         REQUIRE(total_cases == 15 * 4 * 2);
     }
+
+    TEST_CASE("Calibrate argon2id")
+    {
+        auto params = calibrate_argon2id(absl::Milliseconds(20), 1 << 10, 0);
+        CHECK(params.parallelism() == std::max(1u, std::thread::hardware_concurrency()));
+        CHECK(params.memory_cost() == std::max(1u << 10, 8 * params.parallelism()));
+        CHECK(params.time_cost() >= 1);
+
+        // Too slow in one pass for the target, so the memory is cut down to the minimum.
+        params = calibrate_argon2id(absl::Nanoseconds(1), kMinCalibratedMemoryCost * 2, 2);
+        CHECK(params.parallelism() == 2);
+        CHECK(params.memory_cost() == kMinCalibratedMemoryCost);
+        CHECK(params.time_cost() == 1);
+    }
 }    // namespace
 }    // namespace securefs
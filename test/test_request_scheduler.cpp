@@ -0,0 +1,112 @@
+#include "request_scheduler.h"
+
+#include <absl/synchronization/notification.h>
+#include <doctest/doctest.h>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("RequestScheduler queues requests on a busy key")
+    {
+        std::atomic<int> order{0};
+        int first = 0, queued = 0, other = 0;
+        std::thread::id queued_thread;
+        absl::Notification started, release;
+        {
+            auto scheduler = std::make_unique<RequestScheduler>(2);
+            std::thread holder(
+                [&]()
+                {
+                    scheduler->submit(
+                        1,
+                        [&]()
+                        {
+                            started.Notify();
+                            release.WaitForNotification();
+                            first = ++order;
+                        },
+                        []() -> RequestScheduler::Task { return nullptr; });
+                });
+            started.WaitForNotification();
+
+            // Returns at once, without waiting for the request that holds the key.
+            scheduler->submit(
+                1,
+                []() { FAIL("Must not run on the submitting thread"); },
+                [&]() -> RequestScheduler::Task
+                {
+                    return [&]()
+                    {
+                        queued = ++order;
+                        queued_thread = std::this_thread::get_id();
+                    };
+                });
+            CHECK(scheduler->queue_depth() == 1);
+            scheduler->submit(
+                2,
+                [&]() { other = ++order; },
+                []() -> RequestScheduler::Task { return nullptr; });
+            CHECK(other == 1);
+
+            release.Notify();
+            holder.join();
+            scheduler.reset();
+        }
+        CHECK(first == 2);
+        CHECK(queued == 3);
+        CHECK(queued_thread != std::this_thread::get_id());
+    }
+
+    TEST_CASE("RequestScheduler never runs two requests on the same key at once")
+    {
+        constexpr int kKeys = 4, kThreads = 8, kRequests = 2000;
+        std::array<std::atomic<int>, kKeys> running{}, done{};
+        std::atomic<int> overlaps{0};
+        {
+            RequestScheduler scheduler(3);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < kThreads; ++t)
+            {
+                threads.emplace_back(
+                    [&, t]()
+                    {
+                        for (int i = 0; i < kRequests; ++i)
+                        {
+                            int key = (t + i) % kKeys;
+                            auto body = [&running, &done, &overlaps, key]()
+                            {
+                                if (running[key].fetch_add(1) != 0)
+                                {
+                                    ++overlaps;
+                                }
+                                std::this_thread::yield();
+                                running[key].fetch_sub(1);
+                                done[key].fetch_add(1);
+                            };
+                            scheduler.submit(
+                                key, body, [&]() -> RequestScheduler::Task { return body; });
+                        }
+                    });
+            }
+            for (auto&& t : threads)
+            {
+                t.join();
+            }
+        }
+        CHECK(overlaps.load() == 0);
+        int total = 0;
+        for (auto&& d : done)
+        {
+            total += d.load();
+        }
+        CHECK(total == kThreads * kRequests);
+    }
+}    // namespace
+}    // namespace securefs
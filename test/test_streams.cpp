@@ -2,6 +2,7 @@
 #include <doctest/doctest.h>
 
 #include "crypto.h"
+#include "io_uring.h"
 #include "lite_stream.h"
 #include "logger.h"
 #include "myutils.h"
@@ -79,7 +80,7 @@ static void test(securefs::StreamBase& stream, unsigned times)
             b = static_cast<byte>(dist(mt));
     }
 
-    std::uniform_int_distribution<int> flags_dist(0, 4);
+    std::uniform_int_distribution<int> flags_dist(0, 6);
     std::uniform_int_distribution<int> length_dist(0, 7 * 4096 + 1);
     for (size_t i = 0; i < times; ++i)
     {
@@ -116,6 +117,18 @@ static void test(securefs::StreamBase& stream, unsigned times)
             CHECK(memory_stream.size() == size_t(a));
             break;
 
+        case 5:
+            stream.punch_hole(a, b);
+            memory_stream.punch_hole(a, b);
+            CHECK(stream.size() == memory_stream.size());
+            break;
+
+        case 6:
+            stream.preallocate(a, b, b % 2 == 0);
+            memory_stream.preallocate(a, b, b % 2 == 0);
+            CHECK(stream.size() == memory_stream.size());
+            break;
+
         case 4:
             stream.flush();
             memory_stream.flush();
@@ -310,6 +323,50 @@ TEST_CASE("Test streams")
     test_lite_stream(4096, 12, 1);
     test_lite_stream(4096, 12, 32);
 
+    if (securefs::set_io_uring_enabled(true))
+    {
+        DEFER(securefs::set_io_uring_enabled(false));
+        auto open_file = []()
+        {
+            return OSService::get_default().open_file_stream(
+                OSService::temp_name("tmp/", ".stream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        };
+        test(*open_file(), 4000);
+        auto aes_gcm_stream = securefs::make_cryptstream_aes_gcm(
+            open_file(), open_file(), key, key, id, true, 4096, 12);
+        test(*aes_gcm_stream.first, 1000);
+        securefs::lite::AESGCMCryptStream lite_stream(
+            open_file(), key, 4096, 12, true, 32, &padding_aes);
+        test(lite_stream, 1001);
+    }
+
+#ifndef _WIN32
+    {
+        OSService::set_direct_io_enabled(true);
+        DEFER(OSService::set_direct_io_enabled(false));
+        auto open_data_file = []()
+        {
+            return OSService::get_default().open_data_file_stream(
+                OSService::temp_name("tmp/", ".stream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        };
+        test(*open_data_file(), 4000);
+        auto aes_gcm_stream = securefs::make_cryptstream_aes_gcm(
+            open_data_file(),
+            OSService::get_default().open_file_stream(
+                OSService::temp_name("tmp/", ".stream"), O_RDWR | O_CREAT | O_EXCL, 0644),
+            key,
+            key,
+            id,
+            true,
+            4096,
+            12);
+        test(*aes_gcm_stream.first, 1000);
+        securefs::lite::AESGCMCryptStream lite_stream(
+            open_data_file(), key, 4096, 12, true, 32, &padding_aes);
+        test(lite_stream, 1001);
+    }
+#endif
+
     {
         // Test that the `padding_aes` is stateless
         CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption second_padding_aes(key.data(), key.size());
@@ -320,3 +377,127 @@ TEST_CASE("Test streams")
         REQUIRE(memcmp(ciphertext, second_ciphertext, sizeof(ciphertext)) == 0);
     }
 }
+
+TEST_CASE("Punching holes releases the underlying storage")
+{
+    securefs::key_type key(0x3c);
+    securefs::id_type id(0x5a);
+    auto open_file = []()
+    {
+        return OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", ".stream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+    };
+    auto allocated = [](securefs::FileStream& stream)
+    {
+        securefs::fuse_stat st;
+        stream.fstat(&st);
+        return static_cast<int64_t>(st.st_blocks) * 512;
+    };
+    constexpr securefs::length_type kSize = 4 << 20;
+    std::vector<byte> data(kSize);
+    securefs::generate_random(data.data(), data.size());
+
+    auto check = [&](securefs::StreamBase& stream, securefs::FileStream& underlying)
+    {
+        stream.write(data.data(), 0, data.size());
+        stream.flush();
+        underlying.fsync();
+        auto before = allocated(underlying);
+        // Unaligned on both ends, so that the partial blocks are zeroed instead.
+        stream.punch_hole(100000, 3 << 20);
+        stream.flush();
+        underlying.fsync();
+        std::fill(data.begin() + 100000, data.begin() + 100000 + (3 << 20), 0);
+        std::vector<byte> buffer(kSize);
+        REQUIRE(stream.read(buffer.data(), 0, buffer.size()) == kSize);
+        CHECK(buffer == data);
+        CHECK(stream.size() == kSize);
+        // Filesystems without support for holes still pass, as writing zeros is allowed.
+        if (before > 0 && allocated(underlying) < before)
+        {
+            CHECK(allocated(underlying) <= before - (2 << 20));
+        }
+        securefs::generate_random(data.data(), data.size());
+    };
+
+    {
+        auto data_file = open_file(), meta_file = open_file();
+        auto aes_gcm_stream = securefs::make_cryptstream_aes_gcm(
+            data_file, meta_file, key, key, id, true, 4096, 12);
+        check(*aes_gcm_stream.first, *data_file);
+    }
+    {
+        auto file = open_file();
+        securefs::lite::AESGCMCryptStream lite_stream(file, key, 4096, 12, true);
+        check(lite_stream, *file);
+    }
+}
+
+TEST_CASE("Reads of lite streams skip the holes underneath")
+{
+    securefs::key_type key(0x3c);
+    auto file = OSService::get_default().open_file_stream(
+        OSService::temp_name("tmp/", ".stream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+    securefs::lite::AESGCMCryptStream lite_stream(file, key, 4096, 12, true);
+    constexpr securefs::length_type kBlock = 4096, kSize = 1000 * kBlock + 100;
+    std::vector<byte> data(kSize);
+    securefs::generate_random(data.data(), data.size());
+    lite_stream.write(data.data(), 0, data.size());
+    lite_stream.punch_hole(100 * kBlock, 600 * kBlock);
+    std::fill(data.begin() + 100 * kBlock, data.begin() + 700 * kBlock, 0);
+
+    // Filesystems without support for holes report data everywhere.
+    if (file->next_hole(0) < file->size())
+    {
+        CHECK(lite_stream.next_data(0) == 0);
+        CHECK(lite_stream.next_hole(0) == 100 * kBlock);
+        CHECK(lite_stream.next_hole(100 * kBlock + 5) == 100 * kBlock + 5);
+        CHECK(lite_stream.next_data(100 * kBlock) == 700 * kBlock);
+        CHECK(lite_stream.next_hole(700 * kBlock) == kSize);
+    }
+    CHECK(lite_stream.next_data(kSize) == kSize);
+    CHECK(lite_stream.next_hole(kSize) == kSize);
+
+    std::vector<byte> buffer(kSize + 5000);
+    REQUIRE(lite_stream.read(buffer.data(), 0, buffer.size()) == kSize);
+    CHECK(memcmp(buffer.data(), data.data(), kSize) == 0);
+    // Unaligned, and ending within the hole.
+    REQUIRE(lite_stream.read(buffer.data(), 50 * kBlock + 7, 200 * kBlock) == 200 * kBlock);
+    CHECK(memcmp(buffer.data(), data.data() + 50 * kBlock + 7, 200 * kBlock) == 0);
+    REQUIRE(lite_stream.read(buffer.data(), 650 * kBlock + 3, kSize) == kSize - 650 * kBlock - 3);
+    CHECK(memcmp(buffer.data(), data.data() + 650 * kBlock + 3, kSize - 650 * kBlock - 3) == 0);
+}
+
+TEST_CASE("Batched reads on file streams")
+{
+    for (bool io_uring : {false, true})
+    {
+        if (securefs::set_io_uring_enabled(io_uring) != io_uring)
+        {
+            continue;
+        }
+        DEFER(securefs::set_io_uring_enabled(false));
+        CAPTURE(io_uring);
+        auto stream = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", ".stream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        std::vector<byte> data(200000);
+        securefs::generate_random(data.data(), data.size());
+        stream->write(data.data(), 0, data.size());
+
+        // Both small reads, which go through registered buffers, and large ones.
+        std::vector<byte> a(100), b(150000), c(100);
+        securefs::length_type ra = 0, rb = 0, rc = 0;
+        securefs::ReadBatch batch;
+        stream->read_batched(batch, a.data(), 10, a.size(), &ra);
+        stream->read_batched(batch, b.data(), 40000, b.size(), &rb);
+        stream->read_batched(batch, c.data(), data.size() - 30, c.size(), &rc);
+        batch.run();
+        CHECK(ra == a.size());
+        CHECK(memcmp(a.data(), data.data() + 10, a.size()) == 0);
+        CHECK(rb == b.size());
+        CHECK(memcmp(b.data(), data.data() + 40000, b.size()) == 0);
+        CHECK(rc == 30);
+        CHECK(memcmp(c.data(), data.data() + data.size() - 30, 30) == 0);
+        stream->fsync();
+    }
+}
@@ -0,0 +1,62 @@
+#include "task_pool.h"
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <stdexcept>
+
+namespace securefs
+{
+namespace
+{
+    // Counts itself and submits `fanout` children until `depth` reaches zero.
+    void spawn(TaskPool& pool, std::atomic<int>& count, int depth, int fanout)
+    {
+        ++count;
+        for (int i = 0; depth > 0 && i < fanout; ++i)
+        {
+            pool.submit([&pool, &count, depth, fanout]()
+                        { spawn(pool, count, depth - 1, fanout); });
+        }
+    }
+
+    TEST_CASE("TaskPool runs tasks submitted by tasks")
+    {
+        TaskPool pool(4);
+        CHECK(pool.thread_count() == 4);
+        std::atomic<int> count{0};
+        pool.submit([&]() { spawn(pool, count, 6, 3); });
+        pool.run();
+        CHECK(count.load() == 1 + 3 + 9 + 27 + 81 + 243 + 729);
+
+        // The pool can be reused.
+        pool.submit([&]() { spawn(pool, count, 1, 5); });
+        pool.run();
+        CHECK(count.load() == 1093 + 6);
+    }
+
+    TEST_CASE("TaskPool rethrows the first failure")
+    {
+        TaskPool pool(3);
+        std::atomic<int> count{0};
+        for (int i = 0; i < 1000; ++i)
+        {
+            pool.submit(
+                [&count, i]()
+                {
+                    ++count;
+                    if (i == 10)
+                    {
+                        throw std::runtime_error("task failure");
+                    }
+                });
+        }
+        CHECK_THROWS_WITH(pool.run(), "task failure");
+        CHECK(count.load() < 1000);
+
+        pool.submit([&count]() { count = -1; });
+        CHECK_NOTHROW(pool.run());
+        CHECK(count.load() == -1);
+    }
+}    // namespace
+}    // namespace securefs
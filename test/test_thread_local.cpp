@@ -3,6 +3,8 @@
 #include <atomic>
 #include <doctest/doctest.h>
 #include <memory>
+#include <thread>
+#include <vector>
 
 namespace securefs
 {
@@ -42,5 +44,34 @@ namespace
         CHECK(a3.get().value == 3);
         CHECK(A::destroy_count.load() == 1);
     }
+
+    TEST_CASE("PerThread merges the values of exited threads")
+    {
+        PerThread<int> counts([]() { return std::make_unique<int>(0); },
+                              [](int& from, int& into) { into += from; });
+        ++counts.local();
+        for (int round = 0; round < 3; ++round)
+        {
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 4; ++i)
+            {
+                threads.emplace_back([&counts, i]() { counts.local() += i; });
+            }
+            for (auto& t : threads)
+            {
+                t.join();
+            }
+        }
+        int visited = 0, total = 0;
+        counts.for_each(
+            [&](int value)
+            {
+                ++visited;
+                total += value;
+            });
+        // Only the main thread and the retired values are left.
+        CHECK(visited == 2);
+        CHECK(total == 1 + 3 * (0 + 1 + 2 + 3));
+    }
 }    // namespace
 }    // namespace securefs
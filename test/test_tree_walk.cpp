@@ -0,0 +1,272 @@
+#include "tree_walk.h"
+#include "lite_format.h"
+#include "platform.h"
+#include "test_common.h"
+
+#include <absl/strings/str_cat.h>
+#include <doctest/doctest.h>
+#include <fruit/fruit.h>
+
+#include <string>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("ParallelTreeWalker visits and checks a lite repository")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/walk", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+        fruit::Injector<lite_format::FuseHighLevelOps> injector(testing::get_lite_ops_component,
+                                                                &root);
+        auto& ops = injector.get<lite_format::FuseHighLevelOps&>();
+
+        fuse_context ctx{};
+        ctx.uid = OSService::getuid();
+        ctx.gid = OSService::getgid();
+        std::string long_name(200, 'x');
+        uint64_t expected_bytes = 0;
+        for (int d = 0; d < 5; ++d)
+        {
+            auto dir = absl::StrCat("/d", d);
+            REQUIRE(ops.vmkdir(dir.c_str(), 0755, &ctx) == 0);
+            for (int f = 0; f < 10; ++f)
+            {
+                auto path = f == 0 ? absl::StrCat(dir, "/", long_name) : absl::StrCat(dir, "/f", f);
+                fuse_file_info info{};
+                REQUIRE(ops.vcreate(path.c_str(), 0644, &info, &ctx) == 0);
+                std::string content(f * 1000, 'c');
+                REQUIRE(ops.vwrite(path.c_str(), content.data(), content.size(), 0, &info, &ctx)
+                        == static_cast<int>(content.size()));
+                REQUIRE(ops.vrelease(path.c_str(), &info, &ctx) == 0);
+                expected_bytes += content.size();
+            }
+        }
+        REQUIRE(ops.vsymlink("/d0/f1", "/link", &ctx) == 0);
+
+        OpsTreeSource source(ops);
+        auto walk = [&](ParallelTreeWalker& walker)
+        {
+            walker.walk(
+                [&](const std::string& path, const fuse_stat& st)
+                {
+                    switch (st.st_mode & S_IFMT)
+                    {
+                    case S_IFDIR:
+                        source.check_directory(path);
+                        break;
+                    case S_IFLNK:
+                        CHECK(source.read_link(path) == "/d0/f1");
+                        break;
+                    default:
+                        CHECK(source.read_file(path,
+                                               [&](const char*, size_t size)
+                                               { walker.progress().bytes += size; })
+                              == static_cast<uint64_t>(st.st_size));
+                        break;
+                    }
+                },
+                []() {},
+                absl::Seconds(1));
+        };
+
+        {
+            ParallelTreeWalker walker(source, 3, true);
+            walk(walker);
+            CHECK(walker.progress().directories.load() == 6);
+            CHECK(walker.progress().files.load() == 50);
+            CHECK(walker.progress().symlinks.load() == 1);
+            CHECK(walker.progress().bytes.load() == expected_bytes);
+            CHECK(walker.progress().errors.load() == 0);
+        }
+
+        // A name that does not decrypt is skipped by readdir, but not by the check.
+        OSService::get_default().mkdir(temp_dir_name + "/notencrypted", 0755);
+        {
+            ParallelTreeWalker walker(source, 3, true);
+            walk(walker);
+            CHECK(walker.progress().errors.load() == 1);
+            REQUIRE(walker.errors().size() == 1);
+            CHECK(walker.errors()[0].rfind("/: ", 0) == 0);
+        }
+        {
+            ParallelTreeWalker walker(source, 3, false);
+            CHECK_THROWS(walk(walker));
+        }
+    }
+
+    TEST_CASE("ParallelTreeCopier imports a plain directory")
+    {
+        auto plain_dir = OSService::temp_name("tmp/plain", "dir");
+        OSService::get_default().ensure_directory(plain_dir, 0755);
+        OSService plain(plain_dir);
+        plain.mkdir("sub", 0750);
+        plain.mkdir("sub/deeper", 0500);
+        std::string content(3 << 20, 'p');
+        plain.open_file_stream("sub/big", O_WRONLY | O_CREAT | O_EXCL, 0640)
+            ->write(content.data(), 0, content.size());
+        plain.open_file_stream("empty", O_WRONLY | O_CREAT | O_EXCL, 0600);
+        plain.symlink("sub/big", "link");
+        fuse_timespec ts[2] = {{1000, 0}, {2000, 0}};
+        plain.utimens("sub", ts);
+
+        auto repo_dir = OSService::temp_name("tmp/import", "dir");
+        OSService::get_default().ensure_directory(repo_dir, 0755);
+        OSService root(repo_dir);
+        fruit::Injector<lite_format::FuseHighLevelOps> injector(testing::get_lite_ops_component,
+                                                                &root);
+        auto& ops = injector.get<lite_format::FuseHighLevelOps&>();
+
+        OSTreeSource source(plain_dir);
+        OpsTreeSink sink(ops, repo_dir);
+        ParallelTreeCopier copier(source, sink, 3, false);
+        copier.copy([]() {}, absl::Seconds(1));
+        CHECK(copier.walker().progress().directories.load() == 3);
+        CHECK(copier.walker().progress().files.load() == 2);
+        CHECK(copier.walker().progress().symlinks.load() == 1);
+        CHECK(copier.walker().progress().bytes.load() == content.size());
+
+        OpsTreeSource imported(ops);
+        std::string read_back;
+        auto read_size = imported.read_file(
+            "/sub/big", [&](const char* data, size_t size) { read_back.append(data, size); });
+        CHECK(read_size == content.size());
+        CHECK(read_back == content);
+        CHECK(imported.read_link("/link") == "sub/big");
+        CHECK((imported.stat("/sub/big").st_mode & 07777) == 0640);
+        CHECK((imported.stat("/sub/deeper").st_mode & 07777) == 0500);
+        CHECK(imported.stat("/sub").st_mtime == 2000);
+        CHECK(imported.stat("/empty").st_size == 0);
+    }
+
+    TEST_CASE("ParallelTreeCopier exports a lite repository")
+    {
+        auto repo_dir = OSService::temp_name("tmp/export", "dir");
+        OSService::get_default().ensure_directory(repo_dir, 0755);
+        OSService root(repo_dir);
+        fruit::Injector<lite_format::FuseHighLevelOps> injector(testing::get_lite_ops_component,
+                                                                &root);
+        auto& ops = injector.get<lite_format::FuseHighLevelOps&>();
+        fuse_context ctx{};
+        ctx.uid = OSService::getuid();
+        ctx.gid = OSService::getgid();
+        REQUIRE(ops.vmkdir("/sub", 0500, &ctx) == 0);
+        std::string content(3 << 20, 'e');
+        {
+            fuse_file_info info{};
+            REQUIRE(ops.vcreate("/big", 0640, &info, &ctx) == 0);
+            REQUIRE(ops.vwrite("/big", content.data(), content.size(), 0, &info, &ctx)
+                    == static_cast<int>(content.size()));
+            REQUIRE(ops.vrelease("/big", &info, &ctx) == 0);
+        }
+        REQUIRE(ops.vsymlink("big", "/link", &ctx) == 0);
+
+        auto plain_dir = OSService::temp_name("tmp/plain", "dir");
+        OSService::get_default().ensure_directory(plain_dir, 0755);
+        OpsTreeSource source(ops);
+        OSTreeSink sink(plain_dir);
+        ParallelTreeCopier copier(source, sink, 3, false);
+        copier.copy([]() {}, absl::Seconds(1));
+        CHECK(copier.walker().progress().bytes.load() == content.size());
+
+        OSTreeSource exported(plain_dir);
+        std::string read_back;
+        exported.read_file("/big",
+                           [&](const char* data, size_t size) { read_back.append(data, size); });
+        CHECK(read_back == content);
+        CHECK(exported.read_link("/link") == "big");
+        CHECK((exported.stat("/big").st_mode & 07777) == 0640);
+        CHECK((exported.stat("/sub").st_mode & 07777) == 0500);
+        CHECK(exported.stat("/big").st_mtime == source.stat("/big").st_mtime);
+    }
+
+    TEST_CASE("ParallelTreeCopier resumes from a checkpoint")
+    {
+        auto plain_dir = OSService::temp_name("tmp/plain", "dir");
+        OSService::get_default().ensure_directory(plain_dir, 0755);
+        OSService plain(plain_dir);
+        plain.mkdir("sub", 0755);
+        for (const char* name : {"sub/a", "sub/b", "c"})
+        {
+            plain.open_file_stream(name, O_WRONLY | O_CREAT | O_EXCL, 0644)->write("new", 0, 3);
+        }
+
+        auto repo_dir = OSService::temp_name("tmp/convert", "dir");
+        OSService::get_default().ensure_directory(repo_dir, 0755);
+        OSService root(repo_dir);
+        fruit::Injector<lite_format::FuseHighLevelOps> injector(testing::get_lite_ops_component,
+                                                                &root);
+        auto& ops = injector.get<lite_format::FuseHighLevelOps&>();
+        fuse_context ctx{};
+        ctx.uid = OSService::getuid();
+        ctx.gid = OSService::getgid();
+        // What an interrupted run leaves: "/c" is done, while "/sub" and part of "/sub/a" are
+        // created but not yet in the checkpoint, whose last line is cut short.
+        REQUIRE(ops.vmkdir("/sub", 0700, &ctx) == 0);
+        for (const char* path : {"/sub/a", "/c"})
+        {
+            fuse_file_info info{};
+            REQUIRE(ops.vcreate(path, 0600, &info, &ctx) == 0);
+            REQUIRE(ops.vwrite(path, "old", 3, 0, &info, &ctx) == 3);
+            REQUIRE(ops.vrelease(path, &info, &ctx) == 0);
+        }
+        auto checkpoint_stream
+            = root.open_file_stream(".securefs.convert", O_RDWR | O_CREAT | O_EXCL, 0644);
+        checkpoint_stream->write("/c\n/su", 0, 6);
+
+        {
+            TreeCheckpoint checkpoint(checkpoint_stream);
+            CHECK(checkpoint.resuming());
+            CHECK(checkpoint.contains("/c"));
+            CHECK(!checkpoint.contains("/su"));
+            OSTreeSource source(plain_dir);
+            OpsTreeSink sink(ops, repo_dir);
+            ParallelTreeCopier copier(source, sink, 2, false);
+            copier.set_checkpoint(&checkpoint);
+            copier.copy([]() {}, absl::Seconds(1));
+            CHECK(copier.walker().errors().empty());
+        }
+
+        OpsTreeSource converted(ops);
+        auto read_all = [&](const std::string& path)
+        {
+            std::string result;
+            converted.read_file(path,
+                                [&](const char* data, size_t size) { result.append(data, size); });
+            return result;
+        };
+        CHECK(read_all("/sub/a") == "new");
+        CHECK(read_all("/sub/b") == "new");
+        CHECK(read_all("/c") == "old");
+        CHECK(TreeCheckpoint(checkpoint_stream).contains("/sub/b"));
+    }
+
+    TEST_CASE("TarTreeSink headers")
+    {
+        fuse_stat st{};
+        st.st_mode = S_IFREG | 0644;
+        st.st_size = 5;
+        auto header = TarTreeSink::make_header("/dir/file", st, '0', "", {});
+        REQUIRE(header.size() == 512);
+        CHECK(std::string(header.data()) == "dir/file");
+        CHECK(header.substr(124, 12) == std::string("00000000005\0", 12));
+        CHECK(header.substr(257, 6) == std::string("ustar\0", 6));
+        unsigned checksum = 0;
+        for (size_t i = 0; i < header.size(); ++i)
+        {
+            checksum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        CHECK(std::stoul(header.substr(148, 6), nullptr, 8) == checksum);
+
+        // Long names and extended attributes need a pax header in front.
+        auto long_name = absl::StrCat("/", std::string(150, 'n'));
+        auto pax = TarTreeSink::make_header(long_name, st, '0', "", {{"user.k", "v"}});
+        REQUIRE(pax.size() == 3 * 512);
+        CHECK(pax[156] == 'x');
+        CHECK(pax.find(absl::StrCat("160 path=", long_name.substr(1), "\n")) == 512);
+        CHECK(pax.find("25 SCHILY.xattr.user.k=v\n") != std::string::npos);
+        CHECK(pax[1024 + 156] == '0');
+    }
+}    // namespace
+}    // namespace securefs
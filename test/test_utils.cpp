@@ -1,9 +1,13 @@
 #include "crypto.h"
 #include "myutils.h"
 #include "platform.h"
+#include "test_common.h"
 #include <doctest/doctest.h>
 
 #include <cryptopp/base32.h>
+#include <cryptopp/integer.h>
+
+#include <random>
 
 TEST_CASE("Test endian")
 {
@@ -100,3 +104,27 @@ TEST_CASE("is_ascii")
     REQUIRE(!securefs::is_ascii("\x41\xcc\x88\x66\x66\x69\x6e"));
     REQUIRE(!securefs::is_ascii("\x80"));
 }
+
+TEST_CASE("big_endian_modulo against CryptoPP")
+{
+    std::uniform_int_distribution<unsigned> small_dist(1, 65536);
+    std::uniform_int_distribution<uint64_t> large_dist(1, uint64_t(1) << 32);
+    byte data[32];
+    for (int i = 0; i < 10000; ++i)
+    {
+        securefs::generate_random(data, sizeof(data));
+        uint64_t modulus = i % 2 ? small_dist(get_random_number_engine())
+                                 : large_dist(get_random_number_engine());
+        CAPTURE(modulus);
+        for (size_t size : {size_t(1), size_t(7), size_t(16), size_t(32)})
+        {
+            CAPTURE(size);
+            CryptoPP::Integer integer(
+                data, size, CryptoPP::Integer::UNSIGNED, CryptoPP::BIG_ENDIAN_ORDER);
+            auto expected
+                = integer.Modulo(CryptoPP::Integer(CryptoPP::Integer::POSITIVE, modulus));
+            auto actual = securefs::big_endian_modulo(data, size, modulus);
+            CHECK(CryptoPP::Integer(CryptoPP::Integer::POSITIVE, actual) == expected);
+        }
+    }
+}